@@ -0,0 +1,18 @@
+/* In-kernel benchmarks, selected with bench=<name>[,<name>...] or bench=all on
+   the kernel command line */
+
+#pragma once
+
+/* Runs the benchmarks named on the command line, if any. */
+void bench_run_requested(void);
+
+void bench_perf(void);
+void bench_page(void);
+void bench_blk(void);
+void bench_vfs(void);
+void bench_net(void);
+void bench_syscall(void);
+void bench_proc(void);
+void bench_thp(void);
+void bench_uring(void);
+void bench_clock(void);
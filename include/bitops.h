@@ -0,0 +1,23 @@
+/* Bit scans */
+
+#pragma once
+
+/* Number of trailing and leading zero bits. Undefined for 0. With Zbb
+   required these are single instructions; otherwise they are dispatched, see
+   dispatch.h. */
+#ifdef CONFIG_ARCH_ZBB
+static inline unsigned int bit_ctz(unsigned long x) {
+	return __builtin_ctzl(x);
+}
+static inline unsigned int bit_clz(unsigned long x) {
+	return __builtin_clzl(x);
+}
+#else
+unsigned int bit_ctz(unsigned long x);
+unsigned int bit_clz(unsigned long x);
+#endif
+
+/* Index of the highest set bit plus one, or 0 for 0. */
+static inline unsigned int bit_fls(unsigned long x) {
+	return x ? 64 - bit_clz(x) : 0;
+}
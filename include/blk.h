@@ -0,0 +1,101 @@
+/* Block devices
+
+   Requests are asynchronous: blk_submit() queues them and returns, and each
+   request's done callback runs once the device has finished with it, usually
+   in interrupt context on another hart. Drivers merge requests for adjacent
+   sectors within a batch into one device command. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BLK_SECTOR_SIZE 512
+#define BLK_DEVICES_MAX 8
+
+enum blk_op {
+	BLK_READ,
+	BLK_WRITE,
+	BLK_FLUSH,
+};
+
+enum blk_status {
+	BLK_OK,
+	BLK_IOERR,
+	BLK_UNSUPPORTED,
+};
+
+struct blk_request;
+
+typedef void (*blk_done_t)(struct blk_request *req);
+
+struct blk_request {
+	enum blk_op op;
+	uint64_t sector;
+	/* In the HHDM, such as memory from pmm_alloc(). len is a multiple of
+	   BLK_SECTOR_SIZE. */
+	void *buf;
+	uint32_t len;
+	enum blk_status status;
+	/* Called with interrupts disabled; may submit more requests. */
+	blk_done_t done;
+	void *priv;
+	/* Links a batch for blk_submit(), then belongs to the driver. */
+	struct blk_request *next;
+};
+
+struct blk_device;
+struct pcache;
+
+struct blk_ops {
+	/* Queues a batch linked through next, costing the device a single
+	   notification. */
+	void (*submit)(struct blk_device *dev, struct blk_request *reqs);
+	/* Completes whatever the calling hart's queue has finished, for callers
+	   waiting with interrupts off. */
+	void (*poll)(struct blk_device *dev);
+};
+
+struct blk_device {
+	const char *name;
+	uint64_t sectors;
+	/* Hardware queues; requests go to the submitting hart's. */
+	unsigned int nqueues;
+	/* Largest request the device takes. */
+	uint32_t max_len;
+	bool read_only;
+	const struct blk_ops *ops;
+	void *priv;
+	/* Set up by the page cache on first use. */
+	struct pcache *cache;
+
+	/* Requests submitted and device commands they became. */
+	uint64_t stat_requests;
+	uint64_t stat_commands;
+};
+
+/* Makes a device available to blk_get(). */
+void blk_register(struct blk_device *dev);
+
+/* The index-th registered device, or NULL. */
+struct blk_device *blk_get(unsigned int index);
+
+static inline void blk_submit(struct blk_device *dev,
+							  struct blk_request *reqs) {
+	dev->ops->submit(dev, reqs);
+}
+
+static inline void blk_poll(struct blk_device *dev) {
+	if (dev->ops->poll) dev->ops->poll(dev);
+}
+
+/* Submits a batch and waits for all of it, sleeping if called from a
+   thread and polling otherwise. Takes over the requests' done and priv.
+   Returns the first failure, if any. */
+enum blk_status blk_submit_wait(struct blk_device *dev,
+								struct blk_request *reqs);
+
+/* Reads or writes synchronously, sleeping if called from a thread and
+   polling otherwise. */
+enum blk_status blk_rw(struct blk_device *dev, enum blk_op op,
+					   uint64_t sector, void *buf, uint32_t len);
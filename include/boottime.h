@@ -0,0 +1,17 @@
+/* Boot timeline
+
+   Combines the bootloader's own timestamps with rdtime() stamps taken at the
+   end of each kernel init phase. */
+
+#pragma once
+
+/* Stamps kernel entry. Called first thing in init(). */
+void boottime_start(void);
+
+/* Ends the phase called name, which started at the previous mark (or at
+   kernel entry). name must stay valid. */
+void boottime_mark(const char *name);
+
+/* Prints the time spent in firmware, the bootloader, and every kernel phase
+   so far. Needs clock_init(). */
+void boottime_print(void);
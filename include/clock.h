@@ -0,0 +1,15 @@
+/* Frequency of the time CSR */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Ticks per second of rdtime(), from the DTB's timebase-frequency. */
+extern uint64_t clock_freq;
+
+/* Reads the timebase from the DTB, falling back to the 10 MHz of QEMU's virt
+   machine. Must run after fdt_init(). */
+void clock_init(void);
+
+uint64_t clock_ticks_to_ns(uint64_t ticks);
+uint64_t clock_ticks_to_us(uint64_t ticks);
@@ -0,0 +1,22 @@
+/* Kernel command line, from the limine.conf cmdline option */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Copies the command line out of bootloader memory. Lookups before this see
+   an empty command line. */
+void cmdline_init(void);
+
+/* Finds "key" or "key=value". On success, *value and *len describe the value,
+   which is not NUL terminated and is empty for a bare "key". */
+bool cmdline_get(const char *key, const char **value, size_t *len);
+
+bool cmdline_has(const char *key);
+
+/* Value of "key=<number>", decimal or 0x-prefixed hex, or def. */
+unsigned long cmdline_get_ulong(const char *key, unsigned long def);
+
+/* True if "key=a,b,c" lists item, or lists "all". */
+bool cmdline_list_has(const char *key, const char *item);
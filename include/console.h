@@ -0,0 +1,9 @@
+/* The console as a file, for the standard streams of user processes. Writes
+   go to the SBI debug console; reads find the end of the file, as there is
+   no input yet. */
+
+#pragma once
+
+#include "vfs.h"
+
+extern struct inode console_inode;
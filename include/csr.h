@@ -0,0 +1,81 @@
+/* Control and Status Register access */
+
+#pragma once
+
+#include <stdint.h>
+
+#define __csr_str2(x) #x
+#define __csr_str(x) __csr_str2(x)
+
+/* csr may be a CSR name known to the assembler, a numeric CSR address, or a
+   macro expanding to either. */
+#define csr_read(csr)                                    \
+	({                                                   \
+		unsigned long __v;                               \
+		asm volatile("csrr %0, " __csr_str(csr)          \
+					 : "=r"(__v)::"memory");             \
+		__v;                                             \
+	})
+
+#define csr_write(csr, val)                              \
+	({                                                   \
+		unsigned long __v = (unsigned long)(val);        \
+		asm volatile("csrw " __csr_str(csr) ", %0" ::"rK"(__v) \
+					 : "memory");                        \
+	})
+
+#define csr_swap(csr, val)                               \
+	({                                                   \
+		unsigned long __v = (unsigned long)(val);        \
+		asm volatile("csrrw %0, " __csr_str(csr) ", %1"  \
+					 : "=r"(__v)                         \
+					 : "rK"(__v)                         \
+					 : "memory");                        \
+		__v;                                             \
+	})
+
+#define csr_set(csr, val)                                \
+	({                                                   \
+		unsigned long __v = (unsigned long)(val);        \
+		asm volatile("csrs " __csr_str(csr) ", %0" ::"rK"(__v) \
+					 : "memory");                        \
+	})
+
+#define csr_clear(csr, val)                              \
+	({                                                   \
+		unsigned long __v = (unsigned long)(val);        \
+		asm volatile("csrc " __csr_str(csr) ", %0" ::"rK"(__v) \
+					 : "memory");                        \
+	})
+
+/* Cycle counter. M-mode firmware must allow S-mode access (mcounteren.CY),
+   which OpenSBI does by default. */
+static inline uint64_t rdcycle(void) { return csr_read(cycle); }
+
+/* Timer counter, ticking at the DTB's timebase-frequency. */
+static inline uint64_t rdtime(void) { return csr_read(time); }
+
+static inline uint64_t rdinstret(void) { return csr_read(instret); }
+
+#define SSTATUS_SIE (1ul << 1)
+#define SSTATUS_SPIE (1ul << 5)
+#define SSTATUS_SPP (1ul << 8)
+#define SSTATUS_VS_INITIAL (1ul << 9)
+#define SSTATUS_VS (3ul << 9)
+#define SSTATUS_SUM (1ul << 18)
+
+/* Counters user mode may read, in scounteren. */
+#define SCOUNTEREN_CY (1ul << 0)
+#define SCOUNTEREN_TM (1ul << 1)
+#define SCOUNTEREN_IR (1ul << 2)
+
+/* Interrupt numbers, as bits of sie/sip and as scause codes. */
+#define IRQ_S_SOFT 1
+#define IRQ_S_TIMER 5
+#define IRQ_S_EXT 9
+#define IRQ_LCOF 13
+
+#define SCAUSE_INTERRUPT (1ul << 63)
+
+/* Sscofpmf overflow bits of the hpmcounters, readable in S-mode. */
+#define CSR_SCOUNTOVF 0xda0
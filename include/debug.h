@@ -10,6 +10,20 @@
    len should be value of strlen(s). */
 void debug_print_kstr(const char *s, unsigned long len);
 
+/* Formats into a kernel binary buffer and prints it with debug_print_kstr().
+   See printf.h for the supported conversions. Output longer than 256 bytes is
+   truncated. */
+void debug_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Prints len bytes from anywhere in memory, such as a user's buffer, by way
+   of debug_printf()'s buffer. */
+void debug_write(const char *s, unsigned long len);
+
 /* Prints a kernel binary string and attempts to shutdown the system.
    If the SBI does not support SRST, this function will spin. */
-noreturn void early_panic(const char *s);
\ No newline at end of file
+noreturn void early_panic(const char *s);
+
+/* Formats and prints a message like debug_printf(), then shuts down like
+   early_panic(). */
+noreturn void panic(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
@@ -0,0 +1,41 @@
+/* Functions with several implementations, one picked at boot */
+
+#pragma once
+
+#include "isa.h"
+
+/* Defines the function name as a single jump, initially to generic.
+   dispatch_init() retargets the jump to the best variant the harts support,
+   so a call costs one extra direct jump. Use at file scope; generic must not
+   be static. */
+#define DISPATCH(name, generic)              \
+	__asm__(".pushsection .text\n"           \
+			".balign 4\n"                    \
+			".globl " #name "\n"             \
+			".type " #name ", @function\n"   \
+			".option push\n"                 \
+			".option norvc\n" #name ":\n"    \
+			"j " #generic "\n"               \
+			".option pop\n"                  \
+			".size " #name ", 4\n"           \
+			".popsection\n")
+
+struct dispatch_variant {
+	void *site;
+	void *impl;
+	const char *name;
+	/* ISA_BIT()s of the extensions impl needs. */
+	unsigned long exts;
+	/* The highest ranked variant the harts support wins. */
+	unsigned int rank;
+};
+
+/* Registers impl as a variant of the dispatched function name. */
+#define DISPATCH_VARIANT(name, impl, exts_, rank_)         \
+	static const struct dispatch_variant __dispatch_##impl \
+		__attribute__((section("__dispatch"), used)) = {   \
+			(void *)name, (void *)impl, #impl, exts_, rank_}
+
+/* Patches every dispatched function. Runs after isa_init(), before other
+   harts start. */
+void dispatch_init(void);
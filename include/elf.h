@@ -0,0 +1,54 @@
+/* Loading ELF64 executables into user address spaces
+
+   Only statically linked RISC-V executables. Each PT_LOAD segment becomes
+   a private file mapping, so pages are read in as they are touched and
+   code is shared through the page cache; the rest of the file is
+   ignored. */
+
+#pragma once
+
+#include <stdint.h>
+
+#define EM_RISCV 243
+#define ET_EXEC 2
+#define PT_LOAD 1
+
+#define PF_X (1u << 0)
+#define PF_W (1u << 1)
+#define PF_R (1u << 2)
+
+struct elf_header {
+	uint8_t ident[16];
+	uint16_t type;
+	uint16_t machine;
+	uint32_t version;
+	uint64_t entry;
+	uint64_t phoff;
+	uint64_t shoff;
+	uint32_t flags;
+	uint16_t ehsize;
+	uint16_t phentsize;
+	uint16_t phnum;
+	uint16_t shentsize;
+	uint16_t shnum;
+	uint16_t shstrndx;
+};
+
+struct elf_phdr {
+	uint32_t type;
+	uint32_t flags;
+	uint64_t offset;
+	uint64_t vaddr;
+	uint64_t paddr;
+	uint64_t filesz;
+	uint64_t memsz;
+	uint64_t align;
+};
+
+struct mm;
+struct file;
+
+/* Maps the segments of the executable f into mm and stores its entry point
+   in *entry. Returns 0, -ENOEXEC for a file it cannot run, or another
+   error; mm may then hold some of the segments. */
+int elf_load(struct mm *mm, struct file *f, uint64_t *entry);
@@ -0,0 +1,31 @@
+/* Error numbers, with Linux's values. Functions that can fail in more than
+   one way return them negated. */
+
+#pragma once
+
+#define ENOENT 2
+#define EIO 5
+#define ENOEXEC 8
+#define EBADF 9
+#define ECHILD 10
+#define EAGAIN 11
+#define ENOMEM 12
+#define EACCES 13
+#define EFAULT 14
+#define EBUSY 16
+#define ENODEV 19
+#define ENOTDIR 20
+#define EISDIR 21
+#define EINVAL 22
+#define EMFILE 24
+#define EPIPE 32
+#define ENAMETOOLONG 36
+#define ENOSYS 38
+#define EMSGSIZE 90
+#define EADDRINUSE 98
+#define ENETUNREACH 101
+#define ECONNRESET 104
+#define ENOTCONN 107
+#define ETIMEDOUT 110
+#define ECONNREFUSED 111
+#define ECANCELED 125
@@ -0,0 +1,106 @@
+/* FAT16 and FAT32 file systems, read-only
+
+   A volume is found on a block device either at its start or in an MBR
+   partition. Directory entries are read through the page cache and kept in
+   a hash table keyed by directory and case-folded name, so a path is looked
+   up without touching the disk again, and names a fully read directory
+   lacks are known to be missing. Each open file remembers the runs of
+   contiguous clusters its chain is made of; file data is read straight
+   into the caller's buffer with one block request per run, not one per
+   cluster. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blk.h"
+
+#define FAT_NAME_MAX 255
+#define FAT_VOLUMES_MAX 4
+/* Cluster runs remembered per file. */
+#define FAT_EXTENTS 16
+
+#define FAT_ATTR_READ_ONLY 0x01
+#define FAT_ATTR_HIDDEN 0x02
+#define FAT_ATTR_SYSTEM 0x04
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+/* Long file name entries combine these. */
+#define FAT_ATTR_LFN 0x0f
+
+struct fat_volume {
+	struct blk_device *dev;
+	/* 16 or 32. */
+	unsigned int fat_bits;
+	unsigned int cluster_shift;
+	/* Data clusters; they are numbered from 2. */
+	uint32_t clusters;
+	/* Device byte offsets of the first FAT, the FAT16 root directory and
+	   cluster 2. */
+	uint64_t fat_start;
+	uint64_t root_start;
+	uint64_t data_start;
+	/* Bytes of the FAT16 root directory. */
+	uint32_t root_size;
+	/* First cluster of the FAT32 root directory. */
+	uint32_t root_cluster;
+};
+
+/* Clusters file_cluster up to file_cluster + count of a file, which are
+   disk_cluster onwards on the disk. */
+struct fat_extent {
+	uint32_t file_cluster;
+	uint32_t disk_cluster;
+	uint32_t count;
+};
+
+/* An open file or directory. Not safe to share between threads. */
+struct fat_file {
+	struct fat_volume *vol;
+	/* First cluster, 0 for an empty file and the FAT16 root directory. */
+	uint32_t cluster;
+	uint32_t size;
+	uint8_t attr;
+	/* The chain as far as it has been walked. Once extents is full, the
+	   last slot moves along the chain. Complete means no cluster follows
+	   the last extent. */
+	unsigned int nextents;
+	bool extents_complete;
+	struct fat_extent extents[FAT_EXTENTS];
+};
+
+/* Called by fat_readdir() for each entry; returning false stops it. */
+typedef bool (*fat_filldir_t)(void *arg, const char *name, size_t len,
+							  const struct fat_file *f);
+
+/* Mounts the FAT volume on dev, or returns NULL if there is none. */
+struct fat_volume *fat_mount(struct blk_device *dev);
+
+/* The index-th volume mounted at boot, or NULL. */
+struct fat_volume *fat_volume_get(unsigned int index);
+
+void fat_root(struct fat_volume *vol, struct fat_file *out);
+
+/* Looks up name, which is not nul-terminated, in the directory dir. Returns
+   1, 0 if there is no such entry or -1 on an I/O error. */
+int fat_lookup(struct fat_file *dir, const char *name, size_t len,
+			   struct fat_file *out);
+
+/* Looks up a path of names separated by slashes, from the root. */
+bool fat_open(struct fat_volume *vol, const char *path, struct fat_file *out);
+
+/* Copies up to len bytes at off. Returns the number of bytes read, short at
+   the end of the file, or -1 on an I/O error. */
+long fat_read(struct fat_file *f, uint64_t off, void *buf, size_t len);
+
+/* Calls fn for the entries of dir other than "." and "..". Returns false
+   on an I/O error. */
+bool fat_readdir(struct fat_file *dir, fat_filldir_t fn, void *arg);
+
+struct inode;
+
+/* The volume's root directory as a VFS inode, or NULL without memory. */
+struct inode *fat_vfs_root(struct fat_volume *vol);
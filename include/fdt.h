@@ -0,0 +1,74 @@
+/* Flattened device tree (DTB) parsing */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Nodes are referred to by the offset of their FDT_BEGIN_NODE token in the
+   structure block. Lookups return -1 when nothing matches. */
+
+/* Validates the DTB given by the bootloader. Returns false if there is none
+   or it is malformed, in which case every lookup fails. */
+bool fdt_init(void);
+
+/* Switches to a copy of the DTB at blob. Node offsets stay valid. */
+void fdt_relocate(const void *blob);
+
+/* Address and size of the DTB blob, or NULL. */
+const void *fdt_blob(void);
+uint32_t fdt_size(void);
+
+static inline uint32_t fdt32_to_cpu(uint32_t v) { return __builtin_bswap32(v); }
+static inline uint64_t fdt64_to_cpu(uint64_t v) { return __builtin_bswap64(v); }
+
+/* Finds a node by absolute path, such as "/cpus" or "/soc/plic@c000000".
+   A path component without a unit address matches any unit address. */
+int fdt_path_offset(const char *path);
+
+/* Returns the next node after node in depth-first order, or -1 at the end of
+   the tree. *depth is adjusted by the change in depth. Start at 0, the
+   root. */
+int fdt_next_node(int node, int *depth);
+
+/* First child of node, or -1. */
+int fdt_first_child(int node);
+
+/* Next sibling of node, or -1. */
+int fdt_next_sibling(int node);
+
+/* Returns the next node after start (or from the root, if start is -1) whose
+   compatible list contains compat. */
+int fdt_node_by_compatible(int start, const char *compat);
+
+/* Name of node, including the unit address. */
+const char *fdt_node_name(int node);
+
+/* Returns the value of a property and its length in bytes, or NULL. */
+const void *fdt_getprop(int node, const char *name, uint32_t *len);
+
+/* Reads a property of one or two cells as a number. Returns false if it is
+   absent or has a different size. */
+bool fdt_getprop_u32(int node, const char *name, uint32_t *out);
+bool fdt_getprop_u64(int node, const char *name, uint64_t *out);
+
+/* Reads a number of cells (1 or 2) from a big-endian cell array. */
+uint64_t fdt_read_cells(const uint32_t *cells, uint32_t n);
+
+/* #address-cells and #size-cells that apply to the children of node. */
+uint32_t fdt_address_cells(int node);
+uint32_t fdt_size_cells(int node);
+
+/* Reads entry i of the reg property of node, using the cell sizes of
+   parent. Returns false if there is no such entry. */
+bool fdt_get_reg(int parent, int node, unsigned int i, uint64_t *addr,
+				 uint64_t *size);
+
+/* Lookups below use an index of every node built by the fdt_index initcall,
+   and fall back to walking the tree before that. */
+
+/* Node with the given phandle, or -1. */
+int fdt_node_by_phandle(uint32_t phandle);
+
+/* Parent of node, or -1 for the root. */
+int fdt_parent(int node);
@@ -0,0 +1,44 @@
+/* Per-hart state */
+
+#pragma once
+
+/* Harts are numbered densely from 0 by the kernel, independent of the
+   firmware hart IDs. Per-hart arrays in other subsystems are indexed by it. */
+#define HART_MAX 32
+
+/* Offset of stack_top, for entry.S. */
+#define HART_STACK_TOP 8
+
+#ifndef __ASSEMBLER__
+
+struct hart {
+	unsigned long hartid;
+	/* Initial stack, for harts started by smp_init(). */
+	unsigned long stack_top;
+	unsigned int index;
+};
+
+_Static_assert(__builtin_offsetof(struct hart, stack_top) == HART_STACK_TOP,
+			   "entry.S depends on struct hart layout");
+
+extern struct hart harts[HART_MAX];
+extern unsigned int hart_count;
+
+/* The current hart's state. tp holds it while running in the kernel. */
+static inline struct hart *hart_self(void) {
+	struct hart *h;
+	asm volatile("mv %0, tp" : "=r"(h));
+	return h;
+}
+
+static inline unsigned int hart_index(void) { return hart_self()->index; }
+
+static inline void hart_set_self(struct hart *h) {
+	asm volatile("mv tp, %0" ::"r"(h));
+}
+
+/* Sets up index 0 for the boot hart. Must run before anything uses
+   hart_self(). */
+void hart_init_boot(void);
+
+#endif
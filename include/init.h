@@ -0,0 +1,29 @@
+/* Code and data only needed while booting
+
+   Functions marked __init and data marked __initdata are linked into their
+   own page-aligned sections, which init_reclaim() unmaps and frees once boot
+   is done. Nothing may reference them after that. */
+
+#pragma once
+
+#include <stdbool.h>
+
+#define __init __attribute__((section(".init.text"), cold))
+#define __initdata __attribute__((section(".init.data")))
+
+extern char __init_text_start[], __init_text_end[];
+extern char __init_data_start[], __init_data_end[];
+
+/* Set once the init sections are gone. */
+extern bool init_reclaimed;
+
+static inline bool is_init_text(unsigned long addr) {
+	return addr >= (unsigned long)__init_text_start &&
+		   addr < (unsigned long)__init_text_end;
+}
+
+/* Called on the boot hart at the end of boot. Starts a thread that, once
+   every hart has finished booting and all memory is initialized, copies out
+   the bootloader data still in use, then frees the bootloader-reclaimable
+   regions and the init sections. */
+void init_reclaim(void);
@@ -0,0 +1,57 @@
+/* Dependency-ordered init phases, run in parallel on every hart
+
+   Each subsystem declares its initcalls along with the names of the initcalls
+   they depend on. initcall_run() is entered by every hart once SMP is up; any
+   hart may run any initcall whose dependencies have finished. A parallel
+   initcall is split into parts that all harts take from as they come free. */
+
+#pragma once
+
+#include <stdint.h>
+
+#define INITCALL_DEPS_MAX 4
+
+struct initcall {
+	const char *name;
+	void (*fn)(void);
+	/* Set for parallel initcalls instead of fn. Called once for every part
+	   number below nparts, on whichever harts are free. */
+	void (*fn_part)(unsigned int part, unsigned int nparts);
+	const char *const *dep_names;
+
+	/* Filled in by initcall_run(). */
+	struct initcall *deps[INITCALL_DEPS_MAX];
+	unsigned int state;
+	unsigned int nparts, next_part, parts_done;
+	unsigned long hart_mask;
+	uint64_t start, end;
+};
+
+#define __INITCALL(_name, _fn, _fn_part, ...)                         \
+	static const char *const __initcall_deps_##_name[] = {            \
+		__VA_OPT__(__VA_ARGS__, ) 0};                                 \
+	struct initcall __initcall_##_name                                \
+		__attribute__((section("__initcalls"), used, aligned(8))) = { \
+			.name = #_name,                                           \
+			.fn = _fn,                                                \
+			.fn_part = _fn_part,                                      \
+			.dep_names = __initcall_deps_##_name}
+
+/* INITCALL(name, fn, "dep", ...) runs fn() once on some hart. */
+#define INITCALL(name, fn, ...) __INITCALL(name, fn, 0, __VA_ARGS__)
+
+/* INITCALL_PARALLEL(name, fn, "dep", ...) runs fn(part, nparts) for every
+   part, spread across all harts. */
+#define INITCALL_PARALLEL(name, fn, ...) __INITCALL(name, 0, fn, __VA_ARGS__)
+
+/* Resolves dependencies and splits parallel initcalls for hart_count harts.
+   Called by smp_init() on the boot hart once hart_count is final, before
+   other harts start. Panics on unknown names and cycles. */
+void initcall_prepare(void);
+
+/* Runs initcalls until all of them have finished. Called by every hart. */
+void initcall_run(void);
+
+/* Prints when and where each initcall ran, and the chain of dependencies
+   that determined when the last one finished. */
+void initcall_print(void);
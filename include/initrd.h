@@ -0,0 +1,41 @@
+/* Initial ramdisk
+
+   Modules Limine loads that are ustar or cpio (newc) archives form one
+   read-only tree, indexed once at boot. File contents are served from the
+   modules' own memory, which is never freed, and names point into the
+   archive headers: nothing is copied. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct initrd_node {
+	/* Not nul-terminated. */
+	const char *name;
+	size_t len;
+	bool dir;
+	/* Contents of a file, in the HHDM. */
+	const void *data;
+	size_t size;
+
+	struct initrd_node *parent;
+	struct initrd_node *children, *sibling;
+	struct initrd_node *hash_next;
+};
+
+/* NULL if no archive was loaded. */
+struct initrd_node *initrd_root(void);
+
+/* Looks up name, which is not nul-terminated, in the directory dir. */
+struct initrd_node *initrd_lookup(struct initrd_node *dir, const char *name,
+								  size_t len);
+
+/* Looks up a path of names separated by slashes, from the root. */
+struct initrd_node *initrd_open(const char *path);
+
+struct inode;
+
+/* The root as a VFS inode, or NULL if there is no initrd or no memory. */
+struct inode *initrd_vfs_root(void);
@@ -0,0 +1,52 @@
+/* ISA extensions beyond rv64gc, as found in the DTB */
+
+#pragma once
+
+/* Variants of hot routines for an extension are built if the configuration
+   requires the extension, or with CONFIG_DISPATCH for all of them. */
+#if defined(CONFIG_DISPATCH) || defined(CONFIG_ARCH_RV64GCV)
+#define ISA_BUILD_V 1
+#endif
+#if defined(CONFIG_DISPATCH) || defined(CONFIG_ARCH_ZBB)
+#define ISA_BUILD_ZBB 1
+#endif
+#if defined(CONFIG_DISPATCH) || defined(CONFIG_ARCH_ZICBOZ)
+#define ISA_BUILD_ZICBOZ 1
+#endif
+
+#ifndef __ASSEMBLER__
+
+#include <stdbool.h>
+
+enum isa_ext {
+	ISA_EXT_V,
+	ISA_EXT_ZBA,
+	ISA_EXT_ZBB,
+	ISA_EXT_ZICBOM,
+	ISA_EXT_ZICBOP,
+	ISA_EXT_ZICBOZ,
+	ISA_EXT_COUNT,
+};
+
+#define ISA_BIT(ext) (1ul << (ext))
+
+/* Extensions every hart has. */
+extern unsigned long isa_extensions;
+
+/* Cache block size for Zicboz, the smallest of any hart. */
+extern unsigned int isa_cboz_block_size;
+
+static inline bool isa_has(enum isa_ext ext) {
+	return isa_extensions & ISA_BIT(ext);
+}
+
+/* Reads the extensions of all harts from the DTB. Stops the kernel if one
+   the configuration requires is missing. */
+void isa_init(void);
+
+/* Puts the current hart's extension state as the kernel expects it, with
+   vector state off. Runs on every hart before it calls anything that may
+   use them. */
+void isa_hart_init(void);
+
+#endif
@@ -12,10 +12,33 @@ extern struct limine_hhdm_request hhdm_request;
 
 extern struct limine_executable_address_request executable_address_request;
 
-#define LIMINE_HHDM_VTOP(addr) \
-	((void *)((uint64_t)addr - hhdm_request.response->offset))
+extern struct limine_riscv_bsp_hartid_request riscv_bsp_hartid_request;
 
-#define LIMINE_EXE_VTOP(addr)                                     \
-	((void *)((uint64_t)addr -                                    \
-			  executable_address_request.response->virtual_base + \
-			  executable_address_request.response->physical_base))
\ No newline at end of file
+extern struct limine_memmap_request memmap_request;
+
+extern struct limine_mp_request mp_request;
+
+extern struct limine_dtb_request dtb_request;
+
+extern struct limine_module_request module_request;
+
+extern struct limine_date_at_boot_request date_at_boot_request;
+
+extern struct limine_bootloader_performance_request
+	bootloader_performance_request;
+
+/* Copies of the responses that stay in use after bootloader memory is
+   reclaimed. */
+extern uint64_t limine_hhdm_offset;
+extern uint64_t limine_exe_virtual_base, limine_exe_physical_base;
+/* UNIX time at boot, or 0 if the bootloader did not say. */
+extern int64_t limine_boot_date;
+
+/* Saves the values above. Must run first thing at boot. */
+void limine_save_responses(void);
+
+#define LIMINE_HHDM_VTOP(addr) ((void *)((uint64_t)addr - limine_hhdm_offset))
+
+#define LIMINE_EXE_VTOP(addr)                              \
+	((void *)((uint64_t)addr - limine_exe_virtual_base + \
+			  limine_exe_physical_base))
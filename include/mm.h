@@ -0,0 +1,162 @@
+/* User address spaces
+
+   Each process has its own page tables, made by vmm_create(): its mappings
+   below USER_TOP, and the kernel's above. Mappings are described by areas,
+   and pages are only put in the tables when the process first touches
+   them, by mm_fault():
+
+   - anonymous memory reads as a shared zero page until it is written;
+   - file pages come from the file's page cache, see vfs_get_page(), and
+     are shared by every process that maps them until one writes;
+   - a fork shares every page of the parent with the child, both read-only,
+     and whichever side writes first gets its own copy.
+
+   Pages are refcounted, see page_get(), so a page written by the last
+   process still holding it is reused instead of copied.
+
+   Anonymous areas are mapped with 2 MiB megapages where a whole aligned
+   range fits and is untouched when first written, if a free block allows.
+   Ranges that were filled page by page are collapsed into megapages later
+   by a thread on each hart, while their process is stopped in mm_yield().
+   A megapage is split back into single pages when part of it is unmapped
+   or changes protection.
+
+   Memory the kernel does I/O to behind the process's back, such as rings,
+   is mapped shared instead: those pages stay writable and the same across
+   forks, are never copied on write or collapsed, and the kernel holds
+   references that keep them alive after they are unmapped.
+
+   The kernel never dereferences a user pointer. It translates user
+   addresses page by page, faulting pages in as the process would, and goes
+   through the HHDM. A bad pointer makes the system call fail instead of
+   faulting in the kernel, and SUM never needs to be set. An address space
+   is only used by its own process, which stays on one hart, so changes to
+   it flush that hart's TLB alone. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* End of user space, the same in Sv39 and Sv48. */
+#define USER_TOP (1ul << 38)
+/* The stack, just below USER_TOP. */
+#define USER_STACK_SIZE (64ul << 10)
+
+struct file;
+struct page;
+
+/* A mapped range of an address space. */
+struct vma {
+	uint64_t start, end;
+	/* PTE_R, PTE_W and PTE_X, and those mm_protect() may give it. */
+	uint64_t prot, max_prot;
+	/* For file mappings: the file, with a reference, the offset in it of
+	   start, and how many bytes from start the file provides. The rest of
+	   the range reads as zeros. */
+	struct file *file;
+	uint64_t offset;
+	uint64_t file_size;
+	struct vma *next;
+};
+
+struct mm {
+	uint64_t *root;
+	uint64_t satp;
+	/* Sorted by address. */
+	struct vma *vmas;
+	/* Pages mapped, shared ones included, and the most there have been. */
+	unsigned long rss, rss_peak;
+	/* Link in the collapser's list of the hart the process runs on, set
+	   once it has a single page where a megapage fits, and where its
+	   next scan starts. */
+	struct mm *scan_next;
+	bool scan_listed;
+	unsigned int hart;
+	uint64_t scan_va;
+	/* Set while the process is in mm_yield(). */
+	bool quiescent;
+};
+
+/* Whether anonymous memory gets megapages. Cleared by the nothp option. */
+extern bool mm_thp;
+
+/* Megapage events since boot: megapages mapped on a fault, faults that
+   found no free block, ranges collapsed and megapages split. */
+struct mm_thp_stats {
+	unsigned long faults, fallbacks, collapses, splits;
+};
+
+extern struct mm_thp_stats mm_thp_stats;
+
+/* An empty address space, or NULL if out of memory. */
+struct mm *mm_create(void);
+
+/* Frees the address space and drops its pages. It must not be loaded on
+   any hart. */
+void mm_destroy(struct mm *mm);
+
+/* Maps [va, va + size), which must be page aligned and free, as prot says,
+   with the first file_size bytes from file at offset and zeros after them;
+   file may be NULL for anonymous memory. Nothing is mapped until it is
+   touched. Returns 0, -EINVAL or -ENOMEM. */
+int mm_map(struct mm *mm, uint64_t va, uint64_t size, uint64_t prot,
+		   struct file *file, uint64_t offset, uint64_t file_size);
+
+static inline int mm_map_anon(struct mm *mm, uint64_t va, uint64_t size,
+							  uint64_t prot) {
+	return mm_map(mm, va, size, prot, NULL, 0, 0);
+}
+
+/* Maps the n pages from first on, which the caller allocated and keeps a
+   reference to, shared at va, which must be page aligned and free. The
+   process cannot raise prot later. Returns 0, -EINVAL or -ENOMEM. */
+int mm_map_shared(struct mm *mm, uint64_t va, struct page *first,
+				  unsigned long n, uint64_t prot);
+
+/* Pins the pages of [va, va + size), which must be page aligned, for I/O
+   by the kernel: faults them in writable, marks them shared and stores
+   them in pages, each with a reference for the caller to page_put().
+   Returns 0 or -EFAULT. */
+int mm_pin(struct mm *mm, uint64_t va, uint64_t size, struct page **pages);
+
+/* Unmaps [va, va + size), which must be page aligned, splitting the areas
+   it cuts through. Returns 0, -EINVAL or -ENOMEM. */
+int mm_unmap(struct mm *mm, uint64_t va, uint64_t size);
+
+/* Changes the protection of [va, va + size), which must be page aligned and
+   mapped, to prot, which must include PTE_R or PTE_X. Returns 0, -EINVAL,
+   -EACCES or -ENOMEM. */
+int mm_protect(struct mm *mm, uint64_t va, uint64_t size, uint64_t prot);
+
+/* The highest free range of size bytes below the stack, or 0. Ranges of 2
+   MiB and up are aligned for megapages. */
+uint64_t mm_find_free(struct mm *mm, uint64_t size);
+
+/* Handles a fault of the mm's process at va for access, one of PTE_R, PTE_W
+   or PTE_X. Returns 0 once the page is mapped, -EFAULT if the access is
+   not allowed, or -ENOMEM. */
+int mm_fault(struct mm *mm, uint64_t va, uint64_t access);
+
+/* Yields the hart on behalf of mm's process, from a point where the kernel
+   holds no pointers into its memory, so that the collapser may move its
+   pages. */
+void mm_yield(struct mm *mm);
+
+/* A copy of mm for a child process, sharing its pages copy-on-write, or
+   NULL if out of memory. mm must be the one loaded on this hart. */
+struct mm *mm_fork(struct mm *mm);
+
+/* The kernel address of user address va, faulting the page in for access,
+   PTE_R or PTE_W, if need be. NULL if the process may not access it that
+   way. Valid up to the end of its page. */
+void *mm_user_addr(struct mm *mm, uint64_t va, uint64_t access);
+
+/* Return 0, or -EFAULT if part of the user range is not accessible. */
+int copy_from_user(struct mm *mm, void *dst, uint64_t src, size_t len);
+int copy_to_user(struct mm *mm, uint64_t dst, const void *src, size_t len);
+
+/* Copies a string of at most size bytes, NUL included. Returns its length,
+   -EFAULT or -ENAMETOOLONG. */
+long strncpy_from_user(struct mm *mm, char *dst, uint64_t src, size_t size);
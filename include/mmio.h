@@ -0,0 +1,37 @@
+/* Device register access */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Accesses are ordered against normal memory the way drivers expect: a write
+   happens after all earlier memory writes (so a device sees the buffers it is
+   told about), and a read happens before all later memory reads. */
+
+static inline uint32_t mmio_read32(const volatile void *addr) {
+	uint32_t v = *(const volatile uint32_t *)addr;
+	asm volatile("fence i, r" ::: "memory");
+	return v;
+}
+
+static inline void mmio_write32(volatile void *addr, uint32_t v) {
+	asm volatile("fence w, o" ::: "memory");
+	*(volatile uint32_t *)addr = v;
+}
+
+static inline uint16_t mmio_read16(const volatile void *addr) {
+	uint16_t v = *(const volatile uint16_t *)addr;
+	asm volatile("fence i, r" ::: "memory");
+	return v;
+}
+
+static inline uint8_t mmio_read8(const volatile void *addr) {
+	uint8_t v = *(const volatile uint8_t *)addr;
+	asm volatile("fence i, r" ::: "memory");
+	return v;
+}
+
+static inline void mmio_write8(volatile void *addr, uint8_t v) {
+	asm volatile("fence w, o" ::: "memory");
+	*(volatile uint8_t *)addr = v;
+}
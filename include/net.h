@@ -0,0 +1,329 @@
+/* IPv4 network stack
+
+   ARP, IPv4, ICMP echo, UDP and TCP on the first network device, with a
+   static address from ip=<addr>/<prefix>,<gateway> on the command line;
+   the default suits QEMU's user network. Sockets only connect out to a
+   peer: there is no listening yet.
+
+   Protocol processing is per hart. Every flow, a peer address and port and
+   a local port, hashes to one hart that owns its socket. A received packet
+   is handed to its flow's hart through that hart's lock-free inbox, and
+   only threads on that hart ever touch the socket. Connecting picks a local
+   port that hashes to the calling hart, so an application and its sockets
+   share a hart; since scheduling is cooperative, nothing on the way from
+   the device to the application takes a shared lock.
+
+   Data is not copied. Senders fill buffers from sock_buf_alloc() and hand
+   them over: UDP pushes its headers in front, TCP keeps them until they are
+   acknowledged and sends segments of clones behind a separate header
+   buffer. Receivers get the device's buffers with the headers pulled off. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hart.h"
+#include "netdev.h"
+
+/* Addresses are in host byte order. */
+#define IPV4_ADDR(a, b, c, d)                                         \
+	((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | \
+	 (uint32_t)(d))
+
+/* Queued bytes per socket. */
+#define SOCK_SNDBUF (512 * 1024)
+#define SOCK_RCVBUF (256 * 1024)
+
+enum sock_type {
+	SOCK_UDP,
+	SOCK_TCP,
+};
+
+struct sock;
+
+/* Whether the stack is up: a device and an address. */
+bool net_ready(void);
+
+/* A socket, owned by the calling hart and only to be used there. Returns 0
+   or an error. */
+int sock_open(enum sock_type type, struct sock **out);
+
+/* UDP: sets the peer. TCP: connects, waiting for the handshake. */
+int sock_connect(struct sock *s, uint32_t addr, uint16_t port);
+
+/* A buffer for data to send, with room for the headers in front. */
+struct netbuf *sock_buf_alloc(struct sock *s);
+
+/* Sends nb's data and takes nb over, also on failure. UDP sends it as one
+   datagram. TCP appends it to the stream, first waiting while SOCK_SNDBUF
+   is full. Returns 0 or an error. */
+int sock_send(struct sock *s, struct netbuf *nb);
+
+/* Waits for a datagram or more of the stream and stores it in *out.
+   Returns its length, 0 at the end of the stream or an error, -EAGAIN if
+   timeout_us (0 for none) passes first. */
+long sock_recv(struct sock *s, struct netbuf **out, uint64_t timeout_us);
+
+/* TCP: waits until everything sent is acknowledged. */
+int sock_flush(struct sock *s);
+
+/* Frees the socket. A TCP connection is shut down in the background once
+   the data sent before is acknowledged. May be called on any hart: off the
+   owning one, the socket is handed to that hart's stack thread to close. */
+void sock_close(struct sock *s);
+
+struct file;
+
+/* A socket connected to addr and port as a file, for user processes, owned
+   by the calling hart like the socket. Reads take what one sock_recv()
+   returns, keeping the rest of a TCP segment for the next read and
+   dropping that of a datagram; writes send, as one datagram for UDP.
+   Closing the last reference closes the socket. Returns 0 or an error. */
+int sock_file_open(enum sock_type type, uint32_t addr, uint16_t port,
+				   struct file **out);
+
+/* Shared by the stack's files. */
+
+#define ETH_P_IP 0x0800
+#define ETH_P_ARP 0x0806
+
+#define IPPROTO_ICMP 1
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+
+#define IP_HLEN 20
+#define UDP_HLEN 8
+#define TCP_HLEN 20
+
+/* Flows per hart's table. */
+#define NET_FLOW_BUCKETS 256
+
+/* Loads and stores of big-endian fields at any alignment. */
+static inline uint16_t net_get16(const void *p) {
+	const uint8_t *b = p;
+	return (uint16_t)(b[0] << 8 | b[1]);
+}
+
+static inline uint32_t net_get32(const void *p) {
+	const uint8_t *b = p;
+	return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 |
+		   (uint32_t)b[2] << 8 | b[3];
+}
+
+static inline void net_put16(void *p, uint16_t v) {
+	uint8_t *b = p;
+	b[0] = v >> 8;
+	b[1] = v;
+}
+
+static inline void net_put32(void *p, uint32_t v) {
+	uint8_t *b = p;
+	b[0] = v >> 24;
+	b[1] = v >> 16;
+	b[2] = v >> 8;
+	b[3] = v;
+}
+
+struct net_iface {
+	struct netdev *dev;
+	uint32_t addr, mask, gateway;
+};
+
+extern struct net_iface net_iface;
+
+enum tcp_state {
+	TCP_CLOSED,
+	TCP_SYN_SENT,
+	TCP_ESTABLISHED,
+	TCP_FIN_WAIT_1,
+	TCP_FIN_WAIT_2,
+	TCP_CLOSING,
+	TCP_TIME_WAIT,
+	TCP_CLOSE_WAIT,
+	TCP_LAST_ACK,
+};
+
+struct tcp_sock {
+	enum tcp_state state;
+
+	/* Send side. The queue holds the data from snd_una on, starting
+	   snd_off bytes into its first buffer; snd_queued is how much. */
+	uint32_t iss, snd_una, snd_nxt, snd_max;
+	uint32_t snd_wnd, snd_wl1, snd_wl2;
+	struct netbuf *sndq, *sndq_tail;
+	size_t snd_off, snd_queued;
+	/* A FIN follows the queued data. */
+	bool fin_queued;
+	uint16_t mss;
+	uint8_t snd_wscale, rcv_wscale;
+
+	/* Congestion control, NewReno. */
+	uint32_t cwnd, ssthresh, recover;
+	unsigned int dupacks;
+	bool in_recovery;
+
+	/* Receive side. rcv_adv is the right edge of the last window
+	   advertised. An ACK owed is sent at the end of the batch, from the
+	   hart's list. */
+	uint32_t rcv_nxt, rcv_adv;
+	bool ack_pending, ack_listed;
+	struct sock *ack_next;
+
+	/* Round-trip time of one segment at a time, in rdtime() ticks. */
+	bool timing;
+	uint32_t rtt_seq;
+	uint64_t rtt_start;
+	uint64_t srtt, rttvar, rto;
+	unsigned int backoff;
+
+	uint64_t stat_segs_out, stat_retransmits;
+};
+
+struct sock {
+	enum sock_type type;
+	unsigned int hart;
+	uint32_t raddr;
+	uint16_t rport, lport;
+	/* In the hart's flow table. */
+	bool hashed;
+	/* Closed by the application; freed once the connection is done. */
+	bool orphan;
+	int err;
+	struct sock *flow_next;
+
+	/* A thread waiting for the socket to change, if it can sleep. */
+	struct thread *waiter;
+
+	/* Received packets, with the headers pulled off. */
+	struct netbuf *rcvq, *rcvq_tail;
+	size_t rcv_queued;
+	bool rcv_eof;
+
+	/* Next timeout in rdtime() ticks, 0 for none, and the link in the
+	   hart's list of sockets with one. */
+	uint64_t deadline;
+	bool timer_listed;
+	struct sock *timer_next;
+
+	/* The link in the owning hart's list of sockets to close. */
+	struct sock *close_next;
+
+	struct tcp_sock tcp;
+};
+
+/* Per-hart protocol state, only touched by threads on its hart. */
+struct net_hart {
+	struct thread *thread;
+	/* Packets other harts steered here, pushed without a lock. */
+	struct netbuf *inbox;
+	/* Sockets of this hart closed on others, pushed the same way. */
+	struct sock *closing;
+	/* Header and send buffers. */
+	struct netbuf_pool pool;
+	struct sock *flows[NET_FLOW_BUCKETS];
+	struct sock *timers;
+	/* Sockets owing their peer an ACK at the end of the batch. */
+	struct sock *acks;
+	/* Packets waiting for ARP, and when to ask again. */
+	struct netbuf *arp_wait;
+	unsigned int arp_tries;
+	uint64_t arp_retry;
+	bool arp_update;
+	uint16_t ip_id;
+	uint16_t next_port;
+	/* When the hart's stack thread next wakes up by itself, UINT64_MAX for
+	   never. */
+	uint64_t sleep_until;
+
+	uint64_t stat_steered_in;
+};
+
+extern struct net_hart net_harts[HART_MAX];
+
+static inline struct net_hart *net_this_hart(void) {
+	return &net_harts[hart_index()];
+}
+
+/* The hart owning the flow. */
+unsigned int net_flow_hart(uint32_t raddr, uint16_t rport, uint16_t lport);
+struct sock *net_flow_find(struct net_hart *nh, uint32_t raddr, uint16_t rport,
+						   uint16_t lport);
+/* Picks a local port for a flow to raddr:rport owned by the calling hart
+   and adds s to its table. */
+int net_flow_connect(struct sock *s, uint32_t raddr, uint16_t rport);
+void net_flow_remove(struct sock *s);
+
+/* A zeroed socket owned by the calling hart, or NULL. */
+struct sock *net_sock_alloc(enum sock_type type);
+/* Takes the socket out of the hart's tables and frees it with the packets
+   it holds. */
+void net_sock_free(struct sock *s);
+/* Has the owning hart's stack thread sock_close() s. */
+void net_sock_close_remote(struct sock *s);
+
+/* Arms or clears s->deadline. */
+void net_sock_timer(struct sock *s, uint64_t deadline);
+void net_sock_wake(struct sock *s);
+
+/* Internet checksum arithmetic: partial sums are folded and complemented
+   by net_csum_fold(). */
+uint32_t net_csum(uint32_t sum, const void *data, size_t len);
+/* Sums a packet's data from off on, across its buffers. */
+uint32_t net_csum_pkt(uint32_t sum, const struct netbuf *nb, size_t off);
+uint32_t net_csum_pseudo(uint32_t saddr, uint32_t daddr, uint8_t proto,
+						 size_t len);
+uint16_t net_csum_fold(uint32_t sum);
+
+/* Sets the checksum of the transport header nb->data points at, or leaves
+   it to the device. csum_offset is the field's offset in the header. */
+void net_l4_csum(struct netbuf *nb, uint8_t proto, uint32_t daddr,
+				 size_t csum_offset);
+
+/* Checks the checksum of a received transport packet. */
+bool net_l4_csum_ok(const struct netbuf *nb, uint8_t proto, uint32_t saddr);
+
+/* Shortens a packet to len bytes. */
+void net_trim(struct netbuf *nb, size_t len);
+
+/* The neighbour packets to daddr go to: itself or the gateway. */
+uint32_t ip_nexthop(uint32_t daddr);
+
+/* Sends the transport packet nb->data points at to daddr, pushing the IP
+   and Ethernet headers into its headroom. Takes nb over. */
+void ip_output(struct netbuf *nb, uint8_t proto, uint32_t daddr);
+
+/* Handles a received frame of a flow owned by the calling hart. */
+void ip_input(struct netbuf *nb);
+
+/* Received packets, with nb->data past the IP header. */
+void icmp_input(struct netbuf *nb, uint32_t saddr);
+void udp_input(struct netbuf *nb, uint32_t saddr);
+void tcp_input(struct netbuf *nb, uint32_t saddr);
+
+/* Resolves the next hop and sends the IP packet nb->data points at, with
+   room for the Ethernet header in front. Without an answer yet, the packet
+   waits on the hart's ARP list. */
+void arp_output(struct netbuf *nb, uint32_t nexthop);
+/* Handles an ARP packet, nb->data past the Ethernet header. */
+void arp_input(struct netbuf *nb);
+/* Retries packets waiting for ARP on the calling hart. */
+void arp_retry(struct net_hart *nh, uint64_t now);
+
+int tcp_connect(struct sock *s, uint32_t addr, uint16_t port);
+int tcp_send(struct sock *s, struct netbuf *nb);
+int tcp_flush(struct sock *s);
+/* Called after the application took data off the receive queue. */
+void tcp_recvd(struct sock *s);
+void tcp_close(struct sock *s);
+void tcp_timeout(struct sock *s, uint64_t now);
+/* Sends the ACKs owed at the end of a batch. */
+void tcp_send_acks(struct net_hart *nh);
+
+int udp_send(struct sock *s, struct netbuf *nb);
+
+/* Waits for s to change, until deadline if it is not 0. Returns 0, -EAGAIN
+   once the deadline has passed or -ECANCELED if the thread was
+   interrupted. */
+int net_sock_wait(struct sock *s, uint64_t deadline);
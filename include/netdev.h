@@ -0,0 +1,230 @@
+/* Network devices, packet buffers and polled receive
+
+   A packet lives in netbufs: blocks of pages that start with the struct
+   netbuf itself, followed by headroom for headers pushed in front of the
+   data. Buffers come from netbuf pools that keep freed blocks for reuse, so
+   a busy receive ring recycles the same pages. A packet may be a chain of
+   buffers linked through frag, and a clone is a small descriptor for part
+   of another buffer's data, holding a reference on its block: packets are
+   split and joined without copying what they carry.
+
+   Devices take packets in and out through per-queue NAPI contexts: the
+   interrupt for a queue only masks itself and wakes the queue's poll
+   thread, which handles up to a budget of packets per pass. While a pass
+   uses up its budget, the thread keeps polling with interrupts left off,
+   yielding between passes; once a pass comes up short the driver turns
+   interrupts back on and the thread sleeps. Under load, a device therefore
+   costs no interrupts at all. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pmm.h"
+#include "spinlock.h"
+
+#define ETH_ALEN 6
+#define ETH_HLEN 14
+#define ETH_DATA_LEN 1500
+#define NETDEV_MAX 4
+
+/* Bytes from the start of a netbuf to its data when allocated: the struct
+   and room for link, network and transport headers. */
+#define NETBUF_HEADROOM 256
+
+/* Packets per NAPI pass. */
+#define NAPI_BUDGET 64
+
+struct netbuf;
+
+struct netbuf_pool {
+	spinlock_t lock;
+	/* Each buffer is a block of 2^order pages. */
+	unsigned int order;
+	struct netbuf *free;
+};
+
+#define NETBUF_POOL_INIT(block_order) {SPINLOCK_INIT, (block_order), NULL}
+
+enum netbuf_csum {
+	/* Sent as is, or received without the device checking it. */
+	NETBUF_CSUM_NONE,
+	/* The checksum at csum_start + csum_offset covers from csum_start to
+	   the end and is still to be computed: by the device when sending, by
+	   whoever needs it when received from a peer on the same host. */
+	NETBUF_CSUM_PARTIAL,
+	/* Received and verified by the device. */
+	NETBUF_CSUM_VALID,
+};
+
+#define NETBUF_GSO_NONE 0
+#define NETBUF_GSO_TCPV4 1
+#define NETBUF_GSO_TCPV6 2
+
+struct netbuf {
+	/* Links packets in a batch or a queue. */
+	struct netbuf *next;
+	/* The packet's next buffer. Only the first carries the fields below
+	   block. */
+	struct netbuf *frag;
+	/* NULL for a clone. */
+	struct netbuf_pool *pool;
+	/* The buffer heading the block data points into; the netbuf itself
+	   unless it is a clone. */
+	struct netbuf *block;
+	/* On a block's own netbuf: references from it and its clones. */
+	unsigned int refs;
+
+	struct netdev *dev;
+	uint8_t *data;
+	uint32_t len;
+	/* The device queue it came in on. */
+	uint16_t queue;
+	enum netbuf_csum csum;
+	uint16_t csum_start, csum_offset;
+	/* With segmentation offload, a large TCP packet that goes out on the
+	   wire as segments of gso_size payload bytes. */
+	uint8_t gso_type;
+	uint16_t gso_size;
+};
+
+/* A buffer with len = 0 and data NETBUF_HEADROOM into it, or NULL. */
+struct netbuf *netbuf_alloc(struct netbuf_pool *pool);
+
+/* A clone of len bytes at off into nb's data, or NULL. Clones are
+   read-only: they have no head- or tailroom. */
+struct netbuf *netbuf_clone(struct netbuf *nb, size_t off, size_t len);
+
+/* Frees a packet: the buffer and its frags. */
+void netbuf_free(struct netbuf *nb);
+/* Frees packets linked through next. */
+void netbuf_free_list(struct netbuf *list);
+
+static inline bool netbuf_is_clone(const struct netbuf *nb) {
+	return nb->block != nb;
+}
+
+static inline size_t netbuf_size(const struct netbuf *nb) {
+	return PAGE_SIZE << nb->pool->order;
+}
+
+static inline size_t netbuf_headroom(const struct netbuf *nb) {
+	if (netbuf_is_clone(nb)) return 0;
+	return nb->data - (uint8_t *)(nb + 1);
+}
+
+static inline size_t netbuf_tailroom(const struct netbuf *nb) {
+	if (netbuf_is_clone(nb)) return 0;
+	return (uint8_t *)nb + netbuf_size(nb) - (nb->data + nb->len);
+}
+
+/* Bytes in the whole packet. */
+static inline size_t netbuf_pkt_len(const struct netbuf *nb) {
+	size_t len = 0;
+	for (; nb; nb = nb->frag) len += nb->len;
+	return len;
+}
+
+/* Buffers in the packet. */
+static inline unsigned int netbuf_frags(const struct netbuf *nb) {
+	unsigned int n = 0;
+	for (; nb; nb = nb->frag) n++;
+	return n;
+}
+
+/* Makes room for a header in front of the data. */
+static inline void *netbuf_push(struct netbuf *nb, size_t n) {
+	nb->data -= n;
+	nb->len += n;
+	return nb->data;
+}
+
+/* Strips a header from the front. */
+static inline void *netbuf_pull(struct netbuf *nb, size_t n) {
+	nb->data += n;
+	nb->len -= n;
+	return nb->data;
+}
+
+/* Extends the data at the end and returns where the new part starts. */
+static inline void *netbuf_put(struct netbuf *nb, size_t n) {
+	void *tail = nb->data + nb->len;
+	nb->len += n;
+	return tail;
+}
+
+struct napi;
+
+typedef int (*napi_poll_t)(struct napi *n, int budget);
+
+struct napi {
+	/* Handles up to budget packets and returns how many. Returning less
+	   than budget means the driver has re-enabled the interrupt. */
+	napi_poll_t poll;
+	struct thread *thread;
+	void *priv;
+
+	/* Interrupts that woke the thread, and passes that used up their
+	   budget and kept polling. */
+	uint64_t stat_irqs;
+	uint64_t stat_busy_polls;
+};
+
+/* Starts the poll thread on hart. */
+bool napi_init(struct napi *n, napi_poll_t poll, void *priv, int hart);
+
+/* Called from the interrupt handler, with the interrupt already masked. */
+void napi_schedule(struct napi *n);
+
+/* Device offloads, in netdev.features. */
+/* Computes checksums marked NETBUF_CSUM_PARTIAL when sending. */
+#define NETDEV_F_TX_CSUM (1u << 0)
+/* Checks received checksums, and may hand on partial ones. */
+#define NETDEV_F_RX_CSUM (1u << 1)
+/* Segments large TCP packets when sending. */
+#define NETDEV_F_TSO4 (1u << 2)
+#define NETDEV_F_TSO6 (1u << 3)
+/* Coalesces received TCP segments into large packets. */
+#define NETDEV_F_LRO (1u << 4)
+
+struct netdev;
+
+struct netdev_ops {
+	/* Queues a packet on the calling hart's transmit queue and takes it
+	   over. Returns false, freeing it, if the queue is full. */
+	bool (*xmit)(struct netdev *dev, struct netbuf *nb);
+};
+
+struct netdev {
+	const char *name;
+	uint8_t mac[ETH_ALEN];
+	uint16_t mtu;
+	unsigned int nqueues;
+	unsigned int features;
+	/* Largest packet xmit takes, with segmentation offload, and most
+	   buffers in one. */
+	uint32_t max_xmit;
+	unsigned int max_frags;
+	const struct netdev_ops *ops;
+	void *priv;
+
+	/* Set by the network stack. Called from a queue's poll thread with a
+	   batch of received packets linked through next, which it takes
+	   over. Without it packets are dropped. */
+	void (*rx)(struct netdev *dev, struct netbuf *list);
+	void *stack_priv;
+
+	uint64_t stat_rx_packets, stat_rx_bytes, stat_rx_drops;
+	uint64_t stat_tx_packets, stat_tx_bytes, stat_tx_drops;
+};
+
+void netdev_register(struct netdev *dev);
+
+/* The index-th registered device, or NULL. */
+struct netdev *netdev_get(unsigned int index);
+
+static inline bool netdev_xmit(struct netdev *dev, struct netbuf *nb) {
+	return dev->ops->xmit(dev, nb);
+}
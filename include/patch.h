@@ -0,0 +1,19 @@
+/* Runtime patching of kernel text */
+
+#pragma once
+
+#include <stdint.h>
+
+#define RV_INSN_NOP 0x00000013u
+
+/* Encodes "j target" placed at pc. The distance must be within +-1MiB. */
+uint32_t rv_insn_jump(unsigned long pc, unsigned long target);
+
+/* Replaces the 4-byte aligned instruction at addr. The write goes through the
+   HHDM alias, as the kernel's own text mapping is read-only. Other harts may
+   run the old instruction until patch_commit(). */
+void patch_insn(void *addr, uint32_t insn);
+
+/* Makes all patched instructions visible to instruction fetch: fence.i here,
+   then a remote fence.i on every other hart. */
+void patch_commit(void);
@@ -0,0 +1,60 @@
+/* Page cache for block devices
+
+   Keeps device contents a page at a time, indexed by page number in a radix
+   tree per device. Readers get the cached page itself, so repeat reads copy
+   nothing. Misses that continue a sequential stream grow a read-ahead
+   window, and reaching the marker page inside one starts reading the next
+   window in the background. Dirty pages are written back in batches by a
+   thread per device. When the page allocator runs short, a clock sweep
+   frees clean pages nobody holds. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "blk.h"
+
+/* Contents match the device. */
+#define PCACHE_UPTODATE (1u << 0)
+/* The last read failed. */
+#define PCACHE_ERROR (1u << 1)
+/* Being read. */
+#define PCACHE_READING (1u << 2)
+#define PCACHE_DIRTY (1u << 3)
+#define PCACHE_WRITEBACK (1u << 4)
+/* Used since the clock hand last passed. */
+#define PCACHE_REFERENCED (1u << 5)
+/* Reaching this page starts the next read-ahead. */
+#define PCACHE_READAHEAD (1u << 6)
+
+struct pcache_waiter;
+
+struct pcache_page {
+	struct pcache *cache;
+	uint64_t index;
+	/* The page's contents, in the HHDM. */
+	void *data;
+	unsigned int refs;
+	unsigned int flags;
+	struct blk_request req;
+	struct pcache_waiter *waiters;
+	/* Position on the clock. */
+	struct pcache_page *clock_next, *clock_prev;
+};
+
+/* Page index of dev, read in if need be, with a reference held. NULL past
+   the end of the device, on a read error or without memory. */
+struct pcache_page *pcache_get(struct blk_device *dev, uint64_t index);
+
+void pcache_put(struct pcache_page *pg);
+
+/* For a page whose data the caller has changed. */
+void pcache_mark_dirty(struct pcache_page *pg);
+
+/* Writes back every dirty page of dev and flushes the device's cache.
+   Returns false if a write failed. */
+bool pcache_sync(struct blk_device *dev);
+
+/* Frees up to nr clean, unused pages. Returns how many it freed. */
+unsigned long pcache_reclaim(unsigned long nr);
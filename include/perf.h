@@ -0,0 +1,118 @@
+/* Hardware performance counters on top of the SBI PMU extension */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum perf_event {
+	PERF_EVENT_CYCLES,
+	PERF_EVENT_INSTRET,
+	PERF_EVENT_CACHE_REFS,
+	PERF_EVENT_CACHE_MISSES,
+	PERF_EVENT_L1D_READ_MISSES,
+	PERF_EVENT_L1I_READ_MISSES,
+	PERF_EVENT_DTLB_READ_MISSES,
+	PERF_EVENT_ITLB_READ_MISSES,
+	PERF_EVENT_BRANCH_MISSES,
+	PERF_EVENT_COUNT
+};
+
+#define PERF_GROUP_MAX 8
+
+/* A set of counters that are started, stopped and read together. A group
+   belongs to the hart that configured it: PMU counters are per-hart, so every
+   other perf_group_* call must run on that hart too. */
+struct perf_group {
+	unsigned int hart;
+	unsigned int nr;
+	bool running;
+	/* Stop into the hart's snapshot page and read from there. Set by
+	   perf_group_init() when the hart has one; may be cleared to force
+	   per-counter reads. */
+	bool snapshot;
+	bool snapshot_valid;
+	/* Counters as a base and mask, for the SBI start/stop calls. */
+	unsigned long ctr_base, ctr_mask;
+	struct perf_group_event {
+		enum perf_event event;
+		unsigned int ctr;
+		/* Hardware counter CSR, or 0 for a firmware counter. */
+		uint16_t csr;
+		uint8_t width;
+		/* Without the PMU extension, the fixed counters are read directly
+		   and reported relative to their value at start. They cannot be
+		   stopped, so reads after perf_group_stop() keep advancing. */
+		uint64_t base;
+	} ev[PERF_GROUP_MAX];
+};
+
+/* A single counter that raises the local counter-overflow interrupt
+   (Sscofpmf) every period events. Like a group, it belongs to the hart that
+   initialized it. */
+struct perf_sampler {
+	unsigned int ctr;
+	uint8_t width;
+	uint64_t period;
+};
+
+/* Commonly used groups. */
+extern const enum perf_event perf_events_ipc[2];
+extern const enum perf_event perf_events_cache[3];
+extern const enum perf_event perf_events_tlb[3];
+
+/* Enumerates the PMU counters. Called once on the boot hart after
+   sbi_init(). */
+void perf_init(void);
+
+/* Registers the calling hart's PMU snapshot page with the firmware. Called by
+   perf_init() for the boot hart; every other hart calls it once when it comes
+   up. Returns 0, or a negative SBI error if snapshots are unavailable. */
+int perf_hart_init(void);
+
+/* Prints the counter table found by perf_init(). */
+void perf_print_counters(void);
+
+const char *perf_event_name(enum perf_event event);
+
+/* Allocates a counter for each event on the current hart. Returns 0, or a
+   negative SBI error if some event has no counter; nothing is left allocated
+   in that case. */
+int perf_group_init(struct perf_group *g, const enum perf_event *events,
+					unsigned int nr);
+
+/* Releases the group's counters back to the firmware. */
+void perf_group_release(struct perf_group *g);
+
+/* Zeroes and starts all counters of the group. */
+int perf_group_start(struct perf_group *g);
+
+/* Stops all counters of the group. In snapshot mode the firmware also dumps
+   their values to the hart's snapshot page in the same call. */
+int perf_group_stop(struct perf_group *g);
+
+/* Reads the value of every counter, in the order the events were given to
+   perf_group_init(). Works whether or not the group is running. A group
+   stopped in snapshot mode is read from memory without touching the PMU.
+   Otherwise, hardware counters are read straight from their CSR and only
+   firmware counters cost an ecall. */
+void perf_group_read(struct perf_group *g, uint64_t *values);
+
+/* Reads one hardware counter CSR (0xc00-0xc1f) by number. */
+uint64_t perf_read_csr(unsigned int csr);
+
+/* Enables the counter-overflow interrupt on this hart. Returns false if the
+   hart does not implement Sscofpmf. */
+bool perf_enable_overflow_irq(void);
+
+/* Allocates a programmable counter for event on this hart. Only those can
+   raise overflow interrupts, so the fixed cycle and instret counters are never
+   used. */
+int perf_sampler_init(struct perf_sampler *s, enum perf_event event,
+					  uint64_t period);
+
+/* (Re)starts the counter period events away from overflowing, which also
+   clears its overflow state. */
+int perf_sampler_start(struct perf_sampler *s);
+int perf_sampler_stop(struct perf_sampler *s);
+void perf_sampler_release(struct perf_sampler *s);
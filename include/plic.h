@@ -0,0 +1,16 @@
+/* Platform-level interrupt controller */
+
+#pragma once
+
+#include <stdbool.h>
+
+typedef void (*plic_handler_t)(void *arg);
+
+/* Routes interrupt source src to a hart and calls handler(arg) there, with
+   interrupts disabled, each time it fires. Spreads sources over the harts,
+   preferring those other than the boot hart. Returns the hart index, or -1
+   if there is no PLIC or src is out of range. */
+int plic_request_irq(unsigned int src, plic_handler_t handler, void *arg);
+
+/* Enables external interrupts on the current hart. */
+void plic_hart_init(void);
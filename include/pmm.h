@@ -0,0 +1,155 @@
+/* Physical page allocator
+
+   Every page frame between the lowest and highest RAM address the bootloader
+   reported has a struct page. Free pages are kept in power-of-two blocks on
+   per-order buddy lists. Only the first part of memory is set up while
+   booting; the rest is initialized in the background afterwards. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "limine/features.h"
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1ul << PAGE_SHIFT)
+
+/* Largest block order, 4 MiB. */
+#define PMM_MAX_ORDER 10
+
+/* Order of a 2 MiB block, the size of a megapage. */
+#define PMM_HUGE_ORDER 9
+
+struct page {
+	/* Links on a free list, while this is the first page of a free block. */
+	struct page *next, *prev;
+	uint32_t flags;
+	union {
+		/* Order of the free block this page heads. */
+		uint32_t order;
+		/* References to an allocated page or huge block that is shared, see
+		   page_get(). */
+		uint32_t refs;
+	};
+};
+
+/* Not managed by the allocator: holes, firmware, the kernel itself. */
+#define PG_RESERVED (1u << 0)
+/* First page of a free block. */
+#define PG_FREE (1u << 1)
+
+extern struct page *pmm_pages;
+extern uint64_t pmm_base_pfn, pmm_end_pfn;
+
+/* The kernel's HHDM covers all physical addresses up to the end of RAM,
+   MMIO included. */
+static inline void *phys_to_virt(uint64_t phys) {
+	return (void *)(phys + limine_hhdm_offset);
+}
+
+static inline uint64_t virt_to_phys(const void *virt) {
+	return (uint64_t)virt - limine_hhdm_offset;
+}
+
+/* Whether [virt, virt + len) is RAM reached through the HHDM, as devices
+   need of buffers; kernel image and stack addresses are not. */
+static inline bool virt_is_ram(const void *virt, size_t len) {
+	uint64_t first = virt_to_phys(virt) >> PAGE_SHIFT;
+	uint64_t last = (virt_to_phys(virt) + len - 1) >> PAGE_SHIFT;
+	return len && first >= pmm_base_pfn && first <= last &&
+		   last < pmm_end_pfn;
+}
+
+static inline uint64_t page_to_pfn(const struct page *p) {
+	return pmm_base_pfn + (p - pmm_pages);
+}
+
+static inline struct page *pfn_to_page(uint64_t pfn) {
+	return &pmm_pages[pfn - pmm_base_pfn];
+}
+
+static inline uint64_t page_to_phys(const struct page *p) {
+	return page_to_pfn(p) << PAGE_SHIFT;
+}
+
+static inline void *page_address(const struct page *p) {
+	return phys_to_virt(page_to_phys(p));
+}
+
+static inline struct page *virt_to_page(const void *virt) {
+	return pfn_to_page(virt_to_phys(virt) >> PAGE_SHIFT);
+}
+
+/* Single pages shared between users, such as address spaces after a fork:
+   the allocating user calls page_ref_init(), every further one page_get(),
+   and the last page_put() frees the page. Huge blocks are counted in their
+   first page and put with page_put_order(). */
+static inline void page_ref_init(struct page *p) { p->refs = 1; }
+
+static inline void page_get(struct page *p) {
+	__atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int page_refs(struct page *p) {
+	return __atomic_load_n(&p->refs, __ATOMIC_ACQUIRE);
+}
+
+void page_put_order(struct page *p, unsigned int order);
+
+static inline void page_put(struct page *p) { page_put_order(p, 0); }
+
+/* Allocates 2^order contiguous pages, aligned to their size. Returns NULL if
+   there is no such block. */
+struct page *pmm_alloc_pages(unsigned int order);
+void pmm_free_pages(struct page *p, unsigned int order);
+
+/* Gives page frames [start, end) that were reserved so far to the
+   allocator. All memory must have been initialized, see
+   pmm_wait_deferred(). */
+void pmm_free_range(uint64_t start, uint64_t end);
+
+/* Like the above, with the block's HHDM address. */
+void *pmm_alloc(unsigned int order);
+void pmm_free(void *addr, unsigned int order);
+
+/* Like pmm_alloc(), with the pages zeroed. Single pages come from a pool
+   that idle harts keep filled, so usually no zeroing happens here. */
+void *pmm_alloc_zeroed(unsigned int order);
+
+/* A 2 MiB block for a mapping that can do with single pages instead. Fails
+   at once if no such block is free, rather than draining the pool of
+   zeroed pages or shrinking caches. Zeroed blocks usually come from a
+   small pool of their own that idle harts fill once the single page pool
+   is full. */
+struct page *pmm_alloc_huge(bool zeroed);
+
+/* Zeroes up to a batch of pages for the pools. Called by idle harts;
+   returns false if the pools are full or no memory is free. */
+bool pmm_zero_pool_fill(void);
+
+/* Zeroes one page at a page-aligned address. Uses cbo.zero where the harts
+   have Zicboz, see dispatch.h. */
+void zero_page(void *page);
+
+/* A cache that gives memory back when an allocation would otherwise fail.
+   shrink() frees up to nr pages and returns how many it freed. It runs in
+   the failing allocation's context, so it must not wait, and must only
+   trylock locks held around allocations. */
+struct pmm_shrinker {
+	unsigned long (*shrink)(unsigned long nr);
+	struct pmm_shrinker *next;
+};
+
+void pmm_register_shrinker(struct pmm_shrinker *s);
+
+/* Finishes initializing memory left for after boot, helping the background
+   threads doing it. Allocations never need this: they do the same when they
+   would otherwise fail. */
+void pmm_wait_deferred(void);
+
+/* Number of free pages. Memory not initialized yet does not count. */
+uint64_t pmm_free_count(void);
+
+void pmm_print(void);
@@ -0,0 +1,24 @@
+/* Pools of fixed-size objects
+
+   For kernel structures too small to take a page each. Objects are carved
+   out of single pages as a pool grows; freed objects go back on the pool's
+   free list, and the pages stay with the pool. */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "spinlock.h"
+
+struct pool {
+	spinlock_t lock;
+	size_t size;
+	void *free;
+};
+
+/* size must be at least a pointer and at most a page. */
+#define POOL_INIT(obj_size) {SPINLOCK_INIT, (obj_size), NULL}
+
+/* A zeroed object, or NULL if out of memory. */
+void *pool_alloc(struct pool *p);
+void pool_free(struct pool *p, void *obj);
@@ -0,0 +1,14 @@
+/* Freestanding string formatting */
+
+#pragma once
+
+#include <stdarg.h>
+#include <stddef.h>
+
+/* Supports the flags '-' and '0', a field width (or '*'), the length
+   modifiers l, ll and z, and the conversions d i u x X p s c %.
+   Output is always NUL terminated if n > 0. Returns the length the full
+   output would have had. */
+int vsnprintf(char *buf, size_t n, const char *fmt, va_list ap);
+int snprintf(char *buf, size_t n, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
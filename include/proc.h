@@ -0,0 +1,90 @@
+/* User processes
+
+   A process is one kernel thread that spends most of its time in user mode,
+   with its own address space and file descriptors. The thread's user frame,
+   at the top of its stack, holds the user registers while it is in the
+   kernel and the kernel's tp while it is in user mode; see user_entry.S.
+   Processes stay on the hart they were started on, like all threads. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdnoreturn.h>
+
+#include "pmm.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "trap.h"
+#include "vfs.h"
+
+#define PROC_PATH_MAX 64
+
+struct proc {
+	int pid;
+	char path[PROC_PATH_MAX];
+	struct mm *mm;
+	struct thread *thread;
+	struct fdtable fds;
+	spinlock_t lock;
+	bool exited;
+	int exit_code;
+	/* Largest resident set, in pages, known once it exited. */
+	unsigned long rss_peak;
+	/* The thread in proc_wait(), if it sleeps. */
+	struct thread *waiter;
+	/* Children not waited for yet, linked by sibling. Only the process
+	   itself uses the list. */
+	struct proc *children, *sibling;
+	/* Set when the parent exits first; the process then frees itself. */
+	bool detached;
+	/* Registers a forked child starts with. */
+	struct trap_frame fork_frame;
+	/* Set up by SYS_URING_SETUP; a forked child starts without. */
+	struct uring *ring;
+};
+
+static inline struct trap_frame *thread_user_frame(struct thread *t) {
+	return (struct trap_frame *)((char *)t +
+								 (PAGE_SIZE << THREAD_STACK_ORDER) -
+								 TRAP_FRAME_SIZE);
+}
+
+/* The calling thread's process, or NULL in a kernel thread. */
+static inline struct proc *proc_current(void) { return sched_current()->proc; }
+
+/* Starts the executable at path in a new process, on the given hart or on
+   the least busy one if hart is -1, with the console on fds 0-2. Loading
+   happens in the new thread; a program that fails to load exits with the
+   error. Returns 0 or an error. */
+int proc_spawn(const char *path, int hart, struct proc **out);
+
+/* Waits for p to exit, frees it and returns its exit code, and its
+   largest resident set in pages through rss_peak unless that is NULL.
+   Only one thread may wait for a process. */
+int proc_wait(struct proc *p, unsigned long *rss_peak);
+
+/* Copies the calling process, which entered the kernel with the registers
+   in tf. Returns the child's pid or an error. */
+int proc_fork(struct trap_frame *tf);
+
+/* Waits for the calling process's child pid, see proc_wait(). Returns its
+   exit code or -ECHILD. */
+int proc_wait_child(int pid);
+
+/* Ends the calling process. */
+noreturn void proc_exit(int code);
+
+/* Runs the program named by the init= option, /bin/init by default, and
+   waits for it, if the initrd has it. */
+void proc_run_init(void);
+
+/* System calls, see syscall.h and syscall.c. */
+typedef long (*syscall_t)(long, long, long, long, long, long);
+
+/* Handlers of the fast system calls, called from user_entry.S. NULL entries
+   return -ENOSYS. */
+extern const syscall_t syscall_table[];
+
+/* Handles system calls at or above SYS_FAST_MAX, with the whole user frame
+   saved in tf. */
+long syscall_frame(struct trap_frame *tf);
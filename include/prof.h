@@ -0,0 +1,22 @@
+/* Sampling profiler driven by PMU counter-overflow interrupts */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Frames recorded per sample: the interrupted pc plus return addresses. */
+#define PROF_DEPTH 8
+
+/* Starts sampling the current hart every period cycles, recording the
+   interrupted pc and a frame-pointer backtrace. Needs Sscofpmf and a
+   programmable counter that can count cycles. Returns 0, or a negative SBI
+   error. */
+int prof_start(uint64_t period);
+
+/* Stops sampling the current hart. Samples are kept until prof_dump(). */
+void prof_stop(void);
+
+/* Prints the samples of every hart as "prof:" lines, one per distinct stack,
+   for scripts/profile.py to symbolize against build/kernel.elf. Then clears
+   them. */
+void prof_dump(void);
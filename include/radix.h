@@ -0,0 +1,40 @@
+/* Radix trees mapping 64-bit indices to pointers
+
+   Nodes have 64 slots, so a tree of height h covers indices below 2^(6h)
+   and grows as larger ones are inserted. Each slot can carry tags, kept for
+   whole subtrees so that tagged items are found without visiting the rest,
+   like the dirty pages of a cache. Callers provide the locking. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RADIX_TAGS 2
+
+struct radix_node;
+
+struct radix_tree {
+	struct radix_node *root;
+	unsigned int height;
+};
+
+void *radix_lookup(const struct radix_tree *t, uint64_t index);
+
+/* False if index is taken or nodes cannot be allocated. */
+bool radix_insert(struct radix_tree *t, uint64_t index, void *item);
+
+/* Removes and returns the item at index, freeing nodes left empty. */
+void *radix_delete(struct radix_tree *t, uint64_t index);
+
+/* Tags apply to present items only. */
+void radix_tag_set(struct radix_tree *t, uint64_t index, unsigned int tag);
+void radix_tag_clear(struct radix_tree *t, uint64_t index, unsigned int tag);
+bool radix_tag_get(const struct radix_tree *t, uint64_t index,
+				   unsigned int tag);
+
+/* Stores up to max items carrying tag, at indices from start on, in index
+   order. Returns how many it found. */
+unsigned int radix_gang_lookup_tag(const struct radix_tree *t, uint64_t start,
+								   unsigned int tag, void **items,
+								   unsigned int max);
@@ -53,14 +53,69 @@ struct sbiret {
 int sbi_hartmask_add(unsigned long *hart_mask, unsigned long hart_mask_base,
 					 unsigned long hartid);
 
+/* Encodes a spec version the way sbi_get_spec_version() returns it. */
+#define SBI_SPEC_VERSION(major, minor) (((unsigned long)(major) << 24) | (minor))
+#define SBI_SPEC_MAJOR(version) (((version) >> 24) & 0x7f)
+#define SBI_SPEC_MINOR(version) ((version) & 0xffffff)
+
+#define SBI_IMPL_BBL 0
+#define SBI_IMPL_OPENSBI 1
+#define SBI_IMPL_XVISOR 2
+#define SBI_IMPL_KVM 3
+#define SBI_IMPL_RUSTSBI 4
+#define SBI_IMPL_DIOSIX 5
+#define SBI_IMPL_COFFER 6
+#define SBI_IMPL_XEN 7
+#define SBI_IMPL_POLARFIRE_HSS 8
+#define SBI_IMPL_COREBOOT 9
+#define SBI_IMPL_OREBOOT 10
+#define SBI_IMPL_BHYVE 11
+
+/* SBI Firmware Features */
+#define SBI_FWFT_MISALIGNED_EXC_DELEG 0
+#define SBI_FWFT_LANDING_PAD 1
+#define SBI_FWFT_SHADOW_STACK 2
+#define SBI_FWFT_DOUBLE_TRAP 3
+#define SBI_FWFT_PTE_AD_HW_UPDATING 4
+#define SBI_FWFT_POINTER_MASKING_PMLEN 5
+#define SBI_FWFT_COUNT 6
+
 extern struct sbi_extensions {
 	bool timer, ipi, rfence, hsm, srst, pmu, dbcn, susp, cppc, nacl, sta, sse,
 		fwft, dbtr, mpxy;
 } sbi_capabilities;
 
-/* To be called to get capabilities of SBI firmware */
+/* Everything sbi_init() learns about the firmware. Filled in once by the boot
+   hart; secondary harts and later subsystems only read it and never probe the
+   firmware themselves. */
+extern struct sbi_info {
+	unsigned long spec_version;
+	unsigned long impl_id, impl_version;
+	unsigned long mvendorid, marchid, mimpid;
+
+	/* PMU: hardware + firmware counters. 0 without the PMU extension. */
+	unsigned long pmu_num_counters;
+	/* DBTR: number of debug triggers of any type. */
+	unsigned long dbtr_num_triggers;
+	/* FWFT: bit n set if feature n is implemented, with its value at boot. */
+	unsigned long fwft_supported;
+	unsigned long fwft_value[SBI_FWFT_COUNT];
+
+	/* Cost of sbi_init() itself. */
+	unsigned long ecalls;
+	uint64_t cycles;
+} sbi_info;
+
+/* To be called once, on the boot hart, to get capabilities of SBI firmware.
+   Later calls return immediately. */
 void sbi_init(void);
 
+/* Prints the contents of sbi_info. */
+void sbi_print_info(void);
+
+/* Name of the firmware implementation, or NULL if unknown. */
+const char *sbi_impl_name(unsigned long impl_id);
+
 // Base Extension
 
 struct sbiret sbi_get_spec_version(void);
@@ -134,6 +189,53 @@ struct sbiret sbi_system_reset(uint32_t reset_type, uint32_t reset_reason);
 
 // Performance Monitoring Unit Extension "PMU"
 
+/* event_idx is type in bits [19:16] and code in bits [15:0]. */
+#define SBI_PMU_EVENT_TYPE_HW 0
+#define SBI_PMU_EVENT_TYPE_CACHE 1
+#define SBI_PMU_EVENT_TYPE_RAW 2
+#define SBI_PMU_EVENT_TYPE_FW 15
+#define SBI_PMU_EVENT_IDX(type, code) (((unsigned long)(type) << 16) | (code))
+
+#define SBI_PMU_HW_CPU_CYCLES 1
+#define SBI_PMU_HW_INSTRUCTIONS 2
+#define SBI_PMU_HW_CACHE_REFERENCES 3
+#define SBI_PMU_HW_CACHE_MISSES 4
+#define SBI_PMU_HW_BRANCH_INSTRUCTIONS 5
+#define SBI_PMU_HW_BRANCH_MISSES 6
+
+#define SBI_PMU_CACHE_L1D 0
+#define SBI_PMU_CACHE_L1I 1
+#define SBI_PMU_CACHE_LL 2
+#define SBI_PMU_CACHE_DTLB 3
+#define SBI_PMU_CACHE_ITLB 4
+#define SBI_PMU_CACHE_OP_READ 0
+#define SBI_PMU_CACHE_OP_WRITE 1
+#define SBI_PMU_CACHE_OP_PREFETCH 2
+#define SBI_PMU_CACHE_RESULT_ACCESS 0
+#define SBI_PMU_CACHE_RESULT_MISS 1
+#define SBI_PMU_CACHE_CODE(cache, op, result) \
+	(((cache) << 3) | ((op) << 1) | (result))
+
+/* sbi_pmu_counter_get_info() value fields */
+#define SBI_PMU_INFO_CSR(info) ((info) & 0xfff)
+#define SBI_PMU_INFO_WIDTH(info) ((((info) >> 12) & 0x3f) + 1)
+#define SBI_PMU_INFO_FIRMWARE(info) ((info) >> 63)
+
+#define SBI_PMU_CFG_FLAG_SKIP_MATCH (1 << 0)
+#define SBI_PMU_CFG_FLAG_CLEAR_VALUE (1 << 1)
+#define SBI_PMU_CFG_FLAG_AUTO_START (1 << 2)
+#define SBI_PMU_CFG_FLAG_SET_VUINH (1 << 3)
+#define SBI_PMU_CFG_FLAG_SET_VSINH (1 << 4)
+#define SBI_PMU_CFG_FLAG_SET_UINH (1 << 5)
+#define SBI_PMU_CFG_FLAG_SET_SINH (1 << 6)
+#define SBI_PMU_CFG_FLAG_SET_MINH (1 << 7)
+
+#define SBI_PMU_START_FLAG_SET_INIT_VALUE (1 << 0)
+#define SBI_PMU_START_FLAG_INIT_SNAPSHOT (1 << 1)
+
+#define SBI_PMU_STOP_FLAG_RESET (1 << 0)
+#define SBI_PMU_STOP_FLAG_TAKE_SNAPSHOT (1 << 1)
+
 struct sbiret sbi_pmu_num_counters(void);
 struct sbiret sbi_pmu_counter_get_info(unsigned long counter_idx);
 struct sbiret sbi_pmu_counter_config_matching(unsigned long counter_idx_base,
@@ -0,0 +1,110 @@
+/* Kernel threads and the per-hart scheduler
+
+   Scheduling is cooperative: a thread runs until it yields, blocks or exits.
+   Every thread belongs to one hart's run queue. The code each hart was
+   running when it entered the scheduler becomes that hart's idle thread.
+
+   A thread that runs a user process also has its address space, loaded when
+   it is switched to. Kernel threads keep whatever address space the hart
+   had, as the kernel half is the same in all of them. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdnoreturn.h>
+
+struct proc;
+
+/* Callee-saved state, laid out for switch.S. */
+struct context {
+	unsigned long ra, sp;
+	unsigned long s[12];
+};
+
+enum thread_state {
+	THREAD_RUNNABLE,
+	THREAD_RUNNING,
+	THREAD_BLOCKED,
+	THREAD_DEAD,
+};
+
+struct thread {
+	struct context ctx;
+	const char *name;
+	enum thread_state state;
+	unsigned int hart;
+	/* Set by sched_wake() while the thread was still running, so its next
+	   sched_block() returns at once. */
+	bool wake_pending;
+	/* Set by sched_interrupt(); stays set. */
+	bool interrupted;
+	/* While blocked in sched_block_until(): the time it ends, and the link
+	   in the hart's list of such threads. */
+	uint64_t deadline;
+	struct thread *timer_next;
+	void (*fn)(void *);
+	void *arg;
+	/* The user process the thread runs, and the satp of its address space;
+	   0 for kernel threads. */
+	struct proc *proc;
+	uint64_t satp;
+	/* Run queue link. */
+	struct thread *next;
+};
+
+/* Order of the page block holding a thread and its stack. The top
+   TRAP_FRAME_SIZE bytes of the block are kept free for the registers of a
+   user process. */
+#define THREAD_STACK_ORDER 2
+
+/* Sets up the calling hart's idle thread and enables IPIs. Called once by
+   every hart before it uses anything else here. */
+void sched_init_hart(void);
+
+struct thread *sched_current(void);
+
+/* False in a hart's idle thread, which must not block. */
+bool sched_can_block(void);
+
+/* Creates a thread running fn(arg) on the given hart, or on the least busy
+   hart if hart is -1. Returns NULL if out of memory. */
+struct thread *kthread_create(void (*fn)(void *), void *arg, const char *name,
+							  int hart);
+
+/* Switches the calling thread to the address space selected by satp, or
+   back to the kernel's if satp is 0. */
+void sched_set_satp(uint64_t satp);
+
+/* Ends the calling thread. Returning from its function does the same. */
+noreturn void kthread_exit(void);
+
+/* Runs other threads on this hart, if any are runnable. */
+void sched_yield(void);
+
+/* Puts the calling thread to sleep until sched_wake(). A wakeup that arrives
+   between deciding to sleep and calling this is not lost. */
+void sched_block(void);
+
+/* Like sched_block(), but also returns once rdtime() reaches deadline. The
+   hart's timer interrupt ends the sleep; without the SBI timer extension
+   only sched_wake() does. */
+void sched_block_until(uint64_t deadline);
+
+void sched_wake(struct thread *t);
+
+/* Wakes t and marks it interrupted: waits that can give up, such as for a
+   socket, fail with -ECANCELED from then on. For threads asked to finish
+   what they hold and exit. */
+void sched_interrupt(struct thread *t);
+
+/* Whether the calling thread was interrupted. */
+bool sched_interrupted(void);
+
+/* Wakes one other hart that is sleeping in its idle loop, if any, to pick up
+   background work such as pmm_zero_pool_fill(). */
+void sched_kick_idle(void);
+
+/* The idle thread's loop: runs threads, and waits for an IPI when there are
+   none. */
+noreturn void sched_idle(void);
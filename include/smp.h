@@ -0,0 +1,14 @@
+/* Bringing up the other harts */
+
+#pragma once
+
+/* Numbers the harts reported by the bootloader, prepares the initcalls for
+   that many and sends every other hart into initcall_run(), then into the
+   scheduler's idle loop. Returns without
+   waiting for them. Harts beyond HART_MAX are left parked in the
+   bootloader. */
+void smp_init(void);
+
+/* Waits until every other hart has finished initcall_run() and left boot
+   code for good. */
+void smp_wait_booted(void);
@@ -0,0 +1,45 @@
+/* Spinlocks for short critical sections shared between harts */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "trap.h"
+
+typedef struct {
+	unsigned int locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT {0}
+
+static inline void cpu_relax(void) {
+	// pause from Zihintpause, encoded so the assembler needn't know it. It
+	// is a fence hint, a no-op on harts without the extension.
+	asm volatile(".insn i 0x0f, 0, x0, x0, 0x010");
+}
+
+static inline void spin_lock(spinlock_t *l) {
+	while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED)) cpu_relax();
+	}
+}
+
+static inline bool spin_trylock(spinlock_t *l) {
+	return !__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(spinlock_t *l) {
+	__atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+/* For locks also taken from interrupt handlers. */
+static inline bool spin_lock_irqsave(spinlock_t *l) {
+	bool irq = local_irq_save();
+	spin_lock(l);
+	return irq;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, bool irq) {
+	spin_unlock(l);
+	local_irq_restore(irq);
+}
@@ -0,0 +1,57 @@
+/* System call numbers and calling convention, shared with user programs and
+   user_entry.S
+
+   ecall with the number in a7 and up to six arguments in a0-a5. The result,
+   or a negated errno, comes back in a0. a1-a7 and t0-t6 are clobbered and
+   come back zeroed, so nothing of the kernel's leaks through them; the
+   other registers are preserved.
+
+   Numbers below SYS_FAST_MAX take the fast path, which saves only what the
+   C calling convention does not preserve. Calls that need the whole user
+   frame, such as ones that copy or replace the process, go above it. */
+
+#pragma once
+
+#define SYS_NULL 0
+#define SYS_EXIT 1
+#define SYS_GETPID 2
+#define SYS_YIELD 3
+#define SYS_OPEN 4
+#define SYS_CLOSE 5
+#define SYS_READ 6
+#define SYS_WRITE 7
+/* mmap(addr, len, prot, fd, offset): a private mapping of len bytes of fd
+   from offset on, or of zeros if fd is -1. addr is a hint and may be 0.
+   Returns the address. */
+#define SYS_MMAP 8
+#define SYS_MUNMAP 9
+/* wait(pid): waits for a child to exit and returns its exit code. */
+#define SYS_WAIT 10
+/* mprotect(addr, len, prot): changes the protection of mapped pages. prot
+   must allow reading or execution. */
+#define SYS_MPROTECT 11
+/* uring_setup(entries, flags), uring_enter(to_submit, min_complete, flags)
+   and uring_register(addr, len), see uring.h. */
+#define SYS_URING_SETUP 12
+#define SYS_URING_ENTER 13
+#define SYS_URING_REGISTER 14
+/* socket(type, addr, port): a socket connected to the IPv4 address addr,
+   in host order, and port. Returns its fd. */
+#define SYS_SOCKET 15
+/* clock_gettime(clock, ts), which the vDSO answers without trapping, see
+   vdso.h. */
+#define SYS_CLOCK_GETTIME 16
+
+#define SYS_FAST_MAX 32
+
+/* Returns the child's pid, and 0 in the child. */
+#define SYS_FORK 32
+
+/* prot bits of SYS_MMAP. */
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define PROT_EXEC 4
+
+/* type of SYS_SOCKET. */
+#define SOCKET_UDP 0
+#define SOCKET_TCP 1
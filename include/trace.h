@@ -0,0 +1,68 @@
+/* Static tracepoints
+
+   A tracepoint site is a single 4-byte nop while its tracepoint is disabled.
+   Enabling it patches every site into a jump to the code that writes a record
+   to the current hart's ring buffer. Enable them with trace=<name>[,...] or
+   trace=all on the kernel command line. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct tracepoint {
+	const char *name;
+	bool enabled;
+};
+
+/* Emitted into the __trace_sites section by every trace() use. */
+struct trace_site {
+	unsigned long site;
+	unsigned long target;
+	struct tracepoint *tp;
+};
+
+/* Tracepoints live in their own section so trace.c can find them all. */
+#define DEFINE_TRACEPOINT(name)                                      \
+	struct tracepoint __tracepoint_##name                            \
+		__attribute__((section("__tracepoints"), used, aligned(8))) = { \
+			#name, false}
+
+#define DECLARE_TRACEPOINT(name) extern struct tracepoint __tracepoint_##name
+
+/* Records a and b under tracepoint name, if it is enabled. A macro rather than
+   an inline function, so the site and tracepoint address stay assembler
+   constants even at -O0. */
+#define trace(name, a, b)                                                   \
+	do {                                                                    \
+		__label__ __trace_on, __trace_off;                                  \
+		asm goto(                                                           \
+			".balign 4\n"                                                   \
+			".option push\n"                                                \
+			".option norelax\n"                                             \
+			".option norvc\n"                                               \
+			"1: nop\n"                                                      \
+			".option pop\n"                                                 \
+			".pushsection __trace_sites, \"aw\"\n"                          \
+			".balign 8\n"                                                   \
+			".quad 1b, %l[__trace_on], %0\n"                                \
+			".popsection\n" ::"i"(&__tracepoint_##name)::__trace_on);       \
+		goto __trace_off;                                                   \
+	__trace_on:                                                             \
+		trace_record(&__tracepoint_##name, (uint64_t)(a), (uint64_t)(b)); \
+	__trace_off:;                                                           \
+	} while (0)
+
+/* Kept out of line and cold so the enabled path stays off the hot layout. */
+__attribute__((cold, noinline)) void trace_record(struct tracepoint *tp,
+												  uint64_t a, uint64_t b);
+
+/* Enables tracepoints listed in trace= on the command line. */
+void trace_init(void);
+
+/* Returns 0, or -1 if no tracepoint has that name. */
+int trace_enable(const char *name);
+int trace_disable(const char *name);
+
+/* Disables all tracepoints, then prints and clears every hart's buffer. */
+void trace_dump(void);
@@ -0,0 +1,77 @@
+/* Trap entry and dispatch */
+
+#pragma once
+
+/* Size of struct trap_frame, kept 16-byte aligned for the stack. */
+#define TRAP_FRAME_SIZE (36 * 8)
+
+/* Exception codes in scause. */
+#define EXC_ILLEGAL_INST 2
+#define EXC_U_ECALL 8
+#define EXC_INST_PAGE_FAULT 12
+#define EXC_LOAD_PAGE_FAULT 13
+#define EXC_STORE_PAGE_FAULT 15
+
+#ifndef __ASSEMBLER__
+
+#include <stdbool.h>
+#include <stdnoreturn.h>
+
+#include "csr.h"
+
+/* Registers saved by trap_entry, in x1-x31 order, then the trap CSRs. A
+   user thread's frame also keeps the kernel's tp while it is in user
+   mode. */
+struct trap_frame {
+	unsigned long ra, sp, gp, tp;
+	unsigned long t0, t1, t2;
+	unsigned long s0, s1;
+	unsigned long a0, a1, a2, a3, a4, a5, a6, a7;
+	unsigned long s2, s3, s4, s5, s6, s7, s8, s9, s10, s11;
+	unsigned long t3, t4, t5, t6;
+	unsigned long sepc, sstatus, scause, stval;
+	unsigned long kernel_tp;
+};
+
+_Static_assert(sizeof(struct trap_frame) == TRAP_FRAME_SIZE,
+			   "trap_entry frame layout");
+
+typedef void (*irq_handler_t)(struct trap_frame *tf);
+
+/* Points stvec at trap_entry. Called on every hart before it enables
+   interrupts. */
+void trap_init(void);
+
+/* Registers the handler for a local interrupt (an IRQ_* number below 16). The
+   handler runs with interrupts disabled and must clear the pending source. */
+void trap_set_irq_handler(unsigned int irq, irq_handler_t handler);
+
+/* Called by trap_entry. */
+void trap_handler(struct trap_frame *tf);
+
+/* Called by user_trap_entry, see user_entry.S, for traps from user mode
+   other than fast syscalls. */
+void user_trap(struct trap_frame *tf);
+
+/* Enters user mode with the registers in tf, the thread's user frame. */
+noreturn void user_return(struct trap_frame *tf);
+
+static inline void local_irq_enable(void) { csr_set(sstatus, SSTATUS_SIE); }
+
+static inline void local_irq_disable(void) { csr_clear(sstatus, SSTATUS_SIE); }
+
+/* Disables interrupts, returning whether they were enabled. */
+static inline bool local_irq_save(void) {
+	unsigned long s;
+	asm volatile("csrrc %0, sstatus, %1"
+				 : "=r"(s)
+				 : "rK"(SSTATUS_SIE)
+				 : "memory");
+	return s & SSTATUS_SIE;
+}
+
+static inline void local_irq_restore(bool enabled) {
+	if (enabled) local_irq_enable();
+}
+
+#endif
@@ -0,0 +1,114 @@
+/* Submission and completion rings shared with user space
+
+   A process sets up one pair of rings with SYS_URING_SETUP, which maps
+   them into its address space, and registers one buffer area with
+   SYS_URING_REGISTER. It then queues requests in the submission queue and
+   reaps their results from the completion queue without a system call per
+   request: SYS_URING_ENTER hands the kernel everything queued so far and
+   can wait for completions. With URING_SETUP_SQPOLL a kernel thread on
+   another hart watches the submission queue instead, and the process only
+   enters the kernel to wake it after it went idle.
+
+   Each queue is a power-of-two array of entries with free-running head and
+   tail indices. The producer fills entries[tail & mask] and then publishes
+   them with a release store of tail; the consumer reads up to tail with an
+   acquire load and then stores head. The kernel never has more requests in
+   flight than the completion queue holds, so completions are never
+   dropped.
+
+   Data moves between the registered buffer area and files, sockets or
+   block devices. The kernel pins that area once, so it reaches it through
+   its own mapping from any hart, and nothing is copied through the
+   process's page tables per request. Reads and writes that may sleep run
+   one at a time, in order, so a read of a socket with nothing to read
+   holds up the requests after it. When the process lets go of its rings,
+   such a wait fails with -ECANCELED.
+
+   The rest of this file is shared with user programs. */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Largest submission queue; the completion queue is twice as long. */
+#define URING_ENTRIES_MAX 256
+/* Largest registered buffer area. */
+#define URING_BUF_MAX (16ul << 20)
+
+/* flags of SYS_URING_SETUP. */
+#define URING_SETUP_SQPOLL (1u << 0)
+
+/* flags of SYS_URING_ENTER. */
+#define URING_ENTER_SQ_WAKEUP (1u << 0)
+
+/* sq_flags: the polling thread went to sleep and wants
+   URING_ENTER_SQ_WAKEUP once there is more to submit. */
+#define URING_SQ_NEED_WAKEUP (1u << 0)
+
+enum uring_op {
+	URING_OP_NOP,
+	/* Reads len bytes of fd into addr, at off, or at the file position if
+	   off is URING_OFF_POS. Sockets read what has arrived. */
+	URING_OP_READ,
+	/* Writes len bytes at addr to fd, at the file position. Sockets
+	   send. */
+	URING_OP_WRITE,
+	/* Reads or writes len bytes at sector off of block device fd, in
+	   whole sectors, to or from addr, which must be sector aligned. */
+	URING_OP_BLK_READ,
+	URING_OP_BLK_WRITE,
+};
+
+#define URING_OFF_POS UINT64_MAX
+
+struct uring_sqe {
+	uint8_t op;
+	uint8_t pad[3];
+	int32_t fd;
+	uint64_t off;
+	/* Within the registered buffer area. */
+	uint64_t addr;
+	uint32_t len;
+	uint32_t pad2;
+	/* Handed back in the completion. */
+	uint64_t user_data;
+};
+
+struct uring_cqe {
+	uint64_t user_data;
+	/* Bytes moved, or a negated errno. */
+	int64_t res;
+};
+
+/* At the start of the mapping, with the entries after it. The two queues'
+   indices are a cache line apart, as they are written from different
+   sides. */
+struct uring_shared {
+	uint32_t sq_head, sq_tail, sq_mask, sq_flags;
+	uint32_t sqes_off;
+	uint32_t pad[11];
+	uint32_t cq_head, cq_tail, cq_mask;
+	uint32_t cqes_off;
+};
+
+/* Kernel side */
+
+struct uring;
+
+/* Sets up the calling process's rings. Returns their user address or an
+   error. */
+long uring_setup(unsigned int entries, unsigned int flags);
+
+/* Pins [addr, addr + len) of the calling process as its buffer area.
+   Returns 0 or an error. */
+long uring_register(uint64_t addr, uint64_t len);
+
+/* Submits up to to_submit requests, unless a thread polls for them, then
+   waits until min_complete completions are ready or nothing more is in
+   flight. Returns the number submitted or an error. */
+long uring_enter(unsigned int to_submit, unsigned int min_complete,
+				 unsigned int flags);
+
+/* Lets go of a process's rings when it exits. Requests in flight finish in
+   the background. */
+void uring_release(struct uring *r);
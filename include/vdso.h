@@ -0,0 +1,81 @@
+/* The vDSO: clock reads without a system call
+
+   Every process gets two read-only pages at VDSO_BASE: a data page the
+   kernel keeps, then code that reads it along with the time CSR, which
+   scounteren lets user mode read. Firmware may still keep the CSR from
+   user mode. The first read then traps and is emulated, and from there on
+   the code falls back to SYS_CLOCK_GETTIME. The code is position independent
+   and finds the data page right before its own page.
+
+   The data page is a seqlock: seq is odd while the kernel changes the rest,
+   and readers retry if it was odd or changed while they read. Nanoseconds
+   since boot are rdtime() * mult >> 32, with a 128-bit product, and the
+   wall clock adds wall_offset to them. It starts from the date Limine read
+   at boot, to the second.
+
+   The rest of this file is shared with user programs and vdso.S. */
+
+#pragma once
+
+/* 4 MiB below USER_TOP, under the stack and out of the way of mmap(). */
+#define VDSO_BASE 0x3fffc00000ul
+#define VDSO_DATA VDSO_BASE
+#define VDSO_TEXT (VDSO_BASE + 4096)
+
+/* int clock_gettime(int clock, struct timespec *ts), at the start of the
+   code. Returns 0 or -EINVAL. */
+#define VDSO_CLOCK_GETTIME VDSO_TEXT
+
+/* clock of clock_gettime() and SYS_CLOCK_GETTIME. */
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+
+/* Offsets in struct vdso_data, for vdso.S. */
+#define VDSO_SEQ 0
+#define VDSO_USER_TIME 4
+#define VDSO_MULT 8
+#define VDSO_WALL_OFFSET 16
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+
+struct timespec {
+	int64_t tv_sec;
+	int64_t tv_nsec;
+};
+
+struct vdso_data {
+	uint32_t seq;
+	/* Set if user mode may read the time CSR. */
+	uint32_t user_time;
+	uint64_t mult;
+	int64_t wall_offset;
+	/* Ticks per second, for programs that read the CSR themselves. */
+	uint64_t freq;
+};
+
+_Static_assert(__builtin_offsetof(struct vdso_data, user_time) ==
+				   VDSO_USER_TIME,
+			   "vdso.S depends on struct vdso_data layout");
+_Static_assert(__builtin_offsetof(struct vdso_data, mult) == VDSO_MULT,
+			   "vdso.S depends on struct vdso_data layout");
+_Static_assert(__builtin_offsetof(struct vdso_data, wall_offset) ==
+				   VDSO_WALL_OFFSET,
+			   "vdso.S depends on struct vdso_data layout");
+
+/* Kernel side */
+
+struct mm;
+
+/* Maps the vDSO into mm. Returns 0 or an error. */
+int vdso_map(struct mm *mm);
+
+/* Called when a user read of the time CSR trapped: the vDSO stops reading
+   it and makes the system call instead. */
+void vdso_time_trapped(void);
+
+/* Reads clock the way the vDSO does. Returns 0 or -EINVAL. */
+int vdso_clock_gettime(int clock, struct timespec *ts);
+
+#endif
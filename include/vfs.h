@@ -0,0 +1,164 @@
+/* Virtual file system
+
+   File systems provide inodes; the VFS names them with dentries, joins file
+   systems with a mount table and hands out open files. Dentries, positive
+   and negative, live in a hash table keyed by parent and name. Entries are
+   published with release stores and never freed, so path walks read the
+   table without a lock, as they would under RCU: a path that was opened
+   before is found again without locking or asking the file system. Only a
+   miss takes the slow path, which calls the file system's lookup and adds
+   the result under the table's lock.
+
+   Mounts and the file systems below are read-only, so nothing cached ever
+   goes stale. That includes the pages of file contents kept for mappings
+   into user space, see vfs_get_page(). */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "radix.h"
+#include "spinlock.h"
+
+#define VFS_NAME_MAX 255
+/* Names up to this long are stored in the dentry itself. */
+#define VFS_NAME_INLINE 32
+#define FD_MAX 64
+
+struct inode;
+struct file;
+struct page;
+
+/* Called by readdir for each entry; returning false stops it. */
+typedef bool (*vfs_filldir_t)(void *arg, const char *name, size_t len,
+							  bool dir);
+
+struct inode_ops {
+	/* Stores the child name of the directory dir in *out. Returns 0,
+	   -ENOENT or another error. */
+	int (*lookup)(struct inode *dir, const char *name, size_t len,
+				  struct inode **out);
+	/* Optional: sets up f->priv. Returns 0 or an error. */
+	int (*open)(struct file *f);
+	/* Optional: undoes open. */
+	void (*release)(struct file *f);
+	/* Reads up to len bytes at off. Returns the bytes read or an error. */
+	long (*read)(struct file *f, uint64_t off, void *buf, size_t len);
+	/* Optional: writes len bytes at the file position. Returns the bytes
+	   written or an error. */
+	long (*write)(struct file *f, const void *buf, size_t len);
+	int (*readdir)(struct file *f, vfs_filldir_t fn, void *arg);
+	/* Optional: frees what the file system attached to an inode from
+	   lookup that the VFS drops unused, having lost a race for the name. */
+	void (*forget)(struct inode *inode);
+};
+
+/* Created by a file system once per file it is asked for; never freed once
+   a dentry holds it. */
+struct inode {
+	const struct inode_ops *ops;
+	uint64_t size;
+	bool dir;
+	/* Has no size or offsets, like a socket: reads go to the read op with
+	   whatever is asked for. */
+	bool stream;
+	/* The whole contents, for file systems that keep them in memory and
+	   let callers read them in place. */
+	const void *data;
+	void *priv;
+	/* Pages of the contents by index, for mappings. */
+	spinlock_t pages_lock;
+	struct radix_tree pages;
+};
+
+struct mount;
+
+struct dentry {
+	struct dentry *hash_next;
+	/* NULL for the root of a file system. */
+	struct dentry *parent;
+	/* NULL for a negative entry, a name known not to exist. */
+	struct inode *inode;
+	/* A file system mounted here, for path walks to cross into. */
+	struct mount *mounted;
+	/* Set on the root dentry of a mounted file system. */
+	struct mount *mount;
+	uint32_t hash;
+	uint32_t len;
+	const char *name;
+	char iname[VFS_NAME_INLINE];
+};
+
+struct mount {
+	struct dentry *root;
+	/* Where it is mounted; NULL for "/". */
+	struct dentry *mountpoint;
+};
+
+struct file {
+	struct inode *inode;
+	uint64_t pos;
+	unsigned int refs;
+	void *priv;
+	/* Link on a per-hart list of free files. */
+	struct file *next_free;
+};
+
+struct fdtable {
+	spinlock_t lock;
+	struct file *files[FD_MAX];
+};
+
+/* Allocates a zeroed inode for a file system, or returns NULL. */
+struct inode *vfs_inode_alloc(void);
+
+/* Mounts the file system whose root directory is root at path. The first
+   mount must be "/". A mount point need not exist in the file system below;
+   walks find the mount before the name. */
+int vfs_mount(const char *path, struct inode *root);
+
+/* Walks an absolute path, following mounts. */
+int vfs_lookup(const char *path, struct inode **out);
+
+/* Opens path for reading and stores the file, with one reference, in
+   *out. */
+int vfs_open(const char *path, struct file **out);
+
+/* Opens an inode that has no path, such as the console, like vfs_open(). */
+int vfs_open_inode(struct inode *inode, struct file **out);
+
+void vfs_file_get(struct file *f);
+
+/* Drops a reference, closing the file with the last. */
+void vfs_close(struct file *f);
+
+/* Reads at the file position and advances it. */
+long vfs_read(struct file *f, void *buf, size_t len);
+
+long vfs_pread(struct file *f, uint64_t off, void *buf, size_t len);
+
+/* Returns the bytes written, or -EBADF if the file cannot be written. */
+long vfs_write(struct file *f, const void *buf, size_t len);
+
+int vfs_readdir(struct file *f, vfs_filldir_t fn, void *arg);
+
+/* The page of f's contents at page index, zero past the end of the file,
+   with a reference for the caller to page_put(). Pages are read once and
+   then kept with the inode, shared by every mapping of the file. Returns 0,
+   -EINVAL past the last page, or another error. */
+int vfs_get_page(struct file *f, uint64_t index, struct page **out);
+
+/* Gives f, and the caller's reference, the lowest free descriptor of t.
+   Returns it or -EMFILE. */
+int fd_install(struct fdtable *t, struct file *f);
+
+/* Gives dst, which must be empty, the files of src at the same
+   descriptors. */
+void fd_copy(struct fdtable *dst, struct fdtable *src);
+
+/* The file behind fd with a new reference, or NULL. */
+struct file *fd_get(struct fdtable *t, int fd);
+
+int fd_close(struct fdtable *t, int fd);
@@ -0,0 +1,176 @@
+/* virtio devices on the MMIO transport
+
+   The core finds virtio,mmio nodes in the device tree and, as drivers
+   register, resets each matching device, negotiates features and hands it
+   to the driver's probe function. Transport features (packed rings, event
+   index, indirect descriptors) are taken whenever the device offers them,
+   unless listed in virtio_off= on the command line. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VIRTIO_ID_NET 1
+#define VIRTIO_ID_BLOCK 2
+
+/* Device-independent feature bits. */
+#define VIRTIO_F_INDIRECT_DESC 28
+#define VIRTIO_F_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1 32
+#define VIRTIO_F_RING_PACKED 34
+
+#define VIRTIO_FEATURE(bit) (1ull << (bit))
+
+#define VIRTIO_VQ_MAX 16
+
+/* Descriptors per queue, fewer if the device allows fewer. */
+#define VIRTQ_SIZE 256
+/* Entries per indirect table. Longer chains take one ring slot per entry. */
+#define VIRTQ_INDIRECT_MAX 16
+
+struct virtqueue;
+
+typedef void (*virtq_callback_t)(struct virtqueue *vq);
+
+struct virtio_device {
+	char *base;
+	uint32_t device_id;
+	/* Negotiated features. */
+	uint64_t features;
+	unsigned int irq;
+	/* Hart the interrupt is routed to, or -1 if there is none. */
+	int irq_hart;
+	struct virtqueue *vqs[VIRTIO_VQ_MAX];
+	unsigned int nvqs;
+	const struct virtio_driver *driver;
+	void *priv;
+};
+
+struct virtio_driver {
+	const char *name;
+	uint32_t device_id;
+	/* Device-specific features the driver understands. */
+	uint64_t features;
+	/* Called with the features negotiated. Sets up the queues and calls
+	   virtio_device_ready(), or returns false to give up on the device. */
+	bool (*probe)(struct virtio_device *dev);
+	/* Called from the interrupt handler when the configuration changes. */
+	void (*config_changed)(struct virtio_device *dev);
+};
+
+/* Probes every device with drv->device_id found so far. Drivers call this
+   from an initcall depending on "virtio". */
+void virtio_register_driver(const struct virtio_driver *drv);
+
+static inline bool virtio_has_feature(const struct virtio_device *dev,
+									  unsigned int bit) {
+	return dev->features & VIRTIO_FEATURE(bit);
+}
+
+/* Device configuration space. */
+uint8_t virtio_config_read8(struct virtio_device *dev, unsigned int off);
+uint16_t virtio_config_read16(struct virtio_device *dev, unsigned int off);
+uint32_t virtio_config_read32(struct virtio_device *dev, unsigned int off);
+/* Retries until the device's configuration generation is stable, as a 64-bit
+   field is read in two halves. */
+uint64_t virtio_config_read64(struct virtio_device *dev, unsigned int off);
+
+/* Sets up queue index with room for at most size descriptors. cb runs in
+   interrupt context whenever the device has used buffers. Returns NULL if
+   the device has no such queue or memory runs out. */
+struct virtqueue *virtio_setup_vq(struct virtio_device *dev,
+								  unsigned int index, unsigned int size,
+								  virtq_callback_t cb, void *priv);
+
+/* Takes a queue from virtio_setup_vq() away from the device and frees it.
+   Only for queues the device has not been told it may use, as during a
+   probe that gives up. */
+void virtio_del_vq(struct virtqueue *vq);
+
+/* Tells the device the driver is ready; queues may be used from now on. */
+void virtio_device_ready(struct virtio_device *dev);
+
+/* Virtqueues
+
+   Buffers are added as a scatter-gather list of device-readable ("out")
+   entries followed by device-writable ("in") ones, under a token returned
+   once the device has used them. Adding does not notify the device, so that
+   a batch of buffers costs a single notification at virtq_kick(). None of
+   these functions lock; callers serialize access to each queue. */
+
+struct virtq_sg {
+	void *addr;
+	uint32_t len;
+};
+
+struct virtqueue {
+	struct virtio_device *dev;
+	unsigned int index;
+	unsigned int size;
+	/* Free descriptor slots. */
+	unsigned int num_free;
+	bool packed;
+	bool event_idx;
+	bool indirect;
+	bool cb_disabled;
+	virtq_callback_t callback;
+	void *priv;
+
+	/* Per buffer id: the token and the number of ring slots it takes. */
+	void **tokens;
+	uint16_t *chain_len;
+	/* VIRTQ_INDIRECT_MAX descriptors per id, if indirect is set. */
+	void *indirect_tables;
+	/* Head of the free descriptors (split) or free ids (packed). */
+	uint16_t free_head;
+	uint16_t last_used;
+	/* Added since the last kick, in the units the ring's event index counts:
+	   avail entries, one per buffer (split), or descriptor slots (packed). */
+	uint16_t num_added;
+
+	/* Split ring. */
+	struct virtq_desc *desc;
+	struct virtq_avail *avail;
+	struct virtq_used *used;
+
+	/* Packed ring. Free ids are chained through next_id. */
+	struct virtq_packed_desc *pdesc;
+	struct virtq_event *driver_event, *device_event;
+	uint16_t *next_id;
+	uint16_t next_avail;
+	bool avail_wrap;
+	bool used_wrap;
+};
+
+/* Adds a buffer of out + in entries. Returns false if the queue is full or
+   the chain is too long. */
+bool virtq_add(struct virtqueue *vq, const struct virtq_sg *sg,
+			   unsigned int out, unsigned int in, void *token);
+
+/* Notifies the device of buffers added since the last kick, unless it has
+   said it does not need to be. */
+void virtq_kick(struct virtqueue *vq);
+
+/* Whether the device has used buffers waiting for virtq_get_buf(). */
+bool virtq_has_buf(struct virtqueue *vq);
+
+/* Next used buffer's token, or NULL. *len is how much the device wrote. */
+void *virtq_get_buf(struct virtqueue *vq, uint32_t *len);
+
+/* Asks the device to interrupt for the next used buffer. Returns false if
+   some are already waiting, in which case the caller should poll again. */
+bool virtq_enable_cb(struct virtqueue *vq);
+/* Like virtq_enable_cb(), but a device with event indices waits until n more
+   buffers are used, so that one interrupt covers a batch of completions.
+   Returns false if that many are waiting already. */
+bool virtq_enable_cb_delayed(struct virtqueue *vq, unsigned int n);
+void virtq_disable_cb(struct virtqueue *vq);
+
+/* Shared by the core and the queue code. */
+struct virtqueue *virtq_create(struct virtio_device *dev, unsigned int index,
+							   unsigned int size);
+void virtq_destroy(struct virtqueue *vq);
+void virtq_addrs(const struct virtqueue *vq, uint64_t *desc, uint64_t *driver,
+				 uint64_t *device);
+void virtio_notify(struct virtqueue *vq);
@@ -0,0 +1,86 @@
+/* Kernel page tables
+
+   The kernel replaces the bootloader's page tables with its own, in the same
+   paging mode and with the same HHDM offset. The HHDM is mapped with the
+   largest pages that fit, and covers every physical address below the end
+   of the memory map, device MMIO included. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PTE_V (1ul << 0)
+#define PTE_R (1ul << 1)
+#define PTE_W (1ul << 2)
+#define PTE_X (1ul << 3)
+#define PTE_U (1ul << 4)
+#define PTE_G (1ul << 5)
+#define PTE_A (1ul << 6)
+#define PTE_D (1ul << 7)
+
+#define PTE_PPN_SHIFT 10
+
+#define SATP_MODE_SHIFT 60
+
+/* Page table levels of the paging mode in use: 3 for Sv39, 4 for Sv48. */
+extern unsigned int vmm_levels;
+
+/* satp value that selects the kernel page tables. */
+extern uint64_t vmm_kernel_satp;
+
+/* Root table of the kernel page tables. */
+extern uint64_t *vmm_kernel_root;
+
+/* Builds the kernel page tables and switches the boot hart to them. Other
+   harts switch as they start. Runs before the page allocator, so its tables
+   come from a pool in .bss. */
+void vmm_init(void);
+
+/* Maps size bytes at va to pa. Uses 1 GiB and 2 MiB pages where va, pa and
+   the remaining size allow. A/D are preset, as harts without Svadu fault on
+   clear bits. Returns 0, or -1 if a page table could not be allocated or a
+   larger page is already in the way. */
+int vmm_map(uint64_t *root, uint64_t va, uint64_t pa, uint64_t size,
+			uint64_t flags);
+
+/* Removes 4 KiB mappings in [va, va + size). Does not flush TLBs. */
+void vmm_unmap(uint64_t *root, uint64_t va, uint64_t size);
+
+/* Physical address that va maps to, or -1. */
+uint64_t vmm_translate(uint64_t *root, uint64_t va);
+
+/* The entry for va at level, 0 for 4 KiB pages, allocating the tables above
+   it if alloc is true. NULL if a table is missing and alloc is false or out
+   of memory, or if a larger page maps va. */
+uint64_t *vmm_walk(uint64_t *root, uint64_t va, unsigned int level,
+				   bool alloc);
+
+/* The table that a valid non-leaf entry points to. */
+uint64_t *vmm_next_table(uint64_t pte);
+
+/* Frees a table of a user address space that nothing points to any more. */
+void vmm_free_table(uint64_t *table);
+
+/* The leaf entry that maps va, or NULL. Stores its level, 0 for a 4 KiB
+   page, in *level if level is not NULL. */
+uint64_t *vmm_lookup(uint64_t *root, uint64_t va, unsigned int *level);
+
+/* A root table for a user address space: empty in the lower half, sharing
+   the kernel's tables in the upper half. Returns NULL if out of memory. */
+uint64_t *vmm_create(void);
+
+/* Copies the lower half of src into dst, an empty root from vmm_create().
+   dup is called with every leaf of src and returns the entry for dst; it
+   may change the leaf too. Returns 0, or -1 if out of memory, with part of
+   src copied. */
+int vmm_clone(uint64_t *dst, uint64_t *src,
+			  uint64_t (*dup)(uint64_t *pte, unsigned int level));
+
+/* Frees the tables of the lower half of root, and root, calling put on the
+   physical address and level of every leaf. The tables must not be in use
+   on any hart. */
+void vmm_destroy(uint64_t *root, void (*put)(uint64_t pa, unsigned int level));
+
+/* Flushes kernel TLB entries for [va, va + size) on every hart. */
+void vmm_flush_kernel(uint64_t va, uint64_t size);
@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""Resolves the kernel configuration and writes it out for C and make.
+
+Understands the subset of Kconfig the kernel uses: bool options with
+"default" and "depends on", choices, menus and help text. Dependency
+expressions may use !, &&, || and parentheses.
+
+    scripts/kconfig.py Kconfig --defconfig configs/defconfig --config .config
+    scripts/kconfig.py Kconfig --config .config \\
+        --header build/include/generated/config.h --makefile build/config.mk
+"""
+
+import argparse
+import re
+import sys
+
+
+class Symbol:
+    def __init__(self, name):
+        self.name = name
+        self.prompt = None
+        self.default = None
+        self.depends = None
+        self.choice = None
+
+
+class Choice:
+    def __init__(self):
+        self.default = None
+        self.symbols = []
+
+
+def parse(path):
+    symbols = {}
+    choices = []
+    current = None
+    choice = None
+    help_indent = None
+
+    with open(path) as f:
+        for lineno, raw in enumerate(f, 1):
+            line = raw.strip()
+            indent = len(raw.expandtabs()) - len(raw.expandtabs().lstrip())
+            if help_indent is not None:
+                # Help text is everything indented deeper than "help".
+                if not line or indent > help_indent:
+                    continue
+                help_indent = None
+            if not line or line.startswith("#"):
+                continue
+
+            words = line.split(None, 1)
+            key, rest = words[0], words[1] if len(words) > 1 else ""
+            if key == "config":
+                current = symbols.setdefault(rest, Symbol(rest))
+                if choice:
+                    current.choice = choice
+                    choice.symbols.append(current)
+            elif key == "choice":
+                choice = Choice()
+                choices.append(choice)
+                current = choice
+            elif key == "endchoice":
+                choice = current = None
+            elif key in ("menu", "endmenu", "comment", "prompt"):
+                pass
+            elif key == "bool":
+                current.prompt = rest.strip('"')
+            elif key == "default":
+                current.default = rest
+            elif key == "depends" and rest.startswith("on "):
+                current.depends = rest[3:]
+            elif key == "help":
+                help_indent = indent
+            else:
+                sys.exit(f"{path}:{lineno}: unsupported: {line}")
+    return symbols, choices
+
+
+def evaluate(expr, values):
+    """Evaluates a dependency expression to True or False."""
+    tokens = re.findall(r"&&|\|\||!|\(|\)|\w+", expr)
+    py = []
+    for t in tokens:
+        if t == "&&":
+            py.append(" and ")
+        elif t == "||":
+            py.append(" or ")
+        elif t == "!":
+            py.append(" not ")
+        elif t in "()":
+            py.append(t)
+        elif t in ("y", "n"):
+            py.append(str(t == "y"))
+        else:
+            py.append(str(values.get(t, False)))
+    return bool(eval("".join(py)))
+
+
+def read_config(path):
+    values = {}
+    with open(path) as f:
+        for line in f:
+            m = re.match(r"CONFIG_(\w+)=(\w+)", line)
+            if m:
+                values[m.group(1)] = m.group(2) == "y"
+                continue
+            m = re.match(r"# CONFIG_(\w+) is not set", line)
+            if m:
+                values[m.group(1)] = False
+    return values
+
+
+def resolve(symbols, choices, given):
+    for name in given:
+        if name not in symbols:
+            print(f"warning: unknown option CONFIG_{name}", file=sys.stderr)
+
+    values = {}
+    for sym in symbols.values():
+        if sym.choice:
+            continue
+        if sym.name in given:
+            value = given[sym.name]
+        else:
+            value = bool(sym.default) and evaluate(sym.default, values)
+        if sym.depends and not evaluate(sym.depends, values):
+            value = False
+        values[sym.name] = value
+
+    for choice in choices:
+        picked = [s.name for s in choice.symbols if given.get(s.name)]
+        if len(picked) > 1:
+            sys.exit("only one of " + ", ".join("CONFIG_" + p for p in picked)
+                     + " may be set")
+        chosen = picked[0] if picked else choice.default
+        for s in choice.symbols:
+            values[s.name] = s.name == chosen
+    return values
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("kconfig")
+    ap.add_argument("--defconfig", help="start from this file, not --config")
+    ap.add_argument("--config", required=True,
+                    help="configuration to read, or to write with --defconfig")
+    ap.add_argument("--header", help="write #defines for C to this file")
+    ap.add_argument("--makefile", help="write make variables to this file")
+    args = ap.parse_args()
+
+    symbols, choices = parse(args.kconfig)
+    given = read_config(args.defconfig or args.config)
+    values = resolve(symbols, choices, given)
+
+    if args.defconfig:
+        with open(args.config, "w") as f:
+            for name in symbols:
+                if values[name]:
+                    f.write(f"CONFIG_{name}=y\n")
+                else:
+                    f.write(f"# CONFIG_{name} is not set\n")
+
+    if args.header:
+        with open(args.header, "w") as f:
+            f.write("/* Generated by scripts/kconfig.py from .config */\n\n")
+            f.write("#pragma once\n\n")
+            for name in symbols:
+                if values[name]:
+                    f.write(f"#define CONFIG_{name} 1\n")
+
+    if args.makefile:
+        with open(args.makefile, "w") as f:
+            f.write("# Generated by scripts/kconfig.py from .config\n")
+            for name in symbols:
+                if values[name]:
+                    f.write(f"CONFIG_{name} := y\n")
+
+
+if __name__ == "__main__":
+    main()
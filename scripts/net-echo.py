@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Host end of the kernel's network benchmark: a UDP echo server and a TCP
+discard server.
+
+QEMU's user network forwards the guest's connections to its gateway,
+10.0.2.2, to the host's loopback, so run this next to QEMU and boot with
+bench=net:
+
+    scripts/net-echo.py &
+    make run
+
+The ports default to the ones the benchmark uses.
+"""
+
+import argparse
+import socket
+import threading
+
+
+def udp_echo(host, port):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((host, port))
+    while True:
+        data, addr = sock.recvfrom(65536)
+        sock.sendto(data, addr)
+
+
+def tcp_discard_client(conn, addr):
+    total = 0
+    with conn:
+        while True:
+            data = conn.recv(1 << 20)
+            if not data:
+                break
+            total += len(data)
+    print(f"tcp: {addr[0]}:{addr[1]} sent {total} bytes")
+
+
+def tcp_discard(host, port):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind((host, port))
+    sock.listen()
+    while True:
+        conn, addr = sock.accept()
+        threading.Thread(target=tcp_discard_client, args=(conn, addr),
+                         daemon=True).start()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--echo-port", type=int, default=7777)
+    parser.add_argument("--discard-port", type=int, default=7778)
+    args = parser.parse_args()
+
+    threading.Thread(target=udp_echo, args=(args.host, args.echo_port),
+                     daemon=True).start()
+    print(f"udp echo on {args.host}:{args.echo_port}, "
+          f"tcp discard on {args.host}:{args.discard_port}")
+    tcp_discard(args.host, args.discard_port)
+
+
+if __name__ == "__main__":
+    main()
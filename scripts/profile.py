@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+"""Turns the kernel's "prof:" console output into a flat profile and folded
+call stacks.
+
+Boot with profile=<period> on the kernel command line, save the console
+output, then run:
+
+    scripts/profile.py console.log --folded out.folded
+
+The folded file is the input format of flamegraph.pl and speedscope.
+
+--sample-profile writes the samples as an LLVM sample profile in text form,
+for clang's -fprofile-sample-use; see "make kernel-pgo". The kernel should
+be built with -fdebug-info-for-profiling so that lines and inlining are
+exact.
+"""
+
+import argparse
+import collections
+import json
+import re
+import shutil
+import subprocess
+import sys
+
+SAMPLE_RE = re.compile(r"prof: (\d+)((?: [0-9a-f]+)+)\s*$")
+HART_RE = re.compile(r"prof: hart (\d+) samples (\d+) dropped (\d+)")
+
+
+def parse(lines):
+    """Yields (hart, count, [pc, return address, ...]) for every stack."""
+    hart = 0
+    for line in lines:
+        m = HART_RE.search(line)
+        if m:
+            hart = int(m.group(1))
+            if int(m.group(3)):
+                print(f"warning: hart {hart} dropped {m.group(3)} samples",
+                      file=sys.stderr)
+            continue
+        m = SAMPLE_RE.search(line)
+        if m:
+            pcs = [int(x, 16) for x in m.group(2).split()]
+            yield hart, int(m.group(1)), pcs
+
+
+def symbolize(elf, addrs):
+    """Maps each address to a function name using llvm-symbolizer, or
+    addr2line if that is missing."""
+    addrs = sorted(addrs)
+    tool = shutil.which("llvm-symbolizer")
+    if tool:
+        cmd = [tool, "--obj=" + elf, "--functions=linkage", "--no-inlines"]
+    else:
+        tool = shutil.which("addr2line") or "addr2line"
+        cmd = [tool, "-e", elf, "-f"]
+    out = subprocess.run(cmd, input="\n".join(hex(a) for a in addrs) + "\n",
+                         capture_output=True, text=True, check=True).stdout
+
+    names = [l for l in out.splitlines() if l.strip()][0::2]
+    return {a: (n if n != "??" else hex(a)) for a, n in zip(addrs, names)}
+
+
+def base_discriminator(d):
+    """Undoes LLVM's prefix encoding of the base discriminator."""
+    if d & 1:
+        return 0
+    d >>= 1
+    if d & 0x40:
+        return (d >> 1 & 0xfe0) | (d & 0x1f)
+    return d & 0x3f
+
+
+def symbolize_lines(elf, addrs):
+    """Maps each address to its inlining chain, innermost frame first, as
+    (function, line offset from the function start) pairs."""
+    addrs = sorted(addrs)
+    cmd = ["llvm-symbolizer", "--obj=" + elf, "--functions=linkage",
+           "--inlines", "--output-style=JSON"]
+    out = subprocess.run(cmd, input="\n".join(hex(a) for a in addrs) + "\n",
+                         capture_output=True, text=True, check=True).stdout
+
+    chains = {}
+    for a, line in zip(addrs, out.splitlines()):
+        chain = []
+        for f in json.loads(line).get("Symbol", []):
+            if not f.get("FunctionName") or not f.get("Line"):
+                break
+            loc = str(max(f["Line"] - f.get("StartLine", 0), 0))
+            disc = base_discriminator(f.get("Discriminator", 0))
+            if disc:
+                loc += f".{disc}"
+            chain.append((f["FunctionName"], loc))
+        if chain:
+            chains[a] = chain
+    return chains
+
+
+class SampleNode:
+    def __init__(self):
+        self.total = 0
+        self.body = collections.Counter()
+        self.inlined = collections.defaultdict(SampleNode)
+
+    def write(self, f, depth):
+        indent = " " * depth
+        for loc, n in sorted(self.body.items()):
+            f.write(f"{indent}{loc}: {n}\n")
+        for (loc, callee), node in sorted(self.inlined.items()):
+            f.write(f"{indent}{loc}: {callee}:{node.total}\n")
+            node.write(f, depth + 1)
+
+
+def write_sample_profile(path, elf, stacks):
+    """Writes the sampled PCs as an LLVM text sample profile. Only the PC
+    itself counts; the call stack above it says nothing about which blocks
+    of the callers ran."""
+    chains = symbolize_lines(elf, {pcs[0] for _, _, pcs in stacks})
+    roots = collections.defaultdict(SampleNode)
+    for _, count, pcs in stacks:
+        chain = chains.get(pcs[0])
+        if not chain:
+            continue
+        node = roots[chain[-1][0]]
+        for i in range(len(chain) - 1, 0, -1):
+            node.total += count
+            node = node.inlined[(chain[i][1], chain[i - 1][0])]
+        node.total += count
+        node.body[chain[0][1]] += count
+
+    with open(path, "w") as f:
+        for name, node in sorted(roots.items(), key=lambda r: -r[1].total):
+            f.write(f"{name}:{node.total}:0\n")
+            node.write(f, 1)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("log", nargs="?", type=argparse.FileType("r"),
+                    default=sys.stdin, help="console output (default stdin)")
+    ap.add_argument("--elf", default="build/kernel.elf",
+                    help="kernel image with symbols")
+    ap.add_argument("--folded", help="write folded stacks to this file")
+    ap.add_argument("--sample-profile",
+                    help="write an LLVM sample profile to this file")
+    ap.add_argument("--per-hart", action="store_true",
+                    help="root the folded stacks at their hart")
+    ap.add_argument("--top", type=int, default=30,
+                    help="functions shown in the flat profile")
+    args = ap.parse_args()
+
+    stacks = list(parse(args.log))
+    if not stacks:
+        sys.exit("no prof: samples found")
+
+    # Return addresses point after the call; look up the call itself.
+    lookup = set()
+    for _, _, pcs in stacks:
+        lookup.add(pcs[0])
+        lookup.update(pc - 1 for pc in pcs[1:])
+    names = symbolize(args.elf, lookup)
+
+    total = 0
+    self_count = collections.Counter()
+    incl_count = collections.Counter()
+    folded = collections.Counter()
+    for hart, count, pcs in stacks:
+        frames = [names[pcs[0]]] + [names[pc - 1] for pc in pcs[1:]]
+        total += count
+        self_count[frames[0]] += count
+        for f in set(frames):
+            incl_count[f] += count
+        root = [f"hart{hart}"] if args.per_hart else []
+        folded[";".join(root + frames[::-1])] += count
+
+    print(f"{total} samples")
+    print(f"{'self%':>7} {'self':>8} {'total%':>7}  function")
+    for name, n in self_count.most_common(args.top):
+        print(f"{100 * n / total:6.2f}% {n:8} "
+              f"{100 * incl_count[name] / total:6.2f}%  {name}")
+
+    if args.folded:
+        with open(args.folded, "w") as f:
+            for stack, n in sorted(folded.items()):
+                f.write(f"{stack} {n}\n")
+
+    if args.sample_profile:
+        write_sample_profile(args.sample_profile, args.elf, stacks)
+
+
+if __name__ == "__main__":
+    main()
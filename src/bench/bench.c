@@ -0,0 +1,28 @@
+#include "bench.h"
+
+#include "cmdline.h"
+#include "debug.h"
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benches[] = {
+	{"perf", bench_perf},
+	{"page", bench_page},
+	{"blk", bench_blk},
+	{"vfs", bench_vfs},
+	{"net", bench_net},
+	{"syscall", bench_syscall},
+	{"proc", bench_proc},
+	{"thp", bench_thp},
+	{"uring", bench_uring},
+	{"clock", bench_clock},
+};
+
+void bench_run_requested(void) {
+	for (unsigned long i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		if (!cmdline_list_has("bench", benches[i].name)) continue;
+		debug_printf("bench: %s\n", benches[i].name);
+		benches[i].run();
+	}
+}
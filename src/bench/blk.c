@@ -0,0 +1,200 @@
+/* Throughput and latency of each writable block device, the scratch disks
+   rather than a read-only view of the boot disk: 4 KiB reads at random
+   offsets and 1 MiB sequential reads. `make run` gives one of them packed
+   rings, so both ring layouts are measured. Each run keeps a fixed number of
+   requests in flight by resubmitting from the completion callbacks. */
+
+#include <stdint.h>
+
+#include "bench.h"
+#include "blk.h"
+#include "clock.h"
+#include "csr.h"
+#include "debug.h"
+#include "pmm.h"
+#include "spinlock.h"
+
+#define BENCH_BLK_DEPTH_MAX 32
+/* Room for the latencies of 4096 requests. */
+#define BENCH_BLK_LATENCY_ORDER 2
+
+struct bench_blk_run {
+	const char *name;
+	struct blk_device *dev;
+	unsigned int order;
+	bool random;
+	unsigned int depth;
+	unsigned int total;
+
+	spinlock_t lock;
+	unsigned int submitted;
+	uint64_t next_sector;
+	uint64_t rng;
+
+	unsigned int completed;
+	unsigned int errors;
+	/* Ticks from submission to completion of each request. */
+	uint32_t *latency;
+};
+
+struct bench_blk_slot {
+	struct blk_request req;
+	struct bench_blk_run *run;
+	uint64_t start;
+};
+
+static uint64_t bench_blk_rand(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/* Points the slot at the run's next request. False once all are out. */
+static bool bench_blk_prepare(struct bench_blk_slot *slot) {
+	struct bench_blk_run *run = slot->run;
+	uint64_t sectors = (PAGE_SIZE << run->order) / BLK_SECTOR_SIZE;
+	uint64_t blocks = run->dev->sectors / sectors;
+
+	bool irq = spin_lock_irqsave(&run->lock);
+	bool more = run->submitted < run->total;
+	if (more) {
+		run->submitted++;
+		uint64_t block = run->random ? bench_blk_rand(&run->rng) % blocks
+									 : run->next_sector / sectors % blocks;
+		run->next_sector = (block + 1) * sectors;
+		slot->req.sector = block * sectors;
+	}
+	spin_unlock_irqrestore(&run->lock, irq);
+
+	slot->req.next = NULL;
+	slot->start = rdtime();
+	return more;
+}
+
+static void bench_blk_done(struct blk_request *req) {
+	struct bench_blk_slot *slot = req->priv;
+	struct bench_blk_run *run = slot->run;
+
+	uint64_t ticks = rdtime() - slot->start;
+	if (req->status != BLK_OK)
+		__atomic_add_fetch(&run->errors, 1, __ATOMIC_RELAXED);
+	unsigned int i = __atomic_fetch_add(&run->completed, 1, __ATOMIC_RELAXED);
+	run->latency[i] = ticks;
+
+	if (bench_blk_prepare(slot)) blk_submit(run->dev, req);
+}
+
+static void bench_blk_sort(uint32_t *a, unsigned int n) {
+	for (unsigned int gap = n / 2; gap; gap /= 2) {
+		for (unsigned int i = gap; i < n; i++) {
+			uint32_t v = a[i];
+			unsigned int j = i;
+			for (; j >= gap && a[j - gap] > v; j -= gap) a[j] = a[j - gap];
+			a[j] = v;
+		}
+	}
+}
+
+static unsigned long bench_blk_percentile(struct bench_blk_run *run,
+										  unsigned int permille) {
+	unsigned int i = (uint64_t)run->total * permille / 1000;
+	if (i >= run->total) i = run->total - 1;
+	return clock_ticks_to_us(run->latency[i]);
+}
+
+static void bench_blk_run(struct bench_blk_run *run) {
+	struct bench_blk_slot slots[BENCH_BLK_DEPTH_MAX];
+	struct blk_request *batch = NULL, **tail = &batch;
+	unsigned int n = 0;
+	size_t bytes = PAGE_SIZE << run->order;
+
+	if (bytes > run->dev->max_len ||
+		bytes / BLK_SECTOR_SIZE > run->dev->sectors) {
+		debug_printf("  %s: too large for the device\n", run->name);
+		return;
+	}
+	run->latency = pmm_alloc(BENCH_BLK_LATENCY_ORDER);
+	if (!run->latency) goto out;
+
+	for (; n < run->depth; n++) {
+		struct bench_blk_slot *slot = &slots[n];
+		void *buf = pmm_alloc(run->order);
+		if (!buf) break;
+		*slot = (struct bench_blk_slot){
+			.req = {.op = BLK_READ,
+					.buf = buf,
+					.len = bytes,
+					.done = bench_blk_done,
+					.priv = slot},
+			.run = run,
+		};
+	}
+	if (n < run->depth) goto out;
+
+	uint64_t commands = run->dev->stat_commands;
+	uint64_t t0 = rdtime();
+	// The first requests go out as one batch; the callbacks take it from
+	// there.
+	for (unsigned int i = 0; i < n; i++) {
+		if (!bench_blk_prepare(&slots[i])) break;
+		*tail = &slots[i].req;
+		tail = &slots[i].req.next;
+	}
+	if (batch) blk_submit(run->dev, batch);
+	while (__atomic_load_n(&run->completed, __ATOMIC_ACQUIRE) < run->total)
+		blk_poll(run->dev);
+	uint64_t ticks = rdtime() - t0;
+	if (!ticks) ticks = 1;
+
+	bench_blk_sort(run->latency, run->total);
+	debug_printf("  %s: %lu IOPS, %lu MiB/s, %lu commands, %u errors\n",
+				 run->name, (unsigned long)(run->total * clock_freq / ticks),
+				 (unsigned long)(run->total * bytes * clock_freq / ticks >> 20),
+				 (unsigned long)(run->dev->stat_commands - commands),
+				 run->errors);
+	debug_printf("    latency us: p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+				 bench_blk_percentile(run, 500), bench_blk_percentile(run, 900),
+				 bench_blk_percentile(run, 990), bench_blk_percentile(run, 999),
+				 bench_blk_percentile(run, 1000));
+
+out:
+	if (n < run->depth) debug_printf("  %s: no memory\n", run->name);
+	for (unsigned int i = 0; i < n; i++) pmm_free(slots[i].req.buf, run->order);
+	if (run->latency) pmm_free(run->latency, BENCH_BLK_LATENCY_ORDER);
+}
+
+static void bench_blk_device(struct blk_device *dev) {
+	debug_printf("  %s:\n", dev->name);
+	struct bench_blk_run random = {
+		.name = "4K random read, depth 32",
+		.dev = dev,
+		.order = 0,
+		.random = true,
+		.depth = 32,
+		.total = 4096,
+		.rng = rdtime() | 1,
+	};
+	bench_blk_run(&random);
+
+	struct bench_blk_run sequential = {
+		.name = "1M sequential read, depth 4",
+		.dev = dev,
+		.order = 8,
+		.depth = 4,
+		.total = 256,
+	};
+	bench_blk_run(&sequential);
+}
+
+void bench_blk(void) {
+	struct blk_device *dev;
+	unsigned int found = 0;
+	for (unsigned int i = 0; (dev = blk_get(i)); i++) {
+		if (dev->read_only) continue;
+		bench_blk_device(dev);
+		found++;
+	}
+	if (!found) debug_printf("  no block device\n");
+}
@@ -0,0 +1,17 @@
+/* Cost of reading the clock from user mode through the vDSO and through a
+   system call, measured by /bin/bench-clock. The process runs on this
+   hart, which polls for it between its time slices. */
+
+#include "bench.h"
+#include "debug.h"
+#include "hart.h"
+#include "proc.h"
+
+#define BENCH_CLOCK_PATH "/bin/bench-clock"
+
+void bench_clock(void) {
+	struct proc *p;
+	int err = proc_spawn(BENCH_CLOCK_PATH, hart_index(), &p);
+	if (!err) err = proc_wait(p, NULL);
+	if (err) debug_printf("  %s failed (%d)\n", BENCH_CLOCK_PATH, err);
+}
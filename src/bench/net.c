@@ -0,0 +1,151 @@
+/* UDP round trips and TCP throughput against scripts/net-echo.py on the
+   host, which QEMU's user network puts at the gateway address: 64-byte
+   datagrams echoed one at a time, then 64 MiB written to a discard port
+   and flushed until acknowledged. */
+
+#include <stdint.h>
+
+#include "bench.h"
+#include "clock.h"
+#include "csr.h"
+#include "debug.h"
+#include "errno.h"
+#include "net.h"
+#include "string.h"
+
+#define BENCH_NET_HOST IPV4_ADDR(10, 0, 2, 2)
+#define BENCH_NET_ECHO_PORT 7777
+#define BENCH_NET_DISCARD_PORT 7778
+
+#define BENCH_NET_PINGS 1000
+#define BENCH_NET_PING_LEN 64
+#define BENCH_NET_PING_TIMEOUT_US 100000
+/* Pings lost in a row, from the start, that mean nobody answers. */
+#define BENCH_NET_PING_GIVE_UP 10
+
+#define BENCH_NET_STREAM_BYTES (64ul << 20)
+
+/* Sends ping seq and waits for its echo. Returns the round trip in ticks, 0
+   if it was lost, or an error. */
+static long bench_net_ping(struct sock *s, uint32_t seq) {
+	struct netbuf *nb = sock_buf_alloc(s);
+	if (!nb) return -ENOMEM;
+	uint8_t *p = netbuf_put(nb, BENCH_NET_PING_LEN);
+	memset(p, 0, BENCH_NET_PING_LEN);
+	net_put32(p, seq);
+
+	uint64_t t0 = rdtime();
+	int err = sock_send(s, nb);
+	if (err) return err;
+	// Late echoes of earlier pings are skipped.
+	for (;;) {
+		long len = sock_recv(s, &nb, BENCH_NET_PING_TIMEOUT_US);
+		if (len == -EAGAIN) return 0;
+		if (len < 0) return len;
+		bool match = nb->len >= 4 && net_get32(nb->data) == seq;
+		netbuf_free(nb);
+		if (match) return rdtime() - t0;
+	}
+}
+
+static void bench_net_udp(void) {
+	struct sock *s;
+	int err = sock_open(SOCK_UDP, &s);
+	if (!err) err = sock_connect(s, BENCH_NET_HOST, BENCH_NET_ECHO_PORT);
+	if (err) {
+		debug_printf("  udp: no socket (%d)\n", err);
+		return;
+	}
+
+	unsigned int replies = 0, lost = 0;
+	uint64_t total = 0, min = UINT64_MAX, max = 0;
+	for (uint32_t i = 0; i < BENCH_NET_PINGS; i++) {
+		long ticks = bench_net_ping(s, i);
+		if (ticks < 0) {
+			debug_printf("  udp: error %ld\n", ticks);
+			break;
+		}
+		if (!ticks) {
+			if (++lost == BENCH_NET_PING_GIVE_UP && !replies) break;
+			continue;
+		}
+		replies++;
+		total += ticks;
+		if ((uint64_t)ticks < min) min = ticks;
+		if ((uint64_t)ticks > max) max = ticks;
+	}
+	sock_close(s);
+
+	if (!replies) {
+		debug_printf("  udp: no echo from port %u; is scripts/net-echo.py "
+					 "running on the host?\n",
+					 BENCH_NET_ECHO_PORT);
+		return;
+	}
+	debug_printf("  udp echo %u bytes: %u replies, %u lost, round trip min %lu "
+				 "avg %lu max %lu us\n",
+				 BENCH_NET_PING_LEN, replies, lost,
+				 (unsigned long)clock_ticks_to_us(min),
+				 (unsigned long)clock_ticks_to_us(total / replies),
+				 (unsigned long)clock_ticks_to_us(max));
+}
+
+static void bench_net_tcp(void) {
+	struct sock *s;
+	int err = sock_open(SOCK_TCP, &s);
+	if (err) {
+		debug_printf("  tcp: no socket (%d)\n", err);
+		return;
+	}
+	err = sock_connect(s, BENCH_NET_HOST, BENCH_NET_DISCARD_PORT);
+	if (err) {
+		if (err == -ECONNREFUSED)
+			debug_printf("  tcp: port %u refused; is scripts/net-echo.py "
+						 "running on the host?\n",
+						 BENCH_NET_DISCARD_PORT);
+		else
+			debug_printf("  tcp: connect failed (%d)\n", err);
+		sock_close(s);
+		return;
+	}
+
+	uint64_t t0 = rdtime();
+	size_t sent = 0;
+	while (!err && sent < BENCH_NET_STREAM_BYTES) {
+		struct netbuf *nb = sock_buf_alloc(s);
+		if (!nb) {
+			err = -ENOMEM;
+			break;
+		}
+		size_t len = netbuf_tailroom(nb);
+		if (len > BENCH_NET_STREAM_BYTES - sent)
+			len = BENCH_NET_STREAM_BYTES - sent;
+		memset(netbuf_put(nb, len), 0, len);
+		err = sock_send(s, nb);
+		sent += len;
+	}
+	if (!err) err = sock_flush(s);
+	uint64_t us = clock_ticks_to_us(rdtime() - t0);
+	uint64_t segs = s->tcp.stat_segs_out, retransmits = s->tcp.stat_retransmits;
+	sock_close(s);
+
+	if (err) {
+		debug_printf("  tcp: error %d after %lu bytes\n", err,
+					 (unsigned long)sent);
+		return;
+	}
+	debug_printf("  tcp stream %lu MiB: %lu MB/s, %lu segments out, %lu "
+				 "retransmitted\n",
+				 BENCH_NET_STREAM_BYTES >> 20,
+				 (unsigned long)(us ? sent / us : 0), (unsigned long)segs,
+				 (unsigned long)retransmits);
+}
+
+void bench_net(void) {
+	if (!net_ready()) {
+		debug_printf("  no network\n");
+		return;
+	}
+	bench_net_udp();
+	bench_net_tcp();
+}
@@ -0,0 +1,67 @@
+/* Cost of getting a zeroed page: zeroing with the generic memset and with
+   zero_page(), and allocating from the pre-zeroed pool against allocating
+   and zeroing on the spot. */
+
+#include <stdint.h>
+
+#include "bench.h"
+#include "csr.h"
+#include "debug.h"
+#include "pmm.h"
+
+#define BENCH_PAGE_ITERS 64
+
+void *memset_generic(void *s, int c, size_t n);
+
+static void bench_page_zero(void *page) {
+	uint64_t generic = 0, dispatched = 0;
+	for (int i = 0; i < BENCH_PAGE_ITERS; i++) {
+		uint64_t t0 = rdcycle();
+		memset_generic(page, 0, PAGE_SIZE);
+		uint64_t t1 = rdcycle();
+		zero_page(page);
+		generic += t1 - t0;
+		dispatched += rdcycle() - t1;
+	}
+	debug_printf("  zero: generic memset %lu cycles, zero_page %lu cycles\n",
+				 (unsigned long)(generic / BENCH_PAGE_ITERS),
+				 (unsigned long)(dispatched / BENCH_PAGE_ITERS));
+}
+
+static void bench_page_alloc(void) {
+	void *pages[BENCH_PAGE_ITERS];
+	uint64_t pool = 0, direct = 0;
+
+	for (int i = 0; i < BENCH_PAGE_ITERS; i++) {
+		uint64_t t0 = rdcycle();
+		pages[i] = pmm_alloc_zeroed(0);
+		pool += rdcycle() - t0;
+	}
+	for (int i = 0; i < BENCH_PAGE_ITERS; i++) pmm_free(pages[i], 0);
+
+	for (int i = 0; i < BENCH_PAGE_ITERS; i++) {
+		uint64_t t0 = rdcycle();
+		pages[i] = pmm_alloc(0);
+		zero_page(pages[i]);
+		direct += rdcycle() - t0;
+	}
+	for (int i = 0; i < BENCH_PAGE_ITERS; i++) pmm_free(pages[i], 0);
+
+	debug_printf("  alloc: pmm_alloc_zeroed %lu cycles, pmm_alloc + zero_page "
+				 "%lu cycles\n",
+				 (unsigned long)(pool / BENCH_PAGE_ITERS),
+				 (unsigned long)(direct / BENCH_PAGE_ITERS));
+}
+
+void bench_page(void) {
+	void *page = pmm_alloc(0);
+	if (!page) {
+		debug_printf("  no memory\n");
+		return;
+	}
+	bench_page_zero(page);
+	pmm_free(page, 0);
+
+	bench_page_alloc();
+	pmm_print();
+}
@@ -0,0 +1,57 @@
+/* Cost of stopping and reading a counter group, with and without the PMU
+   snapshot page. */
+
+#include <stdint.h>
+
+#include "bench.h"
+#include "csr.h"
+#include "debug.h"
+#include "perf.h"
+
+#define BENCH_PERF_ITERS 1000
+
+static const enum perf_event bench_events[PERF_GROUP_MAX] = {
+	PERF_EVENT_CYCLES,			 PERF_EVENT_INSTRET,
+	PERF_EVENT_CACHE_REFS,		 PERF_EVENT_CACHE_MISSES,
+	PERF_EVENT_L1D_READ_MISSES,	 PERF_EVENT_L1I_READ_MISSES,
+	PERF_EVENT_DTLB_READ_MISSES, PERF_EVENT_ITLB_READ_MISSES,
+};
+
+/* Average cycles for one stop + read of every counter. */
+static uint64_t bench_stop_read(struct perf_group *g, bool snapshot) {
+	uint64_t values[PERF_GROUP_MAX];
+	uint64_t total = 0;
+
+	g->snapshot = snapshot;
+	for (int i = 0; i < BENCH_PERF_ITERS; i++) {
+		perf_group_start(g);
+		uint64_t t0 = rdcycle();
+		perf_group_stop(g);
+		perf_group_read(g, values);
+		total += rdcycle() - t0;
+	}
+	return total / BENCH_PERF_ITERS;
+}
+
+void bench_perf(void) {
+	for (unsigned int n = 1; n <= PERF_GROUP_MAX; n++) {
+		struct perf_group g;
+		if (perf_group_init(&g, bench_events, n)) {
+			debug_printf("  no counter for %s, stopping at %u\n",
+						 perf_event_name(bench_events[n - 1]), n - 1);
+			break;
+		}
+
+		bool have_snapshot = g.snapshot;
+		uint64_t direct = bench_stop_read(&g, false);
+		if (have_snapshot) {
+			uint64_t snap = bench_stop_read(&g, true);
+			debug_printf("  %u counters: direct %lu cycles, snapshot %lu cycles\n",
+						 n, (unsigned long)direct, (unsigned long)snap);
+		} else {
+			debug_printf("  %u counters: direct %lu cycles, no snapshot\n", n,
+						 (unsigned long)direct);
+		}
+		perf_group_release(&g);
+	}
+}
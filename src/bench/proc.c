@@ -0,0 +1,43 @@
+/* Process creation: /bin/true spawned and waited for over and over, with
+   its largest resident set, then fork measured from user mode by
+   /bin/bench-fork. Everything runs on this hart, which polls for the
+   processes between their time slices. */
+
+#include <stdint.h>
+
+#include "bench.h"
+#include "clock.h"
+#include "csr.h"
+#include "debug.h"
+#include "hart.h"
+#include "proc.h"
+
+#define BENCH_PROC_TRUE "/bin/true"
+#define BENCH_PROC_FORK "/bin/bench-fork"
+#define BENCH_PROC_SPAWNS 100
+
+static void bench_proc_spawn(void) {
+	unsigned long rss = 0;
+	uint64_t t0 = rdtime();
+	for (int i = 0; i < BENCH_PROC_SPAWNS; i++) {
+		struct proc *p;
+		int err = proc_spawn(BENCH_PROC_TRUE, hart_index(), &p);
+		if (!err) err = proc_wait(p, &rss);
+		if (err) {
+			debug_printf("  %s failed (%d)\n", BENCH_PROC_TRUE, err);
+			return;
+		}
+	}
+	uint64_t ticks = (rdtime() - t0) / BENCH_PROC_SPAWNS;
+	debug_printf("  spawn and wait %s: %lu us, %lu pages resident\n",
+				 BENCH_PROC_TRUE, (unsigned long)clock_ticks_to_us(ticks), rss);
+}
+
+void bench_proc(void) {
+	bench_proc_spawn();
+
+	struct proc *p;
+	int err = proc_spawn(BENCH_PROC_FORK, hart_index(), &p);
+	if (!err) err = proc_wait(p, NULL);
+	if (err) debug_printf("  %s failed (%d)\n", BENCH_PROC_FORK, err);
+}
@@ -0,0 +1,17 @@
+/* Cost of a system call round trip, ecall into the kernel and sret back,
+   measured from user mode by /bin/bench-syscall with SYS_NULL. The
+   process runs on this hart, which polls for it between its time slices. */
+
+#include "bench.h"
+#include "debug.h"
+#include "hart.h"
+#include "proc.h"
+
+#define BENCH_SYSCALL_PATH "/bin/bench-syscall"
+
+void bench_syscall(void) {
+	struct proc *p;
+	int err = proc_spawn(BENCH_SYSCALL_PATH, hart_index(), &p);
+	if (!err) err = proc_wait(p, NULL);
+	if (err) debug_printf("  %s failed (%d)\n", BENCH_SYSCALL_PATH, err);
+}
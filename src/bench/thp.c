@@ -0,0 +1,38 @@
+/* A large heap touched and read at random by /bin/bench-heap, with
+   anonymous memory in single pages and then in megapages, and the
+   megapage events each run caused. The process runs on this hart, which
+   polls for it between its time slices. */
+
+#include <stdbool.h>
+
+#include "bench.h"
+#include "debug.h"
+#include "hart.h"
+#include "mm.h"
+#include "proc.h"
+
+#define BENCH_THP_PATH "/bin/bench-heap"
+
+void bench_thp(void) {
+	bool thp = mm_thp;
+	for (int on = 0; on < 2; on++) {
+		debug_printf("  %s:\n", on ? "megapages" : "4 KiB pages");
+		mm_thp = on;
+		struct mm_thp_stats s = mm_thp_stats;
+		unsigned long rss = 0;
+		struct proc *p;
+		int err = proc_spawn(BENCH_THP_PATH, hart_index(), &p);
+		if (!err) err = proc_wait(p, &rss);
+		if (err) {
+			debug_printf("  %s failed (%d)\n", BENCH_THP_PATH, err);
+			break;
+		}
+		debug_printf("  %lu pages resident, %lu megapage faults, %lu "
+					 "fallbacks, %lu collapses, %lu splits\n",
+					 rss, mm_thp_stats.faults - s.faults,
+					 mm_thp_stats.fallbacks - s.fallbacks,
+					 mm_thp_stats.collapses - s.collapses,
+					 mm_thp_stats.splits - s.splits);
+	}
+	mm_thp = thp;
+}
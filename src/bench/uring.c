@@ -0,0 +1,17 @@
+/* Requests through the submission and completion rings against a system
+   call each, measured from user mode by /bin/bench-uring. The process runs
+   on this hart, which polls for it between its time slices. */
+
+#include "bench.h"
+#include "debug.h"
+#include "hart.h"
+#include "proc.h"
+
+#define BENCH_URING_PATH "/bin/bench-uring"
+
+void bench_uring(void) {
+	struct proc *p;
+	int err = proc_spawn(BENCH_URING_PATH, hart_index(), &p);
+	if (!err) err = proc_wait(p, NULL);
+	if (err) debug_printf("  %s failed (%d)\n", BENCH_URING_PATH, err);
+}
@@ -0,0 +1,44 @@
+/* Cost of opening and closing a file by path: the first time, when the
+   file systems are asked, and again once the dentry cache knows the path.
+   The missing path measures negative dentries. */
+
+#include <stdint.h>
+
+#include "bench.h"
+#include "csr.h"
+#include "debug.h"
+#include "vfs.h"
+
+#define BENCH_VFS_ITERS 1000
+
+static const char *const bench_vfs_paths[] = {
+	"/etc/motd",
+	"/boot/limine.conf",
+	"/boot/kernel.elf",
+	"/boot/no/such/file",
+};
+
+static int bench_vfs_open_close(const char *path) {
+	struct file *f;
+	int err = vfs_open(path, &f);
+	if (!err) vfs_close(f);
+	return err;
+}
+
+void bench_vfs(void) {
+	for (unsigned long i = 0;
+		 i < sizeof(bench_vfs_paths) / sizeof(bench_vfs_paths[0]); i++) {
+		const char *path = bench_vfs_paths[i];
+		uint64_t t0 = rdcycle();
+		int err = bench_vfs_open_close(path);
+		uint64_t first = rdcycle() - t0;
+
+		t0 = rdcycle();
+		for (int j = 0; j < BENCH_VFS_ITERS; j++) bench_vfs_open_close(path);
+		uint64_t cached = (rdcycle() - t0) / BENCH_VFS_ITERS;
+
+		debug_printf("  %s%s: first %lu cycles, cached %lu cycles\n", path,
+					 err ? " (missing)" : "", (unsigned long)first,
+					 (unsigned long)cached);
+	}
+}
@@ -0,0 +1,80 @@
+#include "blk.h"
+
+#include <stddef.h>
+
+#include "debug.h"
+#include "sched.h"
+#include "spinlock.h"
+
+static struct blk_device *blk_devices[BLK_DEVICES_MAX];
+static unsigned int blk_device_count;
+static spinlock_t blk_lock = SPINLOCK_INIT;
+
+void blk_register(struct blk_device *dev) {
+	bool irq = spin_lock_irqsave(&blk_lock);
+	bool added = blk_device_count < BLK_DEVICES_MAX;
+	if (added) blk_devices[blk_device_count++] = dev;
+	spin_unlock_irqrestore(&blk_lock, irq);
+
+	if (added)
+		debug_printf("blk: %s, %lu MiB, %u queues%s\n", dev->name,
+					 (unsigned long)(dev->sectors * BLK_SECTOR_SIZE >> 20),
+					 dev->nqueues, dev->read_only ? ", read-only" : "");
+}
+
+struct blk_device *blk_get(unsigned int index) {
+	return index < __atomic_load_n(&blk_device_count, __ATOMIC_ACQUIRE)
+			   ? blk_devices[index]
+			   : NULL;
+}
+
+struct blk_waiter {
+	struct thread *thread;
+	unsigned int pending;
+	enum blk_status status;
+};
+
+static void blk_wait_done(struct blk_request *req) {
+	struct blk_waiter *w = req->priv;
+	// The waiter's frame may be gone once the last request is counted.
+	struct thread *t = w->thread;
+	if (req->status != BLK_OK) {
+		enum blk_status ok = BLK_OK;
+		__atomic_compare_exchange_n(&w->status, &ok, req->status, false,
+									__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+	if (__atomic_sub_fetch(&w->pending, 1, __ATOMIC_RELEASE) == 0 && t)
+		sched_wake(t);
+}
+
+enum blk_status blk_submit_wait(struct blk_device *dev,
+								struct blk_request *reqs) {
+	struct blk_waiter w = {
+		.thread = sched_can_block() ? sched_current() : NULL,
+	};
+	for (struct blk_request *r = reqs; r; r = r->next) {
+		r->done = blk_wait_done;
+		r->priv = &w;
+		w.pending++;
+	}
+	if (!w.pending) return BLK_OK;
+	blk_submit(dev, reqs);
+	while (__atomic_load_n(&w.pending, __ATOMIC_ACQUIRE)) {
+		if (w.thread)
+			sched_block();
+		else
+			blk_poll(dev);
+	}
+	return w.status;
+}
+
+enum blk_status blk_rw(struct blk_device *dev, enum blk_op op,
+					   uint64_t sector, void *buf, uint32_t len) {
+	struct blk_request req = {
+		.op = op,
+		.sector = sector,
+		.buf = buf,
+		.len = len,
+	};
+	return blk_submit_wait(dev, &req);
+}
@@ -0,0 +1,72 @@
+#include "boottime.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "csr.h"
+#include "debug.h"
+#include "init.h"
+#include "limine/features.h"
+
+#define BOOTTIME_MAX 32
+
+static struct boottime_stamp {
+	const char *name;
+	uint64_t time;
+} boottime_stamps[BOOTTIME_MAX] __initdata;
+
+static unsigned int boottime_count __initdata;
+static uint64_t boottime_entry __initdata;
+
+void __init boottime_start(void) { boottime_entry = rdtime(); }
+
+void __init boottime_mark(const char *name) {
+	if (boottime_count == BOOTTIME_MAX) return;
+	boottime_stamps[boottime_count].name = name;
+	boottime_stamps[boottime_count].time = rdtime();
+	boottime_count++;
+}
+
+static void __init boottime_line(const char *name, uint64_t us, uint64_t total) {
+	unsigned long pct = total ? us * 1000 / total : 0;
+	debug_printf("boot: %-16s %8lu us %3lu.%lu%%\n", name, us, pct / 10,
+				 pct % 10);
+}
+
+void __init boottime_print(void) {
+	uint64_t entry_us = clock_ticks_to_us(boottime_entry);
+	uint64_t end = boottime_count ? boottime_stamps[boottime_count - 1].time
+								  : boottime_entry;
+	uint64_t kernel_us = clock_ticks_to_us(end - boottime_entry);
+
+	// Limine takes its timestamps from the same time CSR, so they share an
+	// origin with ours. Anything else would put the handoff in the future.
+	struct limine_bootloader_performance_response *perf =
+		bootloader_performance_request.response;
+	bool have_loader = perf && perf->reset_usec <= perf->init_usec &&
+					   perf->init_usec <= perf->exec_usec &&
+					   perf->exec_usec <= entry_us;
+	uint64_t start_us = have_loader ? perf->reset_usec : entry_us;
+	uint64_t total_us = entry_us - start_us + kernel_us;
+
+	debug_printf("boot: timeline, timebase %lu Hz\n", clock_freq);
+	if (have_loader) {
+		boottime_line("firmware", perf->init_usec - perf->reset_usec,
+					  total_us);
+		boottime_line("bootloader", perf->exec_usec - perf->init_usec,
+					  total_us);
+		boottime_line("handoff", entry_us - perf->exec_usec, total_us);
+	} else {
+		debug_printf("boot: no bootloader timestamps\n");
+	}
+
+	uint64_t prev = boottime_entry;
+	for (unsigned int i = 0; i < boottime_count; i++) {
+		struct boottime_stamp *s = &boottime_stamps[i];
+		boottime_line(s->name, clock_ticks_to_us(s->time - prev), total_us);
+		prev = s->time;
+	}
+	debug_printf("boot: %-16s %8lu us (kernel %lu us)\n", "total", total_us,
+				 kernel_us);
+}
@@ -0,0 +1,29 @@
+#include "clock.h"
+
+#include "fdt.h"
+#include "init.h"
+
+#define CLOCK_DEFAULT_FREQ 10000000
+
+uint64_t clock_freq = CLOCK_DEFAULT_FREQ;
+
+void __init clock_init(void) {
+	int cpus = fdt_path_offset("/cpus");
+	uint64_t freq;
+	if (cpus >= 0 && fdt_getprop_u64(cpus, "timebase-frequency", &freq) &&
+		freq)
+		clock_freq = freq;
+}
+
+// Split so that ticks * unit cannot overflow.
+static uint64_t clock_ticks_to(uint64_t ticks, uint64_t unit) {
+	return ticks / clock_freq * unit + ticks % clock_freq * unit / clock_freq;
+}
+
+uint64_t clock_ticks_to_ns(uint64_t ticks) {
+	return clock_ticks_to(ticks, 1000000000);
+}
+
+uint64_t clock_ticks_to_us(uint64_t ticks) {
+	return clock_ticks_to(ticks, 1000000);
+}
@@ -0,0 +1,88 @@
+#include "cmdline.h"
+
+#include "init.h"
+#include "limine/features.h"
+#include "string.h"
+
+#define CMDLINE_MAX 512
+
+static char cmdline[CMDLINE_MAX];
+
+void __init cmdline_init(void) {
+	struct limine_executable_cmdline_response *resp =
+		executable_cmdline_request.response;
+	if (!resp || !resp->cmdline) return;
+
+	size_t len = strlen(resp->cmdline);
+	if (len >= CMDLINE_MAX) len = CMDLINE_MAX - 1;
+	memcpy(cmdline, resp->cmdline, len);
+	cmdline[len] = '\0';
+}
+
+bool cmdline_get(const char *key, const char **value, size_t *len) {
+	size_t klen = strlen(key);
+	const char *p = cmdline;
+
+	while (*p) {
+		while (*p == ' ') p++;
+		const char *end = p;
+		while (*end && *end != ' ') end++;
+
+		if ((size_t)(end - p) >= klen && !strncmp(p, key, klen) &&
+			(p[klen] == '=' || p + klen == end)) {
+			const char *v = p + klen + (p[klen] == '=');
+			if (value) *value = v;
+			if (len) *len = end - v;
+			return true;
+		}
+		p = end;
+	}
+	return false;
+}
+
+bool cmdline_has(const char *key) { return cmdline_get(key, NULL, NULL); }
+
+unsigned long cmdline_get_ulong(const char *key, unsigned long def) {
+	const char *v;
+	size_t len;
+	if (!cmdline_get(key, &v, &len) || !len) return def;
+
+	unsigned long base = 10, n = 0;
+	if (len > 2 && v[0] == '0' && (v[1] == 'x' || v[1] == 'X')) {
+		base = 16;
+		v += 2;
+		len -= 2;
+	}
+	for (; len; v++, len--) {
+		unsigned long d;
+		if (*v >= '0' && *v <= '9')
+			d = *v - '0';
+		else if (base == 16 && *v >= 'a' && *v <= 'f')
+			d = *v - 'a' + 10;
+		else if (base == 16 && *v >= 'A' && *v <= 'F')
+			d = *v - 'A' + 10;
+		else
+			return def;
+		n = n * base + d;
+	}
+	return n;
+}
+
+bool cmdline_list_has(const char *key, const char *item) {
+	const char *v;
+	size_t len;
+	if (!cmdline_get(key, &v, &len)) return false;
+
+	size_t ilen = strlen(item);
+	const char *end = v + len;
+	while (v < end) {
+		const char *comma = v;
+		while (comma < end && *comma != ',') comma++;
+		size_t n = comma - v;
+		if ((n == ilen && !strncmp(v, item, n)) ||
+			(n == 3 && !strncmp(v, "all", 3)))
+			return true;
+		v = comma + 1;
+	}
+	return false;
+}
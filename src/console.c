@@ -0,0 +1,13 @@
+#include "console.h"
+
+#include "debug.h"
+
+static long console_write(struct file *f, const void *buf, size_t len) {
+	(void)f;
+	debug_write(buf, len);
+	return len;
+}
+
+static const struct inode_ops console_ops = {.write = console_write};
+
+struct inode console_inode = {.ops = &console_ops};
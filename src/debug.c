@@ -1,9 +1,12 @@
 #include "debug.h"
 
+#include <stdarg.h>
 #include <stdint.h>
 
 #include "limine/features.h"
+#include "printf.h"
 #include "sbi.h"
+#include "spinlock.h"
 #include "string.h"
 
 void debug_print_kstr(const char *s, unsigned long len) {
@@ -13,6 +16,37 @@ void debug_print_kstr(const char *s, unsigned long len) {
 	sbi_debug_console_write(len, addr & ((1ul << 32) - 1), addr >> 32);
 }
 
+// Serializes the shared buffer, and keeps lines from different harts whole.
+static spinlock_t debug_lock = SPINLOCK_INIT;
+
+void debug_printf(const char *fmt, ...) {
+	static char buf[256];
+	va_list ap;
+
+	bool irq = spin_lock_irqsave(&debug_lock);
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len >= (int)sizeof(buf)) len = sizeof(buf) - 1;
+	debug_print_kstr(buf, len);
+	spin_unlock_irqrestore(&debug_lock, irq);
+}
+
+void debug_write(const char *s, unsigned long len) {
+	static char buf[256];
+
+	bool irq = spin_lock_irqsave(&debug_lock);
+	while (len) {
+		unsigned long n = len < sizeof(buf) ? len : sizeof(buf);
+		memcpy(buf, s, n);
+		debug_print_kstr(buf, n);
+		s += n;
+		len -= n;
+	}
+	spin_unlock_irqrestore(&debug_lock, irq);
+}
+
 noreturn void early_panic(const char *s) {
 	debug_print_kstr(s, strlen(s));
 
@@ -21,3 +55,15 @@ noreturn void early_panic(const char *s) {
 
 	while (1);
 }
+
+noreturn void panic(const char *fmt, ...) {
+	static char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	debug_print_kstr("panic: ", 7);
+	early_panic(buf);
+}
@@ -0,0 +1,36 @@
+#include "dispatch.h"
+
+#include "debug.h"
+#include "init.h"
+#include "patch.h"
+
+extern const struct dispatch_variant __dispatch_start[], __dispatch_end[];
+
+static bool __init dispatch_supported(const struct dispatch_variant *v) {
+	return (v->exts & isa_extensions) == v->exts;
+}
+
+/* Whether v is the variant to use for its site: supported, and no other
+   supported variant ranks higher. Ties go to the first one. */
+static bool __init dispatch_best(const struct dispatch_variant *v) {
+	if (!dispatch_supported(v)) return false;
+	for (const struct dispatch_variant *o = __dispatch_start;
+		 o < __dispatch_end; o++) {
+		if (o == v || o->site != v->site || !dispatch_supported(o)) continue;
+		if (o->rank > v->rank || (o->rank == v->rank && o < v)) return false;
+	}
+	return true;
+}
+
+void __init dispatch_init(void) {
+	bool patched = false;
+	for (const struct dispatch_variant *v = __dispatch_start;
+		 v < __dispatch_end; v++) {
+		if (!dispatch_best(v)) continue;
+		patch_insn(v->site,
+				   rv_insn_jump((unsigned long)v->site, (unsigned long)v->impl));
+		debug_printf("dispatch: using %s\n", v->name);
+		patched = true;
+	}
+	if (patched) patch_commit();
+}
@@ -0,0 +1,67 @@
+#include "elf.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "errno.h"
+#include "mm.h"
+#include "pmm.h"
+#include "string.h"
+#include "vfs.h"
+#include "vmm.h"
+
+#define ELF_PHNUM_MAX 16
+
+static bool elf_header_ok(const struct elf_header *eh) {
+	// 64-bit, little endian, version 1.
+	return !memcmp(eh->ident, "\177ELF", 4) && eh->ident[4] == 2 &&
+		   eh->ident[5] == 1 && eh->ident[6] == 1 && eh->type == ET_EXEC &&
+		   eh->machine == EM_RISCV &&
+		   eh->phentsize == sizeof(struct elf_phdr) && eh->phnum &&
+		   eh->phnum <= ELF_PHNUM_MAX && eh->entry < USER_TOP;
+}
+
+static uint64_t elf_prot(uint32_t flags) {
+	uint64_t prot = 0;
+	if (flags & PF_R) prot |= PTE_R;
+	if (flags & PF_W) prot |= PTE_R | PTE_W;
+	if (flags & PF_X) prot |= PTE_X;
+	return prot;
+}
+
+static int elf_load_segment(struct mm *mm, struct file *f,
+							const struct elf_phdr *ph) {
+	// The mapping starts at the page holding vaddr, and at as many bytes
+	// before offset in the file.
+	uint64_t start = ph->vaddr & ~(PAGE_SIZE - 1);
+	uint64_t skew = ph->vaddr - start;
+	if (ph->filesz > ph->memsz || ph->vaddr >= USER_TOP ||
+		ph->memsz > USER_TOP - ph->vaddr || ph->offset < skew ||
+		ph->offset + ph->filesz > f->inode->size)
+		return -ENOEXEC;
+
+	uint64_t end = (ph->vaddr + ph->memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	int err = mm_map(mm, start, end - start, elf_prot(ph->flags), f,
+					 ph->offset - skew, ph->filesz + skew);
+	// Segments that share a page cannot be mapped separately.
+	return err == -EINVAL ? -ENOEXEC : err;
+}
+
+int elf_load(struct mm *mm, struct file *f, uint64_t *entry) {
+	struct elf_header eh;
+	long got = vfs_pread(f, 0, &eh, sizeof(eh));
+	if (got < 0) return got;
+	if ((size_t)got != sizeof(eh) || !elf_header_ok(&eh)) return -ENOEXEC;
+
+	for (unsigned int i = 0; i < eh.phnum; i++) {
+		struct elf_phdr ph;
+		got = vfs_pread(f, eh.phoff + i * sizeof(ph), &ph, sizeof(ph));
+		if (got < 0) return got;
+		if ((size_t)got != sizeof(ph)) return -ENOEXEC;
+		if (ph.type != PT_LOAD || !ph.memsz) continue;
+		int err = elf_load_segment(mm, f, &ph);
+		if (err) return err;
+	}
+	*entry = eh.entry;
+	return 0;
+}
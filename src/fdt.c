@@ -0,0 +1,317 @@
+#include "fdt.h"
+
+#include <stddef.h>
+
+#include "init.h"
+#include "initcall.h"
+#include "limine/features.h"
+#include "string.h"
+
+#define FDT_MAGIC 0xd00dfeed
+
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE 2
+#define FDT_PROP 3
+#define FDT_NOP 4
+#define FDT_END 9
+
+struct fdt_header {
+	uint32_t magic;
+	uint32_t totalsize;
+	uint32_t off_dt_struct;
+	uint32_t off_dt_strings;
+	uint32_t off_mem_rsvmap;
+	uint32_t version;
+	uint32_t last_comp_version;
+	uint32_t boot_cpuid_phys;
+	uint32_t size_dt_strings;
+	uint32_t size_dt_struct;
+};
+
+static const struct fdt_header *fdt;
+static const char *fdt_struct;
+static const char *fdt_strings;
+static uint32_t fdt_struct_size;
+
+#define FDT_INDEX_MAX 1024
+#define FDT_PHANDLE_MAX 1024
+
+/* Nodes in tree order, which is also offset order. */
+static struct fdt_index_node {
+	int offset;
+	int parent;
+} fdt_index[FDT_INDEX_MAX];
+static unsigned int fdt_index_count;
+static int fdt_phandles[FDT_PHANDLE_MAX];
+static bool fdt_indexed;
+
+#define ALIGN4(x) (((x) + 3) & ~3u)
+
+bool __init fdt_init(void) {
+	struct limine_dtb_response *resp = dtb_request.response;
+	if (!resp || !resp->dtb_ptr) return false;
+
+	const struct fdt_header *h = resp->dtb_ptr;
+	if (fdt32_to_cpu(h->magic) != FDT_MAGIC ||
+		fdt32_to_cpu(h->last_comp_version) > 17)
+		return false;
+
+	fdt_relocate(h);
+	fdt_struct_size = fdt32_to_cpu(h->size_dt_struct);
+	return true;
+}
+
+void fdt_relocate(const void *blob) {
+	const struct fdt_header *h = blob;
+	fdt = h;
+	fdt_struct = (const char *)h + fdt32_to_cpu(h->off_dt_struct);
+	fdt_strings = (const char *)h + fdt32_to_cpu(h->off_dt_strings);
+}
+
+const void *fdt_blob(void) { return fdt; }
+
+uint32_t fdt_size(void) { return fdt ? fdt32_to_cpu(fdt->totalsize) : 0; }
+
+static uint32_t fdt_token(int off) {
+	if (!fdt || off < 0 || (uint32_t)off + 4 > fdt_struct_size) return FDT_END;
+	return fdt32_to_cpu(*(const uint32_t *)(fdt_struct + off));
+}
+
+/* Offset of the first token after a FDT_BEGIN_NODE and its name. */
+static int fdt_node_body(int node) {
+	return node + 4 + ALIGN4(strlen(fdt_struct + node + 4) + 1);
+}
+
+static int fdt_prop_next(int off) {
+	uint32_t len = fdt32_to_cpu(*(const uint32_t *)(fdt_struct + off + 4));
+	return off + 12 + ALIGN4(len);
+}
+
+int fdt_next_node(int node, int *depth) {
+	if (fdt_token(node) != FDT_BEGIN_NODE) return -1;
+
+	int off = fdt_node_body(node);
+	for (;;) {
+		switch (fdt_token(off)) {
+			case FDT_BEGIN_NODE:
+				++*depth;
+				return off;
+			case FDT_END_NODE:
+				--*depth;
+				off += 4;
+				break;
+			case FDT_PROP:
+				off = fdt_prop_next(off);
+				break;
+			case FDT_NOP:
+				off += 4;
+				break;
+			default:
+				return -1;
+		}
+	}
+}
+
+int fdt_first_child(int node) {
+	int depth = 0;
+	int child = fdt_next_node(node, &depth);
+	return depth == 1 ? child : -1;
+}
+
+int fdt_next_sibling(int node) {
+	int depth = 0;
+	do {
+		node = fdt_next_node(node, &depth);
+	} while (node >= 0 && depth > 0);
+	return depth == 0 ? node : -1;
+}
+
+const char *fdt_node_name(int node) {
+	if (fdt_token(node) != FDT_BEGIN_NODE) return NULL;
+	return fdt_struct + node + 4;
+}
+
+static bool fdt_name_matches(const char *name, const char *comp, size_t len) {
+	if (strncmp(name, comp, len)) return false;
+	// "memory" matches "memory@80000000" unless a unit address was given.
+	return name[len] == '\0' || (name[len] == '@' && !memchr(comp, '@', len));
+}
+
+int fdt_path_offset(const char *path) {
+	if (!fdt || *path != '/') return -1;
+
+	int node = 0;
+	while (*path) {
+		while (*path == '/') path++;
+		if (!*path) break;
+		const char *end = path;
+		while (*end && *end != '/') end++;
+
+		int child = fdt_first_child(node);
+		while (child >= 0 &&
+			   !fdt_name_matches(fdt_node_name(child), path, end - path))
+			child = fdt_next_sibling(child);
+		if (child < 0) return -1;
+
+		node = child;
+		path = end;
+	}
+	return node;
+}
+
+const void *fdt_getprop(int node, const char *name, uint32_t *len) {
+	if (fdt_token(node) != FDT_BEGIN_NODE) return NULL;
+
+	int off = fdt_node_body(node);
+	for (;;) {
+		uint32_t token = fdt_token(off);
+		if (token == FDT_NOP) {
+			off += 4;
+			continue;
+		}
+		// Properties come before subnodes.
+		if (token != FDT_PROP) return NULL;
+
+		const uint32_t *p = (const uint32_t *)(fdt_struct + off);
+		if (!strcmp(fdt_strings + fdt32_to_cpu(p[2]), name)) {
+			if (len) *len = fdt32_to_cpu(p[1]);
+			return p + 3;
+		}
+		off = fdt_prop_next(off);
+	}
+}
+
+static bool fdt_stringlist_contains(const char *list, uint32_t len,
+									const char *s) {
+	size_t slen = strlen(s);
+	const char *end = list + len;
+	while (list < end) {
+		size_t n = strlen(list);
+		if (n == slen && !memcmp(list, s, n)) return true;
+		list += n + 1;
+	}
+	return false;
+}
+
+int fdt_node_by_compatible(int start, const char *compat) {
+	if (!fdt) return -1;
+
+	int depth = 0;
+	int node = start < 0 ? 0 : fdt_next_node(start, &depth);
+	for (; node >= 0; node = fdt_next_node(node, &depth)) {
+		uint32_t len;
+		const char *list = fdt_getprop(node, "compatible", &len);
+		if (list && fdt_stringlist_contains(list, len, compat)) return node;
+	}
+	return -1;
+}
+
+uint64_t fdt_read_cells(const uint32_t *cells, uint32_t n) {
+	uint64_t v = 0;
+	while (n--) v = (v << 32) | fdt32_to_cpu(*cells++);
+	return v;
+}
+
+bool fdt_getprop_u32(int node, const char *name, uint32_t *out) {
+	uint32_t len;
+	const uint32_t *p = fdt_getprop(node, name, &len);
+	if (!p || len != 4) return false;
+	*out = fdt32_to_cpu(*p);
+	return true;
+}
+
+bool fdt_getprop_u64(int node, const char *name, uint64_t *out) {
+	uint32_t len;
+	const uint32_t *p = fdt_getprop(node, name, &len);
+	if (!p || (len != 4 && len != 8)) return false;
+	*out = fdt_read_cells(p, len / 4);
+	return true;
+}
+
+uint32_t fdt_address_cells(int node) {
+	uint32_t cells;
+	return fdt_getprop_u32(node, "#address-cells", &cells) ? cells : 2;
+}
+
+uint32_t fdt_size_cells(int node) {
+	uint32_t cells;
+	return fdt_getprop_u32(node, "#size-cells", &cells) ? cells : 1;
+}
+
+bool fdt_get_reg(int parent, int node, unsigned int i, uint64_t *addr,
+				 uint64_t *size) {
+	uint32_t ac = fdt_address_cells(parent), sc = fdt_size_cells(parent);
+	uint32_t len;
+	const uint32_t *reg = fdt_getprop(node, "reg", &len);
+	if (!reg || ac > 2 || sc > 2 || (i + 1) * (ac + sc) * 4 > len)
+		return false;
+
+	reg += i * (ac + sc);
+	*addr = fdt_read_cells(reg, ac);
+	if (size) *size = fdt_read_cells(reg + ac, sc);
+	return true;
+}
+
+static void __init fdt_index_build(void) {
+	int stack[32];
+	int depth = 0;
+
+	for (unsigned int i = 0; i < FDT_PHANDLE_MAX; i++) fdt_phandles[i] = -1;
+	if (!fdt) return;
+
+	// depth is that of node, with the root at 0.
+	for (int node = 0; node >= 0; node = fdt_next_node(node, &depth)) {
+		if (fdt_index_count == FDT_INDEX_MAX || depth >= 32) return;
+		stack[depth] = node;
+
+		struct fdt_index_node *n = &fdt_index[fdt_index_count++];
+		n->offset = node;
+		n->parent = depth ? stack[depth - 1] : -1;
+
+		uint32_t phandle;
+		if ((fdt_getprop_u32(node, "phandle", &phandle) ||
+			 fdt_getprop_u32(node, "linux,phandle", &phandle)) &&
+			phandle < FDT_PHANDLE_MAX)
+			fdt_phandles[phandle] = node;
+	}
+	fdt_indexed = true;
+}
+
+INITCALL(fdt_index, fdt_index_build);
+
+int fdt_node_by_phandle(uint32_t phandle) {
+	if (fdt_indexed && phandle < FDT_PHANDLE_MAX) return fdt_phandles[phandle];
+
+	int depth = 0;
+	for (int node = fdt ? 0 : -1; node >= 0;
+		 node = fdt_next_node(node, &depth)) {
+		uint32_t p;
+		if (fdt_getprop_u32(node, "phandle", &p) && p == phandle) return node;
+	}
+	return -1;
+}
+
+int fdt_parent(int node) {
+	if (fdt_indexed) {
+		unsigned int lo = 0, hi = fdt_index_count;
+		while (lo < hi) {
+			unsigned int mid = (lo + hi) / 2;
+			if (fdt_index[mid].offset < node)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < fdt_index_count && fdt_index[lo].offset == node)
+			return fdt_index[lo].parent;
+		return -1;
+	}
+
+	int stack[32];
+	int depth = 0;
+	for (int n = fdt ? 0 : -1; n >= 0 && depth < 32;
+		 n = fdt_next_node(n, &depth)) {
+		stack[depth] = n;
+		if (n == node) return depth ? stack[depth - 1] : -1;
+	}
+	return -1;
+}
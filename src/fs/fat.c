@@ -0,0 +1,793 @@
+#include "fat.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blk.h"
+#include "debug.h"
+#include "errno.h"
+#include "init.h"
+#include "initcall.h"
+#include "pcache.h"
+#include "pmm.h"
+#include "pool.h"
+#include "spinlock.h"
+#include "string.h"
+#include "vfs.h"
+
+#define FAT_DIRENT_SIZE 32
+#define FAT_DIRENT_END 0x00
+#define FAT_DIRENT_FREE 0xe5
+/* A name starting with 0xe5 has it stored as 0x05. */
+#define FAT_DIRENT_KANJI 0x05
+/* Case of the short name's parts, from Windows NT. */
+#define FAT_CASE_LOWER_BASE 0x08
+#define FAT_CASE_LOWER_EXT 0x10
+
+#define FAT_LFN_LAST 0x40
+#define FAT_LFN_CHARS 13
+
+/* Returned for the cluster after the last one of a chain. */
+#define FAT_CHAIN_END 0
+
+/* Data clusters read with one batch of requests at most. */
+#define FAT_READ_BATCH 8
+
+#define FAT_DCACHE_BUCKETS 512
+#define FAT_DCACHE_MAX 4096
+
+/* Partition types of FAT16 and FAT32 in an MBR. */
+static const uint8_t fat_mbr_types[] = {0x04, 0x06, 0x0b, 0x0c, 0x0e};
+
+/* Where the 13 UTF-16 characters of a long name entry are. */
+static const uint8_t fat_lfn_offsets[FAT_LFN_CHARS] = {
+	1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+/* A directory entry as fat_scan() hands it out. */
+struct fat_dirent {
+	const char *name;
+	size_t len;
+	uint32_t cluster;
+	uint32_t size;
+	uint8_t attr;
+};
+
+typedef bool (*fat_scan_t)(void *arg, const struct fat_dirent *d);
+
+/* A long name collected from the entries before a short one. */
+struct fat_lfn {
+	char name[FAT_NAME_MAX + 1];
+	size_t len;
+	/* Sequence number expected next, counting down to 0. */
+	unsigned int next;
+	uint8_t sum;
+	bool valid;
+};
+
+/* Cached directory entry. The dcache is keyed by volume, first cluster of
+   the directory and the case-folded name. */
+struct fat_dentry {
+	struct fat_dentry *next;
+	struct fat_volume *vol;
+	uint32_t dir;
+	uint32_t hash;
+	uint32_t cluster;
+	uint32_t size;
+	uint8_t attr;
+	/* 0 marks a directory whose entries are all cached. */
+	uint8_t len;
+	char name[FAT_NAME_MAX];
+};
+
+static struct pool fat_volume_pool = POOL_INIT(sizeof(struct fat_volume));
+static struct pool fat_dentry_pool = POOL_INIT(sizeof(struct fat_dentry));
+static struct pool fat_file_pool = POOL_INIT(sizeof(struct fat_file));
+
+static spinlock_t fat_dcache_lock = SPINLOCK_INIT;
+static struct fat_dentry *fat_dcache[FAT_DCACHE_BUCKETS];
+static unsigned int fat_dcache_count;
+
+static struct fat_volume *fat_volumes[FAT_VOLUMES_MAX];
+static unsigned int fat_volume_count;
+
+static uint16_t fat_le16(const uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t fat_le32(const uint8_t *p) {
+	return fat_le16(p) | (uint32_t)fat_le16(p + 2) << 16;
+}
+
+static char fat_fold(char c) {
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static uint64_t fat_cluster_offset(const struct fat_volume *v,
+								   uint32_t cluster) {
+	return v->data_start + ((uint64_t)(cluster - 2) << v->cluster_shift);
+}
+
+/* The FAT page a walk last used, kept between lookups. */
+struct fat_cursor {
+	struct pcache_page *pg;
+};
+
+static void fat_cursor_done(struct fat_cursor *cur) {
+	if (cur->pg) pcache_put(cur->pg);
+	cur->pg = NULL;
+}
+
+/* Stores the cluster following cluster in *next, FAT_CHAIN_END if there is
+   none or the entry is not a valid cluster. False on an I/O error. */
+static bool fat_next(struct fat_volume *v, struct fat_cursor *cur,
+					 uint32_t cluster, uint32_t *next) {
+	unsigned int bytes = v->fat_bits / 8;
+	uint64_t off = v->fat_start + (uint64_t)cluster * bytes;
+	uint64_t index = off >> PAGE_SHIFT;
+	if (!cur->pg || cur->pg->index != index) {
+		fat_cursor_done(cur);
+		cur->pg = pcache_get(v->dev, index);
+		if (!cur->pg) return false;
+	}
+
+	// Entries are aligned to their size and never straddle pages.
+	const uint8_t *e = (const uint8_t *)cur->pg->data + (off & (PAGE_SIZE - 1));
+	uint32_t n = bytes == 2 ? fat_le16(e) : fat_le32(e) & 0x0fffffff;
+	*next = n >= 2 && n - 2 < v->clusters ? n : FAT_CHAIN_END;
+	return true;
+}
+
+/* Fills extents[i] with the run of clusters following extents[i - 1], or
+   starting the chain if i is 0. Returns 1, 0 if the chain ends before it or
+   -1 on an I/O error. */
+static int fat_extent_next(struct fat_file *f, unsigned int i) {
+	struct fat_volume *v = f->vol;
+	struct fat_cursor cur = {0};
+	uint32_t start, file_cluster;
+
+	if (!i) {
+		start = f->cluster >= 2 && f->cluster - 2 < v->clusters
+					? f->cluster
+					: FAT_CHAIN_END;
+		file_cluster = 0;
+	} else {
+		const struct fat_extent *prev = &f->extents[i - 1];
+		if (!fat_next(v, &cur, prev->disk_cluster + prev->count - 1, &start)) {
+			fat_cursor_done(&cur);
+			return -1;
+		}
+		file_cluster = prev->file_cluster + prev->count;
+	}
+	f->nextents = i;
+	f->extents_complete = start == FAT_CHAIN_END;
+	if (f->extents_complete) {
+		fat_cursor_done(&cur);
+		return 0;
+	}
+
+	// Follow the chain while it stays contiguous on the disk. A loop in
+	// a corrupt chain ends at the cluster count.
+	uint32_t count = 1, next;
+	for (;;) {
+		if (!fat_next(v, &cur, start + count - 1, &next)) {
+			fat_cursor_done(&cur);
+			return -1;
+		}
+		if (next != start + count || count >= v->clusters) break;
+		count++;
+	}
+	fat_cursor_done(&cur);
+
+	f->extents[i] = (struct fat_extent){file_cluster, start, count};
+	f->nextents = i + 1;
+	f->extents_complete = next == FAT_CHAIN_END;
+	return 1;
+}
+
+/* Finds the disk cluster of the file's cluster index and how many clusters
+   from there on are contiguous. Returns 1, 0 past the end of the chain or
+   -1 on an I/O error. */
+static int fat_extent_find(struct fat_file *f, uint32_t index,
+						   uint32_t *disk, uint32_t *run) {
+	for (;;) {
+		unsigned int n = f->nextents;
+		for (unsigned int i = 0; i < n; i++) {
+			const struct fat_extent *e = &f->extents[i];
+			if (index - e->file_cluster < e->count) {
+				*disk = e->disk_cluster + (index - e->file_cluster);
+				*run = e->count - (index - e->file_cluster);
+				return 1;
+			}
+		}
+
+		int r;
+		if (n && index < f->extents[n - 1].file_cluster) {
+			// Behind the moving last slot: walk again from the one before.
+			r = fat_extent_next(f, n - 1);
+		} else {
+			if (f->extents_complete) return 0;
+			r = fat_extent_next(f, n < FAT_EXTENTS ? n : FAT_EXTENTS - 1);
+		}
+		if (r <= 0) return r;
+	}
+}
+
+static void fat_file_init(struct fat_file *f, struct fat_volume *v,
+						  uint32_t cluster, uint32_t size, uint8_t attr) {
+	f->vol = v;
+	f->cluster = cluster;
+	f->size = size;
+	f->attr = attr;
+	f->nextents = 0;
+	f->extents_complete = false;
+}
+
+void fat_root(struct fat_volume *vol, struct fat_file *out) {
+	fat_file_init(out, vol, vol->fat_bits == 32 ? vol->root_cluster : 0, 0,
+				  FAT_ATTR_DIRECTORY);
+}
+
+static uint8_t fat_short_sum(const uint8_t *name) {
+	uint8_t sum = 0;
+	for (unsigned int i = 0; i < 11; i++)
+		sum = (uint8_t)((sum & 1) << 7) + (sum >> 1) + name[i];
+	return sum;
+}
+
+static void fat_lfn_add(struct fat_lfn *l, const uint8_t *e) {
+	unsigned int seq = e[0] & 0x1f;
+	if (e[0] & FAT_LFN_LAST) {
+		l->valid = seq && seq * FAT_LFN_CHARS <= FAT_NAME_MAX + FAT_LFN_CHARS;
+		l->next = seq;
+		l->sum = e[13];
+		l->len = 0;
+	}
+	if (!l->valid || seq != l->next || e[13] != l->sum) {
+		l->valid = false;
+		return;
+	}
+
+	size_t pos = (seq - 1) * FAT_LFN_CHARS;
+	for (unsigned int k = 0; k < FAT_LFN_CHARS; k++, pos++) {
+		uint16_t c = fat_le16(e + fat_lfn_offsets[k]);
+		if (!c || c == 0xffff) break;
+		if (pos >= FAT_NAME_MAX) {
+			l->valid = false;
+			return;
+		}
+		// Names are kept in ASCII; anything else cannot be typed anyway.
+		l->name[pos] = c < 0x80 ? c : '?';
+		if (pos + 1 > l->len) l->len = pos + 1;
+	}
+	l->next = seq - 1;
+}
+
+/* The 8.3 name of a short entry, with the dot put back. */
+static size_t fat_short_name(const uint8_t *e, char *name) {
+	size_t len = 0, base = 8, ext = 3;
+	while (base && e[base - 1] == ' ') base--;
+	while (ext && e[8 + ext - 1] == ' ') ext--;
+	for (size_t i = 0; i < base; i++) {
+		char c = i == 0 && e[0] == FAT_DIRENT_KANJI ? (char)0xe5 : e[i];
+		name[len++] = e[12] & FAT_CASE_LOWER_BASE ? fat_fold(c) : c;
+	}
+	if (ext) name[len++] = '.';
+	for (size_t i = 0; i < ext; i++)
+		name[len++] = e[12] & FAT_CASE_LOWER_EXT ? fat_fold(e[8 + i]) : e[8 + i];
+	return len;
+}
+
+/* Calls fn for each entry of dir, other than "." and "..", until it returns
+   false. Returns false on an I/O error. */
+static bool fat_scan(struct fat_file *dir, fat_scan_t fn, void *arg) {
+	struct fat_volume *v = dir->vol;
+	struct pcache_page *pg = NULL;
+	struct fat_lfn lfn = {.valid = false};
+	char short_name[13];
+	bool ok = true;
+
+	for (uint64_t pos = 0;; pos += FAT_DIRENT_SIZE) {
+		uint64_t off;
+		if (!dir->cluster) {
+			if (pos >= v->root_size) break;
+			off = v->root_start + pos;
+		} else {
+			uint32_t disk, run;
+			int r = fat_extent_find(dir, pos >> v->cluster_shift, &disk, &run);
+			if (r <= 0) {
+				ok = !r;
+				break;
+			}
+			off = fat_cluster_offset(v, disk) +
+				  (pos & ((1u << v->cluster_shift) - 1));
+		}
+
+		uint64_t index = off >> PAGE_SHIFT;
+		if (!pg || pg->index != index) {
+			if (pg) pcache_put(pg);
+			pg = pcache_get(v->dev, index);
+			if (!pg) {
+				ok = false;
+				break;
+			}
+		}
+
+		const uint8_t *e = (const uint8_t *)pg->data + (off & (PAGE_SIZE - 1));
+		if (e[0] == FAT_DIRENT_END) break;
+		if (e[0] == FAT_DIRENT_FREE) {
+			lfn.valid = false;
+			continue;
+		}
+		if ((e[11] & 0x3f) == FAT_ATTR_LFN) {
+			fat_lfn_add(&lfn, e);
+			continue;
+		}
+		bool has_lfn = lfn.valid && !lfn.next && lfn.len &&
+					   lfn.sum == fat_short_sum(e);
+		lfn.valid = false;
+		if (e[11] & FAT_ATTR_VOLUME_ID) continue;
+
+		struct fat_dirent d = {
+			.cluster = fat_le16(e + 26) | (uint32_t)fat_le16(e + 20) << 16,
+			.size = fat_le32(e + 28),
+			.attr = e[11],
+		};
+		if (v->fat_bits == 16) d.cluster &= 0xffff;
+		if (has_lfn) {
+			d.name = lfn.name;
+			d.len = lfn.len;
+		} else {
+			d.name = short_name;
+			d.len = fat_short_name(e, short_name);
+		}
+		if (d.name[0] == '.' &&
+			(d.len == 1 || (d.len == 2 && d.name[1] == '.')))
+			continue;
+		if (!fn(arg, &d)) break;
+	}
+	if (pg) pcache_put(pg);
+	return ok;
+}
+
+static uint32_t fat_hash(const struct fat_volume *v, uint32_t dir,
+						 const char *name, size_t len) {
+	uint32_t h = 2166136261u ^ dir ^ (uint32_t)((uintptr_t)v >> 6);
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* Looks up a case-folded name. Returns 1 and fills *out if cached, 0 if the
+   directory is cached in full without it and -1 if it is not known. */
+static int fat_dcache_find(struct fat_volume *v, uint32_t dir,
+						   const char *name, size_t len,
+						   struct fat_dentry *out) {
+	uint32_t hash = fat_hash(v, dir, name, len);
+	uint32_t marker = fat_hash(v, dir, name, 0);
+	int r = -1;
+
+	bool irq = spin_lock_irqsave(&fat_dcache_lock);
+	for (struct fat_dentry *d = fat_dcache[hash % FAT_DCACHE_BUCKETS]; d;
+		 d = d->next) {
+		if (d->hash == hash && d->vol == v && d->dir == dir &&
+			d->len == len && !memcmp(d->name, name, len)) {
+			*out = *d;
+			r = 1;
+			break;
+		}
+	}
+	if (r < 0) {
+		for (struct fat_dentry *d = fat_dcache[marker % FAT_DCACHE_BUCKETS];
+			 d; d = d->next) {
+			if (d->hash == marker && d->vol == v && d->dir == dir &&
+				!d->len) {
+				r = 0;
+				break;
+			}
+		}
+	}
+	spin_unlock_irqrestore(&fat_dcache_lock, irq);
+	return r;
+}
+
+/* Caches an entry, or with a NULL d the marker of a fully cached
+   directory. False once the dcache is full. */
+static bool fat_dcache_add(struct fat_volume *v, uint32_t dir,
+						   const char *name, size_t len,
+						   const struct fat_dirent *d) {
+	if (__atomic_load_n(&fat_dcache_count, __ATOMIC_RELAXED) >= FAT_DCACHE_MAX)
+		return false;
+	struct fat_dentry *new = pool_alloc(&fat_dentry_pool);
+	if (!new) return false;
+	new->vol = v;
+	new->dir = dir;
+	new->hash = fat_hash(v, dir, name, len);
+	new->len = len;
+	memcpy(new->name, name, len);
+	if (d) {
+		new->cluster = d->cluster;
+		new->size = d->size;
+		new->attr = d->attr;
+	}
+
+	struct fat_dentry **bucket = &fat_dcache[new->hash % FAT_DCACHE_BUCKETS];
+	bool irq = spin_lock_irqsave(&fat_dcache_lock);
+	// Another lookup may have read the same directory meanwhile.
+	for (struct fat_dentry *o = *bucket; o; o = o->next) {
+		if (o->hash == new->hash && o->vol == v && o->dir == dir &&
+			o->len == len && !memcmp(o->name, name, len)) {
+			spin_unlock_irqrestore(&fat_dcache_lock, irq);
+			pool_free(&fat_dentry_pool, new);
+			return true;
+		}
+	}
+	new->next = *bucket;
+	*bucket = new;
+	fat_dcache_count++;
+	spin_unlock_irqrestore(&fat_dcache_lock, irq);
+	return true;
+}
+
+struct fat_lookup_state {
+	struct fat_volume *vol;
+	uint32_t dir;
+	const char *name;
+	size_t len;
+	bool found;
+	/* Every entry so far went into the dcache. */
+	bool cached;
+	struct fat_dirent result;
+};
+
+static bool fat_lookup_entry(void *arg, const struct fat_dirent *d) {
+	struct fat_lookup_state *s = arg;
+	char folded[FAT_NAME_MAX];
+	for (size_t i = 0; i < d->len; i++) folded[i] = fat_fold(d->name[i]);
+
+	if (!s->found && d->len == s->len && !memcmp(folded, s->name, s->len)) {
+		s->found = true;
+		s->result = *d;
+	}
+	if (s->cached)
+		s->cached = fat_dcache_add(s->vol, s->dir, folded, d->len, d);
+	// Read on to the end unless the rest cannot be cached anyway.
+	return s->cached || !s->found;
+}
+
+static void fat_open_entry(struct fat_volume *v, uint32_t cluster,
+						   uint32_t size, uint8_t attr, struct fat_file *out) {
+	// A subdirectory's ".." names the root as cluster 0 on FAT32 as well.
+	if (attr & FAT_ATTR_DIRECTORY && !cluster)
+		fat_root(v, out);
+	else
+		fat_file_init(out, v, cluster, size, attr);
+}
+
+int fat_lookup(struct fat_file *dir, const char *name, size_t len,
+			   struct fat_file *out) {
+	struct fat_volume *v = dir->vol;
+	if (!(dir->attr & FAT_ATTR_DIRECTORY) || !len || len > FAT_NAME_MAX)
+		return 0;
+
+	char folded[FAT_NAME_MAX];
+	for (size_t i = 0; i < len; i++) folded[i] = fat_fold(name[i]);
+
+	struct fat_dentry hit;
+	int r = fat_dcache_find(v, dir->cluster, folded, len, &hit);
+	if (r >= 0) {
+		if (r) fat_open_entry(v, hit.cluster, hit.size, hit.attr, out);
+		return r;
+	}
+
+	struct fat_lookup_state s = {
+		.vol = v,
+		.dir = dir->cluster,
+		.name = folded,
+		.len = len,
+		.cached = true,
+	};
+	if (!fat_scan(dir, fat_lookup_entry, &s)) return -1;
+	if (s.cached) fat_dcache_add(v, dir->cluster, "", 0, NULL);
+	if (s.found)
+		fat_open_entry(v, s.result.cluster, s.result.size, s.result.attr, out);
+	return s.found;
+}
+
+bool fat_open(struct fat_volume *vol, const char *path, struct fat_file *out) {
+	fat_root(vol, out);
+	while (*path) {
+		if (*path == '/') {
+			path++;
+			continue;
+		}
+		size_t len = 0;
+		while (path[len] && path[len] != '/') len++;
+		struct fat_file dir = *out;
+		if (fat_lookup(&dir, path, len, out) <= 0) return false;
+		path += len;
+	}
+	return true;
+}
+
+/* Copies from the device through the page cache, not crossing a page. */
+static bool fat_copy(struct fat_volume *v, uint64_t off, void *buf,
+					 size_t len) {
+	struct pcache_page *pg = pcache_get(v->dev, off >> PAGE_SHIFT);
+	if (!pg) return false;
+	memcpy(buf, (const char *)pg->data + (off & (PAGE_SIZE - 1)), len);
+	pcache_put(pg);
+	return true;
+}
+
+long fat_read(struct fat_file *f, uint64_t off, void *buf, size_t len) {
+	struct fat_volume *v = f->vol;
+	struct blk_device *dev = v->dev;
+	uint64_t cluster_size = 1ull << v->cluster_shift;
+	struct blk_request reqs[FAT_READ_BATCH];
+	struct blk_request *batch = NULL, **tail = &batch;
+	unsigned int nreqs = 0;
+	bool ok = true;
+
+	if (off >= f->size) return 0;
+	if (len > f->size - off) len = f->size - off;
+
+	size_t done = 0;
+	while (done < len && ok) {
+		uint64_t pos = off + done;
+		uint32_t disk, run;
+		if (fat_extent_find(f, pos >> v->cluster_shift, &disk, &run) <= 0) {
+			ok = false;
+			break;
+		}
+		uint64_t within = pos & (cluster_size - 1);
+		uint64_t dev_off = fat_cluster_offset(v, disk) + within;
+		uint64_t bytes = run * cluster_size - within;
+		if (bytes > len - done) bytes = len - done;
+		if (bytes > dev->max_len) bytes = dev->max_len;
+		char *dst = (char *)buf + done;
+
+		// Whole sectors of a run go to the device as one request, straight
+		// into the caller's buffer when the device can reach it. The rest
+		// is copied from the page cache.
+		if (!(dev_off % BLK_SECTOR_SIZE) && bytes >= BLK_SECTOR_SIZE &&
+			virt_is_ram(dst, bytes & ~(uint64_t)(BLK_SECTOR_SIZE - 1))) {
+			bytes &= ~(uint64_t)(BLK_SECTOR_SIZE - 1);
+			reqs[nreqs] = (struct blk_request){
+				.op = BLK_READ,
+				.sector = dev_off / BLK_SECTOR_SIZE,
+				.buf = dst,
+				.len = bytes,
+			};
+			*tail = &reqs[nreqs];
+			tail = &reqs[nreqs].next;
+			if (++nreqs == FAT_READ_BATCH) {
+				ok = blk_submit_wait(dev, batch) == BLK_OK;
+				batch = NULL;
+				tail = &batch;
+				nreqs = 0;
+			}
+		} else {
+			uint64_t page_left = PAGE_SIZE - (dev_off & (PAGE_SIZE - 1));
+			if (bytes > page_left) bytes = page_left;
+			ok = fat_copy(v, dev_off, dst, bytes);
+		}
+		done += bytes;
+	}
+	if (batch && blk_submit_wait(dev, batch) != BLK_OK) ok = false;
+	return ok ? (long)len : -1;
+}
+
+struct fat_readdir_state {
+	struct fat_volume *vol;
+	fat_filldir_t fn;
+	void *arg;
+};
+
+static bool fat_readdir_entry(void *arg, const struct fat_dirent *d) {
+	struct fat_readdir_state *s = arg;
+	struct fat_file f;
+	fat_open_entry(s->vol, d->cluster, d->size, d->attr, &f);
+	return s->fn(s->arg, d->name, d->len, &f);
+}
+
+bool fat_readdir(struct fat_file *dir, fat_filldir_t fn, void *arg) {
+	struct fat_readdir_state s = {dir->vol, fn, arg};
+	return fat_scan(dir, fat_readdir_entry, &s);
+}
+
+/* VFS inodes keep a fat_file that is never changed, and each open file a
+   copy of its own, which collects the extents as it is read. */
+static const struct inode_ops fat_inode_ops;
+
+static struct inode *fat_inode(const struct fat_file *f) {
+	struct fat_file *copy = pool_alloc(&fat_file_pool);
+	if (!copy) return NULL;
+	struct inode *inode = vfs_inode_alloc();
+	if (!inode) {
+		pool_free(&fat_file_pool, copy);
+		return NULL;
+	}
+	*copy = *f;
+	*inode = (struct inode){
+		.ops = &fat_inode_ops,
+		.size = f->size,
+		.dir = f->attr & FAT_ATTR_DIRECTORY,
+		.priv = copy,
+	};
+	return inode;
+}
+
+static int fat_vfs_lookup(struct inode *dir, const char *name, size_t len,
+						  struct inode **out) {
+	struct fat_file d = *(const struct fat_file *)dir->priv, f;
+	int r = fat_lookup(&d, name, len, &f);
+	if (r <= 0) return r ? -EIO : -ENOENT;
+	*out = fat_inode(&f);
+	return *out ? 0 : -ENOMEM;
+}
+
+/* The open file's own fat_file, made on first use so that opening takes no
+   lock. */
+static struct fat_file *fat_vfs_file(struct file *file) {
+	struct fat_file *f = __atomic_load_n(&file->priv, __ATOMIC_ACQUIRE);
+	if (f) return f;
+	f = pool_alloc(&fat_file_pool);
+	if (!f) return NULL;
+	*f = *(const struct fat_file *)file->inode->priv;
+
+	void *old = NULL;
+	if (__atomic_compare_exchange_n(&file->priv, &old, f, false,
+									__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return f;
+	pool_free(&fat_file_pool, f);
+	return old;
+}
+
+static void fat_vfs_release(struct file *file) {
+	if (file->priv) pool_free(&fat_file_pool, file->priv);
+}
+
+static long fat_vfs_read(struct file *file, uint64_t off, void *buf,
+						 size_t len) {
+	struct fat_file *f = fat_vfs_file(file);
+	if (!f) return -ENOMEM;
+	long n = fat_read(f, off, buf, len);
+	return n < 0 ? -EIO : n;
+}
+
+struct fat_vfs_readdir_state {
+	vfs_filldir_t fn;
+	void *arg;
+};
+
+static bool fat_vfs_filldir(void *arg, const char *name, size_t len,
+							const struct fat_file *f) {
+	struct fat_vfs_readdir_state *s = arg;
+	return s->fn(s->arg, name, len, f->attr & FAT_ATTR_DIRECTORY);
+}
+
+static void fat_vfs_forget(struct inode *inode) {
+	pool_free(&fat_file_pool, inode->priv);
+}
+
+static int fat_vfs_readdir(struct file *file, vfs_filldir_t fn, void *arg) {
+	struct fat_file *f = fat_vfs_file(file);
+	if (!f) return -ENOMEM;
+	struct fat_vfs_readdir_state s = {fn, arg};
+	return fat_readdir(f, fat_vfs_filldir, &s) ? 0 : -EIO;
+}
+
+static const struct inode_ops fat_inode_ops = {
+	.lookup = fat_vfs_lookup,
+	.release = fat_vfs_release,
+	.read = fat_vfs_read,
+	.readdir = fat_vfs_readdir,
+	.forget = fat_vfs_forget,
+};
+
+struct inode *fat_vfs_root(struct fat_volume *vol) {
+	struct fat_file root;
+	fat_root(vol, &root);
+	return fat_inode(&root);
+}
+
+static bool fat_is_bpb(const uint8_t *b) {
+	uint16_t bps = fat_le16(b + 11);
+	uint8_t spc = b[13];
+	return (b[0] == 0xeb || b[0] == 0xe9) && b[510] == 0x55 &&
+		   b[511] == 0xaa && bps >= BLK_SECTOR_SIZE && bps <= 4096 &&
+		   !(bps & (bps - 1)) && spc && !(spc & (spc - 1)) &&
+		   fat_le16(b + 14) && b[16];
+}
+
+/* Device byte offset of the volume: the device's start, or the first FAT
+   partition of an MBR. */
+static bool fat_find_volume(struct blk_device *dev, uint64_t *start) {
+	struct pcache_page *pg = pcache_get(dev, 0);
+	if (!pg) return false;
+	const uint8_t *s = pg->data;
+	bool found = false;
+
+	if (fat_is_bpb(s)) {
+		*start = 0;
+		found = true;
+	} else if (s[510] == 0x55 && s[511] == 0xaa) {
+		for (unsigned int i = 0; i < 4 && !found; i++) {
+			const uint8_t *p = s + 446 + i * 16;
+			if (!memchr(fat_mbr_types, p[4], sizeof(fat_mbr_types))) continue;
+			*start = (uint64_t)fat_le32(p + 8) * BLK_SECTOR_SIZE;
+			found = true;
+		}
+	}
+	pcache_put(pg);
+	return found;
+}
+
+struct fat_volume *fat_mount(struct blk_device *dev) {
+	uint64_t start;
+	if (!fat_find_volume(dev, &start)) return NULL;
+
+	// Sectors are aligned, so the boot sector lies within one page.
+	struct pcache_page *pg = pcache_get(dev, start >> PAGE_SHIFT);
+	if (!pg) return NULL;
+	uint8_t b[64];
+	const uint8_t *sector = (const uint8_t *)pg->data + (start & (PAGE_SIZE - 1));
+	bool valid = fat_is_bpb(sector);
+	memcpy(b, sector, sizeof(b));
+	pcache_put(pg);
+	if (!valid) return NULL;
+
+	uint32_t bps = fat_le16(b + 11);
+	uint32_t spc = b[13];
+	uint32_t reserved = fat_le16(b + 14);
+	uint32_t nfats = b[16];
+	uint32_t root_entries = fat_le16(b + 17);
+	uint32_t total = fat_le16(b + 19) ? fat_le16(b + 19) : fat_le32(b + 32);
+	uint32_t fat_size = fat_le16(b + 22) ? fat_le16(b + 22) : fat_le32(b + 36);
+	uint32_t root_sectors = (root_entries * FAT_DIRENT_SIZE + bps - 1) / bps;
+	uint64_t data = reserved + (uint64_t)nfats * fat_size + root_sectors;
+	if (total <= data) return NULL;
+	uint32_t clusters = (total - data) / spc;
+
+	// The cluster count alone decides the FAT type.
+	if (clusters < 4085) {
+		debug_printf("fat: %s: FAT12 is not supported\n", dev->name);
+		return NULL;
+	}
+	unsigned int bits = clusters < 65525 ? 16 : 32;
+	if ((uint64_t)fat_size * bps * 8 / bits < clusters + 2ull) return NULL;
+
+	struct fat_volume *v = pool_alloc(&fat_volume_pool);
+	if (!v) return NULL;
+	*v = (struct fat_volume){
+		.dev = dev,
+		.fat_bits = bits,
+		.cluster_shift = __builtin_ctz(bps * spc),
+		.clusters = clusters,
+		.fat_start = start + (uint64_t)reserved * bps,
+		.root_start = start + (reserved + (uint64_t)nfats * fat_size) * bps,
+		.data_start = start + data * bps,
+		.root_size = root_sectors * bps,
+		.root_cluster = bits == 32 ? fat_le32(b + 44) : 0,
+	};
+	debug_printf("fat: %s: FAT%u, %u clusters of %u KiB\n", dev->name, bits,
+				 clusters, bps * spc / 1024);
+	return v;
+}
+
+struct fat_volume *fat_volume_get(unsigned int index) {
+	return index < fat_volume_count ? fat_volumes[index] : NULL;
+}
+
+static void __init fat_init(void) {
+	struct blk_device *dev;
+	for (unsigned int i = 0; (dev = blk_get(i)); i++) {
+		struct fat_volume *v = fat_mount(dev);
+		if (v && fat_volume_count < FAT_VOLUMES_MAX)
+			fat_volumes[fat_volume_count++] = v;
+	}
+}
+
+INITCALL(fat, fat_init, "virtio_blk", "pcache");
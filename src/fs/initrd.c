@@ -0,0 +1,338 @@
+#include "initrd.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "debug.h"
+#include "errno.h"
+#include "init.h"
+#include "initcall.h"
+#include "limine/features.h"
+#include "pool.h"
+#include "string.h"
+#include "vfs.h"
+
+#define INITRD_BUCKETS 1024
+
+#define TAR_BLOCK 512
+#define TAR_NAME 0
+#define TAR_SIZE 124
+#define TAR_TYPE 156
+#define TAR_MAGIC 257
+#define TAR_PREFIX 345
+
+#define CPIO_HEADER 110
+#define CPIO_MODE 14
+#define CPIO_FILESIZE 54
+#define CPIO_NAMESIZE 94
+#define CPIO_S_IFMT 0170000
+#define CPIO_S_IFDIR 0040000
+#define CPIO_S_IFREG 0100000
+
+static struct pool initrd_pool = POOL_INIT(sizeof(struct initrd_node));
+static struct initrd_node *initrd_hash[INITRD_BUCKETS];
+static struct initrd_node initrd_root_node = {.name = "", .dir = true};
+static bool initrd_loaded;
+static unsigned long initrd_files;
+/* Entries that clash with others or climb out with "..". */
+static unsigned long initrd_skipped;
+
+static uint32_t initrd_hash_of(const struct initrd_node *dir, const char *name,
+							   size_t len) {
+	uint32_t h = 2166136261u ^ (uint32_t)((uintptr_t)dir >> 4);
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+struct initrd_node *initrd_root(void) {
+	return initrd_loaded ? &initrd_root_node : NULL;
+}
+
+struct initrd_node *initrd_lookup(struct initrd_node *dir, const char *name,
+								  size_t len) {
+	if (!dir->dir) return NULL;
+	struct initrd_node *n =
+		initrd_hash[initrd_hash_of(dir, name, len) % INITRD_BUCKETS];
+	for (; n; n = n->hash_next) {
+		if (n->parent == dir && n->len == len && !memcmp(n->name, name, len))
+			return n;
+	}
+	return NULL;
+}
+
+struct initrd_node *initrd_open(const char *path) {
+	struct initrd_node *n = initrd_root();
+	while (n && *path) {
+		if (*path == '/') {
+			path++;
+			continue;
+		}
+		size_t len = 0;
+		while (path[len] && path[len] != '/') len++;
+		n = initrd_lookup(n, path, len);
+		path += len;
+	}
+	return n;
+}
+
+static const struct inode_ops initrd_inode_ops;
+
+static struct inode *initrd_inode(struct initrd_node *n) {
+	struct inode *inode = vfs_inode_alloc();
+	if (!inode) return NULL;
+	*inode = (struct inode){
+		.ops = &initrd_inode_ops,
+		.size = n->size,
+		.dir = n->dir,
+		.data = n->data,
+		.priv = n,
+	};
+	return inode;
+}
+
+static int initrd_vfs_lookup(struct inode *dir, const char *name, size_t len,
+							 struct inode **out) {
+	struct initrd_node *n = initrd_lookup(dir->priv, name, len);
+	if (!n) return -ENOENT;
+	*out = initrd_inode(n);
+	return *out ? 0 : -ENOMEM;
+}
+
+static long initrd_vfs_read(struct file *f, uint64_t off, void *buf,
+							size_t len) {
+	memcpy(buf, (const char *)f->inode->data + off, len);
+	return len;
+}
+
+static int initrd_vfs_readdir(struct file *f, vfs_filldir_t fn, void *arg) {
+	const struct initrd_node *dir = f->inode->priv;
+	for (const struct initrd_node *n = dir->children; n; n = n->sibling) {
+		if (!fn(arg, n->name, n->len, n->dir)) break;
+	}
+	return 0;
+}
+
+static const struct inode_ops initrd_inode_ops = {
+	.lookup = initrd_vfs_lookup,
+	.read = initrd_vfs_read,
+	.readdir = initrd_vfs_readdir,
+};
+
+struct inode *initrd_vfs_root(void) {
+	struct initrd_node *root = initrd_root();
+	return root ? initrd_inode(root) : NULL;
+}
+
+/* Finds or adds the node for path below dir, with directories along the
+   way, and returns it. An empty path is dir itself. NULL without memory, if
+   a file is in the way or for "..". */
+static struct initrd_node *__init initrd_add(struct initrd_node *dir,
+											 const char *path, size_t len,
+											 bool is_dir) {
+	size_t i = 0;
+	while (dir && i < len) {
+		if (path[i] == '/') {
+			i++;
+			continue;
+		}
+		const char *name = path + i;
+		size_t n = 0;
+		while (i + n < len && name[n] != '/') n++;
+		i += n;
+		if (n == 1 && name[0] == '.') continue;
+		if (n == 2 && name[0] == '.' && name[1] == '.') return NULL;
+
+		bool last = true;
+		for (size_t j = i; j < len; j++) last &= path[j] == '/';
+		struct initrd_node *child = initrd_lookup(dir, name, n);
+		if (!child) {
+			child = pool_alloc(&initrd_pool);
+			if (!child) return NULL;
+			child->name = name;
+			child->len = n;
+			child->dir = !last || is_dir;
+			child->parent = dir;
+			child->sibling = dir->children;
+			dir->children = child;
+			struct initrd_node **bucket =
+				&initrd_hash[initrd_hash_of(dir, name, n) % INITRD_BUCKETS];
+			child->hash_next = *bucket;
+			*bucket = child;
+			if (!child->dir) initrd_files++;
+		}
+		if (!last && !child->dir) return NULL;
+		dir = child;
+	}
+	return dir;
+}
+
+static void __init initrd_add_file(struct initrd_node *dir, const char *path,
+								   size_t len, bool is_dir, const void *data,
+								   size_t size) {
+	struct initrd_node *n = initrd_add(dir, path, len, is_dir);
+	if (!n || n->dir != is_dir) {
+		initrd_skipped++;
+		return;
+	}
+	// A later copy of a file in the archive replaces an earlier one.
+	if (!is_dir) {
+		n->data = data;
+		n->size = size;
+	}
+}
+
+static size_t __init initrd_strnlen(const char *s, size_t max) {
+	const char *nul = memchr(s, 0, max);
+	return nul ? (size_t)(nul - s) : max;
+}
+
+static uint64_t __init initrd_octal(const char *s, size_t len) {
+	uint64_t v = 0;
+	// GNU tar stores large sizes in base 256, flagged by the top bit.
+	if ((uint8_t)s[0] & 0x80) {
+		for (size_t i = 1; i < len; i++) v = v << 8 | (uint8_t)s[i];
+		return v;
+	}
+	for (size_t i = 0; i < len && s[i] >= '0' && s[i] <= '7'; i++)
+		v = v * 8 + (s[i] - '0');
+	return v;
+}
+
+static uint64_t __init initrd_hex(const char *s) {
+	uint64_t v = 0;
+	for (size_t i = 0; i < 8; i++) {
+		char c = s[i];
+		unsigned int d = c >= '0' && c <= '9'	? c - '0'
+						 : c >= 'a' && c <= 'f' ? c - 'a' + 10
+						 : c >= 'A' && c <= 'F' ? c - 'A' + 10
+												: 0;
+		v = v * 16 + d;
+	}
+	return v;
+}
+
+static bool __init initrd_load_tar(const char *base, size_t size) {
+	size_t off = 0;
+	const char *long_name = NULL;
+	size_t long_len = 0;
+
+	while (size - off >= TAR_BLOCK) {
+		const char *h = base + off;
+		// The archive ends with zeroed blocks.
+		if (!h[TAR_NAME]) return true;
+		if (memcmp(h + TAR_MAGIC, "ustar", 5)) return false;
+
+		uint64_t fsize = initrd_octal(h + TAR_SIZE, 12);
+		const char *data = h + TAR_BLOCK;
+		off += TAR_BLOCK;
+		if (fsize > size - off) return false;
+		off += (fsize + TAR_BLOCK - 1) & ~(uint64_t)(TAR_BLOCK - 1);
+		if (off > size) off = size;
+
+		char type = h[TAR_TYPE];
+		if (type == 'L') {
+			// GNU long name for the entry that follows.
+			long_name = data;
+			long_len = initrd_strnlen(data, fsize);
+			continue;
+		}
+		bool is_dir = type == '5';
+		if (type && type != '0' && type != '7' && !is_dir) {
+			// Links, devices and pax headers.
+			long_name = NULL;
+			continue;
+		}
+
+		struct initrd_node *dir = &initrd_root_node;
+		const char *name = long_name;
+		size_t len = long_len;
+		if (!name) {
+			dir = initrd_add(dir, h + TAR_PREFIX,
+							 initrd_strnlen(h + TAR_PREFIX, 155), true);
+			name = h + TAR_NAME;
+			len = initrd_strnlen(name, 100);
+		}
+		long_name = NULL;
+		if (dir)
+			initrd_add_file(dir, name, len, is_dir, data, fsize);
+		else
+			initrd_skipped++;
+	}
+	return true;
+}
+
+static bool __init initrd_load_cpio(const char *base, size_t size) {
+	size_t off = 0;
+
+	while (size - off >= CPIO_HEADER) {
+		const char *h = base + off;
+		if (memcmp(h, "070701", 6) && memcmp(h, "070702", 6)) return false;
+
+		uint64_t mode = initrd_hex(h + CPIO_MODE);
+		uint64_t fsize = initrd_hex(h + CPIO_FILESIZE);
+		uint64_t namesize = initrd_hex(h + CPIO_NAMESIZE);
+		off += CPIO_HEADER;
+		if (!namesize || namesize > size - off) return false;
+		const char *name = base + off;
+		size_t len = namesize - 1;
+		off = (off + namesize + 3) & ~(size_t)3;
+		if (off > size || fsize > size - off) return false;
+		const char *data = base + off;
+		off = (off + fsize + 3) & ~(size_t)3;
+		if (off > size) off = size;
+
+		if (len == 10 && !memcmp(name, "TRAILER!!!", 10)) return true;
+		if ((mode & CPIO_S_IFMT) == CPIO_S_IFDIR)
+			initrd_add_file(&initrd_root_node, name, len, true, NULL, 0);
+		else if ((mode & CPIO_S_IFMT) == CPIO_S_IFREG)
+			initrd_add_file(&initrd_root_node, name, len, false, data, fsize);
+	}
+	return true;
+}
+
+static void __init initrd_init(void) {
+	struct limine_module_response *r = module_request.response;
+	if (!r) return;
+
+	// Modules stay where Limine put them, in memory the allocator never
+	// takes over. Only the file descriptions are in bootloader memory.
+	bool malformed = false;
+	for (uint64_t i = 0; i < r->module_count; i++) {
+		const struct limine_file *f = r->modules[i];
+		const char *base = f->address;
+		size_t size = f->size;
+		bool ok;
+		if (size >= TAR_BLOCK && !memcmp(base + TAR_MAGIC, "ustar", 5)) {
+			ok = initrd_load_tar(base, size);
+		} else if (size >= CPIO_HEADER && (!memcmp(base, "070701", 6) ||
+										   !memcmp(base, "070702", 6))) {
+			ok = initrd_load_cpio(base, size);
+		} else {
+			debug_printf("initrd: %s: not a tar or cpio archive\n", f->path);
+			continue;
+		}
+		if (!ok) {
+			debug_printf("initrd: %s: malformed archive\n", f->path);
+			malformed = true;
+			continue;
+		}
+		debug_printf("initrd: %s, %lu KiB\n", f->path,
+					 (unsigned long)(size >> 10));
+		initrd_loaded = true;
+	}
+	// The index holds whatever came before the damage, and nodes cannot be
+	// taken back out; an initrd that silently lacks files is worse than
+	// none.
+	if (malformed) {
+		debug_printf("initrd: not mounted\n");
+		initrd_loaded = false;
+	}
+	if (initrd_loaded)
+		debug_printf("initrd: %lu files, %lu entries skipped\n", initrd_files,
+					 initrd_skipped);
+}
+
+INITCALL(initrd, initrd_init, "pmm_pages");
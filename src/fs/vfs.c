@@ -0,0 +1,468 @@
+#include "vfs.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache.h"
+#include "debug.h"
+#include "errno.h"
+#include "fat.h"
+#include "hart.h"
+#include "init.h"
+#include "initcall.h"
+#include "initrd.h"
+#include "pmm.h"
+#include "pool.h"
+#include "string.h"
+#include "trap.h"
+
+#define VFS_DCACHE_BUCKETS 4096
+/* Negative dentries kept at most, so that looking up made-up names cannot
+   use up memory. */
+#define VFS_NEGATIVE_MAX 4096
+/* Free files each hart keeps for itself. */
+#define VFS_FILE_CACHE 16
+
+static struct pool vfs_inode_pool = POOL_INIT(sizeof(struct inode));
+static struct pool vfs_dentry_pool = POOL_INIT(sizeof(struct dentry));
+static struct pool vfs_name_pool = POOL_INIT(VFS_NAME_MAX + 1);
+static struct pool vfs_mount_pool = POOL_INIT(sizeof(struct mount));
+static struct pool vfs_file_pool = POOL_INIT(sizeof(struct file));
+
+/* Serializes additions to the dcache and the mount table. Lookups do not
+   take it. */
+static spinlock_t vfs_lock = SPINLOCK_INIT;
+static struct dentry *vfs_dcache[VFS_DCACHE_BUCKETS];
+static unsigned int vfs_negative_count;
+static struct mount *vfs_root_mount;
+
+/* Open and close touch only the calling hart's list, with interrupts off,
+   instead of the file pool's lock. */
+static struct vfs_file_cache {
+	struct file *free;
+	unsigned int count;
+} vfs_file_caches[HART_MAX];
+
+struct inode *vfs_inode_alloc(void) {
+	return pool_alloc(&vfs_inode_pool);
+}
+
+static void vfs_inode_forget(struct inode *inode) {
+	if (inode->ops->forget) inode->ops->forget(inode);
+	pool_free(&vfs_inode_pool, inode);
+}
+
+static uint32_t vfs_hash(const struct dentry *parent, const char *name,
+						 size_t len) {
+	uint32_t h = 2166136261u ^ (uint32_t)((uintptr_t)parent >> 4);
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static bool d_match(const struct dentry *d, const struct dentry *parent,
+					uint32_t hash, const char *name, size_t len) {
+	return d->hash == hash && d->parent == parent && d->len == len &&
+		   !memcmp(d->name, name, len);
+}
+
+/* The lockless side: entries are complete before they are linked in, and
+   stay where they are forever. */
+static struct dentry *d_lookup(const struct dentry *parent, uint32_t hash,
+							   const char *name, size_t len) {
+	struct dentry *d = __atomic_load_n(&vfs_dcache[hash % VFS_DCACHE_BUCKETS],
+									   __ATOMIC_ACQUIRE);
+	for (; d; d = d->hash_next) {
+		// The next entry loads while this one's name is compared.
+		prefetch_read(d->hash_next);
+		if (d_match(d, parent, hash, name, len)) return d;
+	}
+	return NULL;
+}
+
+static struct dentry *d_alloc(struct dentry *parent, uint32_t hash,
+							  const char *name, size_t len,
+							  struct inode *inode) {
+	struct dentry *d = pool_alloc(&vfs_dentry_pool);
+	if (!d) return NULL;
+	char *copy = d->iname;
+	if (len >= VFS_NAME_INLINE) {
+		copy = pool_alloc(&vfs_name_pool);
+		if (!copy) {
+			pool_free(&vfs_dentry_pool, d);
+			return NULL;
+		}
+	}
+	memcpy(copy, name, len);
+	copy[len] = '\0';
+	d->name = copy;
+	d->len = len;
+	d->hash = hash;
+	d->parent = parent;
+	d->inode = inode;
+	return d;
+}
+
+static void d_free(struct dentry *d) {
+	if (d->name != d->iname) pool_free(&vfs_name_pool, (void *)d->name);
+	pool_free(&vfs_dentry_pool, d);
+}
+
+/* Links d into the dcache, unless a racing lookup added the same name
+   first. Returns the dentry that is in the table. */
+static struct dentry *d_add(struct dentry *d) {
+	struct dentry **bucket = &vfs_dcache[d->hash % VFS_DCACHE_BUCKETS];
+
+	bool irq = spin_lock_irqsave(&vfs_lock);
+	struct dentry *old = d_lookup(d->parent, d->hash, d->name, d->len);
+	if (!old) {
+		if (!d->inode) vfs_negative_count++;
+		d->hash_next = *bucket;
+		__atomic_store_n(bucket, d, __ATOMIC_RELEASE);
+	}
+	spin_unlock_irqrestore(&vfs_lock, irq);
+
+	if (!old) return d;
+	d_free(d);
+	return old;
+}
+
+/* Finds the dentry for name in the directory parent, asking the file system
+   on a miss. The result may be negative. Without keep_negative, names that
+   do not exist may get no dentry once there are enough negative ones, and
+   the result is -ENOENT. */
+static int d_child(struct dentry *parent, const char *name, size_t len,
+				   bool keep_negative, struct dentry **out) {
+	uint32_t hash = vfs_hash(parent, name, len);
+	struct dentry *d = d_lookup(parent, hash, name, len);
+	if (d) {
+		*out = d;
+		return 0;
+	}
+
+	struct inode *dir = parent->inode, *inode = NULL;
+	int err = dir ? dir->ops->lookup(dir, name, len, &inode) : -ENOENT;
+	if (err && err != -ENOENT) return err;
+	if (err && !keep_negative &&
+		__atomic_load_n(&vfs_negative_count, __ATOMIC_RELAXED) >=
+			VFS_NEGATIVE_MAX)
+		return -ENOENT;
+
+	if (err) inode = NULL;
+	d = d_alloc(parent, hash, name, len, inode);
+	if (!d) {
+		if (inode) vfs_inode_forget(inode);
+		return -ENOMEM;
+	}
+	*out = d_add(d);
+	// The name went to a racing lookup; nothing else saw this inode.
+	if (*out != d && inode) vfs_inode_forget(inode);
+	return 0;
+}
+
+/* Crosses into whatever is mounted on d. */
+static struct dentry *vfs_follow(struct dentry *d) {
+	struct mount *m;
+	while ((m = __atomic_load_n(&d->mounted, __ATOMIC_ACQUIRE))) d = m->root;
+	return d;
+}
+
+static struct dentry *vfs_up(struct dentry *d) {
+	while (d->mount && d->mount->mountpoint) d = d->mount->mountpoint;
+	return d->parent ? vfs_follow(d->parent) : d;
+}
+
+/* Walks the first len bytes of an absolute path to a positive dentry. */
+static int vfs_walk(const char *path, size_t len, struct dentry **out) {
+	struct mount *root = __atomic_load_n(&vfs_root_mount, __ATOMIC_ACQUIRE);
+	if (!root) return -ENOENT;
+	struct dentry *d = vfs_follow(root->root);
+
+	size_t i = 0;
+	while (i < len) {
+		if (path[i] == '/') {
+			i++;
+			continue;
+		}
+		const char *name = path + i;
+		size_t n = 0;
+		while (i + n < len && name[n] != '/') n++;
+		i += n;
+
+		if (n == 1 && name[0] == '.') continue;
+		if (n == 2 && name[0] == '.' && name[1] == '.') {
+			d = vfs_up(d);
+			continue;
+		}
+		if (!d->inode->dir) return -ENOTDIR;
+		if (n > VFS_NAME_MAX) return -ENAMETOOLONG;
+
+		struct dentry *child;
+		int err = d_child(d, name, n, false, &child);
+		if (err) return err;
+		child = vfs_follow(child);
+		if (!child->inode) return -ENOENT;
+		d = child;
+	}
+	*out = d;
+	return 0;
+}
+
+int vfs_mount(const char *path, struct inode *root) {
+	if (!root->dir) return -ENOTDIR;
+
+	size_t len = strlen(path);
+	while (len && path[len - 1] == '/') len--;
+	size_t start = len;
+	while (start && path[start - 1] != '/') start--;
+
+	struct dentry *mountpoint = NULL;
+	if (len) {
+		struct dentry *parent;
+		int err = vfs_walk(path, start, &parent);
+		if (!err && !parent->inode->dir) err = -ENOTDIR;
+		if (!err && len - start > VFS_NAME_MAX) err = -ENAMETOOLONG;
+		if (!err)
+			err = d_child(parent, path + start, len - start, true, &mountpoint);
+		if (err) return err;
+	}
+
+	struct mount *m = pool_alloc(&vfs_mount_pool);
+	struct dentry *d = d_alloc(NULL, 0, "/", 1, root);
+	if (!m || !d) {
+		if (m) pool_free(&vfs_mount_pool, m);
+		if (d) d_free(d);
+		return -ENOMEM;
+	}
+	d->mount = m;
+	m->root = d;
+	m->mountpoint = mountpoint;
+
+	int err = 0;
+	bool irq = spin_lock_irqsave(&vfs_lock);
+	struct mount **slot = mountpoint ? &mountpoint->mounted : &vfs_root_mount;
+	if (*slot)
+		err = -EBUSY;
+	else
+		__atomic_store_n(slot, m, __ATOMIC_RELEASE);
+	spin_unlock_irqrestore(&vfs_lock, irq);
+
+	if (err) {
+		d_free(d);
+		pool_free(&vfs_mount_pool, m);
+	}
+	return err;
+}
+
+int vfs_lookup(const char *path, struct inode **out) {
+	struct dentry *d;
+	int err = vfs_walk(path, strlen(path), &d);
+	if (!err) *out = d->inode;
+	return err;
+}
+
+static struct file *vfs_file_alloc(void) {
+	bool irq = local_irq_save();
+	struct vfs_file_cache *c = &vfs_file_caches[hart_index()];
+	struct file *f = c->free;
+	if (f) {
+		c->free = f->next_free;
+		c->count--;
+	}
+	local_irq_restore(irq);
+
+	if (!f) return pool_alloc(&vfs_file_pool);
+	memset(f, 0, sizeof(*f));
+	return f;
+}
+
+static void vfs_file_free(struct file *f) {
+	bool irq = local_irq_save();
+	struct vfs_file_cache *c = &vfs_file_caches[hart_index()];
+	bool cached = c->count < VFS_FILE_CACHE;
+	if (cached) {
+		f->next_free = c->free;
+		c->free = f;
+		c->count++;
+	}
+	local_irq_restore(irq);
+
+	if (!cached) pool_free(&vfs_file_pool, f);
+}
+
+int vfs_open_inode(struct inode *inode, struct file **out) {
+	struct file *f = vfs_file_alloc();
+	if (!f) return -ENOMEM;
+	f->inode = inode;
+	f->refs = 1;
+	int err;
+	if (inode->ops->open && (err = inode->ops->open(f))) {
+		vfs_file_free(f);
+		return err;
+	}
+	*out = f;
+	return 0;
+}
+
+int vfs_open(const char *path, struct file **out) {
+	struct inode *inode;
+	int err = vfs_lookup(path, &inode);
+	if (err) return err;
+	return vfs_open_inode(inode, out);
+}
+
+void vfs_file_get(struct file *f) {
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+void vfs_close(struct file *f) {
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL)) return;
+	if (f->inode->ops->release) f->inode->ops->release(f);
+	vfs_file_free(f);
+}
+
+long vfs_pread(struct file *f, uint64_t off, void *buf, size_t len) {
+	struct inode *inode = f->inode;
+	if (inode->dir) return -EISDIR;
+	if (inode->stream) return len ? inode->ops->read(f, off, buf, len) : 0;
+	if (off >= inode->size || !len) return 0;
+	if (len > inode->size - off) len = inode->size - off;
+	return inode->ops->read(f, off, buf, len);
+}
+
+long vfs_read(struct file *f, void *buf, size_t len) {
+	long n = vfs_pread(f, f->pos, buf, len);
+	if (n > 0) f->pos += n;
+	return n;
+}
+
+long vfs_write(struct file *f, const void *buf, size_t len) {
+	if (!f->inode->ops->write) return -EBADF;
+	if (!len) return 0;
+	return f->inode->ops->write(f, buf, len);
+}
+
+int vfs_readdir(struct file *f, vfs_filldir_t fn, void *arg) {
+	if (!f->inode->dir) return -ENOTDIR;
+	return f->inode->ops->readdir(f, fn, arg);
+}
+
+int vfs_get_page(struct file *f, uint64_t index, struct page **out) {
+	struct inode *inode = f->inode;
+	if (inode->dir) return -EISDIR;
+	if (index >= (inode->size + PAGE_SIZE - 1) >> PAGE_SHIFT) return -EINVAL;
+
+	bool irq = spin_lock_irqsave(&inode->pages_lock);
+	struct page *pg = radix_lookup(&inode->pages, index);
+	if (pg) page_get(pg);
+	spin_unlock_irqrestore(&inode->pages_lock, irq);
+	if (pg) {
+		*out = pg;
+		return 0;
+	}
+
+	void *data = pmm_alloc_zeroed(0);
+	if (!data) return -ENOMEM;
+	long n = vfs_pread(f, index << PAGE_SHIFT, data, PAGE_SIZE);
+	if (n < 0) {
+		pmm_free(data, 0);
+		return n;
+	}
+	// One reference for the inode, one for the caller.
+	pg = virt_to_page(data);
+	page_ref_init(pg);
+	page_get(pg);
+
+	// Someone else may have read the page meanwhile.
+	irq = spin_lock_irqsave(&inode->pages_lock);
+	struct page *old = radix_lookup(&inode->pages, index);
+	bool added = !old && radix_insert(&inode->pages, index, pg);
+	if (old) page_get(old);
+	spin_unlock_irqrestore(&inode->pages_lock, irq);
+	if (!added) {
+		pmm_free(data, 0);
+		if (!old) return -ENOMEM;
+		pg = old;
+	}
+	*out = pg;
+	return 0;
+}
+
+int fd_install(struct fdtable *t, struct file *f) {
+	int fd = -EMFILE;
+	bool irq = spin_lock_irqsave(&t->lock);
+	for (int i = 0; i < FD_MAX; i++) {
+		if (t->files[i]) continue;
+		t->files[i] = f;
+		fd = i;
+		break;
+	}
+	spin_unlock_irqrestore(&t->lock, irq);
+	return fd;
+}
+
+void fd_copy(struct fdtable *dst, struct fdtable *src) {
+	bool irq = spin_lock_irqsave(&src->lock);
+	for (int i = 0; i < FD_MAX; i++) {
+		struct file *f = src->files[i];
+		if (f) vfs_file_get(f);
+		dst->files[i] = f;
+	}
+	spin_unlock_irqrestore(&src->lock, irq);
+}
+
+struct file *fd_get(struct fdtable *t, int fd) {
+	if (fd < 0 || fd >= FD_MAX) return NULL;
+	bool irq = spin_lock_irqsave(&t->lock);
+	struct file *f = t->files[fd];
+	if (f) vfs_file_get(f);
+	spin_unlock_irqrestore(&t->lock, irq);
+	return f;
+}
+
+int fd_close(struct fdtable *t, int fd) {
+	if (fd < 0 || fd >= FD_MAX) return -EBADF;
+	bool irq = spin_lock_irqsave(&t->lock);
+	struct file *f = t->files[fd];
+	t->files[fd] = NULL;
+	spin_unlock_irqrestore(&t->lock, irq);
+	if (!f) return -EBADF;
+	vfs_close(f);
+	return 0;
+}
+
+static int vfs_empty_lookup(struct inode *dir, const char *name, size_t len,
+							struct inode **out) {
+	(void)dir, (void)name, (void)len, (void)out;
+	return -ENOENT;
+}
+
+static int vfs_empty_readdir(struct file *f, vfs_filldir_t fn, void *arg) {
+	(void)f, (void)fn, (void)arg;
+	return 0;
+}
+
+/* The root directory when there is no initrd, to mount other file systems
+   on. */
+static const struct inode_ops vfs_empty_ops = {
+	.lookup = vfs_empty_lookup,
+	.readdir = vfs_empty_readdir,
+};
+
+static struct inode vfs_empty_root = {.ops = &vfs_empty_ops, .dir = true};
+
+static void __init vfs_init(void) {
+	struct inode *root = initrd_vfs_root();
+	if (vfs_mount("/", root ? root : &vfs_empty_root))
+		panic("vfs: cannot mount the root\n");
+	debug_printf("vfs: / from %s\n", root ? "the initrd" : "nothing");
+
+	struct fat_volume *boot = fat_volume_get(0);
+	struct inode *boot_root = boot ? fat_vfs_root(boot) : NULL;
+	if (boot_root && !vfs_mount("/boot", boot_root))
+		debug_printf("vfs: /boot from %s\n", boot->dev->name);
+}
+
+INITCALL(vfs, vfs_init, "initrd", "fat");
@@ -0,0 +1,20 @@
+#include "hart.h"
+
+#include <stddef.h>
+
+#include "init.h"
+#include "limine/features.h"
+
+struct hart harts[HART_MAX];
+unsigned int hart_count;
+
+void __init hart_init_boot(void) {
+	struct hart *h = &harts[0];
+
+	h->index = 0;
+	if (riscv_bsp_hartid_request.response)
+		h->hartid = riscv_bsp_hartid_request.response->bsp_hartid;
+	hart_count = 1;
+
+	hart_set_self(h);
+}
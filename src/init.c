@@ -2,15 +2,92 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "bench.h"
+#include "boottime.h"
+#include "clock.h"
+#include "cmdline.h"
 #include "debug.h"
+#include "dispatch.h"
+#include "fdt.h"
+#include "hart.h"
+#include "init.h"
+#include "initcall.h"
+#include "isa.h"
 #include "limine/features.h"
+#include "perf.h"
+#include "plic.h"
+#include "pmm.h"
+#include "proc.h"
+#include "prof.h"
 #include "sbi.h"
+#include "sched.h"
+#include "smp.h"
+#include "trace.h"
+#include "trap.h"
+#include "vmm.h"
+
+/* Everything up to the point where init memory can be reclaimed. */
+static void __init boot(void) {
+	boottime_start();
+	limine_save_responses();
+	hart_init_boot();
+	trap_init();
+	cmdline_init();
+	boottime_mark("early");
+
+	sbi_init();
+	sbi_print_info();
+	boottime_mark("sbi");
+
+	if (!fdt_init()) debug_printf("fdt: no device tree\n");
+	clock_init();
+	boottime_mark("fdt");
+
+	isa_init();
+	isa_hart_init();
+	dispatch_init();
+	boottime_mark("isa");
+
+	perf_init();
+	perf_print_counters();
+	trace_init();
+	boottime_mark("perf");
+
+	vmm_init();
+	boottime_mark("vmm");
+
+	sched_init_hart();
+	plic_hart_init();
+	smp_init();
+	boottime_mark("smp");
+	initcall_run();
+	boottime_mark("initcalls");
+
+	boottime_print();
+	initcall_print();
+}
 
 void init(void) {
 	int i;
 	i = 4;
 	i = i + 1;
-	sbi_init();
+	boot();
+	init_reclaim();
+	pmm_print();
+
+	unsigned long prof_period = cmdline_get_ulong("profile", 0);
+	if (prof_period && prof_start(prof_period))
+		debug_printf("prof: sampling unavailable\n");
+
+	bench_run_requested();
+	proc_run_init();
+
+	trace_dump();
+
+	if (prof_period) {
+		prof_stop();
+		prof_dump();
+	}
 
 	if (limine_base_revision[2] == 3)
 		early_panic("Limine failed to provide revision 3");
@@ -0,0 +1,167 @@
+#include "initcall.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "clock.h"
+#include "csr.h"
+#include "debug.h"
+#include "hart.h"
+#include "init.h"
+#include "spinlock.h"
+#include "string.h"
+
+enum {
+	INITCALL_PENDING,
+	INITCALL_RUNNING,
+	INITCALL_DONE,
+};
+
+extern struct initcall __initcalls_start[], __initcalls_end[];
+
+static uint64_t initcall_begin __initdata;
+
+#define for_each_initcall(ic) \
+	for (struct initcall *ic = __initcalls_start; ic < __initcalls_end; ic++)
+
+static struct initcall *__init initcall_find(const char *name) {
+	for_each_initcall(ic) {
+		if (!strcmp(ic->name, name)) return ic;
+	}
+	return NULL;
+}
+
+void __init initcall_prepare(void) {
+	for_each_initcall(ic) {
+		unsigned int n = 0;
+		for (const char *const *d = ic->dep_names; *d; d++) {
+			if (n == INITCALL_DEPS_MAX)
+				panic("initcall %s: too many dependencies\n", ic->name);
+			ic->deps[n] = initcall_find(*d);
+			if (!ic->deps[n])
+				panic("initcall %s: unknown dependency %s\n", ic->name, *d);
+			n++;
+		}
+		ic->state = INITCALL_PENDING;
+		ic->nparts = ic->fn_part ? hart_count * 4 : 1;
+	}
+
+	// Order once with the state field as a visited mark, to reject cycles
+	// now rather than having every hart spin forever.
+	unsigned int left = __initcalls_end - __initcalls_start;
+	bool progress = true;
+	while (left && progress) {
+		progress = false;
+		for_each_initcall(ic) {
+			if (ic->state == INITCALL_DONE) continue;
+			bool ready = true;
+			for (unsigned int i = 0; i < INITCALL_DEPS_MAX && ic->deps[i]; i++)
+				ready &= ic->deps[i]->state == INITCALL_DONE;
+			if (ready) {
+				ic->state = INITCALL_DONE;
+				left--;
+				progress = true;
+			}
+		}
+	}
+	for_each_initcall(ic) {
+		if (ic->state != INITCALL_DONE)
+			panic("initcall %s: dependency cycle\n", ic->name);
+		ic->state = INITCALL_PENDING;
+	}
+
+	initcall_begin = rdtime();
+}
+
+static bool __init initcall_ready(struct initcall *ic) {
+	for (unsigned int i = 0; i < INITCALL_DEPS_MAX && ic->deps[i]; i++) {
+		if (__atomic_load_n(&ic->deps[i]->state, __ATOMIC_ACQUIRE) !=
+			INITCALL_DONE)
+			return false;
+	}
+	return true;
+}
+
+static void __init initcall_finish(struct initcall *ic) {
+	ic->end = rdtime();
+	__atomic_store_n(&ic->state, INITCALL_DONE, __ATOMIC_RELEASE);
+}
+
+/* Runs ic, or one part of it. Returns false if there was nothing left to
+   take. */
+static bool __init initcall_try_run(struct initcall *ic) {
+	unsigned long me = 1ul << hart_index();
+
+	if (!ic->fn_part) {
+		unsigned int expected = INITCALL_PENDING;
+		if (!__atomic_compare_exchange_n(&ic->state, &expected,
+										 INITCALL_RUNNING, false,
+										 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return false;
+		ic->start = rdtime();
+		ic->hart_mask = me;
+		ic->fn();
+		initcall_finish(ic);
+		return true;
+	}
+
+	if (__atomic_load_n(&ic->next_part, __ATOMIC_RELAXED) >= ic->nparts)
+		return false;
+	unsigned int part = __atomic_fetch_add(&ic->next_part, 1, __ATOMIC_ACQUIRE);
+	if (part >= ic->nparts) return false;
+	if (part == 0) {
+		ic->start = rdtime();
+		__atomic_store_n(&ic->state, INITCALL_RUNNING, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_or(&ic->hart_mask, me, __ATOMIC_RELAXED);
+	ic->fn_part(part, ic->nparts);
+	if (__atomic_add_fetch(&ic->parts_done, 1, __ATOMIC_ACQ_REL) == ic->nparts)
+		initcall_finish(ic);
+	return true;
+}
+
+void __init initcall_run(void) {
+	for (;;) {
+		bool all_done = true, ran = false;
+		for_each_initcall(ic) {
+			if (__atomic_load_n(&ic->state, __ATOMIC_ACQUIRE) == INITCALL_DONE)
+				continue;
+			all_done = false;
+			if (initcall_ready(ic) && initcall_try_run(ic)) {
+				ran = true;
+				// Rescan from the start, so earlier declared initcalls go
+				// first whenever they become ready.
+				break;
+			}
+		}
+		if (all_done) return;
+		if (!ran) cpu_relax();
+	}
+}
+
+void __init initcall_print(void) {
+	struct initcall *last = NULL;
+	for_each_initcall(ic) {
+		debug_printf("boot: initcall %-12s +%8lu us %8lu us, %u harts\n",
+					 ic->name, clock_ticks_to_us(ic->start - initcall_begin),
+					 clock_ticks_to_us(ic->end - ic->start),
+					 __builtin_popcountl(ic->hart_mask));
+		if (!last || ic->end > last->end) last = ic;
+	}
+	if (!last) return;
+
+	// Walk back from whatever finished last through the dependency that
+	// finished last; that chain is what held up the end of boot.
+	debug_printf("boot: critical path %lu us:",
+				 clock_ticks_to_us(last->end - initcall_begin));
+	for (struct initcall *ic = last; ic;) {
+		debug_printf(" %s", ic->name);
+		struct initcall *prev = NULL;
+		for (unsigned int i = 0; i < INITCALL_DEPS_MAX && ic->deps[i]; i++) {
+			if (!prev || ic->deps[i]->end > prev->end) prev = ic->deps[i];
+		}
+		if (prev) debug_printf(" <-");
+		ic = prev;
+	}
+	debug_printf("\n");
+}
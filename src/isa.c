@@ -0,0 +1,133 @@
+#include "isa.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "csr.h"
+#include "debug.h"
+#include "fdt.h"
+#include "init.h"
+#include "string.h"
+
+unsigned long isa_extensions;
+unsigned int isa_cboz_block_size = 64;
+
+static const char *const isa_ext_names[ISA_EXT_COUNT] = {
+	[ISA_EXT_V] = "v",			 [ISA_EXT_ZBA] = "zba",
+	[ISA_EXT_ZBB] = "zbb",		 [ISA_EXT_ZICBOM] = "zicbom",
+	[ISA_EXT_ZICBOP] = "zicbop", [ISA_EXT_ZICBOZ] = "zicboz",
+};
+
+/* Extensions the configuration lets the kernel assume. */
+static const unsigned long isa_required =
+#ifdef CONFIG_ARCH_RV64GCV
+	ISA_BIT(ISA_EXT_V) |
+#endif
+#ifdef CONFIG_ARCH_ZBA
+	ISA_BIT(ISA_EXT_ZBA) |
+#endif
+#ifdef CONFIG_ARCH_ZBB
+	ISA_BIT(ISA_EXT_ZBB) |
+#endif
+#ifdef CONFIG_ARCH_ZICBOM
+	ISA_BIT(ISA_EXT_ZICBOM) |
+#endif
+#ifdef CONFIG_ARCH_ZICBOZ
+	ISA_BIT(ISA_EXT_ZICBOZ) |
+#endif
+	0;
+
+static unsigned long __init isa_lookup(const char *name, size_t len) {
+	for (unsigned int i = 0; i < ISA_EXT_COUNT; i++) {
+		if (strlen(isa_ext_names[i]) == len &&
+			!strncmp(isa_ext_names[i], name, len))
+			return ISA_BIT(i);
+	}
+	return 0;
+}
+
+/* Parses a riscv,isa string such as "rv64imafdcv_zba_zbb_zicboz". Single
+   letters come first; multi-letter names start with z, s or x and are
+   separated by underscores. */
+static unsigned long __init isa_parse_string(const char *isa) {
+	unsigned long exts = 0;
+	if (strncmp(isa, "rv64", 4)) return 0;
+
+	const char *p = isa + 4;
+	while (*p && *p != '_' && *p != 'z' && *p != 's' && *p != 'x')
+		exts |= isa_lookup(p++, 1);
+	while (*p) {
+		if (*p == '_') {
+			p++;
+			continue;
+		}
+		size_t len = 0;
+		while (p[len] && p[len] != '_') len++;
+		exts |= isa_lookup(p, len);
+		p += len;
+	}
+	return exts;
+}
+
+/* Extensions of one cpu node. The riscv,isa-extensions string list replaces
+   riscv,isa in newer DTBs. */
+static unsigned long __init isa_parse_cpu(int cpu) {
+	uint32_t len;
+	const char *list = fdt_getprop(cpu, "riscv,isa-extensions", &len);
+	if (list) {
+		unsigned long exts = 0;
+		for (const char *end = list + len; list < end;
+			 list += strlen(list) + 1)
+			exts |= isa_lookup(list, strlen(list));
+		return exts;
+	}
+
+	const char *isa = fdt_getprop(cpu, "riscv,isa", NULL);
+	return isa ? isa_parse_string(isa) : 0;
+}
+
+static void __init isa_block_size(int cpu, const char *prop,
+								  unsigned int *size) {
+	uint32_t v;
+	if (fdt_getprop_u32(cpu, prop, &v) && v && v < *size) *size = v;
+}
+
+void __init isa_init(void) {
+	unsigned long exts = -1ul;
+	unsigned int cpus_seen = 0;
+	unsigned int cboz = -1u;
+
+	int cpus = fdt_path_offset("/cpus");
+	for (int cpu = cpus < 0 ? -1 : fdt_first_child(cpus); cpu >= 0;
+		 cpu = fdt_next_sibling(cpu)) {
+		const char *type = fdt_getprop(cpu, "device_type", NULL);
+		const char *status = fdt_getprop(cpu, "status", NULL);
+		if (!type || strcmp(type, "cpu")) continue;
+		if (status && strcmp(status, "okay") && strcmp(status, "ok")) continue;
+
+		exts &= isa_parse_cpu(cpu);
+		isa_block_size(cpu, "riscv,cboz-block-size", &cboz);
+		cpus_seen++;
+	}
+
+	// Without a DTB, trust the configuration.
+	isa_extensions = cpus_seen ? exts : isa_required;
+	if (cboz != -1u) isa_cboz_block_size = cboz;
+
+	debug_printf("isa: rv64gc");
+	for (unsigned int i = 0; i < ISA_EXT_COUNT; i++) {
+		if (isa_has(i)) debug_printf(" %s", isa_ext_names[i]);
+	}
+	debug_printf("\n");
+
+	unsigned long missing = isa_required & ~isa_extensions;
+	if (missing)
+		panic("isa: kernel requires %s, which not every hart has\n",
+			  isa_ext_names[__builtin_ctzl(missing)]);
+}
+
+void __init isa_hart_init(void) {
+	// Vector state is never saved, so VS stays off except inside the
+	// routines that use it, see string_v.S, whatever the firmware left.
+	csr_clear(sstatus, SSTATUS_VS);
+}
@@ -0,0 +1,26 @@
+#include "bitops.h"
+
+#include "dispatch.h"
+
+#ifndef CONFIG_ARCH_ZBB
+
+DISPATCH(bit_ctz, bit_ctz_generic);
+DISPATCH(bit_clz, bit_clz_generic);
+
+#ifdef ISA_BUILD_ZBB
+unsigned int bit_ctz_zbb(unsigned long x);
+unsigned int bit_clz_zbb(unsigned long x);
+DISPATCH_VARIANT(bit_ctz, bit_ctz_zbb, ISA_BIT(ISA_EXT_ZBB), 1);
+DISPATCH_VARIANT(bit_clz, bit_clz_zbb, ISA_BIT(ISA_EXT_ZBB), 1);
+#endif
+
+/* Without Zbb the compiler expands these into a few dozen instructions. */
+__attribute__((used)) unsigned int bit_ctz_generic(unsigned long x) {
+	return __builtin_ctzl(x);
+}
+
+__attribute__((used)) unsigned int bit_clz_generic(unsigned long x) {
+	return __builtin_clzl(x);
+}
+
+#endif
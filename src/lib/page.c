@@ -0,0 +1,14 @@
+#include "dispatch.h"
+#include "pmm.h"
+#include "string.h"
+
+DISPATCH(zero_page, zero_page_generic);
+
+#ifdef ISA_BUILD_ZICBOZ
+void zero_page_zicboz(void *page);
+DISPATCH_VARIANT(zero_page, zero_page_zicboz, ISA_BIT(ISA_EXT_ZICBOZ), 1);
+#endif
+
+__attribute__((used)) void zero_page_generic(void *page) {
+	memset(page, 0, PAGE_SIZE);
+}
@@ -0,0 +1,132 @@
+#include "printf.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "string.h"
+
+struct outbuf {
+	char *buf;
+	size_t n;
+	size_t len;
+};
+
+static void out_char(struct outbuf *o, char c) {
+	if (o->len + 1 < o->n) o->buf[o->len] = c;
+	o->len++;
+}
+
+static void out_pad(struct outbuf *o, char c, int count) {
+	while (count-- > 0) out_char(o, c);
+}
+
+static void out_number(struct outbuf *o, unsigned long long v, bool negative,
+					   unsigned base, bool upper, int width, bool left,
+					   bool zero) {
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char tmp[24];
+	int i = 0;
+
+	do {
+		tmp[i++] = digits[v % base];
+		v /= base;
+	} while (v);
+
+	int len = i + negative;
+	if (!left && !zero) out_pad(o, ' ', width - len);
+	if (negative) out_char(o, '-');
+	if (!left && zero) out_pad(o, '0', width - len);
+	while (i) out_char(o, tmp[--i]);
+	if (left) out_pad(o, ' ', width - len);
+}
+
+int vsnprintf(char *buf, size_t n, const char *fmt, va_list ap) {
+	struct outbuf o = {buf, n, 0};
+
+	for (; *fmt; fmt++) {
+		if (*fmt != '%') {
+			out_char(&o, *fmt);
+			continue;
+		}
+
+		bool left = false, zero = false;
+		int width = 0, lng = 0;
+
+		for (;; fmt++) {
+			if (fmt[1] == '-')
+				left = true;
+			else if (fmt[1] == '0')
+				zero = true;
+			else
+				break;
+		}
+		if (fmt[1] == '*') {
+			width = va_arg(ap, int);
+			fmt++;
+		}
+		while (fmt[1] >= '0' && fmt[1] <= '9')
+			width = width * 10 + (*++fmt - '0');
+		while (fmt[1] == 'l' || fmt[1] == 'z') {
+			lng++;
+			fmt++;
+		}
+
+		unsigned long long u;
+		long long s;
+		const char *str;
+
+		switch (*++fmt) {
+			case 'd':
+			case 'i':
+				s = lng ? va_arg(ap, long) : va_arg(ap, int);
+				out_number(&o, s < 0 ? -(unsigned long long)s : s, s < 0, 10,
+						   false, width, left, zero);
+				break;
+			case 'u':
+			case 'x':
+			case 'X':
+				u = lng ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+				out_number(&o, u, false, *fmt == 'u' ? 10 : 16, *fmt == 'X',
+						   width, left, zero);
+				break;
+			case 'p':
+				out_char(&o, '0');
+				out_char(&o, 'x');
+				out_number(&o, (uintptr_t)va_arg(ap, void *), false, 16, false,
+						   16, false, true);
+				break;
+			case 's':
+				str = va_arg(ap, const char *);
+				if (!str) str = "(null)";
+				s = strlen(str);
+				if (!left) out_pad(&o, ' ', width - s);
+				while (*str) out_char(&o, *str++);
+				if (left) out_pad(&o, ' ', width - s);
+				break;
+			case 'c':
+				out_char(&o, (char)va_arg(ap, int));
+				break;
+			case '%':
+				out_char(&o, '%');
+				break;
+			case '\0':
+				fmt--;
+				break;
+			default:
+				out_char(&o, '%');
+				out_char(&o, *fmt);
+				break;
+		}
+	}
+
+	if (n) buf[o.len < n ? o.len : n - 1] = '\0';
+	return (int)o.len;
+}
+
+int snprintf(char *buf, size_t n, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	int ret = vsnprintf(buf, n, fmt, ap);
+	va_end(ap);
+	return ret;
+}
@@ -0,0 +1,168 @@
+#include "radix.h"
+
+#include <stddef.h>
+
+#include "pool.h"
+
+#define RADIX_SHIFT 6
+#define RADIX_SLOTS (1u << RADIX_SHIFT)
+#define RADIX_MASK (RADIX_SLOTS - 1)
+/* Indices stay below 2^60. */
+#define RADIX_HEIGHT_MAX 10
+
+struct radix_node {
+	void *slots[RADIX_SLOTS];
+	uint64_t tags[RADIX_TAGS];
+	unsigned int count;
+};
+
+static struct pool radix_pool = POOL_INIT(sizeof(struct radix_node));
+
+static uint64_t radix_max(unsigned int height) {
+	return height >= RADIX_HEIGHT_MAX ? (1ull << 60) - 1
+									  : (1ull << (RADIX_SHIFT * height)) - 1;
+}
+
+static unsigned int radix_offset(uint64_t index, unsigned int level) {
+	return (index >> (RADIX_SHIFT * (level - 1))) & RADIX_MASK;
+}
+
+/* Fills path[level] with the nodes leading to index, the root at height and
+   the leaf at 1. False if the leaf is missing. */
+static bool radix_path(const struct radix_tree *t, uint64_t index,
+					   struct radix_node **path) {
+	if (!t->root || index > radix_max(t->height)) return false;
+	struct radix_node *node = t->root;
+	for (unsigned int level = t->height; level > 1; level--) {
+		path[level] = node;
+		node = node->slots[radix_offset(index, level)];
+		if (!node) return false;
+	}
+	path[1] = node;
+	return true;
+}
+
+void *radix_lookup(const struct radix_tree *t, uint64_t index) {
+	struct radix_node *path[RADIX_HEIGHT_MAX + 1];
+	if (!radix_path(t, index, path)) return NULL;
+	return path[1]->slots[index & RADIX_MASK];
+}
+
+bool radix_insert(struct radix_tree *t, uint64_t index, void *item) {
+	if (index > radix_max(RADIX_HEIGHT_MAX)) return false;
+	if (!t->root) {
+		t->root = pool_alloc(&radix_pool);
+		if (!t->root) return false;
+		t->height = 1;
+	}
+	// Grow by putting the root under a new one, carrying its tags up.
+	while (index > radix_max(t->height)) {
+		struct radix_node *root = pool_alloc(&radix_pool);
+		if (!root) return false;
+		root->slots[0] = t->root;
+		root->count = 1;
+		for (unsigned int tag = 0; tag < RADIX_TAGS; tag++)
+			root->tags[tag] = t->root->tags[tag] ? 1 : 0;
+		t->root = root;
+		t->height++;
+	}
+
+	struct radix_node *node = t->root;
+	for (unsigned int level = t->height; level > 1; level--) {
+		unsigned int off = radix_offset(index, level);
+		if (!node->slots[off]) {
+			node->slots[off] = pool_alloc(&radix_pool);
+			if (!node->slots[off]) return false;
+			node->count++;
+		}
+		node = node->slots[off];
+	}
+
+	unsigned int off = index & RADIX_MASK;
+	if (node->slots[off]) return false;
+	node->slots[off] = item;
+	node->count++;
+	return true;
+}
+
+/* Clears tag bits from the leaf up, for as long as nodes lose their last. */
+static void radix_tag_clear_path(struct radix_tree *t, uint64_t index,
+								 unsigned int tag, struct radix_node **path) {
+	for (unsigned int level = 1; level <= t->height; level++) {
+		uint64_t *tags = &path[level]->tags[tag];
+		*tags &= ~(1ull << radix_offset(index, level));
+		if (*tags) break;
+	}
+}
+
+void *radix_delete(struct radix_tree *t, uint64_t index) {
+	struct radix_node *path[RADIX_HEIGHT_MAX + 1];
+	if (!radix_path(t, index, path)) return NULL;
+	unsigned int off = index & RADIX_MASK;
+	void *item = path[1]->slots[off];
+	if (!item) return NULL;
+
+	for (unsigned int tag = 0; tag < RADIX_TAGS; tag++)
+		radix_tag_clear_path(t, index, tag, path);
+	path[1]->slots[off] = NULL;
+
+	// Free the nodes this leaves empty, bottom up.
+	for (unsigned int level = 1; level <= t->height; level++) {
+		if (--path[level]->count) break;
+		pool_free(&radix_pool, path[level]);
+		if (level == t->height) {
+			t->root = NULL;
+			t->height = 0;
+			break;
+		}
+		path[level + 1]->slots[radix_offset(index, level + 1)] = NULL;
+	}
+	return item;
+}
+
+void radix_tag_set(struct radix_tree *t, uint64_t index, unsigned int tag) {
+	struct radix_node *path[RADIX_HEIGHT_MAX + 1];
+	if (!radix_path(t, index, path) || !path[1]->slots[index & RADIX_MASK])
+		return;
+	for (unsigned int level = 1; level <= t->height; level++)
+		path[level]->tags[tag] |= 1ull << radix_offset(index, level);
+}
+
+void radix_tag_clear(struct radix_tree *t, uint64_t index, unsigned int tag) {
+	struct radix_node *path[RADIX_HEIGHT_MAX + 1];
+	if (radix_path(t, index, path)) radix_tag_clear_path(t, index, tag, path);
+}
+
+bool radix_tag_get(const struct radix_tree *t, uint64_t index,
+				   unsigned int tag) {
+	struct radix_node *path[RADIX_HEIGHT_MAX + 1];
+	if (!radix_path(t, index, path)) return false;
+	return path[1]->tags[tag] >> (index & RADIX_MASK) & 1;
+}
+
+static unsigned int radix_gang(const struct radix_node *node,
+							   unsigned int level, uint64_t base,
+							   uint64_t start, unsigned int tag, void **items,
+							   unsigned int n, unsigned int max) {
+	unsigned int shift = RADIX_SHIFT * (level - 1);
+	unsigned int off = start > base ? (start - base) >> shift : 0;
+	uint64_t tags = node->tags[tag] & (~0ull << off);
+	while (tags && n < max) {
+		off = __builtin_ctzll(tags);
+		tags &= tags - 1;
+		if (level == 1)
+			items[n++] = node->slots[off];
+		else
+			n = radix_gang(node->slots[off], level - 1,
+						   base + ((uint64_t)off << shift), start, tag, items,
+						   n, max);
+	}
+	return n;
+}
+
+unsigned int radix_gang_lookup_tag(const struct radix_tree *t, uint64_t start,
+								   unsigned int tag, void **items,
+								   unsigned int max) {
+	if (!t->root || start > radix_max(t->height)) return 0;
+	return radix_gang(t->root, t->height, 0, start, tag, items, 0, max);
+}
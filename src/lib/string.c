@@ -1,18 +1,53 @@
 #include "string.h"
 
 #include <stddef.h>
+#include <stdint.h>
 
-void *memcpy(void *dest, const void *src, size_t n) {
+#include "dispatch.h"
+
+/* memcpy, memset and strlen are dispatched; these are the fallbacks. They
+   must not be turned back into calls to what they implement. */
+#define STRING_GENERIC __attribute__((used, no_builtin))
+
+typedef uint64_t __attribute__((may_alias)) string_word;
+
+DISPATCH(memcpy, memcpy_generic);
+DISPATCH(memset, memset_generic);
+DISPATCH(strlen, strlen_generic);
+
+#ifdef ISA_BUILD_V
+void *memcpy_v(void *dest, const void *src, size_t n);
+void *memset_v(void *s, int c, size_t n);
+DISPATCH_VARIANT(memcpy, memcpy_v, ISA_BIT(ISA_EXT_V), 1);
+DISPATCH_VARIANT(memset, memset_v, ISA_BIT(ISA_EXT_V), 1);
+#endif
+
+#ifdef ISA_BUILD_ZBB
+size_t strlen_zbb(const char *s);
+DISPATCH_VARIANT(strlen, strlen_zbb, ISA_BIT(ISA_EXT_ZBB), 1);
+#endif
+
+/* Both copy a word at a time once aligned. Misaligned word accesses may trap
+   to firmware, so memcpy only does so when dest and src line up. */
+STRING_GENERIC void *memcpy_generic(void *dest, const void *src, size_t n) {
 	unsigned char *d = dest;
 	const unsigned char *s = src;
+	if ((((uintptr_t)d ^ (uintptr_t)s) & 7) == 0) {
+		for (; n && ((uintptr_t)d & 7); n--) *d++ = *s++;
+		for (; n >= 8; n -= 8, d += 8, s += 8)
+			*(string_word *)d = *(const string_word *)s;
+	}
 	while (n--) {
 		*d++ = *s++;
 	}
 	return dest;
 }
 
-void *memset(void *s, int c, size_t n) {
+STRING_GENERIC void *memset_generic(void *s, int c, size_t n) {
 	unsigned char *p = s;
+	for (; n && ((uintptr_t)p & 7); n--) *p++ = (unsigned char)c;
+	string_word word = (unsigned char)c * 0x0101010101010101ull;
+	for (; n >= 8; n -= 8, p += 8) *(string_word *)p = word;
 	while (n--) {
 		*p++ = (unsigned char)c;
 	}
@@ -28,8 +63,27 @@ int memcmp(const void *s1, const void *s2, size_t n) {
 	return 0;
 }
 
-size_t strlen(const char *s) {
+void *memchr(const void *s, int c, size_t n) {
+	const unsigned char *p = s;
+	for (; n--; p++) {
+		if (*p == (unsigned char)c) return (void *)p;
+	}
+	return NULL;
+}
+
+STRING_GENERIC size_t strlen_generic(const char *s) {
 	const char *p = s;
 	while (*p) p++;
 	return p - s;
 }
+
+int strcmp(const char *s1, const char *s2) {
+	for (; *s1 && *s1 == *s2; s1++, s2++);
+	return (unsigned char)*s1 - (unsigned char)*s2;
+}
+
+int strncmp(const char *s1, const char *s2, size_t n) {
+	for (; n && *s1 && *s1 == *s2; n--, s1++, s2++);
+	if (!n) return 0;
+	return (unsigned char)*s1 - (unsigned char)*s2;
+}
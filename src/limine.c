@@ -1,17 +1,55 @@
 #include "limine/limine.h"
+#include "init.h"
 #include "limine/features.h"
 
 #include <stddef.h>
 
-LIMINE_BASE_REVISION(3)
+/* The bootloader writes the responses behind the compiler's back. Keep LTO
+   from internalizing the requests and folding their responses to NULL. */
+#define LIMINE_REQUEST __attribute__((used))
 
-struct limine_executable_cmdline_request executable_cmdline_request = {
-	LIMINE_EXECUTABLE_CMDLINE_REQUEST, 0, NULL};
+LIMINE_REQUEST LIMINE_BASE_REVISION(3)
 
-struct limine_hhdm_request hhdm_request = {LIMINE_HHDM_REQUEST, 0, NULL};
+LIMINE_REQUEST struct limine_executable_cmdline_request
+	executable_cmdline_request = {LIMINE_EXECUTABLE_CMDLINE_REQUEST, 0, NULL};
 
-struct limine_executable_address_request executable_address_request = {
-    LIMINE_EXECUTABLE_ADDRESS_REQUEST, 0, NULL};
+LIMINE_REQUEST struct limine_hhdm_request hhdm_request = {
+	LIMINE_HHDM_REQUEST, 0, NULL};
 
-struct limine_memmap_request memmap_request = {
-	LIMINE_MEMMAP_REQUEST, 0, NULL};
\ No newline at end of file
+LIMINE_REQUEST struct limine_executable_address_request
+	executable_address_request = {LIMINE_EXECUTABLE_ADDRESS_REQUEST, 0, NULL};
+
+LIMINE_REQUEST struct limine_memmap_request memmap_request = {
+	LIMINE_MEMMAP_REQUEST, 0, NULL};
+
+LIMINE_REQUEST struct limine_riscv_bsp_hartid_request
+	riscv_bsp_hartid_request = {LIMINE_RISCV_BSP_HARTID_REQUEST, 0, NULL};
+
+LIMINE_REQUEST struct limine_dtb_request dtb_request = {
+	LIMINE_DTB_REQUEST, 0, NULL};
+
+LIMINE_REQUEST struct limine_bootloader_performance_request
+	bootloader_performance_request = {LIMINE_BOOTLOADER_PERFORMANCE_REQUEST, 0,
+									  NULL};
+
+LIMINE_REQUEST struct limine_module_request module_request = {
+	LIMINE_MODULE_REQUEST, 0, NULL, 0, NULL};
+
+LIMINE_REQUEST struct limine_mp_request mp_request = {
+	LIMINE_MP_REQUEST, 0, NULL, 0};
+
+LIMINE_REQUEST struct limine_date_at_boot_request date_at_boot_request = {
+	LIMINE_DATE_AT_BOOT_REQUEST, 0, NULL};
+
+uint64_t limine_hhdm_offset;
+uint64_t limine_exe_virtual_base, limine_exe_physical_base;
+int64_t limine_boot_date;
+
+void __init limine_save_responses(void) {
+	limine_hhdm_offset = hhdm_request.response->offset;
+	limine_exe_virtual_base = executable_address_request.response->virtual_base;
+	limine_exe_physical_base =
+		executable_address_request.response->physical_base;
+	if (date_at_boot_request.response)
+		limine_boot_date = date_at_boot_request.response->timestamp;
+}
@@ -0,0 +1,764 @@
+#include "mm.h"
+
+#include <stdbool.h>
+
+#include "clock.h"
+#include "cmdline.h"
+#include "csr.h"
+#include "errno.h"
+#include "hart.h"
+#include "init.h"
+#include "initcall.h"
+#include "limine/features.h"
+#include "pmm.h"
+#include "pool.h"
+#include "sched.h"
+#include "string.h"
+#include "vfs.h"
+#include "vmm.h"
+
+/* Range that mm_find_free() hands out: above the usual executable base,
+   and below the stack with a guard page between. */
+#define MM_MMAP_MIN (1ul << 30)
+#define MM_MMAP_TOP (USER_TOP - USER_STACK_SIZE - PAGE_SIZE)
+
+/* Pages of a file mapping around a read fault that are mapped along with
+   it, from an aligned window. Saves a trap per page on code and data read
+   in order. */
+#define MM_FAULT_AROUND 16
+
+#define MM_HUGE_SIZE (PAGE_SIZE << PMM_HUGE_ORDER)
+#define MM_HUGE_PAGES (1ul << PMM_HUGE_ORDER)
+
+/* How often a hart's collapser runs, how many 2 MiB ranges of a process it
+   looks at each time, and how many of those it may copy. */
+#define MM_COLLAPSE_HZ 20
+#define MM_COLLAPSE_SCAN 64
+#define MM_COLLAPSE_MAX 4
+
+/* Software bit of a page shared with the kernel, see mm_map_shared(). */
+#define PTE_SHARED (1ul << 8)
+
+static struct pool mm_pool = POOL_INIT(sizeof(struct mm));
+static struct pool mm_vma_pool = POOL_INIT(sizeof(struct vma));
+
+bool mm_thp = true;
+struct mm_thp_stats mm_thp_stats;
+
+/* The processes a hart's collapser looks at, linked by scan_next. Only
+   threads on the hart use it. */
+static struct mm_hart {
+	struct mm *scan;
+	struct thread *collapser;
+} mm_harts[HART_MAX];
+
+static void __init mm_setup(void) { mm_thp = !cmdline_has("nothp"); }
+
+INITCALL(mm_setup, mm_setup);
+
+/* Backs anonymous memory that has only been read. It is not refcounted. */
+static char mm_zero_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+static uint64_t mm_zero_phys(void) {
+	return (uint64_t)LIMINE_EXE_VTOP(mm_zero_page);
+}
+
+static uint64_t pte_phys(uint64_t pte) {
+	return (pte >> PTE_PPN_SHIFT) << PAGE_SHIFT;
+}
+
+static bool pte_leaf(uint64_t pte) { return pte & (PTE_R | PTE_W | PTE_X); }
+
+static uint64_t mm_leaf(uint64_t pa, uint64_t prot) {
+	return (pa >> PAGE_SHIFT) << PTE_PPN_SHIFT | prot | PTE_U | PTE_A | PTE_D |
+		   PTE_V;
+}
+
+static void mm_stat(unsigned long *counter) {
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void mm_put_phys(uint64_t pa) {
+	if (pa != mm_zero_phys()) page_put(pfn_to_page(pa >> PAGE_SHIFT));
+}
+
+static void mm_flush_page(uint64_t va) {
+	asm volatile("sfence.vma %0, zero" ::"r"(va) : "memory");
+}
+
+struct mm *mm_create(void) {
+	struct mm *mm = pool_alloc(&mm_pool);
+	if (!mm) return NULL;
+	mm->root = vmm_create();
+	if (!mm->root) {
+		pool_free(&mm_pool, mm);
+		return NULL;
+	}
+	mm->satp = (vmm_kernel_satp >> SATP_MODE_SHIFT) << SATP_MODE_SHIFT |
+			   virt_to_phys(mm->root) >> PAGE_SHIFT;
+	return mm;
+}
+
+static void mm_vma_free(struct vma *v) {
+	if (v->file) vfs_close(v->file);
+	pool_free(&mm_vma_pool, v);
+}
+
+static void mm_put_leaf(uint64_t pa, unsigned int level) {
+	if (level)
+		page_put_order(pfn_to_page(pa >> PAGE_SHIFT), PMM_HUGE_ORDER);
+	else
+		mm_put_phys(pa);
+}
+
+void mm_destroy(struct mm *mm) {
+	// Only ever listed on the hart of its process, which is destroying it.
+	if (mm->scan_listed) {
+		struct mm **link = &mm_harts[mm->hart].scan;
+		while (*link != mm) link = &(*link)->scan_next;
+		*link = mm->scan_next;
+	}
+	vmm_destroy(mm->root, mm_put_leaf);
+	while (mm->vmas) {
+		struct vma *v = mm->vmas;
+		mm->vmas = v->next;
+		mm_vma_free(v);
+	}
+	pool_free(&mm_pool, mm);
+}
+
+static bool mm_range_ok(uint64_t va, uint64_t size) {
+	return !((va | size) & (PAGE_SIZE - 1)) && size && va < USER_TOP &&
+		   size <= USER_TOP - va;
+}
+
+int mm_map(struct mm *mm, uint64_t va, uint64_t size, uint64_t prot,
+		   struct file *file, uint64_t offset, uint64_t file_size) {
+	if (!mm_range_ok(va, size)) return -EINVAL;
+	struct vma **link = &mm->vmas;
+	while (*link && (*link)->end <= va) link = &(*link)->next;
+	if (*link && (*link)->start < va + size) return -EINVAL;
+
+	struct vma *v = pool_alloc(&mm_vma_pool);
+	if (!v) return -ENOMEM;
+	v->start = va;
+	v->end = va + size;
+	v->prot = prot;
+	v->max_prot = PTE_R | PTE_W | PTE_X;
+	if (file) {
+		vfs_file_get(file);
+		v->file = file;
+		v->offset = offset;
+		v->file_size = file_size < size ? file_size : size;
+	}
+	v->next = *link;
+	*link = v;
+	return 0;
+}
+
+static void mm_vma_trim_front(struct vma *v, uint64_t start) {
+	uint64_t cut = start - v->start;
+	v->start = start;
+	v->offset += cut;
+	v->file_size = v->file_size > cut ? v->file_size - cut : 0;
+}
+
+static void mm_vma_trim_back(struct vma *v, uint64_t end) {
+	v->end = end;
+	if (v->file_size > end - v->start) v->file_size = end - v->start;
+}
+
+static struct vma *mm_find_vma(struct mm *mm, uint64_t va) {
+	for (struct vma *v = mm->vmas; v && v->start <= va; v = v->next) {
+		if (va < v->end) return v;
+	}
+	return NULL;
+}
+
+/* Whether the megapage at base would lie within v, which must be
+   anonymous. */
+static bool mm_huge_fits(const struct vma *v, uint64_t base) {
+	return !v->file && base >= v->start && base + MM_HUGE_SIZE <= v->end;
+}
+
+/* Replaces the megapage that pmd maps with a table of single pages mapping
+   the same memory. A block still shared since a fork is copied into single
+   pages first, as the parts of a block cannot be refcounted apart. */
+static int mm_split_huge(uint64_t *pmd) {
+	uint64_t *table = pmm_alloc_zeroed(0);
+	if (!table) return -ENOMEM;
+	uint64_t pa = pte_phys(*pmd);
+	uint64_t flags = *pmd & ((1ul << PTE_PPN_SHIFT) - 1);
+	struct page *head = pfn_to_page(pa >> PAGE_SHIFT);
+	bool shared = page_refs(head) > 1;
+
+	for (unsigned long i = 0; i < MM_HUGE_PAGES; i++) {
+		uint64_t part = pa + i * PAGE_SIZE;
+		if (shared) {
+			void *copy = pmm_alloc(0);
+			if (!copy) {
+				while (i--) pmm_free(phys_to_virt(pte_phys(table[i])), 0);
+				pmm_free(table, 0);
+				return -ENOMEM;
+			}
+			memcpy(copy, phys_to_virt(part), PAGE_SIZE);
+			part = virt_to_phys(copy);
+		}
+		page_ref_init(pfn_to_page(part >> PAGE_SHIFT));
+		table[i] = (part >> PAGE_SHIFT) << PTE_PPN_SHIFT | flags;
+	}
+	if (shared) page_put_order(head, PMM_HUGE_ORDER);
+
+	*pmd = (virt_to_phys(table) >> PAGE_SHIFT) << PTE_PPN_SHIFT | PTE_V;
+	asm volatile("sfence.vma" ::: "memory");
+	mm_stat(&mm_thp_stats.splits);
+	return 0;
+}
+
+/* Splits the area and the megapage that straddle va, if any, so that what
+   lies below va can be left alone by changes from va on. */
+static int mm_split(struct mm *mm, uint64_t va) {
+	if (va & (MM_HUGE_SIZE - 1)) {
+		uint64_t *pmd = vmm_walk(mm->root, va, 1, false);
+		if (pmd && *pmd & PTE_V && pte_leaf(*pmd)) {
+			int err = mm_split_huge(pmd);
+			if (err) return err;
+		}
+	}
+
+	struct vma *v = mm_find_vma(mm, va);
+	if (!v || v->start == va) return 0;
+	struct vma *above = pool_alloc(&mm_vma_pool);
+	if (!above) return -ENOMEM;
+	*above = *v;
+	if (above->file) vfs_file_get(above->file);
+	mm_vma_trim_front(above, va);
+	mm_vma_trim_back(v, va);
+	v->next = above;
+	return 0;
+}
+
+/* End of the 2 MiB range holding va, or end if that comes first. */
+static uint64_t mm_huge_next(uint64_t va, uint64_t end) {
+	uint64_t next = (va | (MM_HUGE_SIZE - 1)) + 1;
+	return next < end ? next : end;
+}
+
+/* Drops the pages in [va, end), which no megapage straddles, along with the
+   tables of whole 2 MiB ranges. */
+static void mm_unmap_pages(struct mm *mm, uint64_t va, uint64_t end) {
+	for (uint64_t next; va < end; va = next) {
+		next = mm_huge_next(va, end);
+		uint64_t *pmd = vmm_walk(mm->root, va, 1, false);
+		if (!pmd || !(*pmd & PTE_V)) continue;
+		if (pte_leaf(*pmd)) {
+			mm_put_leaf(pte_phys(*pmd), 1);
+			*pmd = 0;
+			mm->rss -= MM_HUGE_PAGES;
+			continue;
+		}
+
+		uint64_t *table = vmm_next_table(*pmd);
+		for (uint64_t a = va; a < next; a += PAGE_SIZE) {
+			uint64_t *pte = &table[(a >> PAGE_SHIFT) & (MM_HUGE_PAGES - 1)];
+			if (!(*pte & PTE_V)) continue;
+			mm_put_phys(pte_phys(*pte));
+			*pte = 0;
+			mm->rss--;
+		}
+		// An empty table would keep a megapage from being mapped here.
+		if (next - va == MM_HUGE_SIZE) {
+			*pmd = 0;
+			vmm_free_table(table);
+		}
+	}
+	asm volatile("sfence.vma" ::: "memory");
+}
+
+int mm_unmap(struct mm *mm, uint64_t va, uint64_t size) {
+	if (!mm_range_ok(va, size)) return -EINVAL;
+	uint64_t end = va + size;
+	int err = mm_split(mm, va);
+	if (!err) err = mm_split(mm, end);
+	if (err) return err;
+
+	struct vma **link = &mm->vmas;
+	while (*link && (*link)->start < end) {
+		struct vma *v = *link;
+		if (v->start < va) {
+			link = &v->next;
+			continue;
+		}
+		*link = v->next;
+		mm_vma_free(v);
+	}
+	mm_unmap_pages(mm, va, end);
+	return 0;
+}
+
+static void mm_protect_pte(uint64_t *pte, uint64_t prot) {
+	*pte = (*pte & ~(PTE_R | PTE_W | PTE_X)) | prot;
+}
+
+/* Applies prot to the pages mapped in [va, end), which no megapage
+   straddles. Write access is left to come back through mm_cow(), which
+   knows whether a page is shared. */
+static void mm_protect_pages(struct mm *mm, uint64_t va, uint64_t end,
+							 uint64_t prot) {
+	prot &= ~PTE_W;
+	for (uint64_t next; va < end; va = next) {
+		next = mm_huge_next(va, end);
+		uint64_t *pmd = vmm_walk(mm->root, va, 1, false);
+		if (!pmd || !(*pmd & PTE_V)) continue;
+		if (pte_leaf(*pmd)) {
+			mm_protect_pte(pmd, prot);
+			continue;
+		}
+		uint64_t *table = vmm_next_table(*pmd);
+		for (uint64_t a = va; a < next; a += PAGE_SIZE) {
+			uint64_t *pte = &table[(a >> PAGE_SHIFT) & (MM_HUGE_PAGES - 1)];
+			if (*pte & PTE_V) mm_protect_pte(pte, prot);
+		}
+	}
+	asm volatile("sfence.vma" ::: "memory");
+	if (prot & PTE_X) asm volatile("fence.i" ::: "memory");
+}
+
+int mm_protect(struct mm *mm, uint64_t va, uint64_t size, uint64_t prot) {
+	// Entries without R, W or X would point to tables.
+	if (!mm_range_ok(va, size) || !(prot & (PTE_R | PTE_X))) return -EINVAL;
+	uint64_t end = va + size;
+	uint64_t covered = va;
+	for (struct vma *v = mm_find_vma(mm, va); v && v->start <= covered;
+		 v = v->next) {
+		if (v->start < end && prot & ~v->max_prot) return -EACCES;
+		covered = v->end;
+	}
+	if (covered < end) return -ENOMEM;
+
+	int err = mm_split(mm, va);
+	if (!err) err = mm_split(mm, end);
+	if (err) return err;
+	for (struct vma *v = mm_find_vma(mm, va); v && v->start < end; v = v->next)
+		v->prot = prot;
+	mm_protect_pages(mm, va, end, prot);
+	return 0;
+}
+
+uint64_t mm_find_free(struct mm *mm, uint64_t size) {
+	uint64_t align = size >= MM_HUGE_SIZE ? MM_HUGE_SIZE : PAGE_SIZE;
+	uint64_t found = 0, lo = MM_MMAP_MIN;
+	for (struct vma *v = mm->vmas;; v = v->next) {
+		uint64_t hi = v && v->start < MM_MMAP_TOP ? v->start : MM_MMAP_TOP;
+		if (hi > lo && hi - lo >= size && ((hi - size) & ~(align - 1)) >= lo)
+			found = (hi - size) & ~(align - 1);
+		if (!v) break;
+		if (v->end > lo) lo = v->end;
+	}
+	return found;
+}
+
+static void mm_rss_add(struct mm *mm, unsigned long pages) {
+	mm->rss += pages;
+	if (mm->rss > mm->rss_peak) mm->rss_peak = mm->rss;
+}
+
+static int mm_set_pte(struct mm *mm, uint64_t va, uint64_t pa, uint64_t prot) {
+	if (vmm_map(mm->root, va, pa, PAGE_SIZE, prot | PTE_U)) return -ENOMEM;
+	mm_rss_add(mm, 1);
+	return 0;
+}
+
+int mm_map_shared(struct mm *mm, uint64_t va, struct page *first,
+				  unsigned long n, uint64_t prot) {
+	int err = mm_map_anon(mm, va, n * PAGE_SIZE, prot);
+	if (err) return err;
+	// Shared pages become writable on a write fault, see mm_cow().
+	mm_find_vma(mm, va)->max_prot = prot;
+	for (unsigned long i = 0; i < n; i++) {
+		err = mm_set_pte(mm, va + i * PAGE_SIZE, page_to_phys(first + i),
+						 prot | PTE_SHARED);
+		if (err) {
+			mm_unmap(mm, va, n * PAGE_SIZE);
+			return err;
+		}
+		page_get(first + i);
+	}
+	return 0;
+}
+
+/* Whether the page at off in v can be the file's cached page itself: it
+   lies at a page offset in the file, and holds only file data, or file
+   data up to the end of the file. */
+static bool mm_vma_page_shared(const struct vma *v, uint64_t off) {
+	if (!v->file || v->offset & (PAGE_SIZE - 1) || off >= v->file_size)
+		return false;
+	return off + PAGE_SIZE <= v->file_size ||
+		   v->offset + v->file_size >= v->file->inode->size;
+}
+
+/* Maps cached file pages read-only at va and at the unmapped pages around
+   it. Writes copy them, see mm_cow(). */
+static int mm_fault_shared(struct mm *mm, struct vma *v, uint64_t va) {
+	uint64_t window = MM_FAULT_AROUND * PAGE_SIZE;
+	uint64_t lo = va & ~(window - 1), hi = lo + window;
+	if (lo < v->start) lo = v->start;
+	if (hi > v->end) hi = v->end;
+
+	for (uint64_t a = lo; a < hi; a += PAGE_SIZE) {
+		uint64_t off = a - v->start;
+		if (a != va && (!mm_vma_page_shared(v, off) ||
+						vmm_lookup(mm->root, a, NULL)))
+			continue;
+		struct page *pg;
+		int err = vfs_get_page(v->file, (v->offset + off) >> PAGE_SHIFT, &pg);
+		if (!err) {
+			err = mm_set_pte(mm, a, page_to_phys(pg), v->prot & ~PTE_W);
+			if (err) page_put(pg);
+		}
+		// Neighbours are only an optimization.
+		if (err && a == va) return err;
+		if (!err) mm_flush_page(a);
+	}
+	return 0;
+}
+
+/* Maps a page of v of the process's own at va, with the file's data if v
+   has any there and zeros otherwise. */
+static int mm_fault_private(struct mm *mm, struct vma *v, uint64_t va) {
+	void *page = pmm_alloc_zeroed(0);
+	if (!page) return -ENOMEM;
+	uint64_t off = va - v->start;
+	if (off < v->file_size) {
+		size_t n = v->file_size - off < PAGE_SIZE ? v->file_size - off
+												  : PAGE_SIZE;
+		long got = vfs_pread(v->file, v->offset + off, page, n);
+		if (got < 0) {
+			pmm_free(page, 0);
+			return got;
+		}
+	}
+	page_ref_init(virt_to_page(page));
+	int err = mm_set_pte(mm, va, virt_to_phys(page), v->prot);
+	if (err) pmm_free(page, 0);
+	return err;
+}
+
+/* A write to a page mapped read-only in a writable area: the zero page, a
+   file's page, or a page shared since a fork. */
+static int mm_cow(struct vma *v, uint64_t *pte) {
+	// Made read-only by mprotect(), and meant to be written in place.
+	if (*pte & PTE_SHARED) {
+		*pte |= PTE_W;
+		return 0;
+	}
+	uint64_t pa = pte_phys(*pte);
+	bool zero = pa == mm_zero_phys();
+	// Nobody else holds it any more. Cached file pages always have the
+	// cache's reference as well.
+	if (!zero && page_refs(pfn_to_page(pa >> PAGE_SHIFT)) == 1) {
+		*pte |= PTE_W;
+		return 0;
+	}
+
+	void *copy = zero ? pmm_alloc_zeroed(0) : pmm_alloc(0);
+	if (!copy) return -ENOMEM;
+	if (!zero) memcpy(copy, phys_to_virt(pa), PAGE_SIZE);
+	page_ref_init(virt_to_page(copy));
+	*pte = mm_leaf(virt_to_phys(copy), v->prot);
+	mm_put_phys(pa);
+	return 0;
+}
+
+/* mm_cow() for a megapage. Without a free 2 MiB block for the copy, the
+   megapage is split into single pages instead. */
+static int mm_cow_huge(struct mm *mm, struct vma *v, uint64_t *pmd,
+					   uint64_t va) {
+	uint64_t pa = pte_phys(*pmd);
+	struct page *head = pfn_to_page(pa >> PAGE_SHIFT);
+	if (page_refs(head) == 1) {
+		*pmd |= PTE_W;
+		return 0;
+	}
+
+	struct page *copy = pmm_alloc_huge(false);
+	if (!copy) {
+		mm_stat(&mm_thp_stats.fallbacks);
+		int err = mm_split_huge(pmd);
+		return err ? err : mm_cow(v, vmm_lookup(mm->root, va, NULL));
+	}
+	memcpy(page_address(copy), phys_to_virt(pa), MM_HUGE_SIZE);
+	page_ref_init(copy);
+	*pmd = mm_leaf(page_to_phys(copy), v->prot);
+	page_put_order(head, PMM_HUGE_ORDER);
+	return 0;
+}
+
+/* Maps a zeroed megapage for a write to an anonymous 2 MiB range with
+   nothing mapped yet. Returns -EAGAIN to fall back to a single page. */
+static int mm_fault_huge(struct mm *mm, struct vma *v, uint64_t va) {
+	uint64_t base = va & ~(MM_HUGE_SIZE - 1);
+	if (!mm_thp || !mm_huge_fits(v, base)) return -EAGAIN;
+	uint64_t *pmd = vmm_walk(mm->root, base, 1, true);
+	if (!pmd) return -ENOMEM;
+	if (*pmd & PTE_V) return -EAGAIN;
+
+	struct page *pg = pmm_alloc_huge(true);
+	if (!pg) {
+		mm_stat(&mm_thp_stats.fallbacks);
+		return -EAGAIN;
+	}
+	page_ref_init(pg);
+	*pmd = mm_leaf(page_to_phys(pg), v->prot);
+	mm_rss_add(mm, MM_HUGE_PAGES);
+	mm_stat(&mm_thp_stats.faults);
+	return 0;
+}
+
+static void mm_collapser(void *arg);
+
+/* Hands mm to the collapser of this hart, its process's, starting the
+   collapser first if need be. */
+static void mm_scan_add(struct mm *mm) {
+	unsigned int hart = hart_index();
+	struct mm_hart *h = &mm_harts[hart];
+	if (!h->collapser)
+		h->collapser = kthread_create(mm_collapser, h, "collapser", hart);
+	mm->hart = hart;
+	mm->scan_next = h->scan;
+	h->scan = mm;
+	mm->scan_listed = true;
+}
+
+int mm_fault(struct mm *mm, uint64_t va, uint64_t access) {
+	struct vma *v = mm_find_vma(mm, va);
+	if (!v || (v->prot & access) != access) return -EFAULT;
+	va &= ~(PAGE_SIZE - 1);
+
+	int err = 0;
+	unsigned int level;
+	uint64_t *pte = vmm_lookup(mm->root, va, &level);
+	if (pte) {
+		// Present with the access allowed: a stale TLB entry.
+		if ((*pte & access) != access) {
+			if (access != PTE_W) return -EFAULT;
+			err = level ? mm_cow_huge(mm, v, pte, va) : mm_cow(v, pte);
+		}
+	} else if (access != PTE_W && mm_vma_page_shared(v, va - v->start)) {
+		err = mm_fault_shared(mm, v, va);
+	} else if (access != PTE_W && va - v->start >= v->file_size) {
+		err = mm_set_pte(mm, va, mm_zero_phys(), v->prot & ~PTE_W);
+	} else {
+		err = mm_fault_huge(mm, v, va);
+		if (err == -EAGAIN) err = mm_fault_private(mm, v, va);
+	}
+	if (err) return err;
+
+	if (mm_thp && !mm->scan_listed &&
+		mm_huge_fits(v, va & ~(MM_HUGE_SIZE - 1)))
+		mm_scan_add(mm);
+
+	mm_flush_page(va);
+	// The page may hold code just written through the HHDM, by any hart.
+	if (v->prot & PTE_X) asm volatile("fence.i" ::: "memory");
+	return 0;
+}
+
+/* Shares a leaf, a page or a megapage, with the child. Both lose write
+   access, so whichever writes first copies it, unless the page is shared
+   with the kernel. */
+static uint64_t mm_fork_pte(uint64_t *pte, unsigned int level) {
+	(void)level;
+	if (!(*pte & PTE_SHARED)) *pte &= ~PTE_W;
+	uint64_t pa = pte_phys(*pte);
+	if (pa != mm_zero_phys()) page_get(pfn_to_page(pa >> PAGE_SHIFT));
+	return *pte;
+}
+
+struct mm *mm_fork(struct mm *mm) {
+	struct mm *child = mm_create();
+	if (!child) return NULL;
+
+	struct vma **link = &child->vmas;
+	for (struct vma *v = mm->vmas; v; v = v->next) {
+		struct vma *c = pool_alloc(&mm_vma_pool);
+		if (!c) goto fail;
+		*c = *v;
+		c->next = NULL;
+		if (c->file) vfs_file_get(c->file);
+		*link = c;
+		link = &c->next;
+	}
+
+	int err = vmm_clone(child->root, mm->root, mm_fork_pte);
+	asm volatile("sfence.vma" ::: "memory");
+	if (err) goto fail;
+	child->rss = child->rss_peak = mm->rss;
+	return child;
+
+fail:
+	mm_destroy(child);
+	return NULL;
+}
+
+/* The entry of a single page mapped writable at va, faulting it in and
+   splitting the megapage it is part of if need be, or NULL. */
+static uint64_t *mm_pin_pte(struct mm *mm, uint64_t va) {
+	if (!mm_user_addr(mm, va, PTE_W)) return NULL;
+	unsigned int level;
+	uint64_t *pte = vmm_lookup(mm->root, va, &level);
+	// Pins are per page, and a megapage is counted as a whole.
+	if (level && mm_split_huge(pte)) return NULL;
+	return vmm_lookup(mm->root, va, NULL);
+}
+
+int mm_pin(struct mm *mm, uint64_t va, uint64_t size, struct page **pages) {
+	for (unsigned long i = 0; i < size / PAGE_SIZE; i++) {
+		uint64_t *pte = mm_pin_pte(mm, va + i * PAGE_SIZE);
+		if (!pte) {
+			while (i--) {
+				pte = vmm_lookup(mm->root, va + i * PAGE_SIZE, NULL);
+				*pte &= ~PTE_SHARED;
+				page_put(pages[i]);
+			}
+			return -EFAULT;
+		}
+		*pte |= PTE_SHARED;
+		pages[i] = pfn_to_page(pte_phys(*pte) >> PAGE_SHIFT);
+		page_get(pages[i]);
+	}
+	return 0;
+}
+
+/* Copies the single pages that fill the 2 MiB range of v mapped by pmd's
+   table into a megapage. */
+static bool mm_collapse(struct vma *v, uint64_t *pmd) {
+	uint64_t *table = vmm_next_table(*pmd);
+	for (unsigned long i = 0; i < MM_HUGE_PAGES; i++) {
+		if (!(table[i] & PTE_V) || table[i] & PTE_SHARED) return false;
+	}
+	struct page *pg = pmm_alloc_huge(false);
+	if (!pg) return false;
+
+	char *dst = page_address(pg);
+	for (unsigned long i = 0; i < MM_HUGE_PAGES; i++) {
+		uint64_t pa = pte_phys(table[i]);
+		if (pa == mm_zero_phys())
+			zero_page(dst + i * PAGE_SIZE);
+		else
+			memcpy(dst + i * PAGE_SIZE, phys_to_virt(pa), PAGE_SIZE);
+	}
+	// The copy is the process's own, so it is writable if v is.
+	page_ref_init(pg);
+	*pmd = mm_leaf(page_to_phys(pg), v->prot);
+	asm volatile("sfence.vma" ::: "memory");
+	if (v->prot & PTE_X) asm volatile("fence.i" ::: "memory");
+
+	for (unsigned long i = 0; i < MM_HUGE_PAGES; i++)
+		mm_put_phys(pte_phys(table[i]));
+	vmm_free_table(table);
+	mm_stat(&mm_thp_stats.collapses);
+	return true;
+}
+
+/* Looks at the next 2 MiB ranges of mm's anonymous areas, from where the
+   last scan stopped, and collapses those mapped in full with single
+   pages. */
+static void mm_collapse_scan(struct mm *mm) {
+	unsigned int scanned = 0, collapsed = 0;
+	uint64_t va = mm->scan_va;
+	struct vma *v = mm->vmas;
+	while (v && scanned < MM_COLLAPSE_SCAN && collapsed < MM_COLLAPSE_MAX) {
+		uint64_t base = (v->start + MM_HUGE_SIZE - 1) & ~(MM_HUGE_SIZE - 1);
+		if (base < va) base = va;
+		if (!mm_huge_fits(v, base)) {
+			v = v->next;
+			continue;
+		}
+		scanned++;
+		uint64_t *pmd = vmm_walk(mm->root, base, 1, false);
+		if (pmd && *pmd & PTE_V && !pte_leaf(*pmd) && mm_collapse(v, pmd))
+			collapsed++;
+		va = base + MM_HUGE_SIZE;
+	}
+	mm->scan_va = v ? va : 0;
+}
+
+/* One per hart that has run a process with room for megapages. It only
+   touches processes stopped in mm_yield(): threads on a hart run one at a
+   time, so those are between two instructions of user code. */
+static void mm_collapser(void *arg) {
+	struct mm_hart *h = arg;
+	for (;;) {
+		sched_block_until(rdtime() + clock_freq / MM_COLLAPSE_HZ);
+		if (!mm_thp) continue;
+		for (struct mm *mm = h->scan; mm; mm = mm->scan_next) {
+			if (mm->quiescent) mm_collapse_scan(mm);
+		}
+	}
+}
+
+void mm_yield(struct mm *mm) {
+	mm->quiescent = true;
+	sched_yield();
+	mm->quiescent = false;
+}
+
+void *mm_user_addr(struct mm *mm, uint64_t va, uint64_t access) {
+	if (va >= USER_TOP) return NULL;
+	unsigned int level;
+	uint64_t *pte = vmm_lookup(mm->root, va, &level);
+	if (!pte || (*pte & access) != access) {
+		if (mm_fault(mm, va, access)) return NULL;
+		pte = vmm_lookup(mm->root, va, &level);
+	}
+	if (!(*pte & PTE_U)) return NULL;
+	uint64_t page = PAGE_SIZE << (9 * level);
+	return phys_to_virt(pte_phys(*pte) + (va & (page - 1)));
+}
+
+/* Bytes from va to the end of its page, at most len. */
+static size_t mm_chunk(uint64_t va, size_t len) {
+	size_t n = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+	return n < len ? n : len;
+}
+
+int copy_from_user(struct mm *mm, void *dst, uint64_t src, size_t len) {
+	while (len) {
+		size_t n = mm_chunk(src, len);
+		const void *p = mm_user_addr(mm, src, PTE_R);
+		if (!p) return -EFAULT;
+		memcpy(dst, p, n);
+		dst = (char *)dst + n;
+		src += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int copy_to_user(struct mm *mm, uint64_t dst, const void *src, size_t len) {
+	while (len) {
+		size_t n = mm_chunk(dst, len);
+		void *p = mm_user_addr(mm, dst, PTE_W);
+		if (!p) return -EFAULT;
+		memcpy(p, src, n);
+		src = (const char *)src + n;
+		dst += n;
+		len -= n;
+	}
+	return 0;
+}
+
+long strncpy_from_user(struct mm *mm, char *dst, uint64_t src, size_t size) {
+	size_t len = 0;
+	while (len < size) {
+		size_t n = mm_chunk(src + len, size - len);
+		const char *p = mm_user_addr(mm, src + len, PTE_R);
+		if (!p) return -EFAULT;
+		for (size_t i = 0; i < n; i++, len++) {
+			dst[len] = p[i];
+			if (!p[i]) return len;
+		}
+	}
+	return -ENAMETOOLONG;
+}
@@ -0,0 +1,209 @@
+/* ARP
+
+   The neighbour table is shared by all harts. It changes rarely, so
+   readers go without a lock and retry if a writer was busy, and writers
+   serialize on a lock. Packets waiting for an answer are kept on their
+   hart's list, which that hart retries when any hart learns an address. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "csr.h"
+#include "net.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "string.h"
+
+#define ARP_ENTRIES 64
+#define ARP_HLEN 28
+#define ARP_REQUEST 1
+#define ARP_REPLY 2
+/* Requests per wait and the time between them, and packets waiting per
+   hart. */
+#define ARP_TRIES 4
+#define ARP_RETRY_MS 250
+#define ARP_WAIT_MAX 64
+/* Ethernet frames are padded to this. */
+#define ETH_ZLEN 60
+
+struct arp_entry {
+	/* 0 for none. */
+	uint32_t addr;
+	uint8_t mac[ETH_ALEN];
+};
+
+static struct arp_entry arp_table[ARP_ENTRIES];
+/* Odd while the table is being written. */
+static unsigned int arp_seq;
+static spinlock_t arp_lock = SPINLOCK_INIT;
+
+static struct arp_entry *arp_slot(uint32_t addr) {
+	return &arp_table[(addr * 0x9e3779b1u) >> 26];
+}
+
+_Static_assert(ARP_ENTRIES == 1 << (32 - 26), "arp_slot() hash width");
+
+static bool arp_lookup(uint32_t addr, uint8_t *mac) {
+	if (addr == 0xffffffff) {
+		memset(mac, 0xff, ETH_ALEN);
+		return true;
+	}
+	struct arp_entry *e = arp_slot(addr);
+	unsigned int seq;
+	bool found;
+	do {
+		while ((seq = __atomic_load_n(&arp_seq, __ATOMIC_ACQUIRE)) & 1)
+			cpu_relax();
+		found = e->addr == addr;
+		if (found) memcpy(mac, e->mac, ETH_ALEN);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&arp_seq, __ATOMIC_RELAXED) != seq);
+	return found;
+}
+
+static void arp_update(uint32_t addr, const uint8_t *mac) {
+	struct arp_entry *e = arp_slot(addr);
+	bool irq = spin_lock_irqsave(&arp_lock);
+	bool changed = e->addr != addr || memcmp(e->mac, mac, ETH_ALEN);
+	if (changed) {
+		__atomic_store_n(&arp_seq, arp_seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		e->addr = addr;
+		memcpy(e->mac, mac, ETH_ALEN);
+		__atomic_store_n(&arp_seq, arp_seq + 1, __ATOMIC_RELEASE);
+	}
+	spin_unlock_irqrestore(&arp_lock, irq);
+	if (!changed) return;
+
+	for (unsigned int h = 0; h < hart_count; h++) {
+		struct net_hart *nh = &net_harts[h];
+		if (!__atomic_load_n(&nh->arp_wait, __ATOMIC_RELAXED)) continue;
+		__atomic_store_n(&nh->arp_update, true, __ATOMIC_RELEASE);
+		sched_wake(nh->thread);
+	}
+}
+
+static void arp_send(struct netbuf *nb, const uint8_t *dst, uint16_t type) {
+	struct netdev *dev = net_iface.dev;
+	uint8_t *eth = netbuf_push(nb, ETH_HLEN);
+	memcpy(eth, dst, ETH_ALEN);
+	memcpy(eth + ETH_ALEN, dev->mac, ETH_ALEN);
+	net_put16(eth + 12, type);
+	if (!nb->frag && nb->len < ETH_ZLEN &&
+		netbuf_tailroom(nb) >= ETH_ZLEN - nb->len)
+		memset(netbuf_put(nb, ETH_ZLEN - nb->len), 0, ETH_ZLEN - nb->len);
+	netdev_xmit(dev, nb);
+}
+
+static void arp_fill(uint8_t *arp, uint16_t op, const uint8_t *tha,
+					 uint32_t tpa) {
+	net_put16(arp, 1);
+	net_put16(arp + 2, ETH_P_IP);
+	arp[4] = ETH_ALEN;
+	arp[5] = 4;
+	net_put16(arp + 6, op);
+	memcpy(arp + 8, net_iface.dev->mac, ETH_ALEN);
+	net_put32(arp + 14, net_iface.addr);
+	memcpy(arp + 18, tha, ETH_ALEN);
+	net_put32(arp + 24, tpa);
+}
+
+static void arp_request(uint32_t addr) {
+	static const uint8_t zero[ETH_ALEN], broadcast[ETH_ALEN] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+	struct netbuf *nb = netbuf_alloc(&net_this_hart()->pool);
+	if (!nb) return;
+	arp_fill(netbuf_put(nb, ARP_HLEN), ARP_REQUEST, zero, addr);
+	arp_send(nb, broadcast, ETH_P_ARP);
+}
+
+void arp_input(struct netbuf *nb) {
+	uint8_t *arp = nb->data;
+	if (nb->len < ARP_HLEN || net_get16(arp) != 1 ||
+		net_get16(arp + 2) != ETH_P_IP || arp[4] != ETH_ALEN || arp[5] != 4 ||
+		net_get32(arp + 24) != net_iface.addr) {
+		netbuf_free(nb);
+		return;
+	}
+	uint8_t sha[ETH_ALEN];
+	memcpy(sha, arp + 8, ETH_ALEN);
+	uint32_t spa = net_get32(arp + 14);
+	arp_update(spa, sha);
+
+	if (net_get16(arp + 6) != ARP_REQUEST) {
+		netbuf_free(nb);
+		return;
+	}
+	// The request becomes the reply, where it is.
+	nb->len = ARP_HLEN;
+	netbuf_free(nb->frag);
+	nb->frag = NULL;
+	arp_fill(arp, ARP_REPLY, sha, spa);
+	arp_send(nb, sha, ETH_P_ARP);
+}
+
+void arp_output(struct netbuf *nb, uint32_t nexthop) {
+	uint8_t mac[ETH_ALEN];
+	if (arp_lookup(nexthop, mac)) {
+		arp_send(nb, mac, ETH_P_IP);
+		return;
+	}
+
+	struct net_hart *nh = net_this_hart();
+	unsigned int waiting = 0;
+	struct netbuf **tail = &nh->arp_wait;
+	for (; *tail; tail = &(*tail)->next) waiting++;
+	if (waiting >= ARP_WAIT_MAX) {
+		netbuf_free(nb);
+		return;
+	}
+	nb->next = NULL;
+	*tail = nb;
+	if (!waiting) {
+		arp_request(nexthop);
+		nh->arp_tries = 1;
+		nh->arp_retry = rdtime() + clock_freq * ARP_RETRY_MS / 1000;
+		// Make the hart's stack thread see the new deadline.
+		if (nh->arp_retry < nh->sleep_until) {
+			nh->sleep_until = nh->arp_retry;
+			sched_wake(nh->thread);
+		}
+	}
+}
+
+void arp_retry(struct net_hart *nh, uint64_t now) {
+	__atomic_store_n(&nh->arp_update, false, __ATOMIC_RELAXED);
+	struct netbuf *list = nh->arp_wait;
+	nh->arp_wait = NULL;
+
+	// Whatever can go now goes; the rest is queued again, in order.
+	struct netbuf *wait = NULL, **tail = &wait;
+	uint8_t mac[ETH_ALEN];
+	while (list) {
+		struct netbuf *nb = list;
+		list = nb->next;
+		nb->next = NULL;
+		if (arp_lookup(ip_nexthop(net_get32(nb->data + 16)), mac)) {
+			arp_send(nb, mac, ETH_P_IP);
+			continue;
+		}
+		*tail = nb;
+		tail = &nb->next;
+	}
+	nh->arp_wait = wait;
+	if (!wait || now < nh->arp_retry) return;
+
+	if (nh->arp_tries++ >= ARP_TRIES) {
+		netbuf_free_list(wait);
+		nh->arp_wait = NULL;
+		return;
+	}
+	uint32_t last = 0;
+	for (struct netbuf *nb = wait; nb; nb = nb->next) {
+		uint32_t nexthop = ip_nexthop(net_get32(nb->data + 16));
+		if (nexthop != last) arp_request(nexthop);
+		last = nexthop;
+	}
+	nh->arp_retry = now + clock_freq * ARP_RETRY_MS / 1000;
+}
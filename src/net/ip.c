@@ -0,0 +1,210 @@
+/* IPv4, ICMP echo and Internet checksums
+
+   The stack never fragments: TCP segments fit the MTU or go to the device
+   for segmentation, and fragments received are dropped. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+#include "string.h"
+
+#define IP_DF 0x4000
+#define IP_TTL 64
+
+#define ICMP_ECHO_REPLY 0
+#define ICMP_ECHO 8
+
+uint32_t net_csum(uint32_t sum, const void *data, size_t len) {
+	// The sum is kept in host order; being one's complement, it comes out
+	// right once stored the same way.
+	const uint8_t *p = data;
+	uint64_t acc = sum;
+	for (; len >= 4; p += 4, len -= 4) {
+		uint32_t w;
+		memcpy(&w, p, 4);
+		acc += w;
+	}
+	if (len >= 2) {
+		uint16_t w;
+		memcpy(&w, p, 2);
+		acc += w;
+		p += 2;
+		len -= 2;
+	}
+	if (len) acc += *p;
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	return acc;
+}
+
+static uint32_t net_csum_fold16(uint32_t sum) {
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (sum & 0xffff) + (sum >> 16);
+}
+
+static uint32_t net_csum_add(uint32_t a, uint32_t b) {
+	uint64_t sum = (uint64_t)a + b;
+	return (sum & 0xffffffff) + (sum >> 32);
+}
+
+uint32_t net_csum_pkt(uint32_t sum, const struct netbuf *nb, size_t off) {
+	size_t pos = 0;
+	for (; nb; nb = nb->frag) {
+		if (off >= nb->len) {
+			off -= nb->len;
+			continue;
+		}
+		size_t len = nb->len - off;
+		uint32_t part = net_csum(0, nb->data + off, len);
+		// A buffer starting at an odd offset has its bytes paired the
+		// other way round.
+		if (pos & 1) {
+			part = net_csum_fold16(part);
+			part = (part & 0xff) << 8 | part >> 8;
+		}
+		sum = net_csum_add(sum, part);
+		pos += len;
+		off = 0;
+	}
+	return sum;
+}
+
+uint32_t net_csum_pseudo(uint32_t saddr, uint32_t daddr, uint8_t proto,
+						 size_t len) {
+	uint8_t hdr[12];
+	net_put32(hdr, saddr);
+	net_put32(hdr + 4, daddr);
+	hdr[8] = 0;
+	hdr[9] = proto;
+	net_put16(hdr + 10, len);
+	return net_csum(0, hdr, sizeof(hdr));
+}
+
+uint16_t net_csum_fold(uint32_t sum) {
+	return ~net_csum_fold16(sum) & 0xffff;
+}
+
+void net_l4_csum(struct netbuf *nb, uint8_t proto, uint32_t daddr,
+				 size_t csum_offset) {
+	size_t len = netbuf_pkt_len(nb);
+	uint32_t sum = net_csum_pseudo(net_iface.addr, daddr, proto, len);
+	uint8_t *field = nb->data + csum_offset;
+	uint16_t csum;
+
+	if (net_iface.dev->features & NETDEV_F_TX_CSUM) {
+		// The device sums from csum_start on, over the pseudo-header sum
+		// left in the field.
+		nb->csum = NETBUF_CSUM_PARTIAL;
+		nb->csum_start = ETH_HLEN + IP_HLEN;
+		nb->csum_offset = csum_offset;
+		csum = ~net_csum_fold(sum);
+	} else {
+		field[0] = field[1] = 0;
+		nb->csum = NETBUF_CSUM_NONE;
+		csum = net_csum_fold(net_csum_pkt(sum, nb, 0));
+		// Zero means no checksum to UDP.
+		if (proto == IPPROTO_UDP && !csum) csum = 0xffff;
+	}
+	memcpy(field, &csum, 2);
+}
+
+bool net_l4_csum_ok(const struct netbuf *nb, uint8_t proto, uint32_t saddr) {
+	// Partial checksums come from a sender on the same host, over memory.
+	if (nb->csum != NETBUF_CSUM_NONE) return true;
+	uint32_t sum =
+		net_csum_pseudo(saddr, net_iface.addr, proto, netbuf_pkt_len(nb));
+	return !net_csum_fold(net_csum_pkt(sum, nb, 0));
+}
+
+void net_trim(struct netbuf *nb, size_t len) {
+	for (;;) {
+		if (nb->len >= len) {
+			nb->len = len;
+			netbuf_free(nb->frag);
+			nb->frag = NULL;
+			return;
+		}
+		len -= nb->len;
+		if (!nb->frag) return;
+		nb = nb->frag;
+	}
+}
+
+uint32_t ip_nexthop(uint32_t daddr) {
+	if ((daddr & net_iface.mask) == (net_iface.addr & net_iface.mask) ||
+		daddr == 0xffffffff)
+		return daddr;
+	return net_iface.gateway;
+}
+
+void ip_output(struct netbuf *nb, uint8_t proto, uint32_t daddr) {
+	struct net_hart *nh = net_this_hart();
+	size_t len = netbuf_pkt_len(nb) + IP_HLEN;
+	uint8_t *ip = netbuf_push(nb, IP_HLEN);
+	ip[0] = 0x45;
+	ip[1] = 0;
+	net_put16(ip + 2, len);
+	net_put16(ip + 4, nh->ip_id++);
+	net_put16(ip + 6, IP_DF);
+	ip[8] = IP_TTL;
+	ip[9] = proto;
+	ip[10] = ip[11] = 0;
+	net_put32(ip + 12, net_iface.addr);
+	net_put32(ip + 16, daddr);
+	uint16_t csum = net_csum_fold(net_csum(0, ip, IP_HLEN));
+	memcpy(ip + 10, &csum, 2);
+	arp_output(nb, ip_nexthop(daddr));
+}
+
+void ip_input(struct netbuf *nb) {
+	netbuf_pull(nb, ETH_HLEN);
+	const uint8_t *ip = nb->data;
+	if (nb->len < IP_HLEN || ip[0] >> 4 != 4) goto drop;
+	size_t ihl = (ip[0] & 0xf) * 4;
+	size_t len = net_get16(ip + 2);
+	if (ihl < IP_HLEN || ihl > nb->len || len < ihl ||
+		len > netbuf_pkt_len(nb) || net_csum_fold(net_csum(0, ip, ihl)))
+		goto drop;
+	if (net_get16(ip + 6) & 0x3fff) goto drop;
+	uint32_t daddr = net_get32(ip + 16);
+	if (daddr != net_iface.addr && daddr != 0xffffffff &&
+		daddr != (net_iface.addr | ~net_iface.mask))
+		goto drop;
+
+	uint8_t proto = ip[9];
+	uint32_t saddr = net_get32(ip + 12);
+	// Short frames come padded.
+	net_trim(nb, len);
+	netbuf_pull(nb, ihl);
+	switch (proto) {
+	case IPPROTO_ICMP:
+		icmp_input(nb, saddr);
+		return;
+	case IPPROTO_UDP:
+		udp_input(nb, saddr);
+		return;
+	case IPPROTO_TCP:
+		tcp_input(nb, saddr);
+		return;
+	}
+drop:
+	netbuf_free(nb);
+}
+
+void icmp_input(struct netbuf *nb, uint32_t saddr) {
+	uint8_t *icmp = nb->data;
+	if (nb->len < 8 || icmp[0] != ICMP_ECHO ||
+		net_csum_fold(net_csum_pkt(0, nb, 0))) {
+		netbuf_free(nb);
+		return;
+	}
+	// The request becomes the reply, where it is.
+	icmp[0] = ICMP_ECHO_REPLY;
+	icmp[2] = icmp[3] = 0;
+	uint16_t csum = net_csum_fold(net_csum_pkt(0, nb, 0));
+	memcpy(icmp + 2, &csum, 2);
+	nb->csum = NETBUF_CSUM_NONE;
+	nb->gso_type = NETBUF_GSO_NONE;
+	ip_output(nb, IPPROTO_ICMP, saddr);
+}
@@ -0,0 +1,389 @@
+#include "net.h"
+
+#include <stddef.h>
+
+#include "cache.h"
+#include "cmdline.h"
+#include "csr.h"
+#include "debug.h"
+#include "errno.h"
+#include "hart.h"
+#include "init.h"
+#include "initcall.h"
+#include "pool.h"
+#include "sched.h"
+#include "spinlock.h"
+
+/* Ephemeral ports for connecting sockets. */
+#define NET_PORT_FIRST 49152
+#define NET_PORT_COUNT 16384
+
+struct net_iface net_iface;
+struct net_hart net_harts[HART_MAX];
+static struct pool net_socks = POOL_INIT(sizeof(struct sock));
+
+bool net_ready(void) {
+	return __atomic_load_n(&net_iface.dev, __ATOMIC_ACQUIRE);
+}
+
+static uint32_t net_flow_hash(uint32_t raddr, uint16_t rport, uint16_t lport) {
+	uint64_t key = (uint64_t)raddr << 32 | (uint32_t)rport << 16 | lport;
+	return (key * 0x9e3779b97f4a7c15ull) >> 32;
+}
+
+unsigned int net_flow_hart(uint32_t raddr, uint16_t rport, uint16_t lport) {
+	return (uint64_t)net_flow_hash(raddr, rport, lport) * hart_count >> 32;
+}
+
+static struct sock **net_flow_bucket(struct net_hart *nh, uint32_t raddr,
+									 uint16_t rport, uint16_t lport) {
+	uint32_t hash = net_flow_hash(raddr, rport, lport);
+	return &nh->flows[hash % NET_FLOW_BUCKETS];
+}
+
+struct sock *net_flow_find(struct net_hart *nh, uint32_t raddr, uint16_t rport,
+						   uint16_t lport) {
+	struct sock *s = *net_flow_bucket(nh, raddr, rport, lport);
+	while (s && (s->raddr != raddr || s->rport != rport || s->lport != lport))
+		s = s->flow_next;
+	return s;
+}
+
+int net_flow_connect(struct sock *s, uint32_t raddr, uint16_t rport) {
+	struct net_hart *nh = net_this_hart();
+	unsigned int self = hart_index();
+
+	// Every hart gets about one port in hart_count, so this finds one fast.
+	for (unsigned int i = 0; i < NET_PORT_COUNT; i++) {
+		uint16_t lport = NET_PORT_FIRST + nh->next_port++ % NET_PORT_COUNT;
+		if (net_flow_hart(raddr, rport, lport) != self ||
+			net_flow_find(nh, raddr, rport, lport))
+			continue;
+
+		s->raddr = raddr;
+		s->rport = rport;
+		s->lport = lport;
+		struct sock **bucket = net_flow_bucket(nh, raddr, rport, lport);
+		s->flow_next = *bucket;
+		*bucket = s;
+		s->hashed = true;
+		return 0;
+	}
+	return -EADDRINUSE;
+}
+
+void net_flow_remove(struct sock *s) {
+	if (!s->hashed) return;
+	struct sock **link =
+		net_flow_bucket(&net_harts[s->hart], s->raddr, s->rport, s->lport);
+	while (*link != s) link = &(*link)->flow_next;
+	*link = s->flow_next;
+	s->hashed = false;
+}
+
+void net_sock_timer(struct sock *s, uint64_t deadline) {
+	struct net_hart *nh = &net_harts[s->hart];
+	s->deadline = deadline;
+	if (!deadline) return;
+	if (!s->timer_listed) {
+		s->timer_next = nh->timers;
+		nh->timers = s;
+		s->timer_listed = true;
+	}
+	// Armed from an application thread, the stack thread may be asleep
+	// until later or for good.
+	if (deadline < nh->sleep_until) {
+		nh->sleep_until = deadline;
+		sched_wake(nh->thread);
+	}
+}
+
+void net_sock_wake(struct sock *s) {
+	if (s->waiter) sched_wake(s->waiter);
+}
+
+int net_sock_wait(struct sock *s, uint64_t deadline) {
+	if (deadline && rdtime() >= deadline) return -EAGAIN;
+	if (sched_interrupted()) return -ECANCELED;
+	if (sched_can_block()) {
+		s->waiter = sched_current();
+		if (deadline)
+			sched_block_until(deadline);
+		else
+			sched_block();
+		s->waiter = NULL;
+	} else {
+		// A hart's idle thread cannot sleep; it lets the stack's threads
+		// on the hart run instead.
+		sched_yield();
+		cpu_relax();
+	}
+	return 0;
+}
+
+/* Runs the timeouts that are due and returns the next deadline. */
+static uint64_t net_run_timers(struct net_hart *nh, uint64_t now) {
+	struct sock **link = &nh->timers;
+	while (*link) {
+		struct sock *s = *link;
+		if (s->deadline && s->deadline > now) {
+			link = &s->timer_next;
+			continue;
+		}
+		// Off the list first: the timeout may re-arm or free the socket.
+		*link = s->timer_next;
+		s->timer_listed = false;
+		if (s->deadline) {
+			s->deadline = 0;
+			tcp_timeout(s, now);
+		}
+	}
+
+	uint64_t next = UINT64_MAX;
+	for (struct sock *s = nh->timers; s; s = s->timer_next) {
+		if (s->deadline && s->deadline < next) next = s->deadline;
+	}
+	return next;
+}
+
+static void net_timer_unlink(struct sock *s) {
+	if (!s->timer_listed) return;
+	struct sock **link = &net_harts[s->hart].timers;
+	while (*link != s) link = &(*link)->timer_next;
+	*link = s->timer_next;
+	s->timer_listed = false;
+}
+
+struct sock *net_sock_alloc(enum sock_type type) {
+	struct sock *s = pool_alloc(&net_socks);
+	if (!s) return NULL;
+	s->type = type;
+	s->hart = hart_index();
+	return s;
+}
+
+void net_sock_free(struct sock *s) {
+	struct net_hart *nh = &net_harts[s->hart];
+	net_flow_remove(s);
+	net_timer_unlink(s);
+	if (s->tcp.ack_listed) {
+		struct sock **link = &nh->acks;
+		while (*link != s) link = &(*link)->tcp.ack_next;
+		*link = s->tcp.ack_next;
+	}
+	netbuf_free_list(s->rcvq);
+	netbuf_free_list(s->tcp.sndq);
+	pool_free(&net_socks, s);
+}
+
+/* Handles packets received for flows of the calling hart. */
+static void net_input(struct net_hart *nh, struct netbuf *list) {
+	while (list) {
+		struct netbuf *nb = list;
+		list = nb->next;
+		nb->next = NULL;
+		// Fetch the next packet's headers while this one is handled.
+		if (list) prefetch_read(list->data);
+		ip_input(nb);
+	}
+	tcp_send_acks(nh);
+}
+
+/* The hart a received frame belongs to, or -1 if it was handled here. */
+static int net_classify(struct netbuf *nb) {
+	if (nb->len < ETH_HLEN) goto drop;
+	uint16_t type = net_get16(nb->data + 12);
+	if (type == ETH_P_ARP) {
+		netbuf_pull(nb, ETH_HLEN);
+		arp_input(nb);
+		return -1;
+	}
+	if (type != ETH_P_IP) goto drop;
+
+	// Transport flows go to the hart owning them. Fragments and anything
+	// else stay here.
+	const uint8_t *ip = nb->data + ETH_HLEN;
+	if (nb->len < ETH_HLEN + IP_HLEN) goto drop;
+	size_t ihl = (ip[0] & 0xf) * 4;
+	bool fragment = net_get16(ip + 6) & 0x3fff;
+	if ((ip[9] != IPPROTO_TCP && ip[9] != IPPROTO_UDP) || fragment ||
+		nb->len < ETH_HLEN + ihl + 4)
+		return hart_index();
+	const uint8_t *l4 = ip + ihl;
+	return net_flow_hart(net_get32(ip + 12), net_get16(l4), net_get16(l4 + 2));
+
+drop:
+	netbuf_free(nb);
+	return -1;
+}
+
+/* Hands a batch to another hart. head..tail is in reverse order, as the
+   inbox is a stack that its owner reverses. */
+static void net_inbox_push(struct net_hart *nh, struct netbuf *head,
+						   struct netbuf *tail) {
+	struct netbuf *old = __atomic_load_n(&nh->inbox, __ATOMIC_RELAXED);
+	do {
+		tail->next = old;
+	} while (!__atomic_compare_exchange_n(&nh->inbox, &old, head, true,
+										  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	sched_wake(nh->thread);
+}
+
+void net_sock_close_remote(struct sock *s) {
+	struct net_hart *nh = &net_harts[s->hart];
+	struct sock *old = __atomic_load_n(&nh->closing, __ATOMIC_RELAXED);
+	do {
+		s->close_next = old;
+	} while (!__atomic_compare_exchange_n(&nh->closing, &old, s, true,
+										  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	sched_wake(nh->thread);
+}
+
+/* Called from the device's poll threads. */
+static void net_rx(struct netdev *dev, struct netbuf *list) {
+	(void)dev;
+	unsigned int self = hart_index();
+	struct netbuf *heads[HART_MAX] = {0}, *tails[HART_MAX];
+	struct netbuf *local = NULL, **local_tail = &local;
+
+	while (list) {
+		struct netbuf *nb = list;
+		list = nb->next;
+		nb->next = NULL;
+		int hart = net_classify(nb);
+		if (hart < 0) continue;
+		if ((unsigned int)hart == self) {
+			*local_tail = nb;
+			local_tail = &nb->next;
+			continue;
+		}
+		if (!heads[hart]) tails[hart] = nb;
+		nb->next = heads[hart];
+		heads[hart] = nb;
+	}
+
+	for (unsigned int h = 0; h < hart_count; h++) {
+		if (heads[h]) net_inbox_push(&net_harts[h], heads[h], tails[h]);
+	}
+	if (local) net_input(&net_harts[self], local);
+}
+
+static void net_thread(void *arg) {
+	struct net_hart *nh = arg;
+	for (;;) {
+		struct netbuf *list =
+			__atomic_exchange_n(&nh->inbox, NULL, __ATOMIC_ACQUIRE);
+		struct netbuf *in_order = NULL;
+		while (list) {
+			struct netbuf *nb = list;
+			list = nb->next;
+			nb->next = in_order;
+			in_order = nb;
+			nh->stat_steered_in++;
+		}
+		if (in_order) net_input(nh, in_order);
+
+		struct sock *closing =
+			__atomic_exchange_n(&nh->closing, NULL, __ATOMIC_ACQUIRE);
+		while (closing) {
+			struct sock *s = closing;
+			closing = s->close_next;
+			sock_close(s);
+		}
+
+		uint64_t now = rdtime();
+		uint64_t next = net_run_timers(nh, now);
+		if (nh->arp_wait || __atomic_load_n(&nh->arp_update, __ATOMIC_ACQUIRE))
+			arp_retry(nh, now);
+		if (nh->arp_wait && nh->arp_retry < next) next = nh->arp_retry;
+		tcp_send_acks(nh);
+
+		nh->sleep_until = next;
+		if (next == UINT64_MAX)
+			sched_block();
+		else
+			sched_block_until(next);
+	}
+}
+
+static bool net_parse_addr(const char **p, const char *end, uint32_t *out) {
+	uint32_t addr = 0;
+	for (int i = 0; i < 4; i++) {
+		if (i) {
+			if (*p == end || **p != '.') return false;
+			(*p)++;
+		}
+		unsigned int byte = 0, digits = 0;
+		while (*p < end && **p >= '0' && **p <= '9' && digits < 3) {
+			byte = byte * 10 + *(*p)++ - '0';
+			digits++;
+		}
+		if (!digits || byte > 255) return false;
+		addr = addr << 8 | byte;
+	}
+	*out = addr;
+	return true;
+}
+
+/* ip=<addr>/<prefix>,<gateway> */
+static bool net_parse_config(const char *v, size_t len) {
+	const char *p = v, *end = v + len;
+	uint32_t addr, gateway;
+	unsigned int prefix = 0;
+	if (!net_parse_addr(&p, end, &addr) || p == end || *p++ != '/')
+		return false;
+	while (p < end && *p >= '0' && *p <= '9') prefix = prefix * 10 + *p++ - '0';
+	if (!prefix || prefix > 32 || p == end || *p++ != ',') return false;
+	if (!net_parse_addr(&p, end, &gateway) || p != end) return false;
+
+	net_iface.addr = addr;
+	net_iface.mask = ~0u << (32 - prefix);
+	net_iface.gateway = gateway;
+	return true;
+}
+
+static unsigned int net_prefix_len(uint32_t mask) {
+	unsigned int n = 0;
+	while (mask & (1u << 31)) {
+		mask <<= 1;
+		n++;
+	}
+	return n;
+}
+
+static void __init net_init(void) {
+	struct netdev *dev = netdev_get(0);
+	if (!dev) return;
+
+	// QEMU's user network.
+	net_iface.addr = IPV4_ADDR(10, 0, 2, 15);
+	net_iface.mask = IPV4_ADDR(255, 255, 255, 0);
+	net_iface.gateway = IPV4_ADDR(10, 0, 2, 2);
+	const char *v;
+	size_t len;
+	if (cmdline_get("ip", &v, &len) && !net_parse_config(v, len))
+		debug_printf("net: bad ip=, using the default\n");
+
+	for (unsigned int h = 0; h < hart_count; h++) {
+		struct net_hart *nh = &net_harts[h];
+		nh->pool = (struct netbuf_pool)NETBUF_POOL_INIT(0);
+		// Harts start their port searches apart.
+		nh->next_port = h * (NET_PORT_COUNT / hart_count);
+		nh->sleep_until = UINT64_MAX;
+		nh->thread = kthread_create(net_thread, nh, "net", h);
+		if (!nh->thread) {
+			debug_printf("net: out of memory\n");
+			return;
+		}
+	}
+
+	__atomic_store_n(&net_iface.dev, dev, __ATOMIC_RELEASE);
+	__atomic_store_n(&dev->rx, net_rx, __ATOMIC_RELEASE);
+	uint32_t a = net_iface.addr, g = net_iface.gateway;
+	debug_printf("net: %s %u.%u.%u.%u/%u via %u.%u.%u.%u\n", dev->name,
+				 a >> 24, a >> 16 & 0xff, a >> 8 & 0xff, a & 0xff,
+				 net_prefix_len(net_iface.mask), g >> 24, g >> 16 & 0xff,
+				 g >> 8 & 0xff, g & 0xff);
+}
+
+INITCALL(net, net_init, "virtio_net");
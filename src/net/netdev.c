@@ -0,0 +1,120 @@
+#include "netdev.h"
+
+#include <stddef.h>
+
+#include "debug.h"
+#include "pmm.h"
+#include "pool.h"
+#include "sched.h"
+#include "spinlock.h"
+
+static struct netdev *netdevs[NETDEV_MAX];
+static unsigned int netdev_count;
+static spinlock_t netdev_lock = SPINLOCK_INIT;
+static struct pool netbuf_clones = POOL_INIT(sizeof(struct netbuf));
+
+_Static_assert(sizeof(struct netbuf) <= NETBUF_HEADROOM / 2,
+			   "netbuf headroom must leave room for headers");
+
+struct netbuf *netbuf_alloc(struct netbuf_pool *pool) {
+	bool irq = spin_lock_irqsave(&pool->lock);
+	struct netbuf *nb = pool->free;
+	if (nb) pool->free = nb->next;
+	spin_unlock_irqrestore(&pool->lock, irq);
+
+	if (!nb) {
+		nb = pmm_alloc(pool->order);
+		if (!nb) return NULL;
+	}
+	*nb = (struct netbuf){
+		.pool = pool,
+		.block = nb,
+		.refs = 1,
+		.data = (uint8_t *)nb + NETBUF_HEADROOM,
+	};
+	return nb;
+}
+
+struct netbuf *netbuf_clone(struct netbuf *nb, size_t off, size_t len) {
+	struct netbuf *c = pool_alloc(&netbuf_clones);
+	if (!c) return NULL;
+	c->block = nb->block;
+	c->data = nb->data + off;
+	c->len = len;
+	__atomic_add_fetch(&c->block->refs, 1, __ATOMIC_RELAXED);
+	return c;
+}
+
+static void netbuf_put_block(struct netbuf *block) {
+	if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL)) return;
+	struct netbuf_pool *pool = block->pool;
+	bool irq = spin_lock_irqsave(&pool->lock);
+	block->next = pool->free;
+	pool->free = block;
+	spin_unlock_irqrestore(&pool->lock, irq);
+}
+
+void netbuf_free(struct netbuf *nb) {
+	while (nb) {
+		struct netbuf *frag = nb->frag;
+		struct netbuf *block = nb->block;
+		if (netbuf_is_clone(nb)) pool_free(&netbuf_clones, nb);
+		netbuf_put_block(block);
+		nb = frag;
+	}
+}
+
+void netbuf_free_list(struct netbuf *list) {
+	while (list) {
+		struct netbuf *next = list->next;
+		netbuf_free(list);
+		list = next;
+	}
+}
+
+static void napi_thread(void *arg) {
+	struct napi *n = arg;
+	for (;;) {
+		sched_block();
+		while (n->poll(n, NAPI_BUDGET) >= NAPI_BUDGET) {
+			n->stat_busy_polls++;
+			sched_yield();
+		}
+	}
+}
+
+bool napi_init(struct napi *n, napi_poll_t poll, void *priv, int hart) {
+	n->poll = poll;
+	n->priv = priv;
+	n->thread = kthread_create(napi_thread, n, "napi", hart);
+	return n->thread;
+}
+
+void napi_schedule(struct napi *n) {
+	__atomic_add_fetch(&n->stat_irqs, 1, __ATOMIC_RELAXED);
+	sched_wake(n->thread);
+}
+
+void netdev_register(struct netdev *dev) {
+	bool irq = spin_lock_irqsave(&netdev_lock);
+	bool added = netdev_count < NETDEV_MAX;
+	if (added) netdevs[netdev_count++] = dev;
+	spin_unlock_irqrestore(&netdev_lock, irq);
+
+	if (added)
+		debug_printf("net: %s, mac %02x:%02x:%02x:%02x:%02x:%02x, mtu %u, "
+					 "%u queues%s%s%s\n",
+					 dev->name, dev->mac[0], dev->mac[1], dev->mac[2],
+					 dev->mac[3], dev->mac[4], dev->mac[5], dev->mtu,
+					 dev->nqueues,
+					 dev->features & NETDEV_F_TX_CSUM ? ", tx csum" : "",
+					 dev->features & NETDEV_F_RX_CSUM ? ", rx csum" : "",
+					 dev->features & (NETDEV_F_TSO4 | NETDEV_F_TSO6) ? ", tso"
+																	 : "");
+}
+
+struct netdev *netdev_get(unsigned int index) {
+	return index < __atomic_load_n(&netdev_count, __ATOMIC_ACQUIRE)
+			   ? netdevs[index]
+			   : NULL;
+}
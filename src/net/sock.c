@@ -0,0 +1,192 @@
+/* Sockets: the application's side of UDP and TCP */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "csr.h"
+#include "errno.h"
+#include "hart.h"
+#include "net.h"
+#include "pool.h"
+#include "string.h"
+#include "vfs.h"
+
+/* A socket file's socket, and the packet being read, from offset off into
+   its buffer frag. */
+struct sock_file {
+	struct sock *s;
+	struct netbuf *rx, *frag;
+	size_t off;
+};
+
+static struct pool sock_file_pool = POOL_INIT(sizeof(struct sock_file));
+
+int sock_open(enum sock_type type, struct sock **out) {
+	if (!net_ready()) return -ENETUNREACH;
+	if (type != SOCK_UDP && type != SOCK_TCP) return -EINVAL;
+	struct sock *s = net_sock_alloc(type);
+	if (!s) return -ENOMEM;
+	*out = s;
+	return 0;
+}
+
+/* Sockets stay on the hart that opened them. */
+static bool sock_owned(const struct sock *s) {
+	return s->hart == hart_index();
+}
+
+int sock_connect(struct sock *s, uint32_t addr, uint16_t port) {
+	if (!sock_owned(s)) return -EINVAL;
+	if (s->type == SOCK_TCP) return tcp_connect(s, addr, port);
+	if (s->hashed) net_flow_remove(s);
+	return net_flow_connect(s, addr, port);
+}
+
+struct netbuf *sock_buf_alloc(struct sock *s) {
+	return netbuf_alloc(&net_harts[s->hart].pool);
+}
+
+int sock_send(struct sock *s, struct netbuf *nb) {
+	if (!sock_owned(s)) {
+		netbuf_free(nb);
+		return -EINVAL;
+	}
+	if (s->type == SOCK_TCP) return tcp_send(s, nb);
+	if (!s->hashed) {
+		netbuf_free(nb);
+		return -ENOTCONN;
+	}
+	return udp_send(s, nb);
+}
+
+long sock_recv(struct sock *s, struct netbuf **out, uint64_t timeout_us) {
+	if (!sock_owned(s)) return -EINVAL;
+	uint64_t deadline =
+		timeout_us ? rdtime() + clock_freq * timeout_us / 1000000 : 0;
+	while (!s->rcvq) {
+		if (s->err) return s->err;
+		if (s->rcv_eof) return 0;
+		if (s->type == SOCK_UDP && !s->hashed) return -ENOTCONN;
+		int err = net_sock_wait(s, deadline);
+		if (err) return err;
+	}
+
+	struct netbuf *nb = s->rcvq;
+	s->rcvq = nb->next;
+	if (!s->rcvq) s->rcvq_tail = NULL;
+	nb->next = NULL;
+	size_t len = netbuf_pkt_len(nb);
+	s->rcv_queued -= len;
+	if (s->type == SOCK_TCP) tcp_recvd(s);
+	*out = nb;
+	return len;
+}
+
+int sock_flush(struct sock *s) {
+	if (!sock_owned(s)) return -EINVAL;
+	return s->type == SOCK_TCP ? tcp_flush(s) : 0;
+}
+
+void sock_close(struct sock *s) {
+	// The hart's tables take no lock. The last file reference may go on
+	// another hart, from a forked child or a ring's polling thread.
+	if (!sock_owned(s)) {
+		net_sock_close_remote(s);
+		return;
+	}
+	if (s->type == SOCK_TCP)
+		tcp_close(s);
+	else
+		net_sock_free(s);
+}
+
+static long sock_file_read(struct file *f, uint64_t off, void *buf,
+						   size_t len) {
+	(void)off;
+	struct sock_file *sf = f->priv;
+	if (!sf->rx) {
+		long n = sock_recv(sf->s, &sf->rx, 0);
+		if (n <= 0) {
+			sf->rx = NULL;
+			return n;
+		}
+		sf->frag = sf->rx;
+		sf->off = 0;
+	}
+
+	size_t done = 0;
+	while (done < len && sf->frag) {
+		size_t n = sf->frag->len - sf->off;
+		if (n > len - done) n = len - done;
+		memcpy((char *)buf + done, sf->frag->data + sf->off, n);
+		done += n;
+		sf->off += n;
+		if (sf->off == sf->frag->len) {
+			sf->frag = sf->frag->frag;
+			sf->off = 0;
+		}
+	}
+	if (!sf->frag || sf->s->type == SOCK_UDP) {
+		netbuf_free(sf->rx);
+		sf->rx = NULL;
+	}
+	return done;
+}
+
+static long sock_file_write(struct file *f, const void *buf, size_t len) {
+	struct sock_file *sf = f->priv;
+	size_t done = 0;
+	while (done < len) {
+		struct netbuf *nb = sock_buf_alloc(sf->s);
+		if (!nb) return done ? (long)done : -ENOMEM;
+		size_t n = netbuf_tailroom(nb);
+		if (n > len - done) n = len - done;
+		if (sf->s->type == SOCK_UDP && n < len) {
+			netbuf_free(nb);
+			return -EMSGSIZE;
+		}
+		memcpy(netbuf_put(nb, n), (const char *)buf + done, n);
+		int err = sock_send(sf->s, nb);
+		if (err) return done ? (long)done : err;
+		done += n;
+	}
+	return done;
+}
+
+static void sock_file_release(struct file *f) {
+	struct sock_file *sf = f->priv;
+	if (sf->rx) netbuf_free(sf->rx);
+	sock_close(sf->s);
+	pool_free(&sock_file_pool, sf);
+}
+
+static const struct inode_ops sock_file_ops = {
+	.read = sock_file_read,
+	.write = sock_file_write,
+	.release = sock_file_release,
+};
+
+static struct inode sock_inode = {.ops = &sock_file_ops, .stream = true};
+
+int sock_file_open(enum sock_type type, uint32_t addr, uint16_t port,
+				   struct file **out) {
+	struct sock_file *sf = pool_alloc(&sock_file_pool);
+	if (!sf) return -ENOMEM;
+	int err = sock_open(type, &sf->s);
+	if (err) {
+		pool_free(&sock_file_pool, sf);
+		return err;
+	}
+	struct file *f;
+	err = sock_connect(sf->s, addr, port);
+	if (!err) err = vfs_open_inode(&sock_inode, &f);
+	if (err) {
+		sock_close(sf->s);
+		pool_free(&sock_file_pool, sf);
+		return err;
+	}
+	f->priv = sf;
+	*out = f;
+	return 0;
+}
@@ -0,0 +1,804 @@
+/* TCP
+
+   Connections are opened actively and closed from either side. Segments
+   are sent without copying: the application's buffers stay on the send
+   queue until acknowledged, and each segment is a header buffer followed
+   by clones of the queued data, which with segmentation offload can span
+   many segments. Received data is only taken in order; out-of-order
+   segments are dropped and get a duplicate ACK, which the sender's fast
+   retransmit answers. Congestion control is NewReno, with the
+   retransmission timeout of RFC 6298.
+
+   All of it runs on the hart owning the connection, so nothing here
+   takes a lock. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "csr.h"
+#include "errno.h"
+#include "net.h"
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_OPT_WSCALE 3
+/* MSS and window scale, in a SYN. */
+#define TCP_SYN_OPTLEN 8
+
+/* Without an MSS option, and the least taken from one. */
+#define TCP_MSS_DEFAULT 536
+#define TCP_MSS_MIN 88
+
+#define TCP_RTO_INIT_MS 1000
+#define TCP_RTO_MIN_MS 200
+#define TCP_RTO_MAX_MS 60000
+/* Timeouts in a row before giving up. */
+#define TCP_RETRIES 10
+#define TCP_SYN_RETRIES 5
+/* Much less than 2 MSL: ports are plentiful, and peers on the same network
+   do not hold on to old segments for minutes. */
+#define TCP_TIME_WAIT_MS 1000
+/* How long a closed connection waits for the peer's FIN. */
+#define TCP_FIN_WAIT_2_MS 10000
+
+static inline bool seq_lt(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) < 0;
+}
+
+static inline bool seq_le(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) <= 0;
+}
+
+static inline bool seq_gt(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) > 0;
+}
+
+static inline bool seq_ge(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) >= 0;
+}
+
+static uint64_t tcp_ms(uint64_t ms) {
+	return clock_freq * ms / 1000;
+}
+
+/* Receive window: what the receive queue has room for. */
+static uint32_t tcp_rcv_wnd(const struct sock *s) {
+	size_t wnd = s->rcv_queued < SOCK_RCVBUF ? SOCK_RCVBUF - s->rcv_queued : 0;
+	size_t max = (size_t)0xffff << s->tcp.rcv_wscale;
+	return wnd < max ? wnd : max;
+}
+
+/* Largest payload of a packet handed to the device. */
+static size_t tcp_max_seg(const struct sock *s) {
+	const struct netdev *dev = net_iface.dev;
+	size_t mss = s->tcp.mss;
+	unsigned int tso = NETDEV_F_TSO4 | NETDEV_F_TX_CSUM;
+	if ((dev->features & tso) != tso) return mss;
+	size_t max = dev->max_xmit - ETH_HLEN;
+	if (max > 0xffff) max = 0xffff;
+	max -= IP_HLEN + TCP_HLEN;
+	return max < mss ? mss : max - max % mss;
+}
+
+static void tcp_arm_rto(struct sock *s) {
+	struct tcp_sock *t = &s->tcp;
+	uint64_t rto = t->rto << t->backoff, max = tcp_ms(TCP_RTO_MAX_MS);
+	net_sock_timer(s, rdtime() + (rto < max ? rto : max));
+}
+
+static void tcp_rtt_sample(struct tcp_sock *t, uint64_t rtt) {
+	if (!rtt) rtt = 1;
+	if (!t->srtt) {
+		t->srtt = rtt;
+		t->rttvar = rtt / 2;
+	} else {
+		uint64_t delta = t->srtt > rtt ? t->srtt - rtt : rtt - t->srtt;
+		t->rttvar = (3 * t->rttvar + delta) / 4;
+		t->srtt = (7 * t->srtt + rtt) / 8;
+	}
+	uint64_t rto = t->srtt + 4 * t->rttvar;
+	uint64_t min = tcp_ms(TCP_RTO_MIN_MS), max = tcp_ms(TCP_RTO_MAX_MS);
+	t->rto = rto < min ? min : rto > max ? max : rto;
+}
+
+/* Sends a segment at seq carrying up to len bytes of the send queue from
+   there, fewer if the device takes too few buffers. A FIN in flags is only
+   sent with all of len. Returns the bytes sent, or -1 if out of memory. */
+static long tcp_xmit(struct sock *s, uint32_t seq, uint8_t flags, size_t len) {
+	struct tcp_sock *t = &s->tcp;
+	struct netdev *dev = net_iface.dev;
+
+	// The data, as clones of the queued buffers behind the header.
+	struct netbuf *data = NULL, **tail = &data;
+	size_t off = t->snd_off + (seq - t->snd_una), sent = 0;
+	unsigned int frags = 1;
+	for (struct netbuf *nb = t->sndq; nb && sent < len; nb = nb->next) {
+		if (off >= nb->len) {
+			off -= nb->len;
+			continue;
+		}
+		if (frags == dev->max_frags) break;
+		size_t n = nb->len - off < len - sent ? nb->len - off : len - sent;
+		struct netbuf *c = netbuf_clone(nb, off, n);
+		if (!c) break;
+		*tail = c;
+		tail = &c->frag;
+		frags++;
+		sent += n;
+		off = 0;
+	}
+	if (sent < len) flags &= ~TCP_FIN;
+
+	struct netbuf *nb = netbuf_alloc(&net_harts[s->hart].pool);
+	if (!nb) {
+		netbuf_free(data);
+		return -1;
+	}
+	size_t hlen = flags & TCP_SYN ? TCP_HLEN + TCP_SYN_OPTLEN : TCP_HLEN;
+	uint8_t *tcp = netbuf_put(nb, hlen);
+	uint32_t wnd = tcp_rcv_wnd(s);
+	net_put16(tcp, s->lport);
+	net_put16(tcp + 2, s->rport);
+	net_put32(tcp + 4, seq);
+	net_put32(tcp + 8, flags & TCP_ACK ? t->rcv_nxt : 0);
+	tcp[12] = hlen / 4 << 4;
+	tcp[13] = flags;
+	// The window in a SYN is never scaled.
+	if (flags & TCP_SYN)
+		net_put16(tcp + 14, wnd < 0xffff ? wnd : 0xffff);
+	else
+		net_put16(tcp + 14, wnd >> t->rcv_wscale);
+	net_put32(tcp + 16, 0);
+	if (flags & TCP_SYN) {
+		tcp[20] = TCP_OPT_MSS;
+		tcp[21] = 4;
+		net_put16(tcp + 22, dev->mtu - IP_HLEN - TCP_HLEN);
+		tcp[24] = TCP_OPT_NOP;
+		tcp[25] = TCP_OPT_WSCALE;
+		tcp[26] = 3;
+		tcp[27] = t->rcv_wscale;
+	}
+	nb->frag = data;
+
+	if (sent > t->mss) {
+		nb->gso_type = NETBUF_GSO_TCPV4;
+		nb->gso_size = t->mss;
+	}
+	net_l4_csum(nb, IPPROTO_TCP, s->raddr, 16);
+	ip_output(nb, IPPROTO_TCP, s->raddr);
+
+	t->stat_segs_out++;
+	if (seq_lt(seq, t->snd_max) && (sent || flags & (TCP_SYN | TCP_FIN)))
+		t->stat_retransmits++;
+	if (flags & TCP_ACK) {
+		t->ack_pending = false;
+		t->rcv_adv = t->rcv_nxt + (wnd >> t->rcv_wscale << t->rcv_wscale);
+	}
+	return sent;
+}
+
+static void tcp_send_ack(struct sock *s) {
+	tcp_xmit(s, s->tcp.snd_nxt, TCP_ACK, 0);
+}
+
+/* Owes the peer an ACK, sent at the end of the batch. */
+static void tcp_ack_later(struct sock *s) {
+	struct tcp_sock *t = &s->tcp;
+	t->ack_pending = true;
+	if (t->ack_listed) return;
+	struct net_hart *nh = &net_harts[s->hart];
+	t->ack_next = nh->acks;
+	nh->acks = s;
+	t->ack_listed = true;
+}
+
+void tcp_send_acks(struct net_hart *nh) {
+	struct sock *s;
+	while ((s = nh->acks)) {
+		nh->acks = s->tcp.ack_next;
+		s->tcp.ack_listed = false;
+		if (s->tcp.ack_pending) tcp_send_ack(s);
+	}
+}
+
+/* Answers a segment for no connection with a reset, reusing its buffer. */
+static void tcp_reset(struct netbuf *nb, uint32_t saddr, size_t seglen) {
+	uint8_t *tcp = nb->data;
+	uint8_t flags = tcp[13];
+	uint32_t seq = net_get32(tcp + 4), ack = net_get32(tcp + 8);
+	uint16_t sport = net_get16(tcp), dport = net_get16(tcp + 2);
+
+	nb->len = TCP_HLEN;
+	netbuf_free(nb->frag);
+	nb->frag = NULL;
+	nb->csum = NETBUF_CSUM_NONE;
+	nb->gso_type = NETBUF_GSO_NONE;
+	net_put16(tcp, dport);
+	net_put16(tcp + 2, sport);
+	if (flags & TCP_ACK) {
+		net_put32(tcp + 4, ack);
+		net_put32(tcp + 8, 0);
+		tcp[13] = TCP_RST;
+	} else {
+		seglen += !!(flags & TCP_SYN) + !!(flags & TCP_FIN);
+		net_put32(tcp + 4, 0);
+		net_put32(tcp + 8, seq + seglen);
+		tcp[13] = TCP_RST | TCP_ACK;
+	}
+	tcp[12] = TCP_HLEN / 4 << 4;
+	net_put16(tcp + 14, 0);
+	net_put32(tcp + 16, 0);
+	net_l4_csum(nb, IPPROTO_TCP, saddr, 16);
+	ip_output(nb, IPPROTO_TCP, saddr);
+}
+
+/* The connection is over. An orphan is freed; otherwise the application
+   finds it closed. */
+static void tcp_done(struct sock *s) {
+	s->tcp.state = TCP_CLOSED;
+	net_sock_timer(s, 0);
+	if (s->orphan) {
+		net_sock_free(s);
+		return;
+	}
+	net_flow_remove(s);
+	net_sock_wake(s);
+}
+
+static void tcp_abort(struct sock *s, int err) {
+	s->err = err;
+	s->rcv_eof = true;
+	tcp_done(s);
+}
+
+/* Sends what the windows allow. */
+static void tcp_output(struct sock *s) {
+	struct tcp_sock *t = &s->tcp;
+	switch (t->state) {
+	case TCP_ESTABLISHED:
+	case TCP_CLOSE_WAIT:
+	case TCP_FIN_WAIT_1:
+	case TCP_CLOSING:
+	case TCP_LAST_ACK:
+		break;
+	default:
+		return;
+	}
+
+	size_t max_seg = tcp_max_seg(s);
+	uint32_t data_end = t->snd_una + t->snd_queued;
+	for (;;) {
+		uint32_t flight = t->snd_nxt - t->snd_una;
+		uint32_t wnd = t->snd_wnd < t->cwnd ? t->snd_wnd : t->cwnd;
+		// A zero window is probed a byte at a time, on the retransmission
+		// timer.
+		if (!t->snd_wnd && !flight) wnd = 1;
+		size_t avail = seq_lt(t->snd_nxt, data_end) ? data_end - t->snd_nxt : 0;
+		size_t len = wnd > flight ? wnd - flight : 0;
+		if (len > avail) len = avail;
+		if (len > max_seg) len = max_seg;
+		bool fin = t->fin_queued && t->snd_nxt + len == data_end;
+		if (!len && !fin) break;
+		// Silly window avoidance: a short segment waits while more is
+		// queued and something is in flight to bring an ACK.
+		if (len < avail && len < max_seg && flight) break;
+
+		uint8_t flags = TCP_ACK | (len == avail ? TCP_PSH : 0);
+		long n = tcp_xmit(s, t->snd_nxt, flags | (fin ? TCP_FIN : 0), len);
+		if (n < 0) break;
+		// Time one segment of new data per round trip, and none resent.
+		if (!t->timing && n && seq_ge(t->snd_nxt, t->snd_max)) {
+			t->timing = true;
+			t->rtt_seq = t->snd_nxt;
+			t->rtt_start = rdtime();
+		}
+		t->snd_nxt += n + (fin && (size_t)n == len);
+		if (seq_gt(t->snd_nxt, t->snd_max)) t->snd_max = t->snd_nxt;
+		if (!s->deadline) tcp_arm_rto(s);
+		if (!n) break;
+	}
+}
+
+/* Takes n acknowledged bytes off the send queue. */
+static void tcp_sndq_drop(struct tcp_sock *t, size_t n) {
+	t->snd_queued -= n;
+	while (n) {
+		struct netbuf *nb = t->sndq;
+		size_t left = nb->len - t->snd_off;
+		if (n < left) {
+			t->snd_off += n;
+			return;
+		}
+		n -= left;
+		t->snd_off = 0;
+		t->sndq = nb->next;
+		if (!t->sndq) t->sndq_tail = NULL;
+		netbuf_free(nb);
+	}
+}
+
+static void tcp_fast_retransmit(struct sock *s) {
+	struct tcp_sock *t = &s->tcp;
+	size_t len = t->snd_queued < t->mss ? t->snd_queued : t->mss;
+	bool fin = t->fin_queued && len == t->snd_queued;
+	t->timing = false;
+	tcp_xmit(s, t->snd_una, TCP_ACK | (fin ? TCP_FIN : 0), len);
+}
+
+/* Handles a segment's acknowledgment and window. Returns false if the rest
+   of the segment is to be dropped: it acknowledged something never sent,
+   or the connection ended. */
+static bool tcp_ack(struct sock *s, uint32_t seq, uint32_t ack, uint32_t wnd,
+					size_t seglen) {
+	struct tcp_sock *t = &s->tcp;
+	if (seq_gt(ack, t->snd_max)) {
+		tcp_send_ack(s);
+		return false;
+	}
+
+	uint32_t old_wnd = t->snd_wnd;
+	if (seq_lt(t->snd_wl1, seq) ||
+		(t->snd_wl1 == seq && seq_le(t->snd_wl2, ack))) {
+		t->snd_wnd = wnd;
+		t->snd_wl1 = seq;
+		t->snd_wl2 = ack;
+	}
+
+	if (seq_le(ack, t->snd_una)) {
+		// A duplicate: nothing new acknowledged, no data and the same open
+		// window, with data outstanding.
+		if (ack != t->snd_una || seglen || wnd != old_wnd || !wnd ||
+			t->snd_una == t->snd_max)
+			return true;
+		if (t->in_recovery) {
+			t->cwnd += t->mss;
+			tcp_output(s);
+		} else if (++t->dupacks == 3) {
+			uint32_t flight = t->snd_max - t->snd_una;
+			t->ssthresh = flight / 2 > 2u * t->mss ? flight / 2 : 2u * t->mss;
+			t->recover = t->snd_max;
+			t->in_recovery = true;
+			tcp_fast_retransmit(s);
+			t->cwnd = t->ssthresh + 3 * t->mss;
+		}
+		return true;
+	}
+
+	uint32_t acked = ack - t->snd_una;
+	bool fin_acked = t->fin_queued && ack == t->snd_una + t->snd_queued + 1;
+	if (t->timing && seq_gt(ack, t->rtt_seq)) {
+		tcp_rtt_sample(t, rdtime() - t->rtt_start);
+		t->timing = false;
+	}
+	tcp_sndq_drop(t, acked - fin_acked);
+	t->snd_una = ack;
+	if (seq_lt(t->snd_nxt, t->snd_una)) t->snd_nxt = t->snd_una;
+	t->backoff = 0;
+
+	if (t->in_recovery) {
+		if (seq_ge(ack, t->recover)) {
+			t->in_recovery = false;
+			t->cwnd = t->ssthresh;
+		} else {
+			// A partial ACK: the next hole is resent at once, and the
+			// window deflated by what left the network.
+			tcp_fast_retransmit(s);
+			t->cwnd -= acked < t->cwnd ? acked : t->cwnd;
+			t->cwnd += t->mss;
+		}
+	} else if (t->cwnd < t->ssthresh) {
+		t->cwnd += acked < t->mss ? acked : t->mss;
+	} else {
+		uint32_t inc = (uint64_t)t->mss * t->mss / t->cwnd;
+		t->cwnd += inc ? inc : 1;
+	}
+	t->dupacks = 0;
+
+	if (t->snd_una == t->snd_max)
+		net_sock_timer(s, 0);
+	else
+		tcp_arm_rto(s);
+	net_sock_wake(s);
+
+	if (!fin_acked) return true;
+	switch (t->state) {
+	case TCP_FIN_WAIT_1:
+		t->state = TCP_FIN_WAIT_2;
+		net_sock_timer(s, rdtime() + tcp_ms(TCP_FIN_WAIT_2_MS));
+		return true;
+	case TCP_CLOSING:
+		t->state = TCP_TIME_WAIT;
+		net_sock_timer(s, rdtime() + tcp_ms(TCP_TIME_WAIT_MS));
+		return true;
+	case TCP_LAST_ACK:
+		tcp_done(s);
+		return false;
+	default:
+		return true;
+	}
+}
+
+/* The peer's MSS and window scale from a SYN's options, -1 for none. */
+static void tcp_parse_syn_opts(const uint8_t *opt, size_t len, int *mss,
+							   int *wscale) {
+	*mss = *wscale = -1;
+	while (len) {
+		if (opt[0] == TCP_OPT_END) return;
+		if (opt[0] == TCP_OPT_NOP) {
+			opt++;
+			len--;
+			continue;
+		}
+		if (len < 2 || opt[1] < 2 || opt[1] > len) return;
+		if (opt[0] == TCP_OPT_MSS && opt[1] == 4) *mss = net_get16(opt + 2);
+		if (opt[0] == TCP_OPT_WSCALE && opt[1] == 3)
+			*wscale = opt[2] > 14 ? 14 : opt[2];
+		len -= opt[1];
+		opt += opt[1];
+	}
+}
+
+/* Handles the answer to our SYN. */
+static void tcp_syn_sent(struct sock *s, struct netbuf *nb, uint32_t saddr) {
+	struct tcp_sock *t = &s->tcp;
+	const uint8_t *tcp = nb->data;
+	uint8_t flags = tcp[13];
+	uint32_t seq = net_get32(tcp + 4), ack = net_get32(tcp + 8);
+
+	if (flags & TCP_ACK && ack != t->iss + 1) {
+		if (flags & TCP_RST)
+			netbuf_free(nb);
+		else
+			tcp_reset(nb, saddr, netbuf_pkt_len(nb) - (tcp[12] >> 4) * 4);
+		return;
+	}
+	if (flags & TCP_RST) {
+		if (flags & TCP_ACK) tcp_abort(s, -ECONNREFUSED);
+		netbuf_free(nb);
+		return;
+	}
+	// No simultaneous open.
+	if (!(flags & TCP_SYN) || !(flags & TCP_ACK)) {
+		netbuf_free(nb);
+		return;
+	}
+
+	int mss, wscale;
+	tcp_parse_syn_opts(tcp + TCP_HLEN, (tcp[12] >> 4) * 4 - TCP_HLEN, &mss,
+					   &wscale);
+	size_t max_mss = net_iface.dev->mtu - IP_HLEN - TCP_HLEN;
+	t->mss = mss < 0 ? TCP_MSS_DEFAULT : mss < TCP_MSS_MIN ? TCP_MSS_MIN : mss;
+	if (t->mss > max_mss) t->mss = max_mss;
+	if (wscale < 0)
+		t->snd_wscale = t->rcv_wscale = 0;
+	else
+		t->snd_wscale = wscale;
+	t->snd_wnd = net_get16(tcp + 14);
+	t->snd_wl1 = seq;
+	t->snd_wl2 = ack;
+	t->snd_una = ack;
+	t->rcv_nxt = seq + 1;
+	netbuf_free(nb);
+
+	// RFC 6928's initial window.
+	uint32_t iw = 2u * t->mss > 14600 ? 2u * t->mss : 14600;
+	t->cwnd = iw < 10u * t->mss ? iw : 10u * t->mss;
+	t->ssthresh = UINT32_MAX;
+	if (t->timing) tcp_rtt_sample(t, rdtime() - t->rtt_start);
+	t->timing = false;
+	t->backoff = 0;
+	t->state = TCP_ESTABLISHED;
+	net_sock_timer(s, 0);
+	tcp_send_ack(s);
+	net_sock_wake(s);
+}
+
+/* Strips n bytes from the front of a packet. */
+static void tcp_pull(struct netbuf *nb, size_t n) {
+	for (; n; nb = nb->frag) {
+		size_t pull = n < nb->len ? n : nb->len;
+		netbuf_pull(nb, pull);
+		n -= pull;
+	}
+}
+
+static void tcp_fin(struct sock *s) {
+	struct tcp_sock *t = &s->tcp;
+	t->rcv_nxt++;
+	s->rcv_eof = true;
+	switch (t->state) {
+	case TCP_ESTABLISHED:
+		t->state = TCP_CLOSE_WAIT;
+		break;
+	case TCP_FIN_WAIT_1:
+		t->state = TCP_CLOSING;
+		break;
+	case TCP_FIN_WAIT_2:
+		t->state = TCP_TIME_WAIT;
+		net_sock_timer(s, rdtime() + tcp_ms(TCP_TIME_WAIT_MS));
+		break;
+	default:
+		break;
+	}
+	net_sock_wake(s);
+}
+
+void tcp_input(struct netbuf *nb, uint32_t saddr) {
+	uint8_t *tcp = nb->data;
+	if (nb->len < TCP_HLEN) goto drop;
+	size_t hlen = (tcp[12] >> 4) * 4;
+	if (hlen < TCP_HLEN || hlen > nb->len ||
+		!net_l4_csum_ok(nb, IPPROTO_TCP, saddr))
+		goto drop;
+	uint8_t flags = tcp[13];
+	size_t seglen = netbuf_pkt_len(nb) - hlen;
+
+	struct sock *s = net_flow_find(net_this_hart(), saddr, net_get16(tcp),
+								   net_get16(tcp + 2));
+	if (!s || s->type != SOCK_TCP || s->tcp.state == TCP_CLOSED) {
+		if (flags & TCP_RST) goto drop;
+		tcp_reset(nb, saddr, seglen);
+		return;
+	}
+	struct tcp_sock *t = &s->tcp;
+	if (t->state == TCP_SYN_SENT) {
+		tcp_syn_sent(s, nb, saddr);
+		return;
+	}
+
+	uint32_t seq = net_get32(tcp + 4), ack = net_get32(tcp + 8);
+	if (flags & TCP_RST) {
+		// Only an exact match, so that a blind reset must guess it.
+		if (seq == t->rcv_nxt) tcp_abort(s, -ECONNRESET);
+		goto drop;
+	}
+	if (flags & TCP_SYN) {
+		tcp_send_ack(s);
+		goto drop;
+	}
+	if (!(flags & TCP_ACK)) goto drop;
+	if (!tcp_ack(s, seq, ack, (uint32_t)net_get16(tcp + 14) << t->snd_wscale,
+				 seglen))
+		goto drop;
+
+	bool fin = flags & TCP_FIN;
+	if (!seglen && !fin) goto out;
+	if (seq_gt(seq, t->rcv_nxt)) {
+		// Out of order: the duplicate ACK tells the sender what is missing.
+		tcp_send_ack(s);
+		goto out;
+	}
+	uint32_t dup = t->rcv_nxt - seq;
+	if (dup >= seglen + fin) {
+		// Old, resent because our ACK got lost.
+		tcp_send_ack(s);
+		if (t->state == TCP_TIME_WAIT)
+			net_sock_timer(s, rdtime() + tcp_ms(TCP_TIME_WAIT_MS));
+		goto out;
+	}
+	if (dup >= seglen) {
+		seglen = 0;
+	} else {
+		seglen -= dup;
+		hlen += dup;
+	}
+	// After our FIN went out, or once theirs came, data is not expected.
+	switch (t->state) {
+	case TCP_ESTABLISHED:
+	case TCP_FIN_WAIT_1:
+	case TCP_FIN_WAIT_2:
+		break;
+	default:
+		goto out;
+	}
+
+	uint32_t room = tcp_rcv_wnd(s);
+	if (seglen > room) {
+		seglen = room;
+		fin = false;
+	}
+	if (seglen) {
+		tcp_pull(nb, hlen);
+		net_trim(nb, seglen);
+		nb->next = NULL;
+		if (s->rcvq_tail)
+			s->rcvq_tail->next = nb;
+		else
+			s->rcvq = nb;
+		s->rcvq_tail = nb;
+		s->rcv_queued += seglen;
+		t->rcv_nxt += seglen;
+		nb = NULL;
+		net_sock_wake(s);
+		tcp_ack_later(s);
+	}
+	if (fin) {
+		tcp_fin(s);
+		tcp_send_ack(s);
+	}
+out:
+	tcp_output(s);
+drop:
+	netbuf_free(nb);
+}
+
+void tcp_recvd(struct sock *s) {
+	struct tcp_sock *t = &s->tcp;
+	switch (t->state) {
+	case TCP_ESTABLISHED:
+	case TCP_FIN_WAIT_1:
+	case TCP_FIN_WAIT_2:
+		break;
+	default:
+		return;
+	}
+	// Updates the window once it opened by a good part of the buffer.
+	uint32_t edge = t->rcv_nxt + tcp_rcv_wnd(s);
+	uint32_t step = 2u * t->mss < SOCK_RCVBUF / 2 ? 2u * t->mss : SOCK_RCVBUF / 2;
+	if (seq_ge(edge, t->rcv_adv + step)) tcp_send_ack(s);
+}
+
+int tcp_connect(struct sock *s, uint32_t addr, uint16_t port) {
+	struct tcp_sock *t = &s->tcp;
+	if (t->state != TCP_CLOSED || s->hashed) return -EINVAL;
+	int err = net_flow_connect(s, addr, port);
+	if (err) return err;
+
+	s->err = 0;
+	s->rcv_eof = false;
+	t->rcv_wscale = 0;
+	while ((size_t)0xffff << t->rcv_wscale < SOCK_RCVBUF) t->rcv_wscale++;
+	t->iss = (uint32_t)rdtime() * 0x9e3779b1u + ((uint32_t)s->lport << 16);
+	t->snd_una = t->snd_nxt = t->snd_max = t->iss;
+	t->mss = TCP_MSS_DEFAULT;
+	t->rto = tcp_ms(TCP_RTO_INIT_MS);
+	t->backoff = 0;
+	t->state = TCP_SYN_SENT;
+	tcp_xmit(s, t->iss, TCP_SYN, 0);
+	t->snd_nxt = t->snd_max = t->iss + 1;
+	t->timing = true;
+	t->rtt_start = rdtime();
+	tcp_arm_rto(s);
+
+	while (t->state == TCP_SYN_SENT) {
+		int err = net_sock_wait(s, 0);
+		if (err) return err;
+	}
+	return t->state == TCP_ESTABLISHED ? 0 : s->err;
+}
+
+static int tcp_send_err(struct sock *s) {
+	if (s->err) return s->err;
+	switch (s->tcp.state) {
+	case TCP_ESTABLISHED:
+	case TCP_CLOSE_WAIT:
+		return 0;
+	case TCP_CLOSED:
+	case TCP_SYN_SENT:
+		return -ENOTCONN;
+	default:
+		return -EPIPE;
+	}
+}
+
+int tcp_send(struct sock *s, struct netbuf *nb) {
+	struct tcp_sock *t = &s->tcp;
+	// Each of the packet's buffers goes on the queue by itself.
+	while (nb) {
+		int err = tcp_send_err(s);
+		if (err) {
+			netbuf_free(nb);
+			return err;
+		}
+		if (t->snd_queued >= SOCK_SNDBUF) {
+			tcp_output(s);
+			err = net_sock_wait(s, 0);
+			if (err) {
+				netbuf_free(nb);
+				return err;
+			}
+			continue;
+		}
+		struct netbuf *frag = nb->frag;
+		nb->frag = NULL;
+		nb->next = NULL;
+		if (!nb->len) {
+			netbuf_free(nb);
+		} else {
+			if (t->sndq_tail)
+				t->sndq_tail->next = nb;
+			else
+				t->sndq = nb;
+			t->sndq_tail = nb;
+			t->snd_queued += nb->len;
+		}
+		nb = frag;
+	}
+	tcp_output(s);
+	return 0;
+}
+
+int tcp_flush(struct sock *s) {
+	for (;;) {
+		int err = tcp_send_err(s);
+		if (err || !s->tcp.snd_queued) return err;
+		err = net_sock_wait(s, 0);
+		if (err) return err;
+	}
+}
+
+void tcp_close(struct sock *s) {
+	struct tcp_sock *t = &s->tcp;
+	s->orphan = true;
+	netbuf_free_list(s->rcvq);
+	s->rcvq = s->rcvq_tail = NULL;
+	s->rcv_queued = 0;
+
+	switch (t->state) {
+	case TCP_CLOSED:
+	case TCP_SYN_SENT:
+		net_sock_free(s);
+		return;
+	case TCP_ESTABLISHED:
+		t->state = TCP_FIN_WAIT_1;
+		break;
+	case TCP_CLOSE_WAIT:
+		t->state = TCP_LAST_ACK;
+		break;
+	default:
+		return;
+	}
+	t->fin_queued = true;
+	tcp_output(s);
+}
+
+void tcp_timeout(struct sock *s, uint64_t now) {
+	struct tcp_sock *t = &s->tcp;
+	(void)now;
+	switch (t->state) {
+	case TCP_CLOSED:
+		return;
+	case TCP_FIN_WAIT_2:
+	case TCP_TIME_WAIT:
+		tcp_done(s);
+		return;
+	default:
+		break;
+	}
+	if (t->snd_una == t->snd_max) return;
+
+	// Probing a zero window goes on for as long as it takes.
+	bool syn = t->state == TCP_SYN_SENT;
+	unsigned int retries = syn ? TCP_SYN_RETRIES : TCP_RETRIES;
+	if (t->backoff < retries) {
+		t->backoff++;
+	} else if (syn || t->snd_wnd) {
+		tcp_abort(s, -ETIMEDOUT);
+		return;
+	}
+	t->timing = false;
+	if (syn) {
+		tcp_xmit(s, t->iss, TCP_SYN, 0);
+		tcp_arm_rto(s);
+		return;
+	}
+
+	// Everything from the oldest unacknowledged byte goes again, starting
+	// from one segment.
+	uint32_t flight = t->snd_max - t->snd_una;
+	t->ssthresh = flight / 2 > 2u * t->mss ? flight / 2 : 2u * t->mss;
+	t->cwnd = t->mss;
+	t->in_recovery = false;
+	t->dupacks = 0;
+	t->snd_nxt = t->snd_una;
+	tcp_output(s);
+	tcp_arm_rto(s);
+}
@@ -0,0 +1,56 @@
+/* UDP on connected sockets */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "errno.h"
+#include "net.h"
+
+int udp_send(struct sock *s, struct netbuf *nb) {
+	size_t len = netbuf_pkt_len(nb) + UDP_HLEN;
+	if (len + IP_HLEN > net_iface.dev->mtu) {
+		netbuf_free(nb);
+		return -EMSGSIZE;
+	}
+	if (netbuf_headroom(nb) < ETH_HLEN + IP_HLEN + UDP_HLEN) {
+		netbuf_free(nb);
+		return -EINVAL;
+	}
+
+	uint8_t *udp = netbuf_push(nb, UDP_HLEN);
+	net_put16(udp, s->lport);
+	net_put16(udp + 2, s->rport);
+	net_put16(udp + 4, len);
+	net_l4_csum(nb, IPPROTO_UDP, s->raddr, 6);
+	ip_output(nb, IPPROTO_UDP, s->raddr);
+	return 0;
+}
+
+void udp_input(struct netbuf *nb, uint32_t saddr) {
+	const uint8_t *udp = nb->data;
+	if (nb->len < UDP_HLEN) goto drop;
+	size_t len = net_get16(udp + 4);
+	if (len < UDP_HLEN || len > netbuf_pkt_len(nb)) goto drop;
+	net_trim(nb, len);
+	if (net_get16(udp + 6) && !net_l4_csum_ok(nb, IPPROTO_UDP, saddr))
+		goto drop;
+
+	struct sock *s = net_flow_find(net_this_hart(), saddr, net_get16(udp),
+								   net_get16(udp + 2));
+	if (!s || s->type != SOCK_UDP || s->rcv_queued + len > SOCK_RCVBUF)
+		goto drop;
+
+	netbuf_pull(nb, UDP_HLEN);
+	nb->next = NULL;
+	if (s->rcvq_tail)
+		s->rcvq_tail->next = nb;
+	else
+		s->rcvq = nb;
+	s->rcvq_tail = nb;
+	s->rcv_queued += len - UDP_HLEN;
+	net_sock_wake(s);
+	return;
+
+drop:
+	netbuf_free(nb);
+}
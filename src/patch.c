@@ -0,0 +1,24 @@
+#include "patch.h"
+
+#include "hart.h"
+#include "limine/features.h"
+#include "sbi.h"
+
+uint32_t rv_insn_jump(unsigned long pc, unsigned long target) {
+	unsigned long off = target - pc;
+	// jal x0, off: imm[20|10:1|11|19:12] rd opcode
+	return ((off & 0x100000) << 11) | ((off & 0x7fe) << 20) |
+		   ((off & 0x800) << 9) | (off & 0xff000) | 0x6f;
+}
+
+void patch_insn(void *addr, uint32_t insn) {
+	uintptr_t phys = (uintptr_t)LIMINE_EXE_VTOP(addr);
+	volatile uint32_t *alias = (volatile uint32_t *)(phys + limine_hhdm_offset);
+	*alias = insn;
+}
+
+void patch_commit(void) {
+	asm volatile("fence.i" ::: "memory");
+	// A hart_mask_base of -1 targets every hart.
+	if (hart_count > 1 && sbi_capabilities.rfence) sbi_remote_fence_i(0, -1ul);
+}
@@ -0,0 +1,480 @@
+#include "pcache.h"
+
+#include <stddef.h>
+
+#include "init.h"
+#include "initcall.h"
+#include "pmm.h"
+#include "pool.h"
+#include "radix.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "string.h"
+
+/* Read-ahead windows, in pages. */
+#define PCACHE_RA_INIT 4
+#define PCACHE_RA_MAX 128
+
+/* Dirty pages that wake the writeback thread, and pages written per
+   batch. */
+#define PCACHE_DIRTY_KICK 64
+#define PCACHE_WB_BATCH 64
+
+#define PCACHE_SECTORS (PAGE_SIZE / BLK_SECTOR_SIZE)
+
+enum {
+	PCACHE_TAG_DIRTY,
+	PCACHE_TAG_WRITEBACK,
+};
+
+struct pcache {
+	/* Guards the tree and the pages' refs, flags and waiters. Taken from
+	   completion callbacks, so always with interrupts off. */
+	spinlock_t lock;
+	struct blk_device *dev;
+	struct radix_tree pages;
+	uint64_t nr_pages;
+
+	/* One sequential stream is tracked per device: the last page asked
+	   for and the current read-ahead window. */
+	uint64_t prev_index;
+	uint64_t ra_start;
+	unsigned int ra_size;
+
+	unsigned int nr_dirty;
+	bool wb_kick;
+	bool wb_error;
+	struct thread *wb_thread;
+};
+
+struct pcache_waiter {
+	struct pcache_waiter *next;
+	struct thread *thread;
+	bool done;
+};
+
+static struct pool pcache_pool = POOL_INIT(sizeof(struct pcache));
+static struct pool pcache_page_pool = POOL_INIT(sizeof(struct pcache_page));
+
+/* Every cached page, in a ring the clock hand sweeps. Nothing is allocated
+   while holding this lock, and cache locks are only tried under it. */
+static spinlock_t pcache_clock_lock = SPINLOCK_INIT;
+static struct pcache_page *pcache_clock_hand;
+static unsigned long pcache_clock_count;
+
+static void pcache_wb_thread(void *arg);
+
+static struct pcache *pcache_of(struct blk_device *dev) {
+	struct pcache *c = __atomic_load_n(&dev->cache, __ATOMIC_ACQUIRE);
+	if (c) return c;
+
+	c = pool_alloc(&pcache_pool);
+	if (!c) return NULL;
+	c->dev = dev;
+	c->nr_pages = (dev->sectors + PCACHE_SECTORS - 1) / PCACHE_SECTORS;
+	c->prev_index = -1ull;
+
+	struct pcache *old = NULL;
+	if (!__atomic_compare_exchange_n(&dev->cache, &old, c, false,
+									 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		pool_free(&pcache_pool, c);
+		return old;
+	}
+	if (!dev->read_only)
+		__atomic_store_n(&c->wb_thread,
+						 kthread_create(pcache_wb_thread, c, "pcache_wb", -1),
+						 __ATOMIC_RELEASE);
+	return c;
+}
+
+static void pcache_clock_add(struct pcache_page *pg) {
+	bool irq = spin_lock_irqsave(&pcache_clock_lock);
+	struct pcache_page *hand = pcache_clock_hand;
+	if (hand) {
+		// Just behind the hand, so it is the last the sweep reaches.
+		pg->clock_next = hand;
+		pg->clock_prev = hand->clock_prev;
+		hand->clock_prev->clock_next = pg;
+		hand->clock_prev = pg;
+	} else {
+		pg->clock_next = pg->clock_prev = pg;
+		pcache_clock_hand = pg;
+	}
+	pcache_clock_count++;
+	spin_unlock_irqrestore(&pcache_clock_lock, irq);
+}
+
+static void pcache_clock_remove(struct pcache_page *pg) {
+	if (pg->clock_next == pg) {
+		pcache_clock_hand = NULL;
+	} else {
+		if (pcache_clock_hand == pg) pcache_clock_hand = pg->clock_next;
+		pg->clock_prev->clock_next = pg->clock_next;
+		pg->clock_next->clock_prev = pg->clock_prev;
+	}
+	pcache_clock_count--;
+}
+
+static void pcache_wake(struct pcache_waiter *w) {
+	while (w) {
+		struct pcache_waiter *next = w->next;
+		// The waiter's frame may be gone once done is set.
+		struct thread *t = w->thread;
+		__atomic_store_n(&w->done, true, __ATOMIC_RELEASE);
+		if (t) sched_wake(t);
+		w = next;
+	}
+}
+
+/* Waits until none of mask is set in pg->flags. Called with c->lock held,
+   taken with interrupts in state irq, and drops it while waiting. */
+static void pcache_wait(struct pcache *c, struct pcache_page *pg,
+						unsigned int mask, bool irq) {
+	while (pg->flags & mask) {
+		struct pcache_waiter w = {
+			.next = pg->waiters,
+			.thread = sched_can_block() ? sched_current() : NULL,
+		};
+		pg->waiters = &w;
+		spin_unlock_irqrestore(&c->lock, irq);
+		while (!__atomic_load_n(&w.done, __ATOMIC_ACQUIRE)) {
+			if (w.thread)
+				sched_block();
+			else
+				blk_poll(c->dev);
+		}
+		spin_lock_irqsave(&c->lock);
+	}
+}
+
+static void pcache_io_done(struct blk_request *req) {
+	struct pcache_page *pg = req->priv;
+	struct pcache *c = pg->cache;
+
+	bool irq = spin_lock_irqsave(&c->lock);
+	if (pg->flags & PCACHE_READING) {
+		pg->flags &= ~PCACHE_READING;
+		pg->flags |= req->status == BLK_OK ? PCACHE_UPTODATE : PCACHE_ERROR;
+	} else {
+		pg->flags &= ~PCACHE_WRITEBACK;
+		radix_tag_clear(&c->pages, pg->index, PCACHE_TAG_WRITEBACK);
+		if (req->status != BLK_OK) {
+			// Keep the data; a later writeback tries again.
+			c->wb_error = true;
+			if (!(pg->flags & PCACHE_DIRTY)) {
+				pg->flags |= PCACHE_DIRTY;
+				radix_tag_set(&c->pages, pg->index, PCACHE_TAG_DIRTY);
+				c->nr_dirty++;
+			}
+		}
+	}
+	struct pcache_waiter *w = pg->waiters;
+	pg->waiters = NULL;
+	spin_unlock_irqrestore(&c->lock, irq);
+	pcache_wake(w);
+}
+
+/* Points pg->req at the page's sectors, trimming the device's last page. */
+static struct blk_request *pcache_req(struct pcache_page *pg, enum blk_op op) {
+	struct blk_device *dev = pg->cache->dev;
+	uint64_t sector = pg->index * PCACHE_SECTORS;
+	uint64_t sectors = dev->sectors - sector;
+	if (sectors > PCACHE_SECTORS) sectors = PCACHE_SECTORS;
+
+	pg->req = (struct blk_request){
+		.op = op,
+		.sector = sector,
+		.buf = pg->data,
+		.len = sectors * BLK_SECTOR_SIZE,
+		.done = pcache_io_done,
+		.priv = pg,
+	};
+	return &pg->req;
+}
+
+/* Reads the pages of [start, start + size) that are not cached yet, as one
+   batch. The page at marker, if in range, gets PCACHE_READAHEAD. With first,
+   the page at start is stored there with a reference, so that reclaim
+   cannot take it before the caller gets to it; NULL means no memory. */
+static void pcache_readahead(struct pcache *c, uint64_t start,
+							 unsigned int size, uint64_t marker,
+							 struct pcache_page **first) {
+	struct pcache_page *new[PCACHE_RA_MAX];
+	uint64_t missing[PCACHE_RA_MAX / 64] = {0};
+	unsigned int n = 0;
+
+	if (first) *first = NULL;
+	if (start >= c->nr_pages) return;
+	if (size > c->nr_pages - start) size = c->nr_pages - start;
+
+	bool irq = spin_lock_irqsave(&c->lock);
+	for (unsigned int i = 0; i < size; i++) {
+		if (!radix_lookup(&c->pages, start + i))
+			missing[i / 64] |= 1ull << (i % 64);
+	}
+	spin_unlock_irqrestore(&c->lock, irq);
+	// A cached first page may be reclaimed before the lock is taken again,
+	// so one is read anyway and dropped if it turns out not to be needed.
+	if (first) missing[0] |= 1;
+
+	// Allocate with no locks held, so memory pressure can reclaim.
+	for (unsigned int i = 0; i < size; i++) {
+		if (!(missing[i / 64] >> (i % 64) & 1)) continue;
+		struct pcache_page *pg = pool_alloc(&pcache_page_pool);
+		void *data = pg ? pmm_alloc(0) : NULL;
+		if (!data) {
+			if (pg) pool_free(&pcache_page_pool, pg);
+			break;
+		}
+		pg->cache = c;
+		pg->index = start + i;
+		pg->data = data;
+		pg->flags = PCACHE_READING;
+		if (pg->index == marker) pg->flags |= PCACHE_READAHEAD;
+		// Past the device's end, a page reads as zeroes.
+		if (pg->index == c->nr_pages - 1) memset(data, 0, PAGE_SIZE);
+		new[n++] = pg;
+	}
+
+	// Someone else may have read some of the pages meanwhile.
+	struct blk_request *batch = NULL, **tail = &batch;
+	struct pcache_page *unused = NULL;
+	irq = spin_lock_irqsave(&c->lock);
+	for (unsigned int i = 0; i < n; i++) {
+		if (radix_insert(&c->pages, new[i]->index, new[i])) {
+			*tail = pcache_req(new[i], BLK_READ);
+			tail = &(*tail)->next;
+		} else {
+			new[i]->clock_next = unused;
+			unused = new[i];
+			new[i] = NULL;
+		}
+	}
+	if (first) {
+		*first = radix_lookup(&c->pages, start);
+		if (*first) (*first)->refs++;
+	}
+	spin_unlock_irqrestore(&c->lock, irq);
+
+	while (unused) {
+		struct pcache_page *pg = unused;
+		unused = pg->clock_next;
+		pmm_free(pg->data, 0);
+		pool_free(&pcache_page_pool, pg);
+	}
+	for (unsigned int i = 0; i < n; i++) {
+		if (new[i]) pcache_clock_add(new[i]);
+	}
+	if (batch) blk_submit(c->dev, batch);
+}
+
+static unsigned int pcache_ra_grow(unsigned int size) {
+	return size * 2 > PCACHE_RA_MAX ? PCACHE_RA_MAX : size * 2;
+}
+
+struct pcache_page *pcache_get(struct blk_device *dev, uint64_t index) {
+	struct pcache *c = pcache_of(dev);
+	if (!c || index >= c->nr_pages) return NULL;
+
+	bool irq = spin_lock_irqsave(&c->lock);
+	bool sequential = index == c->prev_index + 1;
+	c->prev_index = index;
+	struct pcache_page *pg = radix_lookup(&c->pages, index);
+
+	if (!pg) {
+		// A miss starts a new window: larger while the stream stays
+		// sequential, just the page otherwise.
+		unsigned int size = 1;
+		if (sequential)
+			size = c->ra_size ? pcache_ra_grow(c->ra_size) : PCACHE_RA_INIT;
+		c->ra_start = index;
+		c->ra_size = size;
+		spin_unlock_irqrestore(&c->lock, irq);
+
+		pcache_readahead(c, index, size, size > 1 ? index + size / 2 : -1ull,
+						 &pg);
+		if (!pg) return NULL;
+
+		irq = spin_lock_irqsave(&c->lock);
+		pg->refs--;
+	} else if (pg->flags & PCACHE_READAHEAD) {
+		// Reading into the window: fetch the next one before it is needed.
+		pg->flags &= ~PCACHE_READAHEAD;
+		uint64_t start = c->ra_start + c->ra_size;
+		unsigned int size = pcache_ra_grow(c->ra_size);
+		c->ra_start = start;
+		c->ra_size = size;
+		pg->refs++;
+		spin_unlock_irqrestore(&c->lock, irq);
+
+		pcache_readahead(c, start, size, start, NULL);
+
+		irq = spin_lock_irqsave(&c->lock);
+		pg->refs--;
+	}
+
+	pg->refs++;
+	pg->flags |= PCACHE_REFERENCED;
+	if ((pg->flags & (PCACHE_ERROR | PCACHE_READING)) == PCACHE_ERROR) {
+		// Retry a page whose last read failed.
+		pg->flags = (pg->flags & ~PCACHE_ERROR) | PCACHE_READING;
+		spin_unlock_irqrestore(&c->lock, irq);
+		blk_submit(dev, pcache_req(pg, BLK_READ));
+		irq = spin_lock_irqsave(&c->lock);
+	}
+	pcache_wait(c, pg, PCACHE_READING, irq);
+	bool ok = pg->flags & PCACHE_UPTODATE;
+	if (!ok) pg->refs--;
+	spin_unlock_irqrestore(&c->lock, irq);
+	return ok ? pg : NULL;
+}
+
+void pcache_put(struct pcache_page *pg) {
+	struct pcache *c = pg->cache;
+	bool irq = spin_lock_irqsave(&c->lock);
+	pg->refs--;
+	spin_unlock_irqrestore(&c->lock, irq);
+}
+
+/* Lock-free, as the shrinker calls it. */
+static void pcache_kick_writeback(struct pcache *c) {
+	__atomic_store_n(&c->wb_kick, true, __ATOMIC_RELEASE);
+	struct thread *t = __atomic_load_n(&c->wb_thread, __ATOMIC_ACQUIRE);
+	if (t) sched_wake(t);
+}
+
+void pcache_mark_dirty(struct pcache_page *pg) {
+	struct pcache *c = pg->cache;
+	if (c->dev->read_only) return;
+
+	bool kick = false;
+	bool irq = spin_lock_irqsave(&c->lock);
+	if (!(pg->flags & PCACHE_DIRTY)) {
+		pg->flags |= PCACHE_DIRTY;
+		radix_tag_set(&c->pages, pg->index, PCACHE_TAG_DIRTY);
+		kick = ++c->nr_dirty == PCACHE_DIRTY_KICK;
+	}
+	spin_unlock_irqrestore(&c->lock, irq);
+	if (kick) pcache_kick_writeback(c);
+}
+
+/* Starts writing every dirty page, a batch of neighbours at a time so the
+   driver can merge them. */
+static void pcache_writeback(struct pcache *c) {
+	struct pcache_page *pages[PCACHE_WB_BATCH];
+	uint64_t next = 0;
+	for (;;) {
+		struct blk_request *batch = NULL, **tail = &batch;
+		bool irq = spin_lock_irqsave(&c->lock);
+		unsigned int n = radix_gang_lookup_tag(
+			&c->pages, next, PCACHE_TAG_DIRTY, (void **)pages, PCACHE_WB_BATCH);
+		for (unsigned int i = 0; i < n; i++) {
+			struct pcache_page *pg = pages[i];
+			// A write already under way finishes first; the page stays
+			// dirty for the next pass.
+			if (pg->flags & PCACHE_WRITEBACK) continue;
+			pg->flags = (pg->flags & ~PCACHE_DIRTY) | PCACHE_WRITEBACK;
+			radix_tag_clear(&c->pages, pg->index, PCACHE_TAG_DIRTY);
+			radix_tag_set(&c->pages, pg->index, PCACHE_TAG_WRITEBACK);
+			c->nr_dirty--;
+			*tail = pcache_req(pg, BLK_WRITE);
+			tail = &(*tail)->next;
+		}
+		spin_unlock_irqrestore(&c->lock, irq);
+
+		if (batch) blk_submit(c->dev, batch);
+		if (n < PCACHE_WB_BATCH) return;
+		next = pages[n - 1]->index + 1;
+	}
+}
+
+/* Waits for every write under way. */
+static void pcache_wait_writeback(struct pcache *c) {
+	bool irq = spin_lock_irqsave(&c->lock);
+	struct pcache_page *pg;
+	while (radix_gang_lookup_tag(&c->pages, 0, PCACHE_TAG_WRITEBACK,
+								 (void **)&pg, 1)) {
+		pg->refs++;
+		pcache_wait(c, pg, PCACHE_WRITEBACK, irq);
+		pg->refs--;
+	}
+	spin_unlock_irqrestore(&c->lock, irq);
+}
+
+static void pcache_wb_thread(void *arg) {
+	struct pcache *c = arg;
+	for (;;) {
+		if (__atomic_exchange_n(&c->wb_kick, false, __ATOMIC_ACQUIRE))
+			pcache_writeback(c);
+		else
+			sched_block();
+	}
+}
+
+bool pcache_sync(struct blk_device *dev) {
+	struct pcache *c = __atomic_load_n(&dev->cache, __ATOMIC_ACQUIRE);
+	if (!c || dev->read_only) return true;
+
+	// Pages written while a sync pass runs may need a second one.
+	do {
+		pcache_writeback(c);
+		pcache_wait_writeback(c);
+	} while (__atomic_load_n(&c->nr_dirty, __ATOMIC_RELAXED) &&
+			 !__atomic_load_n(&c->wb_error, __ATOMIC_RELAXED));
+
+	bool irq = spin_lock_irqsave(&c->lock);
+	bool ok = !c->wb_error;
+	c->wb_error = false;
+	spin_unlock_irqrestore(&c->lock, irq);
+	return blk_rw(dev, BLK_FLUSH, 0, NULL, 0) != BLK_IOERR && ok;
+}
+
+unsigned long pcache_reclaim(unsigned long nr) {
+	struct pcache_page *freed = NULL;
+	struct pcache *dirty = NULL;
+	unsigned long n = 0;
+
+	bool irq = spin_lock_irqsave(&pcache_clock_lock);
+	// Two turns of the hand: one clears the referenced bits, the next
+	// frees the pages that were not used again in between.
+	for (unsigned long scan = 2 * pcache_clock_count;
+		 n < nr && scan && pcache_clock_hand; scan--) {
+		struct pcache_page *pg = pcache_clock_hand;
+		pcache_clock_hand = pg->clock_next;
+
+		struct pcache *c = pg->cache;
+		if (!spin_trylock(&c->lock)) continue;
+		bool busy = pg->refs || pg->waiters ||
+					pg->flags & (PCACHE_READING | PCACHE_DIRTY |
+								 PCACHE_WRITEBACK | PCACHE_REFERENCED);
+		if (pg->flags & PCACHE_DIRTY) dirty = c;
+		pg->flags &= ~PCACHE_REFERENCED;
+		if (!busy) radix_delete(&c->pages, pg->index);
+		spin_unlock(&c->lock);
+		if (busy) continue;
+
+		pcache_clock_remove(pg);
+		pg->clock_next = freed;
+		freed = pg;
+		n++;
+	}
+	spin_unlock_irqrestore(&pcache_clock_lock, irq);
+
+	while (freed) {
+		struct pcache_page *pg = freed;
+		freed = pg->clock_next;
+		pmm_free(pg->data, 0);
+		pool_free(&pcache_page_pool, pg);
+	}
+	// Dirty pages become reclaimable once written.
+	if (dirty) pcache_kick_writeback(dirty);
+	return n;
+}
+
+static struct pmm_shrinker pcache_shrinker = {.shrink = pcache_reclaim};
+
+static void __init pcache_init(void) {
+	pmm_register_shrinker(&pcache_shrinker);
+}
+
+INITCALL(pcache, pcache_init);
@@ -0,0 +1,346 @@
+#include "perf.h"
+
+#include <stddef.h>
+
+#include "csr.h"
+#include "debug.h"
+#include "hart.h"
+#include "init.h"
+#include "limine/features.h"
+#include "sbi.h"
+
+#define PERF_COUNTER_MAX 64
+
+/* Counter layout as reported by the firmware. The PMU spec makes counter
+   indices and their CSRs the same on every hart. */
+static struct perf_counter {
+	uint16_t csr;
+	uint8_t width;
+	bool firmware;
+	bool valid;
+} perf_counters[PERF_COUNTER_MAX];
+
+static unsigned int perf_num_counters;
+
+/* Shared memory layout of SBI PMU snapshots. Values are indexed by counter. */
+struct perf_snapshot {
+	uint64_t overflow;
+	uint64_t values[64];
+	uint64_t reserved[447];
+};
+
+_Static_assert(sizeof(struct perf_snapshot) == 4096, "snapshot is one page");
+
+static _Alignas(4096) struct perf_snapshot perf_snapshots[HART_MAX];
+static bool perf_snapshot_enabled[HART_MAX];
+
+#define HW(code) SBI_PMU_EVENT_IDX(SBI_PMU_EVENT_TYPE_HW, code)
+#define CACHE(cache, op, result)                     \
+	SBI_PMU_EVENT_IDX(SBI_PMU_EVENT_TYPE_CACHE,      \
+					  SBI_PMU_CACHE_CODE(SBI_PMU_CACHE_##cache, \
+										 SBI_PMU_CACHE_OP_##op,  \
+										 SBI_PMU_CACHE_RESULT_##result))
+
+static const struct {
+	const char *name;
+	unsigned long event_idx;
+} perf_event_info[PERF_EVENT_COUNT] = {
+	[PERF_EVENT_CYCLES] = {"cycles", HW(SBI_PMU_HW_CPU_CYCLES)},
+	[PERF_EVENT_INSTRET] = {"instret", HW(SBI_PMU_HW_INSTRUCTIONS)},
+	[PERF_EVENT_CACHE_REFS] = {"cache-refs", HW(SBI_PMU_HW_CACHE_REFERENCES)},
+	[PERF_EVENT_CACHE_MISSES] = {"cache-misses", HW(SBI_PMU_HW_CACHE_MISSES)},
+	[PERF_EVENT_L1D_READ_MISSES] = {"l1d-read-misses", CACHE(L1D, READ, MISS)},
+	[PERF_EVENT_L1I_READ_MISSES] = {"l1i-read-misses", CACHE(L1I, READ, MISS)},
+	[PERF_EVENT_DTLB_READ_MISSES] = {"dtlb-read-misses",
+									 CACHE(DTLB, READ, MISS)},
+	[PERF_EVENT_ITLB_READ_MISSES] = {"itlb-read-misses",
+									 CACHE(ITLB, READ, MISS)},
+	[PERF_EVENT_BRANCH_MISSES] = {"branch-misses", HW(SBI_PMU_HW_BRANCH_MISSES)},
+};
+
+const enum perf_event perf_events_ipc[2] = {PERF_EVENT_CYCLES,
+											PERF_EVENT_INSTRET};
+const enum perf_event perf_events_cache[3] = {
+	PERF_EVENT_CYCLES, PERF_EVENT_CACHE_REFS, PERF_EVENT_CACHE_MISSES};
+const enum perf_event perf_events_tlb[3] = {PERF_EVENT_CYCLES,
+											PERF_EVENT_DTLB_READ_MISSES,
+											PERF_EVENT_ITLB_READ_MISSES};
+
+const char *perf_event_name(enum perf_event event) {
+	if (event >= PERF_EVENT_COUNT) return "unknown";
+	return perf_event_info[event].name;
+}
+
+#define CSR_CASE(num, name) \
+	case num:               \
+		return csr_read(name);
+
+uint64_t perf_read_csr(unsigned int csr) {
+	switch (csr) {
+		CSR_CASE(0xc00, cycle)
+		CSR_CASE(0xc01, time)
+		CSR_CASE(0xc02, instret)
+		CSR_CASE(0xc03, hpmcounter3)
+		CSR_CASE(0xc04, hpmcounter4)
+		CSR_CASE(0xc05, hpmcounter5)
+		CSR_CASE(0xc06, hpmcounter6)
+		CSR_CASE(0xc07, hpmcounter7)
+		CSR_CASE(0xc08, hpmcounter8)
+		CSR_CASE(0xc09, hpmcounter9)
+		CSR_CASE(0xc0a, hpmcounter10)
+		CSR_CASE(0xc0b, hpmcounter11)
+		CSR_CASE(0xc0c, hpmcounter12)
+		CSR_CASE(0xc0d, hpmcounter13)
+		CSR_CASE(0xc0e, hpmcounter14)
+		CSR_CASE(0xc0f, hpmcounter15)
+		CSR_CASE(0xc10, hpmcounter16)
+		CSR_CASE(0xc11, hpmcounter17)
+		CSR_CASE(0xc12, hpmcounter18)
+		CSR_CASE(0xc13, hpmcounter19)
+		CSR_CASE(0xc14, hpmcounter20)
+		CSR_CASE(0xc15, hpmcounter21)
+		CSR_CASE(0xc16, hpmcounter22)
+		CSR_CASE(0xc17, hpmcounter23)
+		CSR_CASE(0xc18, hpmcounter24)
+		CSR_CASE(0xc19, hpmcounter25)
+		CSR_CASE(0xc1a, hpmcounter26)
+		CSR_CASE(0xc1b, hpmcounter27)
+		CSR_CASE(0xc1c, hpmcounter28)
+		CSR_CASE(0xc1d, hpmcounter29)
+		CSR_CASE(0xc1e, hpmcounter30)
+		CSR_CASE(0xc1f, hpmcounter31)
+		default:
+			return 0;
+	}
+}
+
+void __init perf_init(void) {
+	if (!sbi_capabilities.pmu) return;
+
+	perf_num_counters = sbi_info.pmu_num_counters;
+	if (perf_num_counters > PERF_COUNTER_MAX)
+		perf_num_counters = PERF_COUNTER_MAX;
+
+	for (unsigned int i = 0; i < perf_num_counters; i++) {
+		struct sbiret ret = sbi_pmu_counter_get_info(i);
+		if (ret.error != SBI_SUCCESS) continue;
+
+		struct perf_counter *c = &perf_counters[i];
+		c->valid = true;
+		c->firmware = SBI_PMU_INFO_FIRMWARE(ret.uvalue);
+		if (!c->firmware) {
+			c->csr = SBI_PMU_INFO_CSR(ret.uvalue);
+			c->width = SBI_PMU_INFO_WIDTH(ret.uvalue);
+		} else {
+			c->width = 64;
+		}
+	}
+
+	perf_hart_init();
+}
+
+int __init perf_hart_init(void) {
+	if (!sbi_capabilities.pmu) return SBI_ERR_NOT_SUPPORTED;
+
+	unsigned int h = hart_index();
+	unsigned long phys = (uintptr_t)LIMINE_EXE_VTOP(&perf_snapshots[h]);
+	struct sbiret ret = sbi_pmu_snapshot_set_shmem(phys, 0, 0);
+	perf_snapshot_enabled[h] = ret.error == SBI_SUCCESS;
+	return ret.error;
+}
+
+void __init perf_print_counters(void) {
+	if (!sbi_capabilities.pmu) {
+		debug_printf("perf: no SBI PMU, only cycle and instret available\n");
+		return;
+	}
+
+	unsigned int hw = 0, fw = 0;
+	for (unsigned int i = 0; i < perf_num_counters; i++) {
+		if (!perf_counters[i].valid) continue;
+		if (perf_counters[i].firmware)
+			fw++;
+		else
+			hw++;
+	}
+	debug_printf("perf: %u hardware and %u firmware counters, snapshots %s\n",
+				 hw, fw, perf_snapshot_enabled[hart_index()] ? "on" : "off");
+}
+
+static unsigned long perf_all_counters(void) {
+	return perf_num_counters >= 64 ? ~0ul : (1ul << perf_num_counters) - 1;
+}
+
+/* The firmware starts and stops counters as a base index and a mask. */
+static void perf_group_set_window(struct perf_group *g, unsigned long used) {
+	g->ctr_base = used ? __builtin_ctzl(used) : 0;
+	g->ctr_mask = used >> g->ctr_base;
+}
+
+int perf_group_init(struct perf_group *g, const enum perf_event *events,
+					unsigned int nr) {
+	if (nr > PERF_GROUP_MAX) return SBI_ERR_INVALID_PARAM;
+
+	g->hart = hart_index();
+	g->nr = 0;
+	g->running = false;
+	g->snapshot = perf_snapshot_enabled[g->hart];
+	g->snapshot_valid = false;
+	g->ctr_base = 0;
+	g->ctr_mask = 0;
+
+	if (!sbi_capabilities.pmu) {
+		for (unsigned int i = 0; i < nr; i++) {
+			if (events[i] != PERF_EVENT_CYCLES &&
+				events[i] != PERF_EVENT_INSTRET)
+				return SBI_ERR_NOT_SUPPORTED;
+			g->ev[i].event = events[i];
+			g->ev[i].ctr = events[i] == PERF_EVENT_CYCLES ? 0 : 2;
+			g->ev[i].csr = 0xc00 + g->ev[i].ctr;
+			g->ev[i].width = 64;
+		}
+		g->nr = nr;
+		return 0;
+	}
+
+	unsigned long used = 0;
+	for (unsigned int i = 0; i < nr; i++) {
+		int err = SBI_ERR_INVALID_PARAM;
+		struct sbiret ret = {SBI_ERR_INVALID_PARAM, {0}};
+
+		if (events[i] < PERF_EVENT_COUNT) {
+			ret = sbi_pmu_counter_config_matching(
+				0, perf_all_counters() & ~used, SBI_PMU_CFG_FLAG_CLEAR_VALUE,
+				perf_event_info[events[i]].event_idx, 0);
+			err = ret.error != SBI_SUCCESS ? ret.error : SBI_ERR_FAILED;
+		}
+		if (ret.error != SBI_SUCCESS || ret.uvalue >= perf_num_counters) {
+			// A counter past the table was still configured; hand it back.
+			if (ret.error == SBI_SUCCESS)
+				sbi_pmu_counter_stop(ret.uvalue, 1, SBI_PMU_STOP_FLAG_RESET);
+			perf_group_release(g);
+			return err;
+		}
+
+		unsigned int ctr = ret.uvalue;
+		struct perf_counter *c = &perf_counters[ctr];
+		used |= 1ul << ctr;
+		// Keep the window covering every counter configured so far, so a
+		// failure on a later event releases exactly these.
+		perf_group_set_window(g, used);
+
+		g->ev[i].event = events[i];
+		g->ev[i].ctr = ctr;
+		g->ev[i].csr = c->firmware ? 0 : c->csr;
+		g->ev[i].width = c->width;
+		g->ev[i].base = 0;
+		g->nr = i + 1;
+	}
+	return 0;
+}
+
+void perf_group_release(struct perf_group *g) {
+	if (sbi_capabilities.pmu && g->nr)
+		sbi_pmu_counter_stop(g->ctr_base, g->ctr_mask,
+							 SBI_PMU_STOP_FLAG_RESET);
+	g->nr = 0;
+	g->running = false;
+}
+
+int perf_group_start(struct perf_group *g) {
+	if (!sbi_capabilities.pmu) {
+		for (unsigned int i = 0; i < g->nr; i++)
+			g->ev[i].base = perf_read_csr(g->ev[i].csr);
+		g->running = true;
+		return 0;
+	}
+
+	struct sbiret ret = sbi_pmu_counter_start(
+		g->ctr_base, g->ctr_mask, SBI_PMU_START_FLAG_SET_INIT_VALUE, 0);
+	if (ret.error != SBI_SUCCESS) return ret.error;
+	g->running = true;
+	g->snapshot_valid = false;
+	return 0;
+}
+
+int perf_group_stop(struct perf_group *g) {
+	g->running = false;
+	if (!sbi_capabilities.pmu) return 0;
+
+	unsigned long flags = g->snapshot ? SBI_PMU_STOP_FLAG_TAKE_SNAPSHOT : 0;
+	struct sbiret ret = sbi_pmu_counter_stop(g->ctr_base, g->ctr_mask, flags);
+	g->snapshot_valid = g->snapshot && ret.error == SBI_SUCCESS;
+	return ret.error;
+}
+
+void perf_group_read(struct perf_group *g, uint64_t *values) {
+	if (!g->running && g->snapshot_valid) {
+		// The firmware wrote the page; keep the compiler from caching it.
+		volatile uint64_t *snap = perf_snapshots[g->hart].values;
+		for (unsigned int i = 0; i < g->nr; i++) {
+			uint64_t v = snap[g->ev[i].ctr];
+			if (g->ev[i].width < 64) v &= (1ull << g->ev[i].width) - 1;
+			values[i] = v;
+		}
+		return;
+	}
+
+	for (unsigned int i = 0; i < g->nr; i++) {
+		struct perf_group_event *e = &g->ev[i];
+		uint64_t v;
+
+		if (e->csr) {
+			v = perf_read_csr(e->csr) - e->base;
+			if (e->width < 64) v &= (1ull << e->width) - 1;
+		} else {
+			v = sbi_pmu_counter_fw_read(e->ctr).uvalue;
+		}
+		values[i] = v;
+	}
+}
+
+bool perf_enable_overflow_irq(void) {
+	// sie.LCOFIE is read-only zero without Sscofpmf.
+	csr_set(sie, 1ul << IRQ_LCOF);
+	return csr_read(sie) & (1ul << IRQ_LCOF);
+}
+
+int perf_sampler_init(struct perf_sampler *s, enum perf_event event,
+					  uint64_t period) {
+	if (!sbi_capabilities.pmu) return SBI_ERR_NOT_SUPPORTED;
+	if (event >= PERF_EVENT_COUNT || !period) return SBI_ERR_INVALID_PARAM;
+
+	unsigned long mask = 0;
+	for (unsigned int i = 0; i < perf_num_counters; i++) {
+		struct perf_counter *c = &perf_counters[i];
+		if (c->valid && !c->firmware && c->csr >= 0xc03) mask |= 1ul << i;
+	}
+	if (!mask) return SBI_ERR_NOT_SUPPORTED;
+
+	struct sbiret ret = sbi_pmu_counter_config_matching(
+		0, mask, SBI_PMU_CFG_FLAG_CLEAR_VALUE,
+		perf_event_info[event].event_idx, 0);
+	if (ret.error != SBI_SUCCESS) return ret.error;
+
+	s->ctr = ret.uvalue;
+	s->width = perf_counters[s->ctr].width;
+	s->period = period;
+	return 0;
+}
+
+int perf_sampler_start(struct perf_sampler *s) {
+	uint64_t init = -s->period;
+	if (s->width < 64) init &= (1ull << s->width) - 1;
+
+	return sbi_pmu_counter_start(s->ctr, 1, SBI_PMU_START_FLAG_SET_INIT_VALUE,
+								 init)
+		.error;
+}
+
+int perf_sampler_stop(struct perf_sampler *s) {
+	return sbi_pmu_counter_stop(s->ctr, 1, 0).error;
+}
+
+void perf_sampler_release(struct perf_sampler *s) {
+	sbi_pmu_counter_stop(s->ctr, 1, SBI_PMU_STOP_FLAG_RESET);
+}
@@ -0,0 +1,119 @@
+#include "plic.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "csr.h"
+#include "debug.h"
+#include "fdt.h"
+#include "hart.h"
+#include "init.h"
+#include "initcall.h"
+#include "mmio.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "trap.h"
+
+#define PLIC_SOURCES_MAX 1024
+
+#define PLIC_PRIORITY(src) (4 * (src))
+#define PLIC_ENABLE(ctx, src) (0x2000 + 0x80 * (ctx) + 4 * ((src) / 32))
+#define PLIC_THRESHOLD(ctx) (0x200000 + 0x1000 * (ctx))
+#define PLIC_CLAIM(ctx) (PLIC_THRESHOLD(ctx) + 4)
+
+static char *plic_base;
+static unsigned int plic_ndev;
+/* S-mode context of each hart, or -1. */
+static int plic_contexts[HART_MAX];
+static unsigned int plic_next_hart;
+static spinlock_t plic_lock = SPINLOCK_INIT;
+
+static struct {
+	plic_handler_t handler;
+	void *arg;
+} plic_handlers[PLIC_SOURCES_MAX];
+
+static void plic_irq(struct trap_frame *tf) {
+	(void)tf;
+	char *claim = plic_base + PLIC_CLAIM(plic_contexts[hart_index()]);
+	uint32_t src;
+	while ((src = mmio_read32(claim))) {
+		if (src < PLIC_SOURCES_MAX && plic_handlers[src].handler)
+			plic_handlers[src].handler(plic_handlers[src].arg);
+		mmio_write32(claim, src);
+	}
+}
+
+static int __init plic_hart_of_context(uint32_t intc_phandle) {
+	int cpu = fdt_parent(fdt_node_by_phandle(intc_phandle));
+	uint64_t hartid;
+	if (cpu < 0 || !fdt_get_reg(fdt_parent(cpu), cpu, 0, &hartid, NULL))
+		return -1;
+	for (unsigned int h = 0; h < hart_count; h++) {
+		if (harts[h].hartid == hartid) return h;
+	}
+	return -1;
+}
+
+static void __init plic_init(void) {
+	for (unsigned int h = 0; h < HART_MAX; h++) plic_contexts[h] = -1;
+
+	int node = fdt_node_by_compatible(-1, "riscv,plic0");
+	if (node < 0) node = fdt_node_by_compatible(-1, "sifive,plic-1.0.0");
+	uint64_t base;
+	if (node < 0 || !fdt_get_reg(fdt_parent(node), node, 0, &base, NULL)) {
+		debug_printf("plic: not found\n");
+		return;
+	}
+	uint32_t ndev = 0;
+	fdt_getprop_u32(node, "riscv,ndev", &ndev);
+	plic_ndev = ndev < PLIC_SOURCES_MAX ? ndev : PLIC_SOURCES_MAX - 1;
+	plic_base = phys_to_virt(base);
+
+	// interrupts-extended lists (interrupt controller, cause) for every
+	// context in order. Cause 9 marks the S-mode ones.
+	uint32_t len;
+	const uint32_t *ctxs = fdt_getprop(node, "interrupts-extended", &len);
+	for (unsigned int ctx = 0; ctxs && ctx < len / 8; ctx++) {
+		if (fdt32_to_cpu(ctxs[2 * ctx + 1]) != IRQ_S_EXT) continue;
+		int h = plic_hart_of_context(fdt32_to_cpu(ctxs[2 * ctx]));
+		if (h < 0) continue;
+		plic_contexts[h] = ctx;
+
+		for (unsigned int src = 0; src <= plic_ndev; src += 32)
+			mmio_write32(plic_base + PLIC_ENABLE(ctx, src), 0);
+		mmio_write32(plic_base + PLIC_THRESHOLD(ctx), 0);
+	}
+
+	trap_set_irq_handler(IRQ_S_EXT, plic_irq);
+}
+
+INITCALL(plic, plic_init, "fdt_index");
+
+int plic_request_irq(unsigned int src, plic_handler_t handler, void *arg) {
+	if (!plic_base || !src || src > plic_ndev) return -1;
+
+	bool irq = spin_lock_irqsave(&plic_lock);
+	// Round-robin over harts with a context, falling back to the boot hart,
+	// which runs with interrupts off for long stretches, only if alone.
+	int hart = -1;
+	for (unsigned int i = 0; i < hart_count; i++) {
+		unsigned int h = (plic_next_hart + i) % hart_count;
+		if (plic_contexts[h] < 0) continue;
+		hart = h;
+		if (h) break;
+	}
+	plic_next_hart = hart + 1;
+	if (hart >= 0) {
+		plic_handlers[src].handler = handler;
+		plic_handlers[src].arg = arg;
+		int ctx = plic_contexts[hart];
+		char *enable = plic_base + PLIC_ENABLE(ctx, src);
+		mmio_write32(enable, mmio_read32(enable) | 1u << (src % 32));
+		mmio_write32(plic_base + PLIC_PRIORITY(src), 1);
+	}
+	spin_unlock_irqrestore(&plic_lock, irq);
+	return hart;
+}
+
+void __init plic_hart_init(void) { csr_set(sie, 1ul << IRQ_S_EXT); }
@@ -0,0 +1,547 @@
+#include "pmm.h"
+
+#include <stdbool.h>
+
+#include "bitops.h"
+#include "clock.h"
+#include "cmdline.h"
+#include "csr.h"
+#include "debug.h"
+#include "hart.h"
+#include "init.h"
+#include "initcall.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "trace.h"
+
+#define PMM_RANGES_MAX 64
+
+/* Struct pages are initialized in slices of this many pages, aligned to the
+   largest block, so that no buddy pair ever spans two slices. */
+#define PMM_SLICE_PAGES (4ul << PMM_MAX_ORDER)
+
+/* Initialized while booting. Slices past this are left to background threads
+   and to allocations that would otherwise fail. */
+#define PMM_EARLY_PAGES (256ul << (20 - PAGE_SHIFT))
+
+/* Default size of the pool of zeroed pages, and how many an idle hart zeroes
+   before checking for work again. */
+#define PMM_ZERO_POOL_PAGES 256
+#define PMM_ZERO_BATCH 16
+
+/* Default number of zeroed 2 MiB blocks kept for pmm_alloc_huge(). */
+#define PMM_HUGE_POOL_BLOCKS 4
+
+struct page *pmm_pages;
+uint64_t pmm_base_pfn, pmm_end_pfn;
+
+/* Usable page frames, copied out of the bootloader's memory map. */
+static struct pmm_range {
+	uint64_t start, end;
+} pmm_ranges[PMM_RANGES_MAX];
+static unsigned int pmm_range_count;
+
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+static struct page *pmm_free_lists[PMM_MAX_ORDER + 1];
+static uint64_t pmm_free_pages_count;
+static uint64_t pmm_total_pages;
+
+static uint64_t pmm_slice_base;
+static unsigned int pmm_slices, pmm_early_slices;
+static unsigned int pmm_slice_next, pmm_slices_done;
+static uint64_t pmm_deferred_start, pmm_deferred_end;
+
+/* Zeroed single pages, linked through next. They count as allocated. */
+static spinlock_t pmm_zero_lock = SPINLOCK_INIT;
+static struct page *pmm_zero_head;
+static unsigned long pmm_zero_count, pmm_zero_max;
+static unsigned long pmm_zero_hits, pmm_zero_misses;
+/* Set once an idle hart has been woken to refill the pool. */
+static bool pmm_zero_kicked;
+
+/* Zeroed 2 MiB blocks, linked through next, under pmm_zero_lock. The block
+   being zeroed is owned by whichever idle hart took it out of
+   pmm_huge_filling, along with pmm_huge_zeroed, its pages done so far. */
+static struct page *pmm_huge_head;
+static unsigned long pmm_huge_count, pmm_huge_max;
+static unsigned long pmm_huge_hits, pmm_huge_misses;
+static struct page *pmm_huge_filling;
+static unsigned long pmm_huge_zeroed;
+
+static struct pmm_shrinker *pmm_shrinkers;
+
+DEFINE_TRACEPOINT(pmm_alloc);
+DEFINE_TRACEPOINT(pmm_free);
+
+static bool pmm_spanned(uint64_t type) {
+	return type == LIMINE_MEMMAP_USABLE ||
+		   type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE ||
+		   type == LIMINE_MEMMAP_EXECUTABLE_AND_MODULES;
+}
+
+static void __init pmm_add_range(uint64_t start, uint64_t end) {
+	if (start >= end) return;
+	if (pmm_range_count == PMM_RANGES_MAX) {
+		debug_printf("pmm: ignoring pages %lx-%lx\n", start, end);
+		return;
+	}
+	pmm_ranges[pmm_range_count].start = start;
+	pmm_ranges[pmm_range_count].end = end;
+	pmm_range_count++;
+	pmm_total_pages += end - start;
+}
+
+/* Sizes the page array and places it at the start of the largest usable
+   region. */
+static void __init pmm_setup(void) {
+	struct limine_memmap_response *resp = memmap_request.response;
+	if (!resp) panic("pmm: no memory map\n");
+
+	struct limine_memmap_entry *largest = NULL;
+	pmm_base_pfn = UINT64_MAX;
+	for (uint64_t i = 0; i < resp->entry_count; i++) {
+		struct limine_memmap_entry *e = resp->entries[i];
+		if (!pmm_spanned(e->type)) continue;
+		uint64_t start = e->base >> PAGE_SHIFT;
+		uint64_t end = (e->base + e->length) >> PAGE_SHIFT;
+		if (start < pmm_base_pfn) pmm_base_pfn = start;
+		if (end > pmm_end_pfn) pmm_end_pfn = end;
+		if (e->type == LIMINE_MEMMAP_USABLE &&
+			(!largest || e->length > largest->length))
+			largest = e;
+	}
+	if (!largest) panic("pmm: no usable memory\n");
+
+	uint64_t array_pages =
+		((pmm_end_pfn - pmm_base_pfn) * sizeof(struct page) + PAGE_SIZE - 1) >>
+		PAGE_SHIFT;
+	if (array_pages > largest->length >> PAGE_SHIFT)
+		panic("pmm: no room for %lu page array pages\n", array_pages);
+	pmm_pages = phys_to_virt(largest->base);
+
+	for (uint64_t i = 0; i < resp->entry_count; i++) {
+		struct limine_memmap_entry *e = resp->entries[i];
+		if (e->type != LIMINE_MEMMAP_USABLE) continue;
+		uint64_t start = (e->base + PAGE_SIZE - 1) >> PAGE_SHIFT;
+		uint64_t end = (e->base + e->length) >> PAGE_SHIFT;
+		if (e == largest) start += array_pages;
+		pmm_add_range(start, end);
+	}
+
+	pmm_slice_base = pmm_base_pfn & ~(PMM_SLICE_PAGES - 1);
+	pmm_slices =
+		(pmm_end_pfn - pmm_slice_base + PMM_SLICE_PAGES - 1) / PMM_SLICE_PAGES;
+	pmm_early_slices = PMM_EARLY_PAGES / PMM_SLICE_PAGES;
+	if (pmm_early_slices > pmm_slices || cmdline_has("pmm_eager"))
+		pmm_early_slices = pmm_slices;
+	pmm_slice_next = pmm_early_slices;
+
+	pmm_zero_max = cmdline_get_ulong("pmm_zero_pool", PMM_ZERO_POOL_PAGES);
+	pmm_huge_max = cmdline_get_ulong("pmm_huge_pool", PMM_HUGE_POOL_BLOCKS);
+}
+
+INITCALL(pmm_setup, pmm_setup);
+
+static void pmm_list_push(struct page *p, unsigned int order) {
+	p->flags = PG_FREE;
+	p->order = order;
+	p->prev = NULL;
+	p->next = pmm_free_lists[order];
+	if (p->next) p->next->prev = p;
+	pmm_free_lists[order] = p;
+}
+
+static void pmm_list_remove(struct page *p, unsigned int order) {
+	if (p->prev)
+		p->prev->next = p->next;
+	else
+		pmm_free_lists[order] = p->next;
+	if (p->next) p->next->prev = p->prev;
+	p->flags &= ~PG_FREE;
+}
+
+/* Order of the largest block that starts at pfn and ends by end, which must
+   be past pfn. */
+static unsigned int pmm_block_order(uint64_t pfn, uint64_t end) {
+	unsigned int order = bit_fls(end - pfn) - 1;
+	if (pfn && bit_ctz(pfn) < order) order = bit_ctz(pfn);
+	return order < PMM_MAX_ORDER ? order : PMM_MAX_ORDER;
+}
+
+/* Initializes the struct pages of one slice of the page array, then frees the
+   usable ones. Freeing slices separately builds the same blocks as freeing
+   everything at once. */
+static void pmm_init_slice(unsigned int slice) {
+	uint64_t lo = pmm_slice_base + slice * PMM_SLICE_PAGES;
+	uint64_t hi = lo + PMM_SLICE_PAGES;
+	if (lo < pmm_base_pfn) lo = pmm_base_pfn;
+	if (hi > pmm_end_pfn) hi = pmm_end_pfn;
+
+	for (uint64_t pfn = lo; pfn < hi; pfn++) {
+		struct page *p = pfn_to_page(pfn);
+		p->next = p->prev = NULL;
+		p->flags = PG_RESERVED;
+		p->order = 0;
+	}
+
+	// Carve the blocks into a local list first and take the lock once.
+	struct page *blocks_head = NULL;
+	uint64_t freed = 0;
+	for (unsigned int i = 0; i < pmm_range_count; i++) {
+		uint64_t pfn = pmm_ranges[i].start > lo ? pmm_ranges[i].start : lo;
+		uint64_t end = pmm_ranges[i].end < hi ? pmm_ranges[i].end : hi;
+		while (pfn < end) {
+			unsigned int order = pmm_block_order(pfn, end);
+			struct page *p = pfn_to_page(pfn);
+			p->order = order;
+			p->next = blocks_head;
+			blocks_head = p;
+			freed += 1ul << order;
+			pfn += 1ul << order;
+		}
+	}
+
+	bool irq = spin_lock_irqsave(&pmm_lock);
+	while (blocks_head) {
+		struct page *p = blocks_head;
+		blocks_head = p->next;
+		pmm_list_push(p, p->order);
+	}
+	pmm_free_pages_count += freed;
+	spin_unlock_irqrestore(&pmm_lock, irq);
+
+	if (__atomic_add_fetch(&pmm_slices_done, 1, __ATOMIC_RELEASE) ==
+		pmm_slices)
+		pmm_deferred_end = rdtime();
+}
+
+static void __init pmm_init_part(unsigned int part, unsigned int nparts) {
+	unsigned int lo = pmm_early_slices * part / nparts;
+	unsigned int hi = pmm_early_slices * (part + 1) / nparts;
+	for (unsigned int slice = lo; slice < hi; slice++) pmm_init_slice(slice);
+}
+
+INITCALL_PARALLEL(pmm_pages, pmm_init_part, "pmm_setup");
+
+/* Initializes the next deferred slice, if any are left to claim. */
+static bool pmm_grow(void) {
+	if (__atomic_load_n(&pmm_slice_next, __ATOMIC_RELAXED) >= pmm_slices)
+		return false;
+	unsigned int slice =
+		__atomic_fetch_add(&pmm_slice_next, 1, __ATOMIC_RELAXED);
+	if (slice >= pmm_slices) return false;
+	pmm_init_slice(slice);
+	return true;
+}
+
+static bool pmm_deferred_pending(void) {
+	return __atomic_load_n(&pmm_slices_done, __ATOMIC_ACQUIRE) < pmm_slices;
+}
+
+static void pmm_deferred_thread(void *arg) {
+	(void)arg;
+	while (pmm_grow()) sched_yield();
+}
+
+/* Hands the rest of memory to one thread per secondary hart, which run once
+   those harts are done with initcalls. */
+static void __init pmm_start_deferred(void) {
+	pmm_deferred_start = rdtime();
+	if (!pmm_deferred_pending()) return;
+	for (unsigned int h = 1; h < hart_count; h++)
+		kthread_create(pmm_deferred_thread, NULL, "pmm_deferred", h);
+}
+
+INITCALL(pmm_deferred, pmm_start_deferred, "pmm_pages");
+
+void pmm_wait_deferred(void) {
+	if (!pmm_deferred_pending()) return;
+	while (pmm_deferred_pending()) {
+		if (!pmm_grow()) sched_yield();
+	}
+	uint64_t pages = (pmm_slices - pmm_early_slices) * PMM_SLICE_PAGES;
+	debug_printf("pmm: deferred init of %lu MiB took %lu us\n",
+				 pages >> (20 - PAGE_SHIFT),
+				 clock_ticks_to_us(pmm_deferred_end - pmm_deferred_start));
+}
+
+static struct page *pmm_try_alloc(unsigned int order) {
+	bool irq = spin_lock_irqsave(&pmm_lock);
+	unsigned int o = order;
+	while (o <= PMM_MAX_ORDER && !pmm_free_lists[o]) o++;
+	if (o > PMM_MAX_ORDER) {
+		spin_unlock_irqrestore(&pmm_lock, irq);
+		return NULL;
+	}
+
+	struct page *p = pmm_free_lists[o];
+	pmm_list_remove(p, o);
+	// Return the upper halves of the block while splitting it down.
+	while (o > order) {
+		o--;
+		pmm_list_push(p + (1ul << o), o);
+	}
+	p->order = order;
+	pmm_free_pages_count -= 1ul << order;
+	spin_unlock_irqrestore(&pmm_lock, irq);
+	return p;
+}
+
+static struct page *pmm_zero_pop(void) {
+	bool irq = spin_lock_irqsave(&pmm_zero_lock);
+	struct page *p = pmm_zero_head;
+	if (p) {
+		pmm_zero_head = p->next;
+		pmm_zero_count--;
+	}
+	spin_unlock_irqrestore(&pmm_zero_lock, irq);
+	return p;
+}
+
+static struct page *pmm_huge_pop(void) {
+	bool irq = spin_lock_irqsave(&pmm_zero_lock);
+	struct page *p = pmm_huge_head;
+	if (p) {
+		pmm_huge_head = p->next;
+		pmm_huge_count--;
+	}
+	spin_unlock_irqrestore(&pmm_zero_lock, irq);
+	return p;
+}
+
+/* Returns the zeroed pages and blocks to the buddy lists. */
+static bool pmm_zero_pool_drain(void) {
+	bool drained = false;
+	struct page *p;
+	while ((p = pmm_zero_pop())) {
+		pmm_free_pages(p, 0);
+		drained = true;
+	}
+	while ((p = pmm_huge_pop())) {
+		pmm_free_pages(p, PMM_HUGE_ORDER);
+		drained = true;
+	}
+	p = __atomic_exchange_n(&pmm_huge_filling, NULL, __ATOMIC_ACQUIRE);
+	if (p) {
+		pmm_free_pages(p, PMM_HUGE_ORDER);
+		drained = true;
+	}
+	return drained;
+}
+
+void pmm_register_shrinker(struct pmm_shrinker *s) {
+	struct pmm_shrinker *head = __atomic_load_n(&pmm_shrinkers, __ATOMIC_RELAXED);
+	do {
+		s->next = head;
+	} while (!__atomic_compare_exchange_n(&pmm_shrinkers, &head, s, true,
+										  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static bool pmm_shrink(unsigned int order) {
+	// Free a little more than asked, as freed pages need not coalesce.
+	unsigned long want = (1ul << order) + PMM_ZERO_BATCH, freed = 0;
+	for (struct pmm_shrinker *s =
+			 __atomic_load_n(&pmm_shrinkers, __ATOMIC_ACQUIRE);
+		 s && freed < want; s = s->next)
+		freed += s->shrink(want - freed);
+	return freed;
+}
+
+struct page *pmm_alloc_pages(unsigned int order) {
+	if (order > PMM_MAX_ORDER) return NULL;
+
+	struct page *p;
+	// Rather than fail, finish initializing memory on the spot, then take
+	// back the pool of zeroed pages, then shrink caches.
+	while (!(p = pmm_try_alloc(order)) && pmm_deferred_pending()) {
+		if (!pmm_grow()) cpu_relax();
+	}
+	if (!p && pmm_zero_pool_drain()) p = pmm_try_alloc(order);
+	if (!p && pmm_shrink(order)) p = pmm_try_alloc(order);
+	if (p) trace(pmm_alloc, page_to_phys(p), order);
+	return p;
+}
+
+void pmm_free_pages(struct page *p, unsigned int order) {
+	uint64_t pfn = page_to_pfn(p);
+	trace(pmm_free, pfn << PAGE_SHIFT, order);
+
+	bool irq = spin_lock_irqsave(&pmm_lock);
+	pmm_free_pages_count += 1ul << order;
+	while (order < PMM_MAX_ORDER) {
+		uint64_t buddy_pfn = pfn ^ (1ul << order);
+		if (buddy_pfn < pmm_base_pfn || buddy_pfn >= pmm_end_pfn) break;
+		struct page *buddy = pfn_to_page(buddy_pfn);
+		if (!(buddy->flags & PG_FREE) || buddy->order != order) break;
+		pmm_list_remove(buddy, order);
+		pfn &= ~(1ul << order);
+		order++;
+	}
+	pmm_list_push(pfn_to_page(pfn), order);
+	spin_unlock_irqrestore(&pmm_lock, irq);
+}
+
+void pmm_free_range(uint64_t start, uint64_t end) {
+	if (start >= end) return;
+	bool irq = spin_lock_irqsave(&pmm_lock);
+	pmm_total_pages += end - start;
+	spin_unlock_irqrestore(&pmm_lock, irq);
+
+	for (uint64_t pfn = start; pfn < end; pfn++) pfn_to_page(pfn)->flags = 0;
+	for (uint64_t pfn = start; pfn < end;) {
+		unsigned int order = pmm_block_order(pfn, end);
+		pmm_free_pages(pfn_to_page(pfn), order);
+		pfn += 1ul << order;
+	}
+}
+
+void page_put_order(struct page *p, unsigned int order) {
+	if (!__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL))
+		pmm_free_pages(p, order);
+}
+
+void *pmm_alloc(unsigned int order) {
+	struct page *p = pmm_alloc_pages(order);
+	return p ? page_address(p) : NULL;
+}
+
+void pmm_free(void *addr, unsigned int order) {
+	pmm_free_pages(virt_to_page(addr), order);
+}
+
+void *pmm_alloc_zeroed(unsigned int order) {
+	struct page *p = order ? NULL : pmm_zero_pop();
+
+	// Idle harts sleep until woken, so wake one once the pool runs low.
+	if (__atomic_load_n(&pmm_zero_count, __ATOMIC_RELAXED) < pmm_zero_max / 2 &&
+		!__atomic_exchange_n(&pmm_zero_kicked, true, __ATOMIC_RELAXED))
+		sched_kick_idle();
+
+	if (p) {
+		__atomic_add_fetch(&pmm_zero_hits, 1, __ATOMIC_RELAXED);
+		trace(pmm_alloc, page_to_phys(p), 0);
+		return page_address(p);
+	}
+	if (!order) __atomic_add_fetch(&pmm_zero_misses, 1, __ATOMIC_RELAXED);
+
+	char *addr = pmm_alloc(order);
+	if (!addr) return NULL;
+	for (unsigned long i = 0; i < 1ul << order; i++)
+		zero_page(addr + i * PAGE_SIZE);
+	return addr;
+}
+
+struct page *pmm_alloc_huge(bool zeroed) {
+	struct page *p = zeroed ? pmm_huge_pop() : NULL;
+	if (zeroed && __atomic_load_n(&pmm_huge_count, __ATOMIC_RELAXED) <
+					  pmm_huge_max &&
+		!__atomic_exchange_n(&pmm_zero_kicked, true, __ATOMIC_RELAXED))
+		sched_kick_idle();
+
+	if (p) {
+		__atomic_add_fetch(&pmm_huge_hits, 1, __ATOMIC_RELAXED);
+		trace(pmm_alloc, page_to_phys(p), PMM_HUGE_ORDER);
+		return p;
+	}
+	if (zeroed) __atomic_add_fetch(&pmm_huge_misses, 1, __ATOMIC_RELAXED);
+
+	p = pmm_try_alloc(PMM_HUGE_ORDER);
+	if (!p) return NULL;
+	trace(pmm_alloc, page_to_phys(p), PMM_HUGE_ORDER);
+	if (zeroed) {
+		for (unsigned long i = 0; i < 1ul << PMM_HUGE_ORDER; i++)
+			zero_page(page_address(p + i));
+	}
+	return p;
+}
+
+/* Zeroes a batch of pages of the 2 MiB block being filled, taking a new one
+   if there is none. */
+static bool pmm_huge_pool_fill(void) {
+	struct page *p =
+		__atomic_exchange_n(&pmm_huge_filling, NULL, __ATOMIC_ACQUIRE);
+	if (!p) {
+		if (__atomic_load_n(&pmm_huge_count, __ATOMIC_RELAXED) >=
+				pmm_huge_max ||
+			pmm_free_count() < 2 * pmm_zero_max + (2ul << PMM_HUGE_ORDER))
+			return false;
+		p = pmm_try_alloc(PMM_HUGE_ORDER);
+		if (!p) return false;
+		pmm_huge_zeroed = 0;
+	}
+
+	for (unsigned int i = 0; i < PMM_ZERO_BATCH; i++)
+		zero_page(page_address(p + pmm_huge_zeroed++));
+	if (pmm_huge_zeroed < 1ul << PMM_HUGE_ORDER) {
+		__atomic_store_n(&pmm_huge_filling, p, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	bool irq = spin_lock_irqsave(&pmm_zero_lock);
+	bool full = pmm_huge_count >= pmm_huge_max;
+	if (!full) {
+		p->next = pmm_huge_head;
+		pmm_huge_head = p;
+		pmm_huge_count++;
+	}
+	spin_unlock_irqrestore(&pmm_zero_lock, irq);
+	if (full) pmm_free_pages(p, PMM_HUGE_ORDER);
+	return !full;
+}
+
+bool pmm_zero_pool_fill(void) {
+	__atomic_store_n(&pmm_zero_kicked, false, __ATOMIC_RELAXED);
+	// Huge blocks only once single pages, which more callers want, are
+	// ready.
+	if (__atomic_load_n(&pmm_zero_count, __ATOMIC_RELAXED) >= pmm_zero_max)
+		return pmm_huge_pool_fill();
+	unsigned int n = 0;
+	while (n < PMM_ZERO_BATCH &&
+		   __atomic_load_n(&pmm_zero_count, __ATOMIC_RELAXED) < pmm_zero_max) {
+		// Leave the last free memory to real allocations.
+		if (pmm_free_count() < 2 * pmm_zero_max) break;
+		struct page *p = pmm_try_alloc(0);
+		if (!p) break;
+		zero_page(page_address(p));
+
+		bool irq = spin_lock_irqsave(&pmm_zero_lock);
+		bool full = pmm_zero_count >= pmm_zero_max;
+		if (!full) {
+			p->next = pmm_zero_head;
+			pmm_zero_head = p;
+			pmm_zero_count++;
+		}
+		spin_unlock_irqrestore(&pmm_zero_lock, irq);
+		if (full) {
+			pmm_free_pages(p, 0);
+			break;
+		}
+		n++;
+	}
+	return n > 0;
+}
+
+uint64_t pmm_free_count(void) {
+	return __atomic_load_n(&pmm_free_pages_count, __ATOMIC_RELAXED);
+}
+
+void pmm_print(void) {
+	uint64_t spanned = pmm_end_pfn - pmm_base_pfn;
+	unsigned int done = __atomic_load_n(&pmm_slices_done, __ATOMIC_ACQUIRE);
+	debug_printf("pmm: %lu MiB free of %lu MiB, %lu KiB of struct page, "
+				 "%u of %u slices initialized\n",
+				 pmm_free_count() >> (20 - PAGE_SHIFT),
+				 pmm_total_pages >> (20 - PAGE_SHIFT),
+				 spanned * sizeof(struct page) >> 10, done, pmm_slices);
+	debug_printf("pmm: %lu of %lu zeroed pages ready, %lu hits %lu misses\n",
+				 __atomic_load_n(&pmm_zero_count, __ATOMIC_RELAXED),
+				 pmm_zero_max,
+				 __atomic_load_n(&pmm_zero_hits, __ATOMIC_RELAXED),
+				 __atomic_load_n(&pmm_zero_misses, __ATOMIC_RELAXED));
+	debug_printf("pmm: %lu of %lu zeroed 2 MiB blocks ready, %lu hits %lu "
+				 "misses\n",
+				 __atomic_load_n(&pmm_huge_count, __ATOMIC_RELAXED),
+				 pmm_huge_max,
+				 __atomic_load_n(&pmm_huge_hits, __ATOMIC_RELAXED),
+				 __atomic_load_n(&pmm_huge_misses, __ATOMIC_RELAXED));
+}
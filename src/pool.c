@@ -0,0 +1,48 @@
+#include "pool.h"
+
+#include "pmm.h"
+#include "string.h"
+
+/* Free objects are linked through their first word. */
+struct pool_free_obj {
+	struct pool_free_obj *next;
+};
+
+void *pool_alloc(struct pool *p) {
+	bool irq = spin_lock_irqsave(&p->lock);
+	struct pool_free_obj *obj = p->free;
+	if (obj) p->free = obj->next;
+	spin_unlock_irqrestore(&p->lock, irq);
+
+	if (!obj) {
+		char *page = pmm_alloc(0);
+		if (!page) return NULL;
+		// Keep the first object, and give the rest to the pool.
+		size_t n = PAGE_SIZE / p->size;
+		obj = (struct pool_free_obj *)page;
+		struct pool_free_obj *head = NULL, *tail = NULL;
+		for (size_t i = n - 1; i > 0; i--) {
+			struct pool_free_obj *o =
+				(struct pool_free_obj *)(page + i * p->size);
+			o->next = head;
+			head = o;
+			if (!tail) tail = o;
+		}
+		if (head) {
+			irq = spin_lock_irqsave(&p->lock);
+			tail->next = p->free;
+			p->free = head;
+			spin_unlock_irqrestore(&p->lock, irq);
+		}
+	}
+	memset(obj, 0, p->size);
+	return obj;
+}
+
+void pool_free(struct pool *p, void *obj) {
+	struct pool_free_obj *o = obj;
+	bool irq = spin_lock_irqsave(&p->lock);
+	o->next = p->free;
+	p->free = o;
+	spin_unlock_irqrestore(&p->lock, irq);
+}
@@ -0,0 +1,236 @@
+#include "proc.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cmdline.h"
+#include "console.h"
+#include "debug.h"
+#include "elf.h"
+#include "errno.h"
+#include "mm.h"
+#include "pool.h"
+#include "string.h"
+#include "uring.h"
+#include "vdso.h"
+#include "vmm.h"
+
+static struct pool proc_pool = POOL_INIT(sizeof(struct proc));
+static int proc_next_pid = 1;
+
+static struct proc *proc_alloc(const char *path) {
+	struct proc *p = pool_alloc(&proc_pool);
+	if (!p) return NULL;
+	p->pid = __atomic_fetch_add(&proc_next_pid, 1, __ATOMIC_RELAXED);
+	memcpy(p->path, path, strlen(path) + 1);
+	return p;
+}
+
+/* Sets up the address space, from the process's own thread. Pages are
+   read in as the program touches them. */
+static int proc_load(struct proc *p, uint64_t *entry) {
+	struct file *f;
+	int err = vfs_open(p->path, &f);
+	if (err) return err;
+	p->mm = mm_create();
+	err = p->mm ? elf_load(p->mm, f, entry) : -ENOMEM;
+	vfs_close(f);
+	if (!err)
+		err = mm_map_anon(p->mm, USER_TOP - USER_STACK_SIZE, USER_STACK_SIZE,
+						  PTE_R | PTE_W);
+	if (!err) err = vdso_map(p->mm);
+	if (err) return err;
+
+	sched_set_satp(p->mm->satp);
+	return 0;
+}
+
+static void proc_thread(void *arg) {
+	struct proc *p = arg;
+	struct thread *t = sched_current();
+	t->proc = p;
+
+	uint64_t entry;
+	int err = proc_load(p, &entry);
+	if (err) {
+		debug_printf("proc: cannot run %s (%d)\n", p->path, err);
+		proc_exit(err);
+	}
+
+	struct trap_frame *tf = thread_user_frame(t);
+	memset(tf, 0, sizeof(*tf));
+	tf->sepc = entry;
+	tf->sp = USER_TOP;
+	user_return(tf);
+}
+
+/* The other half of proc_fork(). */
+static void proc_fork_thread(void *arg) {
+	struct proc *p = arg;
+	struct thread *t = sched_current();
+	t->proc = p;
+	sched_set_satp(p->mm->satp);
+	// The parent's code may have been written on another hart.
+	asm volatile("fence.i" ::: "memory");
+
+	struct trap_frame *tf = thread_user_frame(t);
+	*tf = p->fork_frame;
+	tf->a0 = 0;
+	user_return(tf);
+}
+
+static void proc_close_files(struct proc *p) {
+	for (int fd = 0; fd < FD_MAX; fd++) fd_close(&p->fds, fd);
+}
+
+int proc_spawn(const char *path, int hart, struct proc **out) {
+	if (strlen(path) >= PROC_PATH_MAX) return -ENAMETOOLONG;
+	struct proc *p = proc_alloc(path);
+	if (!p) return -ENOMEM;
+
+	struct file *con;
+	int err = vfs_open_inode(&console_inode, &con);
+	if (err) {
+		pool_free(&proc_pool, p);
+		return err;
+	}
+	for (int fd = 0; fd < 3; fd++) {
+		if (fd) vfs_file_get(con);
+		fd_install(&p->fds, con);
+	}
+
+	p->thread = kthread_create(proc_thread, p, "user", hart);
+	if (!p->thread) {
+		proc_close_files(p);
+		pool_free(&proc_pool, p);
+		return -ENOMEM;
+	}
+	*out = p;
+	return 0;
+}
+
+int proc_fork(struct trap_frame *tf) {
+	struct proc *parent = proc_current();
+	struct proc *p = proc_alloc(parent->path);
+	if (!p) return -ENOMEM;
+	p->mm = mm_fork(parent->mm);
+	if (!p->mm) {
+		pool_free(&proc_pool, p);
+		return -ENOMEM;
+	}
+	fd_copy(&p->fds, &parent->fds);
+	p->fork_frame = *tf;
+
+	p->thread = kthread_create(proc_fork_thread, p, "user", -1);
+	if (!p->thread) {
+		proc_close_files(p);
+		mm_destroy(p->mm);
+		pool_free(&proc_pool, p);
+		return -ENOMEM;
+	}
+	p->sibling = parent->children;
+	parent->children = p;
+	return p->pid;
+}
+
+/* Leaves the children to free themselves, or frees those that exited. */
+static void proc_detach_children(struct proc *p) {
+	while (p->children) {
+		struct proc *c = p->children;
+		p->children = c->sibling;
+		bool irq = spin_lock_irqsave(&c->lock);
+		bool exited = c->exited;
+		c->detached = true;
+		spin_unlock_irqrestore(&c->lock, irq);
+		if (exited) pool_free(&proc_pool, c);
+	}
+}
+
+noreturn void proc_exit(int code) {
+	struct proc *p = proc_current();
+	// Before its threads lose the files and memory they use.
+	if (p->ring) {
+		uring_release(p->ring);
+		p->ring = NULL;
+	}
+	sched_set_satp(0);
+	if (p->mm) {
+		p->rss_peak = p->mm->rss_peak;
+		mm_destroy(p->mm);
+		p->mm = NULL;
+	}
+	proc_close_files(p);
+	proc_detach_children(p);
+
+	bool irq = spin_lock_irqsave(&p->lock);
+	p->exit_code = code;
+	p->exited = true;
+	bool detached = p->detached;
+	struct thread *waiter = p->waiter;
+	spin_unlock_irqrestore(&p->lock, irq);
+	// Otherwise p may be gone from here on.
+	if (detached)
+		pool_free(&proc_pool, p);
+	else if (waiter)
+		sched_wake(waiter);
+	kthread_exit();
+}
+
+int proc_wait(struct proc *p, unsigned long *rss_peak) {
+	// The idle thread, which runs the benchmarks, cannot sleep and polls.
+	bool block = sched_can_block();
+	for (;;) {
+		bool irq = spin_lock_irqsave(&p->lock);
+		bool exited = p->exited;
+		if (!exited && block) p->waiter = sched_current();
+		spin_unlock_irqrestore(&p->lock, irq);
+		if (exited) break;
+		if (block) {
+			sched_block();
+		} else {
+			sched_yield();
+			cpu_relax();
+		}
+	}
+
+	int code = p->exit_code;
+	if (rss_peak) *rss_peak = p->rss_peak;
+	pool_free(&proc_pool, p);
+	return code;
+}
+
+int proc_wait_child(int pid) {
+	struct proc *parent = proc_current();
+	for (struct proc **link = &parent->children; *link;
+		 link = &(*link)->sibling) {
+		struct proc *c = *link;
+		if (c->pid != pid) continue;
+		*link = c->sibling;
+		return proc_wait(c, NULL);
+	}
+	return -ECHILD;
+}
+
+void proc_run_init(void) {
+	char path[PROC_PATH_MAX] = "/bin/init";
+	const char *value;
+	size_t len;
+	if (cmdline_get("init", &value, &len)) {
+		if (!len || len >= sizeof(path)) {
+			debug_printf("proc: bad init= path\n");
+			return;
+		}
+		memcpy(path, value, len);
+		path[len] = 0;
+	}
+
+	struct inode *inode;
+	if (vfs_lookup(path, &inode)) return;
+	struct proc *p;
+	int err = proc_spawn(path, -1, &p);
+	if (err) {
+		debug_printf("proc: cannot start %s (%d)\n", path, err);
+		return;
+	}
+	debug_printf("proc: %s exited with %d\n", path, proc_wait(p, NULL));
+}
@@ -0,0 +1,152 @@
+#include "prof.h"
+
+#include <stdbool.h>
+
+#include "csr.h"
+#include "debug.h"
+#include "hart.h"
+#include "perf.h"
+#include "printf.h"
+#include "sbi.h"
+#include "string.h"
+#include "trap.h"
+
+/* Distinct stacks kept per hart. Samples of stacks that do not fit are only
+   counted. */
+#define PROF_TABLE_SIZE 512
+#define PROF_PROBES 16
+
+/* How far above the interrupted sp a frame pointer may be. */
+#define PROF_STACK_SPAN (64 * 1024)
+
+extern char __text_start[], __text_end[];
+
+struct prof_entry {
+	unsigned long count;
+	unsigned long depth;
+	unsigned long pc[PROF_DEPTH];
+};
+
+static struct prof_hart {
+	struct perf_sampler sampler;
+	uint64_t period;
+	bool active;
+	unsigned long samples, dropped;
+	struct prof_entry table[PROF_TABLE_SIZE];
+} prof_harts[HART_MAX];
+
+static bool prof_is_text(unsigned long addr) {
+	return addr >= (unsigned long)__text_start &&
+		   addr < (unsigned long)__text_end;
+}
+
+/* Walks the frame records the compiler keeps with -fno-omit-frame-pointer:
+   the return address at fp - 8 and the caller's fp at fp - 16. */
+static unsigned long prof_backtrace(struct trap_frame *tf, unsigned long *pc) {
+	unsigned long depth = 0;
+	unsigned long fp = tf->s0;
+	unsigned long lo = tf->sp, hi = tf->sp + PROF_STACK_SPAN;
+
+	pc[depth++] = tf->sepc;
+	// User stacks are not for the kernel to read, and not its profile.
+	if (!(tf->sstatus & SSTATUS_SPP)) return depth;
+	while (depth < PROF_DEPTH) {
+		if (fp & 7 || fp < lo + 16 || fp > hi) break;
+		unsigned long ra = ((unsigned long *)fp)[-1];
+		unsigned long next = ((unsigned long *)fp)[-2];
+		if (!prof_is_text(ra)) break;
+		pc[depth++] = ra;
+		if (next <= fp) break;
+		fp = next;
+	}
+	return depth;
+}
+
+static void prof_record(struct prof_hart *p, struct trap_frame *tf) {
+	unsigned long pc[PROF_DEPTH];
+	unsigned long depth = prof_backtrace(tf, pc);
+
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (unsigned long i = 0; i < depth; i++)
+		hash = (hash ^ pc[i]) * 0x100000001b3ull;
+
+	p->samples++;
+	for (unsigned int probe = 0; probe < PROF_PROBES; probe++) {
+		struct prof_entry *e = &p->table[(hash + probe) % PROF_TABLE_SIZE];
+		if (!e->count) {
+			e->depth = depth;
+			memcpy(e->pc, pc, depth * sizeof(pc[0]));
+		} else if (e->depth != depth ||
+				   memcmp(e->pc, pc, depth * sizeof(pc[0]))) {
+			continue;
+		}
+		e->count++;
+		return;
+	}
+	p->dropped++;
+}
+
+static void prof_irq(struct trap_frame *tf) {
+	struct prof_hart *p = &prof_harts[hart_index()];
+
+	perf_sampler_stop(&p->sampler);
+	csr_clear(sip, 1ul << IRQ_LCOF);
+	if (!p->active) return;
+
+	prof_record(p, tf);
+	perf_sampler_start(&p->sampler);
+}
+
+int prof_start(uint64_t period) {
+	struct prof_hart *p = &prof_harts[hart_index()];
+
+	if (!perf_enable_overflow_irq()) return SBI_ERR_NOT_SUPPORTED;
+	int err = perf_sampler_init(&p->sampler, PERF_EVENT_CYCLES, period);
+	if (err) return err;
+
+	trap_set_irq_handler(IRQ_LCOF, prof_irq);
+	p->period = period;
+	p->active = true;
+	err = perf_sampler_start(&p->sampler);
+	if (err) {
+		p->active = false;
+		perf_sampler_release(&p->sampler);
+		return err;
+	}
+	local_irq_enable();
+	return 0;
+}
+
+void prof_stop(void) {
+	struct prof_hart *p = &prof_harts[hart_index()];
+	if (!p->active) return;
+
+	bool irq = local_irq_save();
+	p->active = false;
+	perf_sampler_release(&p->sampler);
+	local_irq_restore(irq);
+}
+
+void prof_dump(void) {
+	for (unsigned int h = 0; h < hart_count; h++) {
+		struct prof_hart *p = &prof_harts[h];
+		if (!p->samples) continue;
+
+		debug_printf("prof: hart %u samples %lu dropped %lu period %lu\n", h,
+					 p->samples, p->dropped, (unsigned long)p->period);
+		for (unsigned int i = 0; i < PROF_TABLE_SIZE; i++) {
+			struct prof_entry *e = &p->table[i];
+			if (!e->count) continue;
+
+			char line[32 + PROF_DEPTH * 17];
+			int len = snprintf(line, sizeof(line), "prof: %lu", e->count);
+			for (unsigned long d = 0; d < e->depth; d++)
+				len += snprintf(line + len, sizeof(line) - len, " %lx",
+								e->pc[d]);
+			debug_printf("%s\n", line);
+		}
+		memset(p->table, 0, sizeof(p->table));
+		p->samples = p->dropped = 0;
+	}
+	debug_printf("prof: end\n");
+}
@@ -0,0 +1,101 @@
+#include <stdint.h>
+
+#include "debug.h"
+#include "fdt.h"
+#include "init.h"
+#include "limine/features.h"
+#include "pmm.h"
+#include "sched.h"
+#include "smp.h"
+#include "string.h"
+#include "vmm.h"
+
+#define RECLAIM_RANGES_MAX 64
+
+bool init_reclaimed;
+
+static struct reclaim_range {
+	uint64_t start, end;
+} reclaim_ranges[RECLAIM_RANGES_MAX];
+
+static bool reclaim_contains(unsigned int n, uint64_t phys) {
+	for (unsigned int i = 0; i < n; i++) {
+		if (phys >= reclaim_ranges[i].start << PAGE_SHIFT &&
+			phys < reclaim_ranges[i].end << PAGE_SHIFT)
+			return true;
+	}
+	return false;
+}
+
+/* Moves the DTB out of bootloader memory, if that is where it is. */
+static void reclaim_copy_fdt(unsigned int n) {
+	const void *blob = fdt_blob();
+	if (!blob || !reclaim_contains(n, virt_to_phys(blob))) return;
+
+	uint32_t size = fdt_size();
+	unsigned int order = 0;
+	while ((PAGE_SIZE << order) < size) order++;
+	void *copy = pmm_alloc(order);
+	if (!copy) panic("reclaim: no memory for the DTB\n");
+	memcpy(copy, blob, size);
+	fdt_relocate(copy);
+}
+
+/* Unmaps an init section from the kernel image and frees its pages. */
+static uint64_t reclaim_section(char *start, char *end) {
+	uint64_t size = end - start;
+	if (!size) return 0;
+
+	vmm_unmap(vmm_kernel_root, (uint64_t)start, size);
+	vmm_flush_kernel((uint64_t)start, size);
+
+	uint64_t phys = (uint64_t)LIMINE_EXE_VTOP(start);
+	pmm_free_range(phys >> PAGE_SHIFT, (phys + size) >> PAGE_SHIFT);
+	return size;
+}
+
+static void reclaim_thread(void *arg) {
+	(void)arg;
+	// No hart may still be in init code, and pmm_free_range() needs all
+	// struct pages set up. This thread helps with the latter rather than
+	// the boot path waiting for it.
+	smp_wait_booted();
+	pmm_wait_deferred();
+
+	// The memory map is itself bootloader-reclaimable, so note the ranges
+	// before freeing any of them. Page tables and stacks from the
+	// bootloader are in there too; every hart has left them since vmm_init()
+	// and entry.S.
+	struct limine_memmap_response *memmap = memmap_request.response;
+	unsigned int n = 0;
+	uint64_t loader_pages = 0;
+	for (uint64_t i = 0; i < memmap->entry_count && n < RECLAIM_RANGES_MAX;
+		 i++) {
+		struct limine_memmap_entry *e = memmap->entries[i];
+		if (e->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) continue;
+		reclaim_ranges[n].start = (e->base + PAGE_SIZE - 1) >> PAGE_SHIFT;
+		reclaim_ranges[n].end = (e->base + e->length) >> PAGE_SHIFT;
+		n++;
+	}
+
+	reclaim_copy_fdt(n);
+
+	for (unsigned int i = 0; i < n; i++) {
+		pmm_free_range(reclaim_ranges[i].start, reclaim_ranges[i].end);
+		loader_pages += reclaim_ranges[i].end - reclaim_ranges[i].start;
+	}
+
+	// Tracepoint sites in init text must not be patched from now on.
+	init_reclaimed = true;
+	uint64_t init_bytes = reclaim_section(__init_text_start, __init_text_end);
+	init_bytes += reclaim_section(__init_data_start, __init_data_end);
+
+	debug_printf("reclaim: freed %lu KiB of bootloader memory, %lu KiB of init "
+				 "sections\n",
+				 loader_pages << (PAGE_SHIFT - 10), init_bytes >> 10);
+}
+
+void init_reclaim(void) {
+	if (!kthread_create(reclaim_thread, NULL, "reclaim", -1))
+		reclaim_thread(NULL);
+}
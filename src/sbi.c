@@ -2,8 +2,14 @@
 
 #include "sbi.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "csr.h"
+#include "debug.h"
+#include "init.h"
+#include "trace.h"
+
 #define SBI_SUCCESS 0
 #define SBI_ERR_FAILED -1
 #define SBI_ERR_NOT_SUPPORTED -2
@@ -39,24 +45,146 @@
 #define SBI_EXT_MPXY 0x4d505859
 
 struct sbi_extensions sbi_capabilities;
+struct sbi_info sbi_info;
+
+/* Extensions worth probing, with the spec version that introduced each. A
+   firmware cannot implement an extension newer than the spec it reports, so
+   those probes are skipped; on older firmware this drops up to half of the
+   ecalls. */
+static const struct {
+	long eid;
+	unsigned long since;
+	bool *present;
+} sbi_probe_table[] = {
+	{SBI_EXT_TIME, SBI_SPEC_VERSION(0, 2), &sbi_capabilities.timer},
+	{SBI_EXT_IPI, SBI_SPEC_VERSION(0, 2), &sbi_capabilities.ipi},
+	{SBI_EXT_RFENCE, SBI_SPEC_VERSION(0, 2), &sbi_capabilities.rfence},
+	{SBI_EXT_HSM, SBI_SPEC_VERSION(0, 2), &sbi_capabilities.hsm},
+	{SBI_EXT_SRST, SBI_SPEC_VERSION(0, 3), &sbi_capabilities.srst},
+	{SBI_EXT_PMU, SBI_SPEC_VERSION(0, 3), &sbi_capabilities.pmu},
+	{SBI_EXT_DBCN, SBI_SPEC_VERSION(2, 0), &sbi_capabilities.dbcn},
+	{SBI_EXT_SUSP, SBI_SPEC_VERSION(2, 0), &sbi_capabilities.susp},
+	{SBI_EXT_CPPC, SBI_SPEC_VERSION(2, 0), &sbi_capabilities.cppc},
+	{SBI_EXT_NACL, SBI_SPEC_VERSION(2, 0), &sbi_capabilities.nacl},
+	{SBI_EXT_STA, SBI_SPEC_VERSION(2, 0), &sbi_capabilities.sta},
+	{SBI_EXT_SSE, SBI_SPEC_VERSION(3, 0), &sbi_capabilities.sse},
+	{SBI_EXT_FWFT, SBI_SPEC_VERSION(3, 0), &sbi_capabilities.fwft},
+	{SBI_EXT_DBTR, SBI_SPEC_VERSION(3, 0), &sbi_capabilities.dbtr},
+	{SBI_EXT_MPXY, SBI_SPEC_VERSION(3, 0), &sbi_capabilities.mpxy},
+};
+
+static const char *const sbi_impl_names[] = {
+	[SBI_IMPL_BBL] = "BBL",
+	[SBI_IMPL_OPENSBI] = "OpenSBI",
+	[SBI_IMPL_XVISOR] = "Xvisor",
+	[SBI_IMPL_KVM] = "KVM",
+	[SBI_IMPL_RUSTSBI] = "RustSBI",
+	[SBI_IMPL_DIOSIX] = "Diosix",
+	[SBI_IMPL_COFFER] = "Coffer",
+	[SBI_IMPL_XEN] = "Xen",
+	[SBI_IMPL_POLARFIRE_HSS] = "PolarFire HSS",
+	[SBI_IMPL_COREBOOT] = "coreboot",
+	[SBI_IMPL_OREBOOT] = "oreboot",
+	[SBI_IMPL_BHYVE] = "bhyve",
+};
+
+const char *sbi_impl_name(unsigned long impl_id) {
+	if (impl_id >= sizeof(sbi_impl_names) / sizeof(sbi_impl_names[0]))
+		return NULL;
+	return sbi_impl_names[impl_id];
+}
+
+static void __init sbi_probe_features(void) {
+	struct sbiret ret;
 
-void sbi_init(void) {
-	sbi_capabilities.timer = sbi_probe_extension(SBI_EXT_TIME).uvalue != 0;
-	sbi_capabilities.ipi = sbi_probe_extension(SBI_EXT_IPI).uvalue != 0;
-	sbi_capabilities.rfence = sbi_probe_extension(SBI_EXT_RFENCE).uvalue != 0;
-	sbi_capabilities.hsm = sbi_probe_extension(SBI_EXT_HSM).uvalue != 0;
-	sbi_capabilities.srst = sbi_probe_extension(SBI_EXT_SRST).uvalue != 0;
-	sbi_capabilities.pmu = sbi_probe_extension(SBI_EXT_PMU).uvalue != 0;
-	sbi_capabilities.dbcn = sbi_probe_extension(SBI_EXT_DBCN).uvalue != 0;
-	sbi_capabilities.susp = sbi_probe_extension(SBI_EXT_SUSP).uvalue != 0;
-	sbi_capabilities.cppc = sbi_probe_extension(SBI_EXT_CPPC).uvalue != 0;
-	sbi_capabilities.nacl = sbi_probe_extension(SBI_EXT_NACL).uvalue != 0;
-	sbi_capabilities.sta = sbi_probe_extension(SBI_EXT_STA).uvalue != 0;
-	sbi_capabilities.sse = sbi_probe_extension(SBI_EXT_SSE).uvalue != 0;
-	sbi_capabilities.fwft = sbi_probe_extension(SBI_EXT_FWFT).uvalue != 0;
-	sbi_capabilities.dbtr = sbi_probe_extension(SBI_EXT_DBTR).uvalue != 0;
-	sbi_capabilities.mpxy = sbi_probe_extension(SBI_EXT_MPXY).uvalue != 0;
+	if (sbi_capabilities.pmu) {
+		ret = sbi_pmu_num_counters();
+		sbi_info.ecalls++;
+		if (ret.error == SBI_SUCCESS) sbi_info.pmu_num_counters = ret.uvalue;
+	}
+
+	if (sbi_capabilities.dbtr) {
+		// A zero trig_tdata1 matches triggers of any type.
+		ret = sbi_debug_num_triggers(0);
+		sbi_info.ecalls++;
+		if (ret.error == SBI_SUCCESS) sbi_info.dbtr_num_triggers = ret.uvalue;
+	}
+
+	if (sbi_capabilities.fwft) {
+		for (int i = 0; i < SBI_FWFT_COUNT; i++) {
+			ret = sbi_fwft_get(i);
+			sbi_info.ecalls++;
+			if (ret.error != SBI_SUCCESS) continue;
+			sbi_info.fwft_supported |= 1ul << i;
+			sbi_info.fwft_value[i] = ret.uvalue;
+		}
+	}
+}
+
+void __init sbi_init(void) {
+	static bool done;
+	if (done) return;
+	done = true;
+
+	uint64_t start = rdcycle();
+
+	// SBI v0.1 firmware has no base extension and returns an error here.
+	struct sbiret ret = sbi_get_spec_version();
+	sbi_info.ecalls = 1;
+	if (ret.error == SBI_SUCCESS) {
+		sbi_info.spec_version = ret.uvalue;
+		sbi_info.impl_id = sbi_get_impl_id().uvalue;
+		sbi_info.impl_version = sbi_get_impl_version().uvalue;
+		sbi_info.mvendorid = sbi_get_mvendorid().uvalue;
+		sbi_info.marchid = sbi_get_marchid().uvalue;
+		sbi_info.mimpid = sbi_get_mimpid().uvalue;
+		sbi_info.ecalls += 5;
+
+		for (unsigned long i = 0;
+			 i < sizeof(sbi_probe_table) / sizeof(sbi_probe_table[0]); i++) {
+			if (sbi_info.spec_version < sbi_probe_table[i].since) continue;
+			*sbi_probe_table[i].present =
+				sbi_probe_extension(sbi_probe_table[i].eid).uvalue != 0;
+			sbi_info.ecalls++;
+		}
+
+		sbi_probe_features();
+	}
+
+	sbi_info.cycles = rdcycle() - start;
+}
+
+void __init sbi_print_info(void) {
+	const char *impl = sbi_impl_name(sbi_info.impl_id);
+
+	debug_printf("SBI v%lu.%lu, %s (id %lu) version 0x%lx\n",
+				 SBI_SPEC_MAJOR(sbi_info.spec_version),
+				 SBI_SPEC_MINOR(sbi_info.spec_version), impl ? impl : "unknown",
+				 sbi_info.impl_id, sbi_info.impl_version);
+	debug_printf("  mvendorid 0x%lx marchid 0x%lx mimpid 0x%lx\n",
+				 sbi_info.mvendorid, sbi_info.marchid, sbi_info.mimpid);
+	debug_printf(
+		"  extensions:%s%s%s%s%s%s%s%s%s%s%s%s%s%s%s\n",
+		sbi_capabilities.timer ? " TIME" : "", sbi_capabilities.ipi ? " IPI" : "",
+		sbi_capabilities.rfence ? " RFNC" : "",
+		sbi_capabilities.hsm ? " HSM" : "", sbi_capabilities.srst ? " SRST" : "",
+		sbi_capabilities.pmu ? " PMU" : "", sbi_capabilities.dbcn ? " DBCN" : "",
+		sbi_capabilities.susp ? " SUSP" : "",
+		sbi_capabilities.cppc ? " CPPC" : "",
+		sbi_capabilities.nacl ? " NACL" : "", sbi_capabilities.sta ? " STA" : "",
+		sbi_capabilities.sse ? " SSE" : "", sbi_capabilities.fwft ? " FWFT" : "",
+		sbi_capabilities.dbtr ? " DBTR" : "",
+		sbi_capabilities.mpxy ? " MPXY" : "");
+	if (sbi_capabilities.pmu)
+		debug_printf("  PMU: %lu counters\n", sbi_info.pmu_num_counters);
+	if (sbi_capabilities.dbtr)
+		debug_printf("  DBTR: %lu triggers\n", sbi_info.dbtr_num_triggers);
+	if (sbi_capabilities.fwft)
+		debug_printf("  FWFT: supported mask 0x%lx\n", sbi_info.fwft_supported);
+	debug_printf("  probed with %lu ecalls in %lu cycles\n", sbi_info.ecalls,
+				 (unsigned long)sbi_info.cycles);
 }
+
 int sbi_hartmask_add(unsigned long *hart_mask, unsigned long hart_mask_base,
 					 unsigned long hartid) {
 	if (hartid >= (8 * sizeof(unsigned long)) + hart_mask_base) return -1;
@@ -64,8 +192,11 @@ int sbi_hartmask_add(unsigned long *hart_mask, unsigned long hart_mask_base,
 	return 0;
 }
 
+DEFINE_TRACEPOINT(sbi_ecall);
+
 static inline struct sbiret sbi_ecall0(long ext, long fid) {
 	struct sbiret ret;
+	trace(sbi_ecall, ext, fid);
 	register uint64_t a0 asm("a0");
 	register uint64_t a1 asm("a1");
 	register uint64_t a6 asm("a6") = fid;
@@ -78,6 +209,7 @@ static inline struct sbiret sbi_ecall0(long ext, long fid) {
 
 static inline struct sbiret sbi_ecall1(long ext, long fid, long arg0) {
 	struct sbiret ret;
+	trace(sbi_ecall, ext, fid);
 	register uint64_t a0 asm("a0") = arg0;
 	register uint64_t a1 asm("a1");
 	register uint64_t a6 asm("a6") = fid;
@@ -91,6 +223,7 @@ static inline struct sbiret sbi_ecall1(long ext, long fid, long arg0) {
 static inline struct sbiret sbi_ecall2(long ext, long fid, long arg0,
 									   long arg1) {
 	struct sbiret ret;
+	trace(sbi_ecall, ext, fid);
 	register uint64_t a0 asm("a0") = arg0;
 	register uint64_t a1 asm("a1") = arg1;
 	register uint64_t a6 asm("a6") = fid;
@@ -104,6 +237,7 @@ static inline struct sbiret sbi_ecall2(long ext, long fid, long arg0,
 static inline struct sbiret sbi_ecall3(long ext, long fid, long arg0, long arg1,
 									   long arg2) {
 	struct sbiret ret;
+	trace(sbi_ecall, ext, fid);
 	register uint64_t a0 asm("a0") = arg0;
 	register uint64_t a1 asm("a1") = arg1;
 	register uint64_t a2 asm("a2") = arg2;
@@ -121,6 +255,7 @@ static inline struct sbiret sbi_ecall3(long ext, long fid, long arg0, long arg1,
 static inline struct sbiret sbi_ecall4(long ext, long fid, long arg0, long arg1,
 									   long arg2, long arg3) {
 	struct sbiret ret;
+	trace(sbi_ecall, ext, fid);
 	register uint64_t a0 asm("a0") = arg0;
 	register uint64_t a1 asm("a1") = arg1;
 	register uint64_t a2 asm("a2") = arg2;
@@ -139,6 +274,7 @@ static inline struct sbiret sbi_ecall4(long ext, long fid, long arg0, long arg1,
 static inline struct sbiret sbi_ecall5(long ext, long fid, long arg0, long arg1,
 									   long arg2, long arg3, long arg4) {
 	struct sbiret ret;
+	trace(sbi_ecall, ext, fid);
 	register uint64_t a0 asm("a0") = arg0;
 	register uint64_t a1 asm("a1") = arg1;
 	register uint64_t a2 asm("a2") = arg2;
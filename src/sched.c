@@ -0,0 +1,336 @@
+#include "sched.h"
+
+#include <stddef.h>
+
+#include "csr.h"
+#include "debug.h"
+#include "hart.h"
+#include "init.h"
+#include "pmm.h"
+#include "sbi.h"
+#include "spinlock.h"
+#include "trace.h"
+#include "trap.h"
+#include "vmm.h"
+
+struct runqueue {
+	spinlock_t lock;
+	struct thread *head, *tail;
+	unsigned int nr;
+	struct thread *current;
+	/* A thread that exited on this hart, freed once we are off its stack. */
+	struct thread *dead;
+	/* Threads in sched_block_until(). */
+	struct thread *sleepers;
+	/* The satp the hart has loaded. */
+	uint64_t satp;
+	struct thread idle;
+};
+
+static struct runqueue runqueues[HART_MAX];
+
+DEFINE_TRACEPOINT(sched_switch);
+
+void switch_context(struct context *prev, struct context *next);
+
+static struct runqueue *this_rq(void) { return &runqueues[hart_index()]; }
+
+static void rq_push(struct runqueue *rq, struct thread *t) {
+	t->next = NULL;
+	if (rq->tail)
+		rq->tail->next = t;
+	else
+		rq->head = t;
+	rq->tail = t;
+	rq->nr++;
+}
+
+static struct thread *rq_pop(struct runqueue *rq) {
+	struct thread *t = rq->head;
+	if (!t) return NULL;
+	rq->head = t->next;
+	if (!rq->head) rq->tail = NULL;
+	rq->nr--;
+	return t;
+}
+
+static void sched_ipi(struct trap_frame *tf) {
+	(void)tf;
+	csr_clear(sip, 1ul << IRQ_S_SOFT);
+}
+
+/* Points the hart's timer at the earliest sleeper's deadline. Called on
+   the runqueue's own hart with its lock held. */
+static void sched_timer_program(struct runqueue *rq) {
+	uint64_t next = UINT64_MAX;
+	for (struct thread *t = rq->sleepers; t; t = t->timer_next) {
+		if (t->deadline < next) next = t->deadline;
+	}
+	// A deadline at UINT64_MAX also clears a pending timer interrupt.
+	sbi_set_timer(next);
+}
+
+static void sched_timer(struct trap_frame *tf) {
+	(void)tf;
+	struct runqueue *rq = this_rq();
+	uint64_t now = rdtime();
+
+	spin_lock(&rq->lock);
+	struct thread **link = &rq->sleepers;
+	while (*link) {
+		struct thread *t = *link;
+		if (t->deadline > now) {
+			link = &t->timer_next;
+			continue;
+		}
+		*link = t->timer_next;
+		t->deadline = 0;
+		t->state = THREAD_RUNNABLE;
+		rq_push(rq, t);
+	}
+	sched_timer_program(rq);
+	spin_unlock(&rq->lock);
+}
+
+/* Takes a thread being woken off its hart's sleeper list. Called with the
+   runqueue locked. */
+static void sched_timer_cancel(struct runqueue *rq, struct thread *t) {
+	if (!t->deadline) return;
+	for (struct thread **link = &rq->sleepers; *link;
+		 link = &(*link)->timer_next) {
+		if (*link == t) {
+			*link = t->timer_next;
+			break;
+		}
+	}
+	// The timer may still fire for it; the handler then finds nothing due.
+	t->deadline = 0;
+}
+
+void __init sched_init_hart(void) {
+	struct runqueue *rq = this_rq();
+	rq->idle.name = "idle";
+	rq->idle.state = THREAD_RUNNING;
+	rq->idle.hart = hart_index();
+	rq->current = &rq->idle;
+	rq->satp = csr_read(satp);
+
+	trap_set_irq_handler(IRQ_S_SOFT, sched_ipi);
+	csr_set(sie, 1ul << IRQ_S_SOFT);
+	if (sbi_capabilities.timer) {
+		trap_set_irq_handler(IRQ_S_TIMER, sched_timer);
+		sbi_set_timer(UINT64_MAX);
+		csr_set(sie, 1ul << IRQ_S_TIMER);
+	}
+}
+
+struct thread *sched_current(void) { return this_rq()->current; }
+
+bool sched_can_block(void) {
+	struct runqueue *rq = this_rq();
+	return rq->current != &rq->idle;
+}
+
+static void sched_finish_switch(struct runqueue *rq) {
+	if (rq->dead) {
+		pmm_free(rq->dead, THREAD_STACK_ORDER);
+		rq->dead = NULL;
+	}
+}
+
+/* There are no ASIDs yet, so a new address space flushes the TLB. Global
+   kernel entries survive the flush. */
+static void sched_load_satp(struct runqueue *rq, uint64_t satp) {
+	if (rq->satp == satp) return;
+	rq->satp = satp;
+	csr_write(satp, satp);
+	asm volatile("sfence.vma" ::: "memory");
+}
+
+/* Switches to the next runnable thread. Called with rq->lock held and
+   interrupts off, and returns the same way once the caller runs again. */
+static void sched_switch(struct runqueue *rq) {
+	struct thread *prev = rq->current;
+	struct thread *next = rq_pop(rq);
+
+	if (!next) {
+		if (prev->state == THREAD_RUNNING) return;
+		next = &rq->idle;
+	}
+	if (prev->state == THREAD_RUNNING && prev != &rq->idle) {
+		prev->state = THREAD_RUNNABLE;
+		rq_push(rq, prev);
+	}
+	if (prev->state == THREAD_DEAD) rq->dead = prev;
+
+	next->state = THREAD_RUNNING;
+	rq->current = next;
+	trace(sched_switch, prev, next);
+	if (next->satp) sched_load_satp(rq, next->satp);
+	switch_context(&prev->ctx, &next->ctx);
+	sched_finish_switch(rq);
+}
+
+/* First code run by a new thread, still holding the lock of the switch that
+   started it. */
+static void kthread_trampoline(void) {
+	struct runqueue *rq = this_rq();
+	sched_finish_switch(rq);
+	spin_unlock(&rq->lock);
+	local_irq_enable();
+
+	struct thread *t = rq->current;
+	t->fn(t->arg);
+	kthread_exit();
+}
+
+static void sched_kick(unsigned int hart) {
+	if (hart == hart_index() || !sbi_capabilities.ipi) return;
+	sbi_send_ipi(1, harts[hart].hartid);
+}
+
+struct thread *kthread_create(void (*fn)(void *), void *arg, const char *name,
+							  int hart) {
+	if (hart < 0) {
+		hart = 0;
+		for (unsigned int h = 1; h < hart_count; h++) {
+			if (runqueues[h].nr < runqueues[hart].nr) hart = h;
+		}
+	}
+
+	struct thread *t = pmm_alloc(THREAD_STACK_ORDER);
+	if (!t) return NULL;
+
+	// The thread lives at the bottom of its own stack block.
+	*t = (struct thread){0};
+	t->name = name;
+	t->fn = fn;
+	t->arg = arg;
+	t->hart = hart;
+	t->state = THREAD_RUNNABLE;
+	t->ctx.ra = (unsigned long)kthread_trampoline;
+	t->ctx.sp =
+		(unsigned long)t + (PAGE_SIZE << THREAD_STACK_ORDER) - TRAP_FRAME_SIZE;
+
+	struct runqueue *rq = &runqueues[hart];
+	bool irq = spin_lock_irqsave(&rq->lock);
+	rq_push(rq, t);
+	spin_unlock_irqrestore(&rq->lock, irq);
+	sched_kick(hart);
+	return t;
+}
+
+void sched_set_satp(uint64_t satp) {
+	struct runqueue *rq = this_rq();
+	bool irq = spin_lock_irqsave(&rq->lock);
+	rq->current->satp = satp;
+	sched_load_satp(rq, satp ? satp : vmm_kernel_satp);
+	spin_unlock_irqrestore(&rq->lock, irq);
+}
+
+noreturn void kthread_exit(void) {
+	struct runqueue *rq = this_rq();
+	local_irq_disable();
+	spin_lock(&rq->lock);
+	rq->current->state = THREAD_DEAD;
+	sched_switch(rq);
+	__builtin_unreachable();
+}
+
+void sched_yield(void) {
+	struct runqueue *rq = this_rq();
+	if (!__atomic_load_n(&rq->head, __ATOMIC_RELAXED)) return;
+
+	bool irq = spin_lock_irqsave(&rq->lock);
+	sched_switch(rq);
+	spin_unlock_irqrestore(&rq->lock, irq);
+}
+
+void sched_block(void) {
+	struct runqueue *rq = this_rq();
+	bool irq = spin_lock_irqsave(&rq->lock);
+	struct thread *cur = rq->current;
+	if (cur->wake_pending) {
+		cur->wake_pending = false;
+	} else {
+		cur->state = THREAD_BLOCKED;
+		sched_switch(rq);
+	}
+	spin_unlock_irqrestore(&rq->lock, irq);
+}
+
+void sched_block_until(uint64_t deadline) {
+	struct runqueue *rq = this_rq();
+	bool irq = spin_lock_irqsave(&rq->lock);
+	struct thread *cur = rq->current;
+	if (cur->wake_pending) {
+		cur->wake_pending = false;
+	} else if (rdtime() < deadline) {
+		cur->deadline = deadline;
+		cur->timer_next = rq->sleepers;
+		rq->sleepers = cur;
+		if (sbi_capabilities.timer) sched_timer_program(rq);
+		cur->state = THREAD_BLOCKED;
+		sched_switch(rq);
+	}
+	spin_unlock_irqrestore(&rq->lock, irq);
+}
+
+void sched_wake(struct thread *t) {
+	struct runqueue *rq = &runqueues[t->hart];
+	bool kick = false;
+
+	bool irq = spin_lock_irqsave(&rq->lock);
+	if (t->state == THREAD_BLOCKED) {
+		sched_timer_cancel(rq, t);
+		t->state = THREAD_RUNNABLE;
+		rq_push(rq, t);
+		kick = true;
+	} else if (t->state == THREAD_RUNNING) {
+		t->wake_pending = true;
+	}
+	spin_unlock_irqrestore(&rq->lock, irq);
+
+	if (kick) sched_kick(t->hart);
+}
+
+void sched_interrupt(struct thread *t) {
+	__atomic_store_n(&t->interrupted, true, __ATOMIC_RELEASE);
+	sched_wake(t);
+}
+
+bool sched_interrupted(void) {
+	return __atomic_load_n(&sched_current()->interrupted, __ATOMIC_ACQUIRE);
+}
+
+void sched_kick_idle(void) {
+	for (unsigned int h = 0; h < hart_count; h++) {
+		struct runqueue *rq = &runqueues[h];
+		if (h != hart_index() &&
+			__atomic_load_n(&rq->current, __ATOMIC_RELAXED) == &rq->idle) {
+			sched_kick(h);
+			return;
+		}
+	}
+}
+
+noreturn void sched_idle(void) {
+	struct runqueue *rq = this_rq();
+	for (;;) {
+		sched_yield();
+
+		// Spare time goes to zeroing pages for pmm_alloc_zeroed().
+		if (pmm_zero_pool_fill()) continue;
+
+		// An IPI arriving after the check stays pending in sip and ends the
+		// wfi at once, so no wakeup is lost. Without IPIs, poll instead.
+		local_irq_disable();
+		if (!__atomic_load_n(&rq->head, __ATOMIC_RELAXED)) {
+			if (sbi_capabilities.ipi)
+				asm volatile("wfi");
+			else
+				cpu_relax();
+		}
+		local_irq_enable();
+	}
+}
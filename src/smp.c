@@ -0,0 +1,84 @@
+#include "smp.h"
+
+#include <stddef.h>
+
+#include "debug.h"
+#include "hart.h"
+#include "init.h"
+#include "initcall.h"
+#include "isa.h"
+#include "limine/features.h"
+#include "perf.h"
+#include "plic.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "trap.h"
+
+#define SMP_STACK_SIZE 0x4000
+
+/* Stacks of the other harts' idle threads. The bootloader's are freed with
+   the rest of its memory. */
+static char smp_stacks[HART_MAX][SMP_STACK_SIZE] __attribute__((aligned(16)));
+
+static unsigned int smp_booted;
+
+extern char smp_ap_start[];
+
+/* Called by entry.S on the hart's own stack. Not __init: it is still on the
+   call stack, waiting to return from initcall_run(), when the init sections
+   go away. */
+void smp_ap_main(void) {
+	isa_hart_init();
+	trap_init();
+	perf_hart_init();
+	sched_init_hart();
+	plic_hart_init();
+
+	initcall_run();
+	__atomic_add_fetch(&smp_booted, 1, __ATOMIC_RELEASE);
+	sched_idle();
+}
+
+void __init smp_init(void) {
+	struct limine_mp_response *resp = mp_request.response;
+	if (!resp) {
+		initcall_prepare();
+		return;
+	}
+
+	struct hart *self = hart_self();
+	self->hartid = resp->bsp_hartid;
+	unsigned int n = 1;
+	for (uint64_t i = 0; i < resp->cpu_count && n < HART_MAX; i++) {
+		struct limine_mp_info *info = resp->cpus[i];
+		if (info->hartid == self->hartid) continue;
+
+		struct hart *h = &harts[n];
+		h->hartid = info->hartid;
+		h->stack_top = (unsigned long)smp_stacks[n] + SMP_STACK_SIZE;
+		h->index = n++;
+		info->extra_argument = (uint64_t)h;
+	}
+	// Anything sized by hart_count must see every hart before any starts,
+	// parallel initcalls included.
+	hart_count = n;
+	initcall_prepare();
+
+	if (resp->cpu_count > HART_MAX)
+		debug_printf("smp: using %u of %lu harts\n", n, resp->cpu_count);
+
+	for (unsigned int i = 1; i < n; i++) {
+		for (uint64_t j = 0; j < resp->cpu_count; j++) {
+			struct limine_mp_info *info = resp->cpus[j];
+			if (info->extra_argument == (uint64_t)&harts[i])
+				__atomic_store_n(&info->goto_address,
+								 (limine_goto_address)smp_ap_start,
+								 __ATOMIC_RELEASE);
+		}
+	}
+}
+
+void smp_wait_booted(void) {
+	while (__atomic_load_n(&smp_booted, __ATOMIC_ACQUIRE) < hart_count - 1)
+		cpu_relax();
+}
@@ -0,0 +1,191 @@
+#include "syscall.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "errno.h"
+#include "mm.h"
+#include "net.h"
+#include "proc.h"
+#include "sched.h"
+#include "uring.h"
+#include "vdso.h"
+#include "vfs.h"
+#include "vmm.h"
+
+#define SYSCALL_PATH_MAX 256
+
+static long sys_null(void) { return 0; }
+
+static long sys_exit(long code) { proc_exit(code); }
+
+static long sys_getpid(void) { return proc_current()->pid; }
+
+static long sys_yield(void) {
+	mm_yield(proc_current()->mm);
+	return 0;
+}
+
+static long sys_open(unsigned long upath) {
+	struct proc *p = proc_current();
+	char path[SYSCALL_PATH_MAX];
+	long len = strncpy_from_user(p->mm, path, upath, sizeof(path));
+	if (len < 0) return len;
+
+	struct file *f;
+	int err = vfs_open(path, &f);
+	if (err) return err;
+	int fd = fd_install(&p->fds, f);
+	if (fd < 0) vfs_close(f);
+	return fd;
+}
+
+static long sys_close(long fd) { return fd_close(&proc_current()->fds, fd); }
+
+/* Moves data between f and a user buffer a page at a time, in place, with
+   no bounce buffer. Returns the bytes moved if any, else the error. */
+static long sys_rw(long fd, unsigned long buf, unsigned long len, bool write) {
+	struct proc *p = proc_current();
+	struct file *f = fd_get(&p->fds, fd);
+	if (!f) return -EBADF;
+
+	long done = 0, err = 0;
+	while ((unsigned long)done < len) {
+		unsigned long va = buf + done;
+		size_t n = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+		if (n > len - done) n = len - done;
+		void *addr = mm_user_addr(p->mm, va, write ? PTE_R : PTE_W);
+		if (!addr) {
+			err = -EFAULT;
+			break;
+		}
+		long got = write ? vfs_write(f, addr, n) : vfs_read(f, addr, n);
+		if (got < 0) {
+			err = got;
+			break;
+		}
+		done += got;
+		if ((size_t)got < n) break;
+	}
+	vfs_close(f);
+	return done ? done : err;
+}
+
+/* Page table bits for PROT_* bits. Writable implies readable. */
+static uint64_t prot_to_pte(long prot) {
+	uint64_t pte = 0;
+	if (prot & PROT_READ) pte |= PTE_R;
+	if (prot & PROT_WRITE) pte |= PTE_R | PTE_W;
+	if (prot & PROT_EXEC) pte |= PTE_X;
+	return pte;
+}
+
+static long sys_mmap(unsigned long addr, unsigned long len, long prot, long fd,
+					 unsigned long offset) {
+	struct proc *p = proc_current();
+	len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if (!len || prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC) ||
+		offset & (PAGE_SIZE - 1))
+		return -EINVAL;
+	uint64_t pte = prot_to_pte(prot);
+
+	struct file *f = NULL;
+	uint64_t file_size = 0;
+	if (fd != -1) {
+		f = fd_get(&p->fds, fd);
+		if (!f) return -EBADF;
+		if (f->inode->dir) {
+			vfs_close(f);
+			return -EINVAL;
+		}
+		if (offset < f->inode->size) file_size = f->inode->size - offset;
+	}
+
+	// The hint is taken if that range is free.
+	int err = -EINVAL;
+	if (addr && !(addr & (PAGE_SIZE - 1)))
+		err = mm_map(p->mm, addr, len, pte, f, offset, file_size);
+	if (err == -EINVAL) {
+		addr = mm_find_free(p->mm, len);
+		err = addr ? mm_map(p->mm, addr, len, pte, f, offset, file_size)
+				   : -ENOMEM;
+	}
+	if (f) vfs_close(f);
+	return err ? err : (long)addr;
+}
+
+static long sys_munmap(unsigned long addr, unsigned long len) {
+	len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	return mm_unmap(proc_current()->mm, addr, len);
+}
+
+static long sys_mprotect(unsigned long addr, unsigned long len, long prot) {
+	len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) return -EINVAL;
+	return mm_protect(proc_current()->mm, addr, len, prot_to_pte(prot));
+}
+
+static long sys_wait(long pid) { return proc_wait_child(pid); }
+
+static long sys_socket(long type, unsigned long addr, unsigned long port) {
+	if ((type != SOCKET_UDP && type != SOCKET_TCP) || addr > UINT32_MAX ||
+		port > UINT16_MAX)
+		return -EINVAL;
+	struct file *f;
+	int err = sock_file_open(type == SOCKET_TCP ? SOCK_TCP : SOCK_UDP, addr,
+							 port, &f);
+	if (err) return err;
+	struct proc *p = proc_current();
+	int fd = fd_install(&p->fds, f);
+	if (fd < 0) vfs_close(f);
+	return fd;
+}
+
+static long sys_clock_gettime(long clock, unsigned long uts) {
+	struct timespec ts;
+	int err = vdso_clock_gettime(clock, &ts);
+	if (err) return err;
+	return copy_to_user(proc_current()->mm, uts, &ts, sizeof(ts));
+}
+
+static long sys_read(long fd, unsigned long buf, unsigned long len) {
+	return sys_rw(fd, buf, len, false);
+}
+
+static long sys_write(long fd, unsigned long buf, unsigned long len) {
+	return sys_rw(fd, buf, len, true);
+}
+
+// The handlers take fewer arguments than syscall_t passes, which the
+// calling convention allows.
+#define SYSCALL(nr, fn) [nr] = (syscall_t)(void (*)(void))(fn)
+
+const syscall_t syscall_table[SYS_FAST_MAX] = {
+	SYSCALL(SYS_NULL, sys_null),
+	SYSCALL(SYS_EXIT, sys_exit),
+	SYSCALL(SYS_GETPID, sys_getpid),
+	SYSCALL(SYS_YIELD, sys_yield),
+	SYSCALL(SYS_OPEN, sys_open),
+	SYSCALL(SYS_CLOSE, sys_close),
+	SYSCALL(SYS_READ, sys_read),
+	SYSCALL(SYS_WRITE, sys_write),
+	SYSCALL(SYS_MMAP, sys_mmap),
+	SYSCALL(SYS_MUNMAP, sys_munmap),
+	SYSCALL(SYS_WAIT, sys_wait),
+	SYSCALL(SYS_MPROTECT, sys_mprotect),
+	SYSCALL(SYS_URING_SETUP, uring_setup),
+	SYSCALL(SYS_URING_ENTER, uring_enter),
+	SYSCALL(SYS_URING_REGISTER, uring_register),
+	SYSCALL(SYS_SOCKET, sys_socket),
+	SYSCALL(SYS_CLOCK_GETTIME, sys_clock_gettime),
+};
+
+long syscall_frame(struct trap_frame *tf) {
+	switch (tf->a7) {
+	case SYS_FORK:
+		return proc_fork(tf);
+	default:
+		return -ENOSYS;
+	}
+}
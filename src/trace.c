@@ -0,0 +1,117 @@
+#include "trace.h"
+
+#include <stddef.h>
+
+#include "cmdline.h"
+#include "csr.h"
+#include "debug.h"
+#include "hart.h"
+#include "init.h"
+#include "patch.h"
+#include "string.h"
+#include "trap.h"
+
+#define TRACE_RING_SIZE 1024
+
+struct trace_entry {
+	uint64_t time;
+	struct tracepoint *tp;
+	uint64_t a, b;
+};
+
+/* Written only by the owning hart, with interrupts off, so no locking. head
+   counts every record ever written; the ring keeps the newest ones. */
+struct trace_ring {
+	unsigned long head;
+	struct trace_entry entries[TRACE_RING_SIZE];
+};
+
+static struct trace_ring trace_rings[HART_MAX];
+
+extern struct trace_site __trace_sites_start[], __trace_sites_end[];
+extern struct tracepoint __tracepoints_start[], __tracepoints_end[];
+
+void trace_record(struct tracepoint *tp, uint64_t a, uint64_t b) {
+	bool irq = local_irq_save();
+	struct trace_ring *r = &trace_rings[hart_index()];
+	struct trace_entry *e = &r->entries[r->head++ % TRACE_RING_SIZE];
+	e->time = rdtime();
+	e->tp = tp;
+	e->a = a;
+	e->b = b;
+	local_irq_restore(irq);
+}
+
+static struct tracepoint *trace_find(const char *name) {
+	for (struct tracepoint *tp = __tracepoints_start; tp < __tracepoints_end;
+		 tp++) {
+		if (!strcmp(tp->name, name)) return tp;
+	}
+	return NULL;
+}
+
+static void trace_patch_sites(struct tracepoint *tp, bool enable) {
+	for (struct trace_site *s = __trace_sites_start; s < __trace_sites_end;
+		 s++) {
+		if (s->tp != tp) continue;
+		// Init text is unmapped once reclaimed.
+		if (init_reclaimed && is_init_text(s->site)) continue;
+		patch_insn((void *)s->site,
+				   enable ? rv_insn_jump(s->site, s->target) : RV_INSN_NOP);
+	}
+}
+
+static int trace_set(const char *name, bool enable) {
+	struct tracepoint *tp = trace_find(name);
+	if (!tp) return -1;
+	if (tp->enabled != enable) {
+		tp->enabled = enable;
+		trace_patch_sites(tp, enable);
+		patch_commit();
+	}
+	return 0;
+}
+
+int trace_enable(const char *name) { return trace_set(name, true); }
+
+int trace_disable(const char *name) { return trace_set(name, false); }
+
+void __init trace_init(void) {
+	if (!cmdline_has("trace")) return;
+
+	for (struct tracepoint *tp = __tracepoints_start; tp < __tracepoints_end;
+		 tp++) {
+		if (cmdline_list_has("trace", tp->name)) {
+			tp->enabled = true;
+			trace_patch_sites(tp, true);
+		}
+	}
+	patch_commit();
+}
+
+void trace_dump(void) {
+	bool any = false;
+	for (struct tracepoint *tp = __tracepoints_start; tp < __tracepoints_end;
+		 tp++) {
+		if (!tp->enabled) continue;
+		tp->enabled = false;
+		trace_patch_sites(tp, false);
+		any = true;
+	}
+	if (!any) return;
+	patch_commit();
+
+	for (unsigned int h = 0; h < hart_count; h++) {
+		struct trace_ring *r = &trace_rings[h];
+		unsigned long first =
+			r->head > TRACE_RING_SIZE ? r->head - TRACE_RING_SIZE : 0;
+		debug_printf("trace: hart %u records %lu dropped %lu\n", h, r->head,
+					 first);
+		for (unsigned long i = first; i < r->head; i++) {
+			struct trace_entry *e = &r->entries[i % TRACE_RING_SIZE];
+			debug_printf("trace: %lu %s %lx %lx\n", e->time, e->tp->name, e->a,
+						 e->b);
+		}
+		r->head = 0;
+	}
+}
@@ -0,0 +1,135 @@
+#include "trap.h"
+
+#include "csr.h"
+#include "debug.h"
+#include "errno.h"
+#include "init.h"
+#include "mm.h"
+#include "proc.h"
+#include "sched.h"
+#include "trace.h"
+#include "vdso.h"
+#include "vmm.h"
+
+#define TRAP_IRQ_MAX 16
+
+/* csrr rd, time, which is csrrs rd, time, x0, with rd masked out. */
+#define INSN_RDTIME_MASK 0xfffff07fu
+#define INSN_RDTIME 0xc0102073u
+
+extern char trap_entry[];
+
+static irq_handler_t irq_handlers[TRAP_IRQ_MAX];
+
+DEFINE_TRACEPOINT(trap);
+
+static const char *const exception_names[] = {
+	"instruction address misaligned",
+	"instruction access fault",
+	"illegal instruction",
+	"breakpoint",
+	"load address misaligned",
+	"load access fault",
+	"store address misaligned",
+	"store access fault",
+	"environment call from U-mode",
+	"environment call from S-mode",
+	"reserved",
+	"reserved",
+	"instruction page fault",
+	"load page fault",
+	"reserved",
+	"store page fault",
+};
+
+void __init trap_init(void) {
+	csr_write(stvec, trap_entry);
+	// User code may read the time, for the vDSO, but not the cycle and
+	// instret counters, which would show it what other processes do.
+	csr_write(scounteren, SCOUNTEREN_TM);
+}
+
+void trap_set_irq_handler(unsigned int irq, irq_handler_t handler) {
+	if (irq < TRAP_IRQ_MAX) irq_handlers[irq] = handler;
+}
+
+static void trap_irq(struct trap_frame *tf) {
+	unsigned long irq = tf->scause & ~SCAUSE_INTERRUPT;
+	if (irq < TRAP_IRQ_MAX && irq_handlers[irq]) {
+		irq_handlers[irq](tf);
+		return;
+	}
+	panic("unexpected interrupt %lu at %lx\n", irq, tf->sepc);
+}
+
+static const char *exception_name(unsigned long scause) {
+	if (scause < sizeof(exception_names) / sizeof(exception_names[0]))
+		return exception_names[scause];
+	return "unknown";
+}
+
+void trap_handler(struct trap_frame *tf) {
+	trace(trap, tf->scause, tf->sepc);
+
+	if (tf->scause & SCAUSE_INTERRUPT) {
+		trap_irq(tf);
+		return;
+	}
+	panic("%s (scause %lu) at %lx, stval %lx, ra %lx, sp %lx\n",
+		  exception_name(tf->scause), tf->scause, tf->sepc, tf->stval, tf->ra,
+		  tf->sp);
+}
+
+/* A user read of the time CSR traps if the firmware keeps it from user mode
+   through mcounteren, which S-mode has no way to read. The kernel's own
+   rdtime() still works, emulated by the firmware if need be, so it answers
+   the read, and the vDSO uses the system call from then on. */
+static bool trap_emulate_rdtime(struct mm *mm, struct trap_frame *tf) {
+	uint32_t insn = tf->stval;
+	// stval may hold zero instead of the instruction.
+	if (!insn && copy_from_user(mm, &insn, tf->sepc, sizeof(insn)))
+		return false;
+	if ((insn & INSN_RDTIME_MASK) != INSN_RDTIME) return false;
+	// The frame starts with x1.
+	unsigned int rd = insn >> 7 & 31;
+	if (rd) (&tf->ra)[rd - 1] = rdtime();
+	tf->sepc += 4;
+	vdso_time_trapped();
+	return true;
+}
+
+void user_trap(struct trap_frame *tf) {
+	trace(trap, tf->scause, tf->sepc);
+
+	if (tf->scause & SCAUSE_INTERRUPT) {
+		trap_irq(tf);
+		// Interrupts are where user code gives up the hart.
+		mm_yield(proc_current()->mm);
+		return;
+	}
+
+	local_irq_enable();
+	struct proc *p = proc_current();
+	switch (tf->scause) {
+	case EXC_U_ECALL:
+		tf->sepc += 4;
+		tf->a0 = syscall_frame(tf);
+		return;
+	case EXC_ILLEGAL_INST:
+		if (trap_emulate_rdtime(p->mm, tf)) return;
+		break;
+	case EXC_INST_PAGE_FAULT:
+		if (!mm_fault(p->mm, tf->stval, PTE_X)) return;
+		break;
+	case EXC_LOAD_PAGE_FAULT:
+		if (!mm_fault(p->mm, tf->stval, PTE_R)) return;
+		break;
+	case EXC_STORE_PAGE_FAULT:
+		if (!mm_fault(p->mm, tf->stval, PTE_W)) return;
+		break;
+	}
+	debug_printf("pid %d: %s (scause %lu) at %lx, stval %lx\n",
+				 p->pid, exception_name(tf->scause), tf->scause,
+				 tf->sepc, tf->stval);
+	proc_exit(-EFAULT);
+}
@@ -0,0 +1,505 @@
+#include "uring.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "blk.h"
+#include "clock.h"
+#include "csr.h"
+#include "errno.h"
+#include "hart.h"
+#include "mm.h"
+#include "pmm.h"
+#include "pool.h"
+#include "proc.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "vfs.h"
+#include "vmm.h"
+
+/* Largest block request, and the most device requests it becomes: one per
+   page of the buffer area it touches. */
+#define URING_BLK_MAX (64u << 10)
+#define URING_BLK_PARTS (URING_BLK_MAX / PAGE_SIZE + 1)
+
+/* How long the polling thread spins on an empty queue before it sleeps. */
+#define URING_SQPOLL_IDLE_US 2000
+
+struct uring;
+
+/* A request that completes after submission: waiting for the worker, or
+   for its block requests. */
+struct uring_req {
+	struct uring *ring;
+	struct uring_sqe sqe;
+	struct file *file;
+	/* Block requests not done yet, and the result once they are. */
+	unsigned int parts;
+	long res;
+	struct uring_req *next;
+	struct blk_request blk[URING_BLK_PARTS];
+};
+
+struct uring {
+	struct uring_shared *sh;
+	struct uring_sqe *sqes;
+	struct uring_cqe *cqes;
+	struct page *block;
+	unsigned int order;
+	uint32_t sq_entries, cq_entries;
+	/* The kernel's own copies of the indices it writes. */
+	uint32_t sq_head, cq_tail;
+	struct proc *proc;
+	unsigned int hart;
+	/* Held by the process, the threads below and each request in
+	   flight. */
+	unsigned int refs;
+
+	spinlock_t lock;
+	/* Under lock: requests started and not completed, and the process's
+	   thread if it waits for completions. */
+	uint32_t inflight;
+	struct thread *waiter;
+
+	/* The registered buffer area, published by buf_len. */
+	uint64_t buf_va, buf_len;
+	struct page **buf_pages;
+	unsigned int buf_order;
+
+	/* Runs the reads and writes that may sleep, one at a time, on the
+	   process's hart, which its sockets belong to. Queued under lock. A
+	   read waiting on an idle socket holds up every request behind it
+	   until data comes or the ring is released, which interrupts it. */
+	struct thread *worker;
+	struct uring_req *work, *work_tail;
+
+	struct thread *sqpoll;
+	bool stop;
+	bool sqpoll_done;
+};
+
+/* Block requests of one submission by device index, each list sent with
+   one notification. */
+struct uring_batch {
+	struct blk_request *head[BLK_DEVICES_MAX], *tail[BLK_DEVICES_MAX];
+};
+
+static struct pool uring_pool = POOL_INIT(sizeof(struct uring));
+static struct pool uring_req_pool = POOL_INIT(sizeof(struct uring_req));
+
+static void uring_get(struct uring *r) {
+	__atomic_add_fetch(&r->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void uring_put(struct uring *r) {
+	if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL)) return;
+	if (r->buf_pages) {
+		for (uint64_t i = 0; i < r->buf_len / PAGE_SIZE; i++)
+			page_put(r->buf_pages[i]);
+		pmm_free(r->buf_pages, r->buf_order);
+	}
+	for (unsigned long i = 0; i < 1ul << r->order; i++)
+		page_put(r->block + i);
+	pool_free(&uring_pool, r);
+}
+
+/* Posts a completion, in any context, and drops the request's reference
+   on the ring. */
+static void uring_complete(struct uring *r, uint64_t user_data, long res) {
+	bool irq = spin_lock_irqsave(&r->lock);
+	struct uring_cqe *cqe = &r->cqes[r->cq_tail & (r->cq_entries - 1)];
+	cqe->user_data = user_data;
+	cqe->res = res;
+	__atomic_store_n(&r->sh->cq_tail, ++r->cq_tail, __ATOMIC_RELEASE);
+	r->inflight--;
+	struct thread *waiter = r->waiter;
+	r->waiter = NULL;
+	spin_unlock_irqrestore(&r->lock, irq);
+	if (waiter) sched_wake(waiter);
+	uring_put(r);
+}
+
+static bool uring_buf_ok(struct uring *r, uint64_t addr, uint64_t len) {
+	uint64_t buf_len = __atomic_load_n(&r->buf_len, __ATOMIC_ACQUIRE);
+	return addr >= r->buf_va && len <= buf_len &&
+		   addr - r->buf_va <= buf_len - len;
+}
+
+/* The kernel address of addr in the buffer area, valid to the end of its
+   page. */
+static char *uring_buf_addr(struct uring *r, uint64_t addr) {
+	uint64_t off = addr - r->buf_va;
+	return (char *)page_address(r->buf_pages[off >> PAGE_SHIFT]) +
+		   (off & (PAGE_SIZE - 1));
+}
+
+/* Moves the data of a read or write a page at a time. Returns the bytes
+   moved if any, else the error. */
+static long uring_rw(struct uring *r, const struct uring_sqe *sqe,
+					 struct file *f) {
+	long done = 0, err = 0;
+	while ((uint64_t)done < sqe->len) {
+		uint64_t addr = sqe->addr + done;
+		size_t n = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+		if (n > (size_t)(sqe->len - done)) n = sqe->len - done;
+		char *buf = uring_buf_addr(r, addr);
+		long got;
+		if (sqe->op == URING_OP_WRITE)
+			got = vfs_write(f, buf, n);
+		else if (sqe->off == URING_OFF_POS)
+			got = vfs_read(f, buf, n);
+		else
+			got = vfs_pread(f, sqe->off + done, buf, n);
+		if (got < 0) {
+			err = got;
+			break;
+		}
+		done += got;
+		if ((size_t)got < n) break;
+	}
+	return done ? done : err;
+}
+
+static void uring_worker(void *arg) {
+	struct uring *r = arg;
+	for (;;) {
+		bool irq = spin_lock_irqsave(&r->lock);
+		struct uring_req *req = r->work;
+		if (req) {
+			r->work = req->next;
+			if (!r->work) r->work_tail = NULL;
+		}
+		bool stop = !req && r->stop;
+		spin_unlock_irqrestore(&r->lock, irq);
+		if (stop) break;
+		if (!req) {
+			sched_block();
+			continue;
+		}
+
+		long res = uring_rw(r, &req->sqe, req->file);
+		vfs_close(req->file);
+		uring_complete(r, req->sqe.user_data, res);
+		pool_free(&uring_req_pool, req);
+	}
+	uring_put(r);
+}
+
+/* Returns true if the request completes later, else stores its result in
+   *res. */
+static bool uring_start_rw(struct uring *r, const struct uring_sqe *sqe,
+						   long *res) {
+	if (!uring_buf_ok(r, sqe->addr, sqe->len)) {
+		*res = -EFAULT;
+		return false;
+	}
+	struct file *f = fd_get(&r->proc->fds, sqe->fd);
+	if (!f) {
+		*res = -EBADF;
+		return false;
+	}
+	// Reads of files held in memory cannot sleep, so they are done here.
+	if (sqe->op == URING_OP_READ && f->inode->data) {
+		*res = uring_rw(r, sqe, f);
+		vfs_close(f);
+		return false;
+	}
+
+	struct uring_req *req = pool_alloc(&uring_req_pool);
+	if (!req) {
+		vfs_close(f);
+		*res = -ENOMEM;
+		return false;
+	}
+	req->ring = r;
+	req->sqe = *sqe;
+	req->file = f;
+	bool irq = spin_lock_irqsave(&r->lock);
+	if (r->work_tail)
+		r->work_tail->next = req;
+	else
+		r->work = req;
+	r->work_tail = req;
+	spin_unlock_irqrestore(&r->lock, irq);
+	sched_wake(r->worker);
+	return true;
+}
+
+static void uring_blk_done(struct blk_request *b) {
+	struct uring_req *req = b->priv;
+	if (b->status != BLK_OK)
+		__atomic_store_n(&req->res,
+						 b->status == BLK_UNSUPPORTED ? -EINVAL : -EIO,
+						 __ATOMIC_RELAXED);
+	if (__atomic_sub_fetch(&req->parts, 1, __ATOMIC_ACQ_REL)) return;
+	uring_complete(req->ring, req->sqe.user_data, req->res);
+	pool_free(&uring_req_pool, req);
+}
+
+static long uring_blk_check(struct uring *r, const struct uring_sqe *sqe,
+							struct blk_device *dev) {
+	if (!dev) return -ENODEV;
+	uint64_t sectors = sqe->len / BLK_SECTOR_SIZE;
+	if (!sqe->len || sqe->len > URING_BLK_MAX ||
+		(sqe->len | sqe->addr) & (BLK_SECTOR_SIZE - 1) ||
+		sqe->off >= dev->sectors || sectors > dev->sectors - sqe->off)
+		return -EINVAL;
+	if (!uring_buf_ok(r, sqe->addr, sqe->len)) return -EFAULT;
+	if (sqe->op == URING_OP_BLK_WRITE && dev->read_only) return -EBADF;
+	return 0;
+}
+
+/* Like uring_start_rw(). The device requests, one per page of the buffer,
+   join the batch. */
+static bool uring_start_blk(struct uring *r, const struct uring_sqe *sqe,
+							struct uring_batch *batch, long *res) {
+	unsigned int index = sqe->fd;
+	struct blk_device *dev = index < BLK_DEVICES_MAX ? blk_get(index) : NULL;
+	struct uring_req *req = NULL;
+	*res = uring_blk_check(r, sqe, dev);
+	if (!*res && !(req = pool_alloc(&uring_req_pool))) *res = -ENOMEM;
+	if (*res) return false;
+
+	req->ring = r;
+	req->sqe = *sqe;
+	req->res = sqe->len;
+	unsigned int n = 0;
+	for (uint32_t done = 0; done < sqe->len; n++) {
+		uint64_t addr = sqe->addr + done;
+		uint32_t len = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+		if (len > sqe->len - done) len = sqe->len - done;
+		struct blk_request *b = &req->blk[n];
+		b->op = sqe->op == URING_OP_BLK_WRITE ? BLK_WRITE : BLK_READ;
+		b->sector = sqe->off + done / BLK_SECTOR_SIZE;
+		b->buf = uring_buf_addr(r, addr);
+		b->len = len;
+		b->done = uring_blk_done;
+		b->priv = req;
+		b->next = NULL;
+		if (batch->tail[index])
+			batch->tail[index]->next = b;
+		else
+			batch->head[index] = b;
+		batch->tail[index] = b;
+		done += len;
+	}
+	req->parts = n;
+	return true;
+}
+
+static void uring_start(struct uring *r, const struct uring_sqe *sqe,
+						struct uring_batch *batch) {
+	long res = -EINVAL;
+	switch (sqe->op) {
+	case URING_OP_NOP:
+		res = 0;
+		break;
+	case URING_OP_READ:
+	case URING_OP_WRITE:
+		if (uring_start_rw(r, sqe, &res)) return;
+		break;
+	case URING_OP_BLK_READ:
+	case URING_OP_BLK_WRITE:
+		if (uring_start_blk(r, sqe, batch, &res)) return;
+		break;
+	}
+	uring_complete(r, sqe->user_data, res);
+}
+
+/* Starts up to max requests from the submission queue, as many as the
+   completion queue has room for along with those in flight. Returns how
+   many. */
+static unsigned int uring_submit(struct uring *r, unsigned int max) {
+	uint32_t tail = __atomic_load_n(&r->sh->sq_tail, __ATOMIC_ACQUIRE);
+	struct uring_batch batch = {0};
+	unsigned int n = 0;
+	while (n < max && r->sq_head != tail) {
+		bool irq = spin_lock_irqsave(&r->lock);
+		uint32_t unreaped =
+			r->cq_tail - __atomic_load_n(&r->sh->cq_head, __ATOMIC_ACQUIRE);
+		bool room = r->inflight + unreaped < r->cq_entries;
+		if (room) r->inflight++;
+		spin_unlock_irqrestore(&r->lock, irq);
+		if (!room) break;
+
+		// A copy, as the process may change the entry meanwhile.
+		struct uring_sqe sqe = r->sqes[r->sq_head++ & (r->sq_entries - 1)];
+		uring_get(r);
+		uring_start(r, &sqe, &batch);
+		n++;
+	}
+	__atomic_store_n(&r->sh->sq_head, r->sq_head, __ATOMIC_RELEASE);
+
+	for (unsigned int i = 0; i < BLK_DEVICES_MAX; i++) {
+		if (batch.head[i]) blk_submit(blk_get(i), batch.head[i]);
+	}
+	return n;
+}
+
+static void uring_sqpoll(void *arg) {
+	struct uring *r = arg;
+	uint64_t idle = clock_freq * URING_SQPOLL_IDLE_US / 1000000;
+	uint64_t busy = rdtime();
+	while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+		if (uring_submit(r, r->sq_entries)) {
+			busy = rdtime();
+			continue;
+		}
+		if (rdtime() - busy < idle) {
+			sched_yield();
+			cpu_relax();
+			continue;
+		}
+		// The process looks at the flag after publishing its tail, so
+		// one of the two sees the other's store.
+		__atomic_fetch_or(&r->sh->sq_flags, URING_SQ_NEED_WAKEUP,
+						  __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&r->sh->sq_tail, __ATOMIC_SEQ_CST) == r->sq_head &&
+			!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE))
+			sched_block();
+		__atomic_fetch_and(&r->sh->sq_flags, ~URING_SQ_NEED_WAKEUP,
+						   __ATOMIC_RELAXED);
+		busy = rdtime();
+	}
+	__atomic_store_n(&r->sqpoll_done, true, __ATOMIC_RELEASE);
+	uring_put(r);
+}
+
+long uring_setup(unsigned int entries, unsigned int flags) {
+	struct proc *p = proc_current();
+	if (p->ring) return -EBUSY;
+	if (!entries || entries > URING_ENTRIES_MAX || entries & (entries - 1) ||
+		flags & ~URING_SETUP_SQPOLL)
+		return -EINVAL;
+
+	size_t sqes_off = (sizeof(struct uring_shared) + 63) & ~63ul;
+	size_t cqes_off = sqes_off + entries * sizeof(struct uring_sqe);
+	size_t size = cqes_off + 2 * entries * sizeof(struct uring_cqe);
+	unsigned int order = 0;
+	while (PAGE_SIZE << order < size) order++;
+
+	struct uring *r = pool_alloc(&uring_pool);
+	if (!r) return -ENOMEM;
+	char *mem = pmm_alloc_zeroed(order);
+	if (!mem) {
+		pool_free(&uring_pool, r);
+		return -ENOMEM;
+	}
+	r->block = virt_to_page(mem);
+	r->order = order;
+	for (unsigned long i = 0; i < 1ul << order; i++)
+		page_ref_init(r->block + i);
+	r->sh = (struct uring_shared *)mem;
+	r->sqes = (struct uring_sqe *)(mem + sqes_off);
+	r->cqes = (struct uring_cqe *)(mem + cqes_off);
+	r->sq_entries = entries;
+	r->cq_entries = 2 * entries;
+	r->sh->sq_mask = r->sq_entries - 1;
+	r->sh->cq_mask = r->cq_entries - 1;
+	r->sh->sqes_off = sqes_off;
+	r->sh->cqes_off = cqes_off;
+	r->proc = p;
+	r->hart = hart_index();
+	r->refs = 1;
+
+	uint64_t va = mm_find_free(p->mm, PAGE_SIZE << order);
+	int err = va ? mm_map_shared(p->mm, va, r->block, 1ul << order,
+								 PTE_R | PTE_W)
+				 : -ENOMEM;
+	if (err) {
+		uring_put(r);
+		return err;
+	}
+
+	r->worker = kthread_create(uring_worker, r, "uring_worker", r->hart);
+	if (r->worker) uring_get(r);
+	// Next to the process rather than on its hart, which it keeps busy.
+	if (r->worker && flags & URING_SETUP_SQPOLL) {
+		r->sqpoll = kthread_create(uring_sqpoll, r, "uring_sqpoll",
+								   (r->hart + 1) % hart_count);
+		if (r->sqpoll) uring_get(r);
+	}
+	if (!r->worker || (flags & URING_SETUP_SQPOLL && !r->sqpoll)) {
+		mm_unmap(p->mm, va, PAGE_SIZE << order);
+		uring_release(r);
+		return -ENOMEM;
+	}
+	p->ring = r;
+	return va;
+}
+
+long uring_register(uint64_t addr, uint64_t len) {
+	struct proc *p = proc_current();
+	struct uring *r = p->ring;
+	if (!r) return -EINVAL;
+	if (r->buf_pages) return -EBUSY;
+	if (!len || len > URING_BUF_MAX || (addr | len) & (PAGE_SIZE - 1))
+		return -EINVAL;
+
+	unsigned long n = len / PAGE_SIZE;
+	unsigned int order = 0;
+	while (PAGE_SIZE << order < n * sizeof(struct page *)) order++;
+	struct page **pages = pmm_alloc(order);
+	if (!pages) return -ENOMEM;
+	int err = mm_pin(p->mm, addr, len, pages);
+	if (err) {
+		pmm_free(pages, order);
+		return err;
+	}
+	r->buf_pages = pages;
+	r->buf_order = order;
+	r->buf_va = addr;
+	__atomic_store_n(&r->buf_len, len, __ATOMIC_RELEASE);
+	return 0;
+}
+
+long uring_enter(unsigned int to_submit, unsigned int min_complete,
+				 unsigned int flags) {
+	struct uring *r = proc_current()->ring;
+	if (!r || min_complete > r->cq_entries) return -EINVAL;
+
+	long submitted = 0;
+	if (!r->sqpoll)
+		submitted = uring_submit(r, to_submit < r->sq_entries ? to_submit
+															  : r->sq_entries);
+	else if (flags & URING_ENTER_SQ_WAKEUP)
+		sched_wake(r->sqpoll);
+
+	for (;;) {
+		bool irq = spin_lock_irqsave(&r->lock);
+		uint32_t ready =
+			r->cq_tail - __atomic_load_n(&r->sh->cq_head, __ATOMIC_ACQUIRE);
+		// Nothing more can complete without another submission.
+		bool idle = !r->inflight &&
+					(!r->sqpoll || __atomic_load_n(&r->sh->sq_tail,
+												   __ATOMIC_ACQUIRE) ==
+									   __atomic_load_n(&r->sh->sq_head,
+													   __ATOMIC_ACQUIRE));
+		bool done = ready >= min_complete || idle;
+		if (!done) r->waiter = sched_current();
+		spin_unlock_irqrestore(&r->lock, irq);
+		if (done) break;
+		sched_block();
+	}
+	return submitted;
+}
+
+void uring_release(struct uring *r) {
+	bool irq = spin_lock_irqsave(&r->lock);
+	r->stop = true;
+	spin_unlock_irqrestore(&r->lock, irq);
+
+	if (r->sqpoll) {
+		// It looks up the process's files, which are about to go.
+		sched_wake(r->sqpoll);
+		while (!__atomic_load_n(&r->sqpoll_done, __ATOMIC_ACQUIRE)) {
+			sched_yield();
+			cpu_relax();
+		}
+	}
+	// The worker runs on this hart, so it cannot have seen stop and exited
+	// yet. Socket waits it is in or gets to fail, so that it drains the
+	// queue and drops its files instead of waiting on an idle peer.
+	if (r->worker) sched_interrupt(r->worker);
+	uring_put(r);
+}
@@ -0,0 +1,89 @@
+#include "vdso.h"
+
+#include <stdbool.h>
+
+#include "clock.h"
+#include "csr.h"
+#include "debug.h"
+#include "errno.h"
+#include "init.h"
+#include "initcall.h"
+#include "limine/features.h"
+#include "mm.h"
+#include "pmm.h"
+#include "string.h"
+#include "vmm.h"
+
+extern const char vdso_text_start[], vdso_text_end[];
+
+/* The data page, then the code page. */
+static struct page *vdso_pages;
+static struct vdso_data *vdso_data;
+
+/* Changes the data page under its seqlock. Writers are serialized by the
+   caller. */
+static void vdso_update(uint64_t mult, int64_t wall_offset) {
+	struct vdso_data *d = vdso_data;
+	__atomic_store_n(&d->seq, d->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	d->mult = mult;
+	d->wall_offset = wall_offset;
+	__atomic_store_n(&d->seq, d->seq + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t vdso_ns(uint64_t ticks, uint64_t mult) {
+	return (unsigned __int128)ticks * mult >> 32;
+}
+
+static void __init vdso_init(void) {
+	size_t len = vdso_text_end - vdso_text_start;
+	if (len > PAGE_SIZE) panic("vdso: %zu bytes of code\n", len);
+	char *mem = pmm_alloc_zeroed(1);
+	if (!mem) panic("vdso: out of memory\n");
+	vdso_pages = virt_to_page(mem);
+	page_ref_init(vdso_pages);
+	page_ref_init(vdso_pages + 1);
+	memcpy(mem + PAGE_SIZE, vdso_text_start, len);
+
+	vdso_data = (struct vdso_data *)mem;
+	vdso_data->freq = clock_freq;
+	// trap_init() lets user mode read the time CSR. Whether the firmware
+	// does too only shows when a read traps, see vdso_time_trapped().
+	vdso_data->user_time = 1;
+
+	uint64_t mult = ((uint64_t)1000000000 << 32) / clock_freq;
+	int64_t date = limine_boot_date;
+	int64_t wall = date ? date * 1000000000 - vdso_ns(rdtime(), mult) : 0;
+	vdso_update(mult, wall);
+}
+
+INITCALL(vdso, vdso_init, "pmm_pages");
+
+int vdso_map(struct mm *mm) {
+	int err = mm_map_shared(mm, VDSO_DATA, vdso_pages, 1, PTE_R);
+	if (!err)
+		err = mm_map_shared(mm, VDSO_TEXT, vdso_pages + 1, 1, PTE_R | PTE_X);
+	// The code was written at boot, maybe by another hart.
+	asm volatile("fence.i" ::: "memory");
+	return err;
+}
+
+void vdso_time_trapped(void) {
+	__atomic_store_n(&vdso_data->user_time, 0, __ATOMIC_RELAXED);
+}
+
+int vdso_clock_gettime(int clock, struct timespec *ts) {
+	if (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC) return -EINVAL;
+	const struct vdso_data *d = vdso_data;
+	uint32_t seq;
+	uint64_t ns;
+	do {
+		seq = __atomic_load_n(&d->seq, __ATOMIC_ACQUIRE);
+		ns = vdso_ns(rdtime(), d->mult);
+		if (clock == CLOCK_REALTIME) ns += d->wall_offset;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq & 1 || __atomic_load_n(&d->seq, __ATOMIC_RELAXED) != seq);
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+	return 0;
+}
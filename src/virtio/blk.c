@@ -0,0 +1,292 @@
+/* virtio block devices
+
+   Each hart submits to its own virtqueue when the device has enough
+   (VIRTIO_BLK_F_MQ). A batch becomes as few device commands as possible: a
+   request continuing the one before it in the batch joins its command as one
+   more data segment. Requests that find the ring full wait on the queue's
+   backlog until completions make room. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blk.h"
+#include "hart.h"
+#include "init.h"
+#include "initcall.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "virtio.h"
+
+#define VIRTIO_BLK_F_SIZE_MAX 1
+#define VIRTIO_BLK_F_SEG_MAX 2
+#define VIRTIO_BLK_F_RO 5
+#define VIRTIO_BLK_F_FLUSH 9
+#define VIRTIO_BLK_F_MQ 12
+
+/* Configuration space offsets. */
+#define VIRTIO_BLK_CFG_CAPACITY 0
+#define VIRTIO_BLK_CFG_SIZE_MAX 8
+#define VIRTIO_BLK_CFG_SEG_MAX 12
+#define VIRTIO_BLK_CFG_NUM_QUEUES 34
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_UNSUPP 2
+
+/* Data segments per command, leaving room in an indirect table for the
+   header and the status byte. */
+#define VIRTIO_BLK_SEGS (VIRTQ_INDIRECT_MAX - 2)
+
+struct virtio_blk_hdr {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+};
+
+/* A device command: the header and status the device reads and writes, and
+   the requests merged into it, in sector order. */
+struct virtio_blk_cmd {
+	struct virtio_blk_hdr hdr;
+	uint8_t status;
+	struct blk_request *reqs;
+	struct virtio_blk_cmd *next_free;
+};
+
+struct virtio_blk_queue {
+	spinlock_t lock;
+	struct virtqueue *vq;
+	struct virtio_blk_cmd *free_cmds;
+	struct blk_request *backlog, *backlog_tail;
+	struct virtio_blk *vb;
+};
+
+struct virtio_blk {
+	struct blk_device blk;
+	struct virtio_device *dev;
+	/* Data segments per command. */
+	unsigned int seg_max;
+	char name[8];
+	struct virtio_blk_queue queues[VIRTIO_VQ_MAX];
+};
+
+static unsigned int virtio_blk_count;
+
+static unsigned int virtio_blk_order(size_t bytes) {
+	unsigned int order = 0;
+	while ((PAGE_SIZE << order) < bytes) order++;
+	return order;
+}
+
+static bool virtio_blk_mergeable(const struct blk_request *prev,
+								 const struct blk_request *next) {
+	return prev->op == next->op && next->op != BLK_FLUSH &&
+		   prev->sector + prev->len / BLK_SECTOR_SIZE == next->sector;
+}
+
+/* Turns the backlog into commands while the ring has room. Called with the
+   queue locked. */
+static void virtio_blk_dispatch(struct virtio_blk_queue *q) {
+	struct virtio_blk *vb = q->vb;
+	bool added = false;
+
+	while (q->backlog && q->free_cmds) {
+		struct virtio_blk_cmd *cmd = q->free_cmds;
+		struct blk_request *first = q->backlog, *last = first;
+		struct virtq_sg sg[VIRTIO_BLK_SEGS + 2];
+		unsigned int nsg = 1;
+
+		cmd->hdr.type = first->op == BLK_READ	 ? VIRTIO_BLK_T_IN
+						: first->op == BLK_WRITE ? VIRTIO_BLK_T_OUT
+												 : VIRTIO_BLK_T_FLUSH;
+		cmd->hdr.reserved = 0;
+		cmd->hdr.sector = first->op == BLK_FLUSH ? 0 : first->sector;
+		cmd->status = 0xff;
+		sg[0] = (struct virtq_sg){&cmd->hdr, sizeof(cmd->hdr)};
+		if (first->op != BLK_FLUSH) {
+			sg[nsg++] = (struct virtq_sg){first->buf, first->len};
+			while (last->next && nsg <= vb->seg_max &&
+				   virtio_blk_mergeable(last, last->next)) {
+				last = last->next;
+				sg[nsg++] = (struct virtq_sg){last->buf, last->len};
+			}
+		}
+		sg[nsg++] = (struct virtq_sg){&cmd->status, 1};
+
+		unsigned int out = first->op == BLK_WRITE ? nsg - 1 : 1;
+		if (!virtq_add(q->vq, sg, out, nsg - out, cmd)) break;
+
+		q->backlog = last->next;
+		if (!q->backlog) q->backlog_tail = NULL;
+		last->next = NULL;
+		cmd->reqs = first;
+		q->free_cmds = cmd->next_free;
+		__atomic_add_fetch(&vb->blk.stat_commands, 1, __ATOMIC_RELAXED);
+		added = true;
+	}
+	if (added) virtq_kick(q->vq);
+}
+
+static void virtio_blk_submit(struct blk_device *bdev,
+							  struct blk_request *reqs) {
+	struct virtio_blk *vb = bdev->priv;
+	struct virtio_blk_queue *q = &vb->queues[hart_index() % bdev->nqueues];
+
+	unsigned int n = 0;
+	struct blk_request *tail = reqs;
+	for (struct blk_request *r = reqs; r; r = r->next) {
+		tail = r;
+		n++;
+	}
+	__atomic_add_fetch(&bdev->stat_requests, n, __ATOMIC_RELAXED);
+
+	bool irq = spin_lock_irqsave(&q->lock);
+	if (q->backlog_tail)
+		q->backlog_tail->next = reqs;
+	else
+		q->backlog = reqs;
+	q->backlog_tail = tail;
+	virtio_blk_dispatch(q);
+	spin_unlock_irqrestore(&q->lock, irq);
+}
+
+/* Reaps finished commands, refills the ring from the backlog and then calls
+   the done callbacks, outside the lock so they can submit more. */
+static void virtio_blk_complete(struct virtio_blk_queue *q) {
+	struct blk_request *done = NULL, **tail = &done;
+
+	bool irq = spin_lock_irqsave(&q->lock);
+	do {
+		virtq_disable_cb(q->vq);
+		struct virtio_blk_cmd *cmd;
+		while ((cmd = virtq_get_buf(q->vq, NULL))) {
+			enum blk_status status = cmd->status == VIRTIO_BLK_S_OK ? BLK_OK
+									 : cmd->status == VIRTIO_BLK_S_UNSUPP
+										 ? BLK_UNSUPPORTED
+										 : BLK_IOERR;
+			*tail = cmd->reqs;
+			for (struct blk_request *r = cmd->reqs; r; r = r->next) {
+				r->status = status;
+				tail = &r->next;
+			}
+			cmd->next_free = q->free_cmds;
+			q->free_cmds = cmd;
+		}
+	} while (!virtq_enable_cb(q->vq));
+	virtio_blk_dispatch(q);
+	spin_unlock_irqrestore(&q->lock, irq);
+
+	while (done) {
+		struct blk_request *r = done;
+		done = r->next;
+		r->next = NULL;
+		r->done(r);
+	}
+}
+
+static void virtio_blk_vq_done(struct virtqueue *vq) {
+	virtio_blk_complete(vq->priv);
+}
+
+static void virtio_blk_poll(struct blk_device *bdev) {
+	struct virtio_blk *vb = bdev->priv;
+	virtio_blk_complete(&vb->queues[hart_index() % bdev->nqueues]);
+}
+
+static const struct blk_ops virtio_blk_ops = {
+	.submit = virtio_blk_submit,
+	.poll = virtio_blk_poll,
+};
+
+static bool virtio_blk_setup_queue(struct virtio_blk *vb, unsigned int i) {
+	struct virtio_blk_queue *q = &vb->queues[i];
+	q->vb = vb;
+	q->vq = virtio_setup_vq(vb->dev, i, VIRTQ_SIZE, virtio_blk_vq_done, q);
+	if (!q->vq) return false;
+
+	// A command per ring slot is enough for all to be in flight.
+	unsigned int n = q->vq->size;
+	struct virtio_blk_cmd *cmds =
+		pmm_alloc_zeroed(virtio_blk_order(n * sizeof(*cmds)));
+	if (!cmds) {
+		virtio_del_vq(q->vq);
+		q->vq = NULL;
+		return false;
+	}
+	for (unsigned int c = 0; c < n; c++) {
+		cmds[c].next_free = q->free_cmds;
+		q->free_cmds = &cmds[c];
+	}
+	return true;
+}
+
+static bool virtio_blk_probe(struct virtio_device *dev) {
+	struct virtio_blk *vb = pmm_alloc_zeroed(virtio_blk_order(sizeof(*vb)));
+	if (!vb) return false;
+	vb->dev = dev;
+	dev->priv = vb;
+
+	unsigned int nqueues = 1;
+	if (virtio_has_feature(dev, VIRTIO_BLK_F_MQ))
+		nqueues = virtio_config_read16(dev, VIRTIO_BLK_CFG_NUM_QUEUES);
+	if (!nqueues) nqueues = 1;
+	if (nqueues > hart_count) nqueues = hart_count;
+	if (nqueues > VIRTIO_VQ_MAX) nqueues = VIRTIO_VQ_MAX;
+	for (unsigned int i = 0; i < nqueues; i++) {
+		if (virtio_blk_setup_queue(vb, i)) continue;
+		if (!i) {
+			pmm_free(vb, virtio_blk_order(sizeof(*vb)));
+			return false;
+		}
+		nqueues = i;
+	}
+
+	vb->seg_max = VIRTIO_BLK_SEGS;
+	if (virtio_has_feature(dev, VIRTIO_BLK_F_SEG_MAX)) {
+		uint32_t seg_max = virtio_config_read32(dev, VIRTIO_BLK_CFG_SEG_MAX);
+		if (seg_max && seg_max < vb->seg_max) vb->seg_max = seg_max;
+	}
+	uint32_t max_len = -1u & ~(BLK_SECTOR_SIZE - 1);
+	if (virtio_has_feature(dev, VIRTIO_BLK_F_SIZE_MAX)) {
+		uint32_t size_max = virtio_config_read32(dev, VIRTIO_BLK_CFG_SIZE_MAX);
+		if (size_max) max_len = size_max & ~(BLK_SECTOR_SIZE - 1);
+	}
+
+	unsigned int index = __atomic_fetch_add(&virtio_blk_count, 1,
+											__ATOMIC_RELAXED);
+	vb->name[0] = 'v';
+	vb->name[1] = 'd';
+	vb->name[2] = 'a' + index % 26;
+	vb->blk = (struct blk_device){
+		.name = vb->name,
+		.sectors = virtio_config_read64(dev, VIRTIO_BLK_CFG_CAPACITY),
+		.nqueues = nqueues,
+		.max_len = max_len,
+		.read_only = virtio_has_feature(dev, VIRTIO_BLK_F_RO),
+		.ops = &virtio_blk_ops,
+		.priv = vb,
+	};
+
+	virtio_device_ready(dev);
+	blk_register(&vb->blk);
+	return true;
+}
+
+static const struct virtio_driver virtio_blk_driver = {
+	.name = "blk",
+	.device_id = VIRTIO_ID_BLOCK,
+	.features = VIRTIO_FEATURE(VIRTIO_BLK_F_SIZE_MAX) |
+				VIRTIO_FEATURE(VIRTIO_BLK_F_SEG_MAX) |
+				VIRTIO_FEATURE(VIRTIO_BLK_F_RO) |
+				VIRTIO_FEATURE(VIRTIO_BLK_F_FLUSH) |
+				VIRTIO_FEATURE(VIRTIO_BLK_F_MQ),
+	.probe = virtio_blk_probe,
+};
+
+static void __init virtio_blk_init(void) {
+	virtio_register_driver(&virtio_blk_driver);
+}
+
+INITCALL(virtio_blk, virtio_blk_init, "virtio");
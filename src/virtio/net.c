@@ -0,0 +1,510 @@
+/* virtio network devices
+
+   Each hart gets its own receive and transmit queue pair when the device
+   has enough (VIRTIO_NET_F_MQ); the pair count is set through the control
+   queue. Receive rings are kept full of single-page buffers from a pool per
+   queue, which the device merges when a packet needs several
+   (VIRTIO_NET_F_MRG_RXBUF). Every pair has a NAPI context on its hart: the
+   interrupt masks the queue and wakes it, and the poll thread receives,
+   refills the ring and reaps finished transmissions until the queue runs
+   dry. Transmit interrupts are only asked for once most of the packets in
+   flight are done, so a stream of packets costs one per batch. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "debug.h"
+#include "hart.h"
+#include "init.h"
+#include "initcall.h"
+#include "netdev.h"
+#include "pmm.h"
+#include "printf.h"
+#include "spinlock.h"
+#include "string.h"
+#include "virtio.h"
+
+#define VIRTIO_NET_F_CSUM 0
+#define VIRTIO_NET_F_GUEST_CSUM 1
+#define VIRTIO_NET_F_MTU 3
+#define VIRTIO_NET_F_MAC 5
+#define VIRTIO_NET_F_GUEST_TSO4 7
+#define VIRTIO_NET_F_GUEST_TSO6 8
+#define VIRTIO_NET_F_HOST_TSO4 11
+#define VIRTIO_NET_F_HOST_TSO6 12
+#define VIRTIO_NET_F_MRG_RXBUF 15
+#define VIRTIO_NET_F_STATUS 16
+#define VIRTIO_NET_F_CTRL_VQ 17
+#define VIRTIO_NET_F_MQ 22
+
+/* Configuration space offsets. */
+#define VIRTIO_NET_CFG_MAC 0
+#define VIRTIO_NET_CFG_STATUS 6
+#define VIRTIO_NET_CFG_MAX_PAIRS 8
+#define VIRTIO_NET_CFG_MTU 10
+
+#define VIRTIO_NET_S_LINK_UP 1
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+
+#define VIRTIO_NET_HDR_GSO_NONE 0
+#define VIRTIO_NET_HDR_GSO_TCPV4 1
+#define VIRTIO_NET_HDR_GSO_TCPV6 4
+
+#define VIRTIO_NET_CTRL_MQ 4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_OK 0
+
+/* Receive buffers big enough for a coalesced packet, for devices that
+   coalesce without merging buffers: 64 KiB, the headers and the
+   headroom. */
+#define VIRTIO_NET_BIG_ORDER 5
+/* Buffers of that size posted per receive ring. */
+#define VIRTIO_NET_BIG_POSTED 16
+
+/* Precedes every packet in both directions. */
+struct virtio_net_hdr {
+	uint8_t flags;
+	uint8_t gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+	/* Buffers the packet spans, with VIRTIO_NET_F_MRG_RXBUF. */
+	uint16_t num_buffers;
+};
+
+struct virtio_net_ctrl {
+	uint8_t class;
+	uint8_t cmd;
+	uint16_t pairs;
+	uint8_t ack;
+};
+
+struct virtio_net_queue {
+	struct virtio_net *vn;
+	unsigned int index;
+	spinlock_t rx_lock;
+	struct virtqueue *rx;
+	struct netbuf_pool rx_pool;
+	/* Buffers to keep posted. */
+	unsigned int rx_target;
+	unsigned int rx_posted;
+
+	spinlock_t tx_lock;
+	struct virtqueue *tx;
+	unsigned int tx_inflight;
+
+	struct napi napi;
+};
+
+struct virtio_net {
+	struct netdev netdev;
+	struct virtio_device *dev;
+	struct virtqueue *ctrl;
+	struct virtio_net_ctrl *ctrl_buf;
+	bool mrg_rxbuf;
+	char name[8];
+	struct virtio_net_queue queues[VIRTIO_VQ_MAX / 2];
+};
+
+static unsigned int virtio_net_count;
+
+static unsigned int virtio_net_order(size_t bytes) {
+	unsigned int order = 0;
+	while ((PAGE_SIZE << order) < bytes) order++;
+	return order;
+}
+
+/* Posts buffers until the ring is full or has rx_target. Called with the
+   receive side locked. */
+static void virtio_net_refill(struct virtio_net_queue *q) {
+	bool added = false;
+	while (q->rx_posted < q->rx_target) {
+		struct netbuf *nb = netbuf_alloc(&q->rx_pool);
+		if (!nb) break;
+		struct virtq_sg sg = {nb->data, netbuf_tailroom(nb)};
+		if (!virtq_add(q->rx, &sg, 0, 1, nb)) {
+			netbuf_free(nb);
+			break;
+		}
+		q->rx_posted++;
+		added = true;
+	}
+	if (added) virtq_kick(q->rx);
+}
+
+/* Takes the rest of a packet spanning several buffers off the ring and
+   chains them to the first. Frees them all and returns NULL if a part is
+   missing. */
+static struct netbuf *virtio_net_merge(struct virtio_net_queue *q,
+									   struct netbuf *first, unsigned int n) {
+	struct netbuf **tail = &first->frag;
+	for (unsigned int i = 1; i < n; i++) {
+		uint32_t len;
+		struct netbuf *nb = virtq_get_buf(q->rx, &len);
+		if (!nb) {
+			netbuf_free(first);
+			return NULL;
+		}
+		q->rx_posted--;
+		nb->len = len;
+		*tail = nb;
+		tail = &nb->frag;
+	}
+	return first;
+}
+
+/* Turns a used receive buffer into a packet, or returns NULL to drop it.
+   Called with the receive side locked. */
+static struct netbuf *virtio_net_receive(struct virtio_net_queue *q,
+										 struct netbuf *nb, uint32_t len) {
+	struct virtio_net_hdr hdr;
+	if (len < sizeof(hdr) + ETH_HLEN) {
+		netbuf_free(nb);
+		return NULL;
+	}
+	memcpy(&hdr, nb->data, sizeof(hdr));
+	nb->len = len;
+	if (q->vn->mrg_rxbuf && hdr.num_buffers > 1) {
+		nb = virtio_net_merge(q, nb, hdr.num_buffers);
+		if (!nb) return NULL;
+	}
+	netbuf_pull(nb, sizeof(hdr));
+
+	nb->dev = &q->vn->netdev;
+	nb->queue = q->index;
+	if (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+		nb->csum = NETBUF_CSUM_PARTIAL;
+		nb->csum_start = hdr.csum_start;
+		nb->csum_offset = hdr.csum_offset;
+	} else if (hdr.flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+		nb->csum = NETBUF_CSUM_VALID;
+	}
+	switch (hdr.gso_type) {
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+		nb->gso_type = NETBUF_GSO_TCPV4;
+		nb->gso_size = hdr.gso_size;
+		break;
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		nb->gso_type = NETBUF_GSO_TCPV6;
+		nb->gso_size = hdr.gso_size;
+		break;
+	}
+	return nb;
+}
+
+/* Frees sent packets. Called with the transmit side locked. */
+static void virtio_net_tx_reap(struct virtio_net_queue *q) {
+	struct netbuf *nb;
+	while ((nb = virtq_get_buf(q->tx, NULL))) {
+		netbuf_free(nb);
+		q->tx_inflight--;
+	}
+}
+
+static void virtio_net_tx_complete(struct virtio_net_queue *q) {
+	bool irq = spin_lock_irqsave(&q->tx_lock);
+	// Another interrupt once three quarters of what is in flight is done;
+	// with nothing in flight, none is needed.
+	do {
+		virtio_net_tx_reap(q);
+	} while (q->tx_inflight &&
+			 !virtq_enable_cb_delayed(q->tx, (q->tx_inflight * 3 + 3) / 4));
+	spin_unlock_irqrestore(&q->tx_lock, irq);
+}
+
+static int virtio_net_poll(struct napi *napi, int budget) {
+	struct virtio_net_queue *q = napi->priv;
+	struct netdev *ndev = &q->vn->netdev;
+	struct netbuf *list = NULL, **tail = &list;
+	uint64_t packets = 0, bytes = 0, drops = 0;
+	int n = 0;
+
+	virtio_net_tx_complete(q);
+
+	bool irq = spin_lock_irqsave(&q->rx_lock);
+	while (n < budget) {
+		uint32_t len;
+		struct netbuf *nb = virtq_get_buf(q->rx, &len);
+		if (!nb) break;
+		q->rx_posted--;
+		n++;
+		nb = virtio_net_receive(q, nb, len);
+		if (!nb) {
+			drops++;
+			continue;
+		}
+		packets++;
+		bytes += nb->len;
+		*tail = nb;
+		tail = &nb->next;
+	}
+	*tail = NULL;
+	virtio_net_refill(q);
+	// Polling stops only with the interrupt back on; if packets came in
+	// meanwhile, pretend the budget ran out to get another pass.
+	if (n < budget && !virtq_enable_cb(q->rx)) {
+		virtq_disable_cb(q->rx);
+		n = budget;
+	}
+	spin_unlock_irqrestore(&q->rx_lock, irq);
+
+	if (list && !ndev->rx) {
+		netbuf_free_list(list);
+		drops += packets;
+		packets = bytes = 0;
+	} else if (list) {
+		ndev->rx(ndev, list);
+	}
+	__atomic_add_fetch(&ndev->stat_rx_packets, packets, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ndev->stat_rx_bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ndev->stat_rx_drops, drops, __ATOMIC_RELAXED);
+	return n;
+}
+
+static void virtio_net_rx_done(struct virtqueue *vq) {
+	struct virtio_net_queue *q = vq->priv;
+	// One interrupt runs the callbacks of every queue of the device.
+	if (!virtq_has_buf(vq)) return;
+	spin_lock(&q->rx_lock);
+	virtq_disable_cb(vq);
+	spin_unlock(&q->rx_lock);
+	napi_schedule(&q->napi);
+}
+
+static void virtio_net_tx_done(struct virtqueue *vq) {
+	struct virtio_net_queue *q = vq->priv;
+	if (!virtq_has_buf(vq)) return;
+	spin_lock(&q->tx_lock);
+	virtq_disable_cb(vq);
+	spin_unlock(&q->tx_lock);
+	napi_schedule(&q->napi);
+}
+
+static bool virtio_net_xmit(struct netdev *ndev, struct netbuf *nb) {
+	struct virtio_net *vn = ndev->priv;
+	struct virtio_net_queue *q = &vn->queues[hart_index() % ndev->nqueues];
+	size_t len = netbuf_pkt_len(nb);
+
+	if (netbuf_headroom(nb) < sizeof(struct virtio_net_hdr)) goto drop;
+	struct virtio_net_hdr *hdr = netbuf_push(nb, sizeof(*hdr));
+	memset(hdr, 0, sizeof(*hdr));
+	if (nb->csum == NETBUF_CSUM_PARTIAL) {
+		hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		hdr->csum_start = nb->csum_start;
+		hdr->csum_offset = nb->csum_offset;
+	}
+	if (nb->gso_type != NETBUF_GSO_NONE) {
+		// Segments repeat the headers up to the end of the TCP header,
+		// whose length is in its data offset field. The stack keeps all
+		// headers in the first buffer.
+		const uint8_t *tcp = (uint8_t *)(hdr + 1) + nb->csum_start;
+		hdr->gso_type = nb->gso_type == NETBUF_GSO_TCPV4
+							? VIRTIO_NET_HDR_GSO_TCPV4
+							: VIRTIO_NET_HDR_GSO_TCPV6;
+		hdr->gso_size = nb->gso_size;
+		hdr->hdr_len = nb->csum_start + (tcp[12] >> 4) * 4;
+	}
+
+	struct virtq_sg sg[VIRTQ_INDIRECT_MAX];
+	unsigned int nsg = 0;
+	for (struct netbuf *f = nb; f; f = f->frag) {
+		if (nsg == VIRTQ_INDIRECT_MAX) goto drop;
+		sg[nsg++] = (struct virtq_sg){f->data, f->len};
+	}
+
+	bool irq = spin_lock_irqsave(&q->tx_lock);
+	virtio_net_tx_reap(q);
+	bool ok = virtq_add(q->tx, sg, nsg, 0, nb);
+	if (ok) {
+		q->tx_inflight++;
+		virtq_kick(q->tx);
+	}
+	spin_unlock_irqrestore(&q->tx_lock, irq);
+	if (!ok) goto drop;
+
+	__atomic_add_fetch(&ndev->stat_tx_packets, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ndev->stat_tx_bytes, len, __ATOMIC_RELAXED);
+	return true;
+
+drop:
+	netbuf_free(nb);
+	__atomic_add_fetch(&ndev->stat_tx_drops, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+static const struct netdev_ops virtio_net_ops = {
+	.xmit = virtio_net_xmit,
+};
+
+/* Runs a control command, polling for the answer. Only used while probing,
+   before anything else can use the control queue. */
+static bool virtio_net_set_pairs(struct virtio_net *vn, unsigned int pairs) {
+	struct virtio_net_ctrl *c = vn->ctrl_buf;
+	*c = (struct virtio_net_ctrl){
+		.class = VIRTIO_NET_CTRL_MQ,
+		.cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+		.pairs = pairs,
+		.ack = 0xff,
+	};
+	struct virtq_sg sg[] = {
+		{&c->class, 2},
+		{&c->pairs, sizeof(c->pairs)},
+		{&c->ack, sizeof(c->ack)},
+	};
+	if (!virtq_add(vn->ctrl, sg, 2, 1, c)) return false;
+	virtq_kick(vn->ctrl);
+	while (!virtq_get_buf(vn->ctrl, NULL)) cpu_relax();
+	return __atomic_load_n(&c->ack, __ATOMIC_ACQUIRE) == VIRTIO_NET_OK;
+}
+
+static bool virtio_net_setup_queue(struct virtio_net *vn, unsigned int i,
+								   unsigned int rx_order) {
+	struct virtio_net_queue *q = &vn->queues[i];
+	q->vn = vn;
+	q->index = i;
+	q->rx_pool = (struct netbuf_pool)NETBUF_POOL_INIT(rx_order);
+	q->rx = virtio_setup_vq(vn->dev, 2 * i, VIRTQ_SIZE, virtio_net_rx_done, q);
+	q->tx =
+		virtio_setup_vq(vn->dev, 2 * i + 1, VIRTQ_SIZE, virtio_net_tx_done, q);
+	if (q->rx && q->tx) {
+		q->rx_target = q->rx->size;
+		if (rx_order && q->rx_target > VIRTIO_NET_BIG_POSTED)
+			q->rx_target = VIRTIO_NET_BIG_POSTED;
+		// The poll thread runs where the pair's transmit side is used.
+		if (napi_init(&q->napi, virtio_net_poll, q, i)) return true;
+	}
+	if (q->rx) virtio_del_vq(q->rx);
+	if (q->tx) virtio_del_vq(q->tx);
+	q->rx = q->tx = NULL;
+	return false;
+}
+
+static void virtio_net_config_changed(struct virtio_device *dev) {
+	struct virtio_net *vn = dev->priv;
+	if (!vn || !virtio_has_feature(dev, VIRTIO_NET_F_STATUS)) return;
+	uint16_t status = virtio_config_read16(dev, VIRTIO_NET_CFG_STATUS);
+	debug_printf("net: %s: link %s\n", vn->name,
+				 status & VIRTIO_NET_S_LINK_UP ? "up" : "down");
+}
+
+static bool virtio_net_probe(struct virtio_device *dev) {
+	struct virtio_net *vn = pmm_alloc_zeroed(virtio_net_order(sizeof(*vn)));
+	if (!vn) return false;
+	vn->dev = dev;
+
+	vn->mrg_rxbuf = virtio_has_feature(dev, VIRTIO_NET_F_MRG_RXBUF);
+	bool guest_tso = virtio_has_feature(dev, VIRTIO_NET_F_GUEST_TSO4) ||
+					 virtio_has_feature(dev, VIRTIO_NET_F_GUEST_TSO6);
+	unsigned int rx_order =
+		guest_tso && !vn->mrg_rxbuf ? VIRTIO_NET_BIG_ORDER : 0;
+
+	// With a control queue and several pairs, it comes after all the pairs
+	// the device has, used or not.
+	unsigned int max_pairs = 1;
+	if (virtio_has_feature(dev, VIRTIO_NET_F_MQ))
+		max_pairs = virtio_config_read16(dev, VIRTIO_NET_CFG_MAX_PAIRS);
+	if (!max_pairs) max_pairs = 1;
+	if (virtio_has_feature(dev, VIRTIO_NET_F_CTRL_VQ) &&
+		2 * max_pairs < VIRTIO_VQ_MAX) {
+		vn->ctrl = virtio_setup_vq(dev, 2 * max_pairs, 16, NULL, NULL);
+		if (vn->ctrl) vn->ctrl_buf = pmm_alloc_zeroed(0);
+		if (vn->ctrl && !vn->ctrl_buf) {
+			virtio_del_vq(vn->ctrl);
+			vn->ctrl = NULL;
+		}
+	}
+
+	unsigned int npairs = vn->ctrl ? max_pairs : 1;
+	if (npairs > hart_count) npairs = hart_count;
+	if (npairs > VIRTIO_VQ_MAX / 2) npairs = VIRTIO_VQ_MAX / 2;
+	for (unsigned int i = 0; i < npairs; i++) {
+		if (virtio_net_setup_queue(vn, i, rx_order)) continue;
+		if (!i) {
+			// virtio_probe() takes down the control queue.
+			if (vn->ctrl_buf) pmm_free(vn->ctrl_buf, 0);
+			pmm_free(vn, virtio_net_order(sizeof(*vn)));
+			return false;
+		}
+		npairs = i;
+	}
+
+	unsigned int index = __atomic_fetch_add(&virtio_net_count, 1,
+											__ATOMIC_RELAXED);
+	snprintf(vn->name, sizeof(vn->name), "eth%u", index);
+	vn->netdev = (struct netdev){
+		.name = vn->name,
+		.mtu = ETH_DATA_LEN,
+		.nqueues = npairs,
+		.max_frags = VIRTQ_INDIRECT_MAX,
+		.ops = &virtio_net_ops,
+		.priv = vn,
+	};
+	if (virtio_has_feature(dev, VIRTIO_NET_F_MAC)) {
+		for (unsigned int i = 0; i < ETH_ALEN; i++)
+			vn->netdev.mac[i] =
+				virtio_config_read8(dev, VIRTIO_NET_CFG_MAC + i);
+	} else {
+		// Locally administered, unique among this machine's devices.
+		vn->netdev.mac[0] = 0x02;
+		vn->netdev.mac[4] = index >> 8;
+		vn->netdev.mac[5] = index;
+	}
+	if (virtio_has_feature(dev, VIRTIO_NET_F_MTU))
+		vn->netdev.mtu = virtio_config_read16(dev, VIRTIO_NET_CFG_MTU);
+	if (virtio_has_feature(dev, VIRTIO_NET_F_CSUM)) {
+		vn->netdev.features |= NETDEV_F_TX_CSUM;
+		if (virtio_has_feature(dev, VIRTIO_NET_F_HOST_TSO4))
+			vn->netdev.features |= NETDEV_F_TSO4;
+		if (virtio_has_feature(dev, VIRTIO_NET_F_HOST_TSO6))
+			vn->netdev.features |= NETDEV_F_TSO6;
+	}
+	if (virtio_has_feature(dev, VIRTIO_NET_F_GUEST_CSUM))
+		vn->netdev.features |= NETDEV_F_RX_CSUM;
+	if (guest_tso) vn->netdev.features |= NETDEV_F_LRO;
+	vn->netdev.max_xmit =
+		vn->netdev.features & (NETDEV_F_TSO4 | NETDEV_F_TSO6)
+			? 65535
+			: ETH_HLEN + vn->netdev.mtu;
+
+	dev->priv = vn;
+	virtio_device_ready(dev);
+	if (npairs > 1 && !virtio_net_set_pairs(vn, npairs)) npairs = 1;
+	vn->netdev.nqueues = npairs;
+	for (unsigned int i = 0; i < npairs; i++) {
+		struct virtio_net_queue *q = &vn->queues[i];
+		bool irq = spin_lock_irqsave(&q->rx_lock);
+		virtio_net_refill(q);
+		spin_unlock_irqrestore(&q->rx_lock, irq);
+	}
+	netdev_register(&vn->netdev);
+	virtio_net_config_changed(dev);
+	return true;
+}
+
+static const struct virtio_driver virtio_net_driver = {
+	.name = "net",
+	.device_id = VIRTIO_ID_NET,
+	.features = VIRTIO_FEATURE(VIRTIO_NET_F_CSUM) |
+				VIRTIO_FEATURE(VIRTIO_NET_F_GUEST_CSUM) |
+				VIRTIO_FEATURE(VIRTIO_NET_F_MTU) |
+				VIRTIO_FEATURE(VIRTIO_NET_F_MAC) |
+				VIRTIO_FEATURE(VIRTIO_NET_F_GUEST_TSO4) |
+				VIRTIO_FEATURE(VIRTIO_NET_F_GUEST_TSO6) |
+				VIRTIO_FEATURE(VIRTIO_NET_F_HOST_TSO4) |
+				VIRTIO_FEATURE(VIRTIO_NET_F_HOST_TSO6) |
+				VIRTIO_FEATURE(VIRTIO_NET_F_MRG_RXBUF) |
+				VIRTIO_FEATURE(VIRTIO_NET_F_STATUS) |
+				VIRTIO_FEATURE(VIRTIO_NET_F_CTRL_VQ) |
+				VIRTIO_FEATURE(VIRTIO_NET_F_MQ),
+	.probe = virtio_net_probe,
+	.config_changed = virtio_net_config_changed,
+};
+
+static void __init virtio_net_init(void) {
+	virtio_register_driver(&virtio_net_driver);
+}
+
+INITCALL(virtio_net, virtio_net_init, "virtio");
@@ -0,0 +1,259 @@
+#include "virtio.h"
+
+#include <stddef.h>
+
+#include "cmdline.h"
+#include "debug.h"
+#include "fdt.h"
+#include "init.h"
+#include "initcall.h"
+#include "mmio.h"
+#include "plic.h"
+#include "pmm.h"
+#include "spinlock.h"
+
+/* virtio-mmio version 2 registers. */
+#define VIRTIO_MMIO_MAGIC 0x000
+#define VIRTIO_MMIO_VERSION 0x004
+#define VIRTIO_MMIO_DEVICE_ID 0x008
+#define VIRTIO_MMIO_DEVICE_FEATURES 0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES 0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL 0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX 0x034
+#define VIRTIO_MMIO_QUEUE_NUM 0x038
+#define VIRTIO_MMIO_QUEUE_READY 0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY 0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS 0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK 0x064
+#define VIRTIO_MMIO_STATUS 0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW 0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH 0x084
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW 0x090
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH 0x094
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW 0x0a0
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH 0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION 0x0fc
+#define VIRTIO_MMIO_CONFIG 0x100
+
+#define VIRTIO_MMIO_MAGIC_VALUE 0x74726976
+
+#define VIRTIO_MMIO_INT_VRING 1
+#define VIRTIO_MMIO_INT_CONFIG 2
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER 2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_STATUS_FAILED 128
+
+#define VIRTIO_DEVICES_MAX 32
+
+static struct virtio_device virtio_devices[VIRTIO_DEVICES_MAX];
+static unsigned int virtio_device_count;
+
+/* Transport features the kernel uses when offered. */
+static uint64_t virtio_transport_features;
+
+static uint32_t virtio_read(struct virtio_device *dev, unsigned int reg) {
+	return mmio_read32(dev->base + reg);
+}
+
+static void virtio_write(struct virtio_device *dev, unsigned int reg,
+						 uint32_t v) {
+	mmio_write32(dev->base + reg, v);
+}
+
+static void virtio_set_status(struct virtio_device *dev, uint32_t bits) {
+	virtio_write(dev, VIRTIO_MMIO_STATUS,
+				 virtio_read(dev, VIRTIO_MMIO_STATUS) | bits);
+}
+
+uint8_t virtio_config_read8(struct virtio_device *dev, unsigned int off) {
+	return mmio_read8(dev->base + VIRTIO_MMIO_CONFIG + off);
+}
+
+uint16_t virtio_config_read16(struct virtio_device *dev, unsigned int off) {
+	return mmio_read16(dev->base + VIRTIO_MMIO_CONFIG + off);
+}
+
+uint32_t virtio_config_read32(struct virtio_device *dev, unsigned int off) {
+	return virtio_read(dev, VIRTIO_MMIO_CONFIG + off);
+}
+
+uint64_t virtio_config_read64(struct virtio_device *dev, unsigned int off) {
+	uint32_t gen, lo, hi;
+	do {
+		gen = virtio_read(dev, VIRTIO_MMIO_CONFIG_GENERATION);
+		lo = virtio_config_read32(dev, off);
+		hi = virtio_config_read32(dev, off + 4);
+	} while (gen != virtio_read(dev, VIRTIO_MMIO_CONFIG_GENERATION));
+	return (uint64_t)hi << 32 | lo;
+}
+
+void virtio_notify(struct virtqueue *vq) {
+	virtio_write(vq->dev, VIRTIO_MMIO_QUEUE_NOTIFY, vq->index);
+}
+
+struct virtqueue *virtio_setup_vq(struct virtio_device *dev,
+								  unsigned int index, unsigned int size,
+								  virtq_callback_t cb, void *priv) {
+	if (index >= VIRTIO_VQ_MAX) return NULL;
+	virtio_write(dev, VIRTIO_MMIO_QUEUE_SEL, index);
+	if (virtio_read(dev, VIRTIO_MMIO_QUEUE_READY)) return NULL;
+
+	uint32_t max = virtio_read(dev, VIRTIO_MMIO_QUEUE_NUM_MAX);
+	if (size > max) size = max;
+	if (size > VIRTQ_SIZE) size = VIRTQ_SIZE;
+	if (!size) return NULL;
+	// Split rings need a power of two.
+	while (size & (size - 1)) size &= size - 1;
+
+	struct virtqueue *vq = virtq_create(dev, index, size);
+	if (!vq) return NULL;
+	vq->callback = cb;
+	vq->priv = priv;
+
+	uint64_t desc, driver, device;
+	virtq_addrs(vq, &desc, &driver, &device);
+	virtio_write(dev, VIRTIO_MMIO_QUEUE_NUM, size);
+	virtio_write(dev, VIRTIO_MMIO_QUEUE_DESC_LOW, desc);
+	virtio_write(dev, VIRTIO_MMIO_QUEUE_DESC_HIGH, desc >> 32);
+	virtio_write(dev, VIRTIO_MMIO_QUEUE_DRIVER_LOW, driver);
+	virtio_write(dev, VIRTIO_MMIO_QUEUE_DRIVER_HIGH, driver >> 32);
+	virtio_write(dev, VIRTIO_MMIO_QUEUE_DEVICE_LOW, device);
+	virtio_write(dev, VIRTIO_MMIO_QUEUE_DEVICE_HIGH, device >> 32);
+	virtio_write(dev, VIRTIO_MMIO_QUEUE_READY, 1);
+
+	dev->vqs[index] = vq;
+	if (index >= dev->nvqs) dev->nvqs = index + 1;
+	return vq;
+}
+
+void virtio_del_vq(struct virtqueue *vq) {
+	struct virtio_device *dev = vq->dev;
+	virtio_write(dev, VIRTIO_MMIO_QUEUE_SEL, vq->index);
+	virtio_write(dev, VIRTIO_MMIO_QUEUE_READY, 0);
+	dev->vqs[vq->index] = NULL;
+	virtq_destroy(vq);
+}
+
+/* A device has one interrupt for all its queues. */
+static void virtio_irq(void *arg) {
+	struct virtio_device *dev = arg;
+	uint32_t status = virtio_read(dev, VIRTIO_MMIO_INTERRUPT_STATUS);
+	virtio_write(dev, VIRTIO_MMIO_INTERRUPT_ACK, status);
+
+	if (status & VIRTIO_MMIO_INT_VRING) {
+		for (unsigned int i = 0; i < dev->nvqs; i++) {
+			struct virtqueue *vq = dev->vqs[i];
+			if (vq && vq->callback) vq->callback(vq);
+		}
+	}
+	if (status & VIRTIO_MMIO_INT_CONFIG && dev->driver->config_changed)
+		dev->driver->config_changed(dev);
+}
+
+void virtio_device_ready(struct virtio_device *dev) {
+	dev->irq_hart = dev->irq ? plic_request_irq(dev->irq, virtio_irq, dev) : -1;
+	virtio_set_status(dev, VIRTIO_STATUS_DRIVER_OK);
+}
+
+static uint64_t virtio_read_features(struct virtio_device *dev) {
+	virtio_write(dev, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 1);
+	uint64_t hi = virtio_read(dev, VIRTIO_MMIO_DEVICE_FEATURES);
+	virtio_write(dev, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 0);
+	return hi << 32 | virtio_read(dev, VIRTIO_MMIO_DEVICE_FEATURES);
+}
+
+static void virtio_write_features(struct virtio_device *dev, uint64_t f) {
+	virtio_write(dev, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
+	virtio_write(dev, VIRTIO_MMIO_DRIVER_FEATURES, f >> 32);
+	virtio_write(dev, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
+	virtio_write(dev, VIRTIO_MMIO_DRIVER_FEATURES, f);
+}
+
+/* Initialization as in section 3.1.1 of the spec. */
+static bool virtio_probe(struct virtio_device *dev,
+						 const struct virtio_driver *drv) {
+	virtio_write(dev, VIRTIO_MMIO_STATUS, 0);
+	while (virtio_read(dev, VIRTIO_MMIO_STATUS)) cpu_relax();
+	virtio_set_status(dev, VIRTIO_STATUS_ACKNOWLEDGE);
+	virtio_set_status(dev, VIRTIO_STATUS_DRIVER);
+
+	uint64_t offered = virtio_read_features(dev);
+	dev->features = offered & (drv->features | virtio_transport_features);
+	if (!virtio_has_feature(dev, VIRTIO_F_VERSION_1)) goto fail;
+	virtio_write_features(dev, dev->features);
+	virtio_set_status(dev, VIRTIO_STATUS_FEATURES_OK);
+	if (!(virtio_read(dev, VIRTIO_MMIO_STATUS) & VIRTIO_STATUS_FEATURES_OK))
+		goto fail;
+
+	dev->driver = drv;
+	if (drv->probe(dev)) {
+		debug_printf("virtio: %s at %lx, features %lx, %s rings\n", drv->name,
+					 virt_to_phys(dev->base), dev->features,
+					 virtio_has_feature(dev, VIRTIO_F_RING_PACKED) ? "packed"
+																   : "split");
+		return true;
+	}
+	// Whatever queues the driver set up before giving up go with it.
+	for (unsigned int i = 0; i < dev->nvqs; i++)
+		if (dev->vqs[i]) virtio_del_vq(dev->vqs[i]);
+	dev->nvqs = 0;
+	dev->driver = NULL;
+	dev->priv = NULL;
+
+fail:
+	virtio_set_status(dev, VIRTIO_STATUS_FAILED);
+	return false;
+}
+
+void virtio_register_driver(const struct virtio_driver *drv) {
+	// Each driver owns its own device ID, so drivers registering at the same
+	// time on different harts never touch the same device.
+	for (unsigned int i = 0; i < virtio_device_count; i++) {
+		struct virtio_device *dev = &virtio_devices[i];
+		if (dev->device_id == drv->device_id && !dev->driver)
+			virtio_probe(dev, drv);
+	}
+}
+
+static void __init virtio_init(void) {
+	virtio_transport_features = VIRTIO_FEATURE(VIRTIO_F_VERSION_1);
+	if (!cmdline_list_has("virtio_off", "packed"))
+		virtio_transport_features |= VIRTIO_FEATURE(VIRTIO_F_RING_PACKED);
+	if (!cmdline_list_has("virtio_off", "event_idx"))
+		virtio_transport_features |= VIRTIO_FEATURE(VIRTIO_F_EVENT_IDX);
+	if (!cmdline_list_has("virtio_off", "indirect"))
+		virtio_transport_features |= VIRTIO_FEATURE(VIRTIO_F_INDIRECT_DESC);
+
+	for (int node = fdt_node_by_compatible(-1, "virtio,mmio");
+		 node >= 0 && virtio_device_count < VIRTIO_DEVICES_MAX;
+		 node = fdt_node_by_compatible(node, "virtio,mmio")) {
+		uint64_t base;
+		if (!fdt_get_reg(fdt_parent(node), node, 0, &base, NULL)) continue;
+
+		struct virtio_device *dev = &virtio_devices[virtio_device_count];
+		dev->base = phys_to_virt(base);
+		if (virtio_read(dev, VIRTIO_MMIO_MAGIC) != VIRTIO_MMIO_MAGIC_VALUE)
+			continue;
+		// Version 1 is the legacy interface, which we do not speak.
+		if (virtio_read(dev, VIRTIO_MMIO_VERSION) != 2) {
+			debug_printf("virtio: legacy device at %lx ignored\n", base);
+			continue;
+		}
+		// Unused slots have device ID 0.
+		dev->device_id = virtio_read(dev, VIRTIO_MMIO_DEVICE_ID);
+		if (!dev->device_id) continue;
+
+		uint32_t irq = 0;
+		fdt_getprop_u32(node, "interrupts", &irq);
+		dev->irq = irq;
+		dev->irq_hart = -1;
+		virtio_device_count++;
+	}
+}
+
+INITCALL(virtio, virtio_init, "plic", "pmm_pages");
@@ -0,0 +1,429 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pmm.h"
+#include "virtio.h"
+
+/* Ring layouts from the virtio 1.2 spec. Everything is little-endian, as is
+   the kernel. */
+
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_DESC_F_INDIRECT 4
+/* Packed ring only. */
+#define VIRTQ_DESC_F_AVAIL (1 << 7)
+#define VIRTQ_DESC_F_USED (1 << 15)
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY 1
+
+#define VIRTQ_EVENT_F_ENABLE 0
+#define VIRTQ_EVENT_F_DISABLE 1
+#define VIRTQ_EVENT_F_DESC 2
+
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+/* Followed by used_event. */
+struct virtq_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+};
+
+struct virtq_used_elem {
+	uint32_t id;
+	uint32_t len;
+};
+
+/* Followed by avail_event. */
+struct virtq_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct virtq_used_elem ring[];
+};
+
+struct virtq_packed_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t id;
+	uint16_t flags;
+};
+
+struct virtq_event {
+	uint16_t off_wrap;
+	uint16_t flags;
+};
+
+static unsigned int virtq_order(size_t bytes) {
+	unsigned int order = 0;
+	while ((PAGE_SIZE << order) < bytes) order++;
+	return order;
+}
+
+/* Whether an event index between old and new was passed, from the spec. */
+static bool virtq_need_event(uint16_t event, uint16_t new, uint16_t old) {
+	return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
+
+static void virtq_mb(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+static uint16_t *virtq_used_event(struct virtqueue *vq) {
+	return &vq->avail->ring[vq->size];
+}
+
+static uint16_t *virtq_avail_event(struct virtqueue *vq) {
+	return (uint16_t *)&vq->used->ring[vq->size];
+}
+
+static uint16_t virtq_packed_flags(const struct virtqueue *vq) {
+	return vq->avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED;
+}
+
+/* Sizes of the pieces of a queue, shared by virtq_create() and
+   virtq_destroy(). */
+static size_t virtq_meta_bytes(unsigned int size) {
+	return sizeof(struct virtqueue) + size * (sizeof(void *) + 4);
+}
+
+static size_t virtq_indirect_bytes(unsigned int size) {
+	return size * VIRTQ_INDIRECT_MAX * sizeof(struct virtq_desc);
+}
+
+static size_t virtq_ring_bytes(unsigned int size, bool packed) {
+	size_t desc_bytes = size * sizeof(struct virtq_desc);
+	if (packed) return desc_bytes + 2 * sizeof(struct virtq_event);
+	return ((desc_bytes + 6 + 2 * size + 3) & ~3ul) + 6 + 8 * size;
+}
+
+struct virtqueue *virtq_create(struct virtio_device *dev, unsigned int index,
+							   unsigned int size) {
+	bool packed = virtio_has_feature(dev, VIRTIO_F_RING_PACKED);
+
+	// The queue and its per-id arrays share a page.
+	struct virtqueue *vq =
+		pmm_alloc_zeroed(virtq_order(virtq_meta_bytes(size)));
+	if (!vq) return NULL;
+	vq->dev = dev;
+	vq->index = index;
+	vq->size = size;
+	vq->num_free = size;
+	vq->packed = packed;
+	vq->event_idx = virtio_has_feature(dev, VIRTIO_F_EVENT_IDX);
+	vq->tokens = (void **)(vq + 1);
+	vq->chain_len = (uint16_t *)(vq->tokens + size);
+	vq->next_id = vq->chain_len + size;
+
+	if (virtio_has_feature(dev, VIRTIO_F_INDIRECT_DESC)) {
+		vq->indirect_tables =
+			pmm_alloc_zeroed(virtq_order(virtq_indirect_bytes(size)));
+		vq->indirect = vq->indirect_tables != NULL;
+	}
+
+	char *ring = pmm_alloc_zeroed(virtq_order(virtq_ring_bytes(size, packed)));
+	if (!ring) {
+		virtq_destroy(vq);
+		return NULL;
+	}
+	size_t desc_bytes = size * sizeof(struct virtq_desc);
+	if (packed) {
+		vq->pdesc = (struct virtq_packed_desc *)ring;
+		vq->driver_event = (struct virtq_event *)(ring + desc_bytes);
+		vq->device_event = vq->driver_event + 1;
+		vq->avail_wrap = vq->used_wrap = true;
+		for (unsigned int i = 0; i < size; i++) vq->next_id[i] = i + 1;
+	} else {
+		size_t used_off = (desc_bytes + 6 + 2 * size + 3) & ~3ul;
+		vq->desc = (struct virtq_desc *)ring;
+		vq->avail = (struct virtq_avail *)(ring + desc_bytes);
+		vq->used = (struct virtq_used *)(ring + used_off);
+		for (unsigned int i = 0; i < size; i++) vq->desc[i].next = i + 1;
+	}
+	return vq;
+}
+
+void virtq_destroy(struct virtqueue *vq) {
+	void *ring = vq->packed ? (void *)vq->pdesc : (void *)vq->desc;
+	if (ring)
+		pmm_free(ring, virtq_order(virtq_ring_bytes(vq->size, vq->packed)));
+	if (vq->indirect_tables)
+		pmm_free(vq->indirect_tables,
+				 virtq_order(virtq_indirect_bytes(vq->size)));
+	pmm_free(vq, virtq_order(virtq_meta_bytes(vq->size)));
+}
+
+void virtq_addrs(const struct virtqueue *vq, uint64_t *desc, uint64_t *driver,
+				 uint64_t *device) {
+	if (vq->packed) {
+		*desc = virt_to_phys(vq->pdesc);
+		*driver = virt_to_phys(vq->driver_event);
+		*device = virt_to_phys(vq->device_event);
+	} else {
+		*desc = virt_to_phys(vq->desc);
+		*driver = virt_to_phys(vq->avail);
+		*device = virt_to_phys(vq->used);
+	}
+}
+
+/* Fills an indirect table for id and returns its size in bytes. Split and
+   packed tables share the layout but for the meaning of the last field. */
+static uint32_t virtq_fill_indirect(struct virtqueue *vq, uint16_t id,
+									const struct virtq_sg *sg,
+									unsigned int out, unsigned int n) {
+	struct virtq_desc *table =
+		(struct virtq_desc *)vq->indirect_tables + id * VIRTQ_INDIRECT_MAX;
+	for (unsigned int i = 0; i < n; i++) {
+		table[i].addr = virt_to_phys(sg[i].addr);
+		table[i].len = sg[i].len;
+		if (vq->packed) {
+			table[i].flags = 0;
+			table[i].next = i >= out ? VIRTQ_DESC_F_WRITE : 0;
+		} else {
+			table[i].flags = (i >= out ? VIRTQ_DESC_F_WRITE : 0) |
+							 (i + 1 < n ? VIRTQ_DESC_F_NEXT : 0);
+			table[i].next = i + 1;
+		}
+	}
+	return n * sizeof(struct virtq_desc);
+}
+
+static void virtq_add_split(struct virtqueue *vq, const struct virtq_sg *sg,
+							unsigned int out, unsigned int n, bool indirect) {
+	// Chains follow the free list, which is linked through the next fields,
+	// so only the last descriptor's link needs reading.
+	uint16_t head = vq->free_head;
+	uint16_t idx = head;
+	if (indirect) {
+		struct virtq_desc *d = &vq->desc[idx];
+		d->len = virtq_fill_indirect(vq, head, sg, out, n);
+		d->addr = virt_to_phys(
+			(struct virtq_desc *)vq->indirect_tables + head * VIRTQ_INDIRECT_MAX);
+		d->flags = VIRTQ_DESC_F_INDIRECT;
+		idx = d->next;
+	} else {
+		for (unsigned int i = 0; i < n; i++) {
+			struct virtq_desc *d = &vq->desc[idx];
+			d->addr = virt_to_phys(sg[i].addr);
+			d->len = sg[i].len;
+			d->flags = (i >= out ? VIRTQ_DESC_F_WRITE : 0) |
+					   (i + 1 < n ? VIRTQ_DESC_F_NEXT : 0);
+			idx = d->next;
+		}
+	}
+	vq->free_head = idx;
+
+	uint16_t avail = vq->avail->idx;
+	vq->avail->ring[avail % vq->size] = head;
+	__atomic_store_n(&vq->avail->idx, avail + 1, __ATOMIC_RELEASE);
+}
+
+static uint16_t virtq_add_packed(struct virtqueue *vq,
+								 const struct virtq_sg *sg, unsigned int out,
+								 unsigned int n, bool indirect) {
+	uint16_t id = vq->free_head;
+	vq->free_head = vq->next_id[id];
+
+	// The first descriptor's flags are written last, publishing the chain.
+	uint16_t head = vq->next_avail;
+	uint16_t head_flags = 0;
+	unsigned int slots = indirect ? 1 : n;
+	for (unsigned int i = 0; i < slots; i++) {
+		struct virtq_packed_desc *d = &vq->pdesc[vq->next_avail];
+		uint16_t flags = virtq_packed_flags(vq);
+		if (indirect) {
+			d->len = virtq_fill_indirect(vq, id, sg, out, n);
+			d->addr = virt_to_phys((struct virtq_desc *)vq->indirect_tables +
+								   id * VIRTQ_INDIRECT_MAX);
+			flags |= VIRTQ_DESC_F_INDIRECT;
+		} else {
+			d->addr = virt_to_phys(sg[i].addr);
+			d->len = sg[i].len;
+			flags |= (i >= out ? VIRTQ_DESC_F_WRITE : 0) |
+					 (i + 1 < n ? VIRTQ_DESC_F_NEXT : 0);
+		}
+		d->id = id;
+		if (i)
+			d->flags = flags;
+		else
+			head_flags = flags;
+
+		if (++vq->next_avail == vq->size) {
+			vq->next_avail = 0;
+			vq->avail_wrap = !vq->avail_wrap;
+		}
+	}
+	__atomic_store_n(&vq->pdesc[head].flags, head_flags, __ATOMIC_RELEASE);
+	return id;
+}
+
+bool virtq_add(struct virtqueue *vq, const struct virtq_sg *sg,
+			   unsigned int out, unsigned int in, void *token) {
+	unsigned int n = out + in;
+	// A chain of more than one entry takes a single slot through an
+	// indirect table, leaving the ring for more requests in flight.
+	bool indirect = vq->indirect && n > 1 && n <= VIRTQ_INDIRECT_MAX;
+	unsigned int slots = indirect ? 1 : n;
+	if (!n || slots > vq->num_free) return false;
+
+	uint16_t id;
+	if (vq->packed) {
+		id = virtq_add_packed(vq, sg, out, n, indirect);
+	} else {
+		id = vq->free_head;
+		virtq_add_split(vq, sg, out, n, indirect);
+	}
+	vq->tokens[id] = token;
+	vq->chain_len[id] = slots;
+	vq->num_free -= slots;
+	// A packed ring's event index is a slot, and a chain that does not go
+	// indirect takes one per entry.
+	vq->num_added += vq->packed ? slots : 1;
+	return true;
+}
+
+void virtq_kick(struct virtqueue *vq) {
+	if (!vq->num_added) return;
+
+	// The device must see the new buffers before we look at whether it
+	// wants to be told about them.
+	virtq_mb();
+	bool notify;
+	if (vq->packed) {
+		uint16_t new = vq->next_avail, old = new - vq->num_added;
+		uint16_t off_wrap = vq->device_event->off_wrap;
+		uint16_t flags = vq->device_event->flags;
+		if (flags == VIRTQ_EVENT_F_DESC && vq->event_idx) {
+			uint16_t event = off_wrap & 0x7fff;
+			if ((off_wrap >> 15) != vq->avail_wrap) event -= vq->size;
+			notify = virtq_need_event(event, new, old);
+		} else {
+			notify = flags != VIRTQ_EVENT_F_DISABLE;
+		}
+	} else {
+		uint16_t new = vq->avail->idx, old = new - vq->num_added;
+		if (vq->event_idx)
+			notify = virtq_need_event(*virtq_avail_event(vq), new, old);
+		else
+			notify = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+	}
+	vq->num_added = 0;
+	if (notify) virtio_notify(vq);
+}
+
+static bool virtq_more_used(struct virtqueue *vq) {
+	if (vq->packed) {
+		uint16_t flags =
+			__atomic_load_n(&vq->pdesc[vq->last_used].flags, __ATOMIC_ACQUIRE);
+		bool avail = flags & VIRTQ_DESC_F_AVAIL, used = flags & VIRTQ_DESC_F_USED;
+		return avail == used && used == vq->used_wrap;
+	}
+	return vq->last_used !=
+		   __atomic_load_n(&vq->used->idx, __ATOMIC_ACQUIRE);
+}
+
+/* Tells an event-index device which used buffer to interrupt for. */
+static void virtq_set_used_event(struct virtqueue *vq) {
+	if (vq->packed)
+		vq->driver_event->off_wrap = vq->last_used | vq->used_wrap << 15;
+	else
+		*virtq_used_event(vq) = vq->last_used;
+}
+
+bool virtq_has_buf(struct virtqueue *vq) {
+	return virtq_more_used(vq);
+}
+
+void *virtq_get_buf(struct virtqueue *vq, uint32_t *len) {
+	if (!virtq_more_used(vq)) return NULL;
+
+	uint16_t id;
+	if (vq->packed) {
+		struct virtq_packed_desc *d = &vq->pdesc[vq->last_used];
+		id = d->id;
+		if (len) *len = d->len;
+		// The device skips over the rest of the chain.
+		vq->last_used += vq->chain_len[id];
+		if (vq->last_used >= vq->size) {
+			vq->last_used -= vq->size;
+			vq->used_wrap = !vq->used_wrap;
+		}
+		vq->next_id[id] = vq->free_head;
+		vq->free_head = id;
+	} else {
+		struct virtq_used_elem *e = &vq->used->ring[vq->last_used % vq->size];
+		id = e->id;
+		if (len) *len = e->len;
+		vq->last_used++;
+
+		uint16_t last = id;
+		for (unsigned int i = 1; i < vq->chain_len[id]; i++)
+			last = vq->desc[last].next;
+		vq->desc[last].next = vq->free_head;
+		vq->free_head = id;
+	}
+	vq->num_free += vq->chain_len[id];
+
+	void *token = vq->tokens[id];
+	vq->tokens[id] = NULL;
+	if (vq->event_idx && !vq->cb_disabled) {
+		virtq_set_used_event(vq);
+		virtq_mb();
+	}
+	return token;
+}
+
+bool virtq_enable_cb(struct virtqueue *vq) {
+	vq->cb_disabled = false;
+	if (vq->event_idx) {
+		virtq_set_used_event(vq);
+		if (vq->packed) vq->driver_event->flags = VIRTQ_EVENT_F_DESC;
+	} else if (vq->packed) {
+		vq->driver_event->flags = VIRTQ_EVENT_F_ENABLE;
+	} else {
+		vq->avail->flags = 0;
+	}
+	virtq_mb();
+	return !virtq_more_used(vq);
+}
+
+bool virtq_enable_cb_delayed(struct virtqueue *vq, unsigned int n) {
+	if (!vq->event_idx || n <= 1) return virtq_enable_cb(vq);
+	if (n > vq->size) n = vq->size;
+	vq->cb_disabled = false;
+
+	if (vq->packed) {
+		// Slots rather than buffers, which is the same for single-slot
+		// chains and makes the device interrupt earlier otherwise.
+		unsigned int off = vq->last_used + n - 1;
+		bool wrap = vq->used_wrap;
+		if (off >= vq->size) {
+			off -= vq->size;
+			wrap = !wrap;
+		}
+		vq->driver_event->off_wrap = off | wrap << 15;
+		vq->driver_event->flags = VIRTQ_EVENT_F_DESC;
+		virtq_mb();
+		uint16_t flags =
+			__atomic_load_n(&vq->pdesc[off].flags, __ATOMIC_ACQUIRE);
+		bool avail = flags & VIRTQ_DESC_F_AVAIL, used = flags & VIRTQ_DESC_F_USED;
+		return !(avail == used && used == wrap);
+	}
+	*virtq_used_event(vq) = vq->last_used + n - 1;
+	virtq_mb();
+	return (uint16_t)(__atomic_load_n(&vq->used->idx, __ATOMIC_ACQUIRE) -
+					  vq->last_used) < n;
+}
+
+void virtq_disable_cb(struct virtqueue *vq) {
+	vq->cb_disabled = true;
+	// With event indices, the split ring's flags must stay 0; the device
+	// then interrupts at most once more.
+	if (vq->packed)
+		vq->driver_event->flags = VIRTQ_EVENT_F_DISABLE;
+	else if (!vq->event_idx)
+		vq->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+}
@@ -0,0 +1,247 @@
+#include "vmm.h"
+
+#include <stddef.h>
+
+#include "csr.h"
+#include "debug.h"
+#include "hart.h"
+#include "init.h"
+#include "limine/features.h"
+#include "pmm.h"
+#include "sbi.h"
+#include "string.h"
+
+#define VMM_BOOT_TABLES 16
+
+#define GiB (1ul << 30)
+
+/* Root table entries from here on map the kernel half. */
+#define VMM_KERNEL_HALF 256
+
+unsigned int vmm_levels;
+uint64_t vmm_kernel_satp;
+uint64_t *vmm_kernel_root;
+
+/* Tables for vmm_init(), which runs before the page allocator, on the boot
+   hart alone. Every table after it comes from pmm. */
+static uint64_t vmm_boot_tables[VMM_BOOT_TABLES][512]
+	__attribute__((aligned(4096)));
+static unsigned int vmm_boot_tables_used;
+static bool vmm_booting;
+
+extern char __kernel_start[], __kernel_end[];
+extern char __text_start[];
+extern char __rodata_start[], __data_start[];
+
+static uint64_t *vmm_alloc_table(void) {
+	if (!vmm_booting) return pmm_alloc_zeroed(0);
+	if (vmm_boot_tables_used == VMM_BOOT_TABLES) return NULL;
+	return vmm_boot_tables[vmm_boot_tables_used++];
+}
+
+/* Boot tables are accessed through the kernel image mapping, so they work
+   whichever HHDM is active. */
+static bool vmm_is_boot_table(uint64_t phys) {
+	uint64_t base = (uint64_t)LIMINE_EXE_VTOP(vmm_boot_tables);
+	return phys >= base && phys < base + sizeof(vmm_boot_tables);
+}
+
+static uint64_t vmm_table_phys(uint64_t *t) {
+	if ((char *)t >= __kernel_start && (char *)t < __kernel_end)
+		return (uint64_t)LIMINE_EXE_VTOP(t);
+	return virt_to_phys(t);
+}
+
+static uint64_t *vmm_table_virt(uint64_t phys) {
+	if (vmm_is_boot_table(phys))
+		return (uint64_t *)((char *)vmm_boot_tables +
+							(phys - (uint64_t)LIMINE_EXE_VTOP(vmm_boot_tables)));
+	return phys_to_virt(phys);
+}
+
+uint64_t *vmm_next_table(uint64_t pte) {
+	return vmm_table_virt((pte >> PTE_PPN_SHIFT) << PAGE_SHIFT);
+}
+
+void vmm_free_table(uint64_t *table) { pmm_free(table, 0); }
+
+static unsigned int vmm_index(uint64_t va, unsigned int level) {
+	return (va >> (PAGE_SHIFT + 9 * level)) & 511;
+}
+
+uint64_t *vmm_walk(uint64_t *root, uint64_t va, unsigned int level,
+				   bool alloc) {
+	uint64_t *table = root;
+	for (unsigned int l = vmm_levels - 1; l > level; l--) {
+		uint64_t *pte = &table[vmm_index(va, l)];
+		if (!(*pte & PTE_V)) {
+			if (!alloc) return NULL;
+			uint64_t *next = vmm_alloc_table();
+			if (!next) return NULL;
+			*pte = (vmm_table_phys(next) >> PAGE_SHIFT) << PTE_PPN_SHIFT | PTE_V;
+		} else if (*pte & (PTE_R | PTE_W | PTE_X)) {
+			return NULL;
+		}
+		table = vmm_next_table(*pte);
+	}
+	return &table[vmm_index(va, level)];
+}
+
+int vmm_map(uint64_t *root, uint64_t va, uint64_t pa, uint64_t size,
+			uint64_t flags) {
+	uint64_t end = va + size;
+	while (va < end) {
+		unsigned int level = 2;
+		for (;; level--) {
+			uint64_t page = PAGE_SIZE << (9 * level);
+			if (level < vmm_levels && !(va & (page - 1)) &&
+				!(pa & (page - 1)) && end - va >= page)
+				break;
+			if (!level) break;
+		}
+
+		uint64_t *pte = vmm_walk(root, va, level, true);
+		if (!pte) return -1;
+		*pte = (pa >> PAGE_SHIFT) << PTE_PPN_SHIFT | flags | PTE_A | PTE_D |
+			   PTE_V;
+		va += PAGE_SIZE << (9 * level);
+		pa += PAGE_SIZE << (9 * level);
+	}
+	return 0;
+}
+
+void vmm_unmap(uint64_t *root, uint64_t va, uint64_t size) {
+	for (uint64_t end = va + size; va < end; va += PAGE_SIZE) {
+		uint64_t *pte = vmm_walk(root, va, 0, false);
+		if (pte) *pte = 0;
+	}
+}
+
+uint64_t *vmm_lookup(uint64_t *root, uint64_t va, unsigned int *level) {
+	uint64_t *table = root;
+	for (int l = vmm_levels - 1; l >= 0; l--) {
+		uint64_t *pte = &table[vmm_index(va, l)];
+		if (!(*pte & PTE_V)) return NULL;
+		if (*pte & (PTE_R | PTE_W | PTE_X)) {
+			if (level) *level = l;
+			return pte;
+		}
+		table = vmm_table_virt((*pte >> PTE_PPN_SHIFT) << PAGE_SHIFT);
+	}
+	return NULL;
+}
+
+uint64_t vmm_translate(uint64_t *root, uint64_t va) {
+	unsigned int level;
+	uint64_t *pte = vmm_lookup(root, va, &level);
+	if (!pte) return -1;
+	uint64_t page = PAGE_SIZE << (9 * level);
+	return ((*pte >> PTE_PPN_SHIFT) << PAGE_SHIFT) + (va & (page - 1));
+}
+
+uint64_t *vmm_create(void) {
+	uint64_t *root = pmm_alloc_zeroed(0);
+	if (!root) return NULL;
+	// The kernel's top-level entries never change after vmm_init(), so
+	// copies of them stay valid.
+	memcpy(root + VMM_KERNEL_HALF, vmm_kernel_root + VMM_KERNEL_HALF,
+		   (512 - VMM_KERNEL_HALF) * sizeof(*root));
+	return root;
+}
+
+static int vmm_clone_table(uint64_t *dst, uint64_t *src, unsigned int level,
+						   unsigned int entries,
+						   uint64_t (*dup)(uint64_t *pte, unsigned int level)) {
+	for (unsigned int i = 0; i < entries; i++) {
+		uint64_t pte = src[i];
+		if (!(pte & PTE_V)) continue;
+		if (pte & (PTE_R | PTE_W | PTE_X)) {
+			dst[i] = dup(&src[i], level);
+			continue;
+		}
+		uint64_t *next = pmm_alloc_zeroed(0);
+		if (!next) return -1;
+		dst[i] = (virt_to_phys(next) >> PAGE_SHIFT) << PTE_PPN_SHIFT | PTE_V;
+		uint64_t *from = vmm_table_virt((pte >> PTE_PPN_SHIFT) << PAGE_SHIFT);
+		if (vmm_clone_table(next, from, level - 1, 512, dup)) return -1;
+	}
+	return 0;
+}
+
+int vmm_clone(uint64_t *dst, uint64_t *src,
+			  uint64_t (*dup)(uint64_t *pte, unsigned int level)) {
+	return vmm_clone_table(dst, src, vmm_levels - 1, VMM_KERNEL_HALF, dup);
+}
+
+static void vmm_destroy_table(uint64_t *table, unsigned int level,
+							  unsigned int entries,
+							  void (*put)(uint64_t pa, unsigned int level)) {
+	for (unsigned int i = 0; i < entries; i++) {
+		uint64_t pte = table[i];
+		if (!(pte & PTE_V)) continue;
+		uint64_t phys = (pte >> PTE_PPN_SHIFT) << PAGE_SHIFT;
+		if (pte & (PTE_R | PTE_W | PTE_X))
+			put(phys, level);
+		else
+			vmm_destroy_table(vmm_table_virt(phys), level - 1, 512, put);
+	}
+	vmm_free_table(table);
+}
+
+void vmm_destroy(uint64_t *root, void (*put)(uint64_t pa, unsigned int level)) {
+	vmm_destroy_table(root, vmm_levels - 1, VMM_KERNEL_HALF, put);
+}
+
+void vmm_flush_kernel(uint64_t va, uint64_t size) {
+	for (uint64_t a = va; a < va + size; a += PAGE_SIZE)
+		asm volatile("sfence.vma %0, zero" ::"r"(a) : "memory");
+	if (hart_count > 1 && sbi_capabilities.rfence)
+		sbi_remote_sfence_vma(0, -1ul, va, size);
+}
+
+static void __init vmm_map_kernel(char *start, char *end, uint64_t flags) {
+	uint64_t va = (uint64_t)start;
+	if (start == end) return;
+	if (vmm_map(vmm_kernel_root, va, (uint64_t)LIMINE_EXE_VTOP(va),
+				(uint64_t)end - va, flags | PTE_G))
+		panic("vmm: out of boot page tables\n");
+}
+
+void __init vmm_init(void) {
+	unsigned long mode = csr_read(satp) >> SATP_MODE_SHIFT;
+	// Sv39, Sv48 and Sv57 are modes 8, 9 and 10.
+	if (mode < 8 || mode > 10) panic("vmm: unknown paging mode %lu\n", mode);
+	vmm_levels = mode - 5;
+
+	vmm_booting = true;
+	vmm_kernel_root = vmm_alloc_table();
+
+	// The HHDM runs up to the end of the memory map, whatever the type, so
+	// that device MMIO below RAM is reachable too.
+	struct limine_memmap_response *memmap = memmap_request.response;
+	uint64_t top = 4 * GiB;
+	for (uint64_t i = 0; i < memmap->entry_count; i++) {
+		uint64_t end = memmap->entries[i]->base + memmap->entries[i]->length;
+		if (end > top) top = end;
+	}
+	top = (top + GiB - 1) & ~(GiB - 1);
+	if (vmm_map(vmm_kernel_root, limine_hhdm_offset, 0, top,
+				PTE_R | PTE_W | PTE_G))
+		panic("vmm: out of boot page tables\n");
+
+	// W^X for the kernel image. The init sections are mapped on their own,
+	// so they get 4 KiB pages that init_reclaim() can unmap.
+	vmm_map_kernel(__text_start, __init_text_start, PTE_R | PTE_X);
+	vmm_map_kernel(__init_text_start, __init_text_end, PTE_R | PTE_X);
+	vmm_map_kernel(__rodata_start, __data_start, PTE_R);
+	vmm_map_kernel(__data_start, __init_data_start, PTE_R | PTE_W);
+	vmm_map_kernel(__init_data_start, __init_data_end, PTE_R | PTE_W);
+	vmm_map_kernel(__init_data_end, __kernel_end, PTE_R | PTE_W);
+
+	vmm_booting = false;
+
+	vmm_kernel_satp = mode << SATP_MODE_SHIFT |
+					  vmm_table_phys(vmm_kernel_root) >> PAGE_SHIFT;
+	csr_write(satp, vmm_kernel_satp);
+	asm volatile("sfence.vma" ::: "memory");
+}
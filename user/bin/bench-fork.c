@@ -0,0 +1,36 @@
+/* Cost of fork: a child that exits at once, waited for by the parent, with
+   a small and a large address space. The large one has a few MiB written,
+   all of which the child shares instead of copying. */
+
+#include "user.h"
+
+#define FORKS 200
+#define TOUCHED (4ul << 20)
+
+static void bench(const char *what) {
+	uint64_t t0 = now_ns();
+	for (int i = 0; i < FORKS; i++) {
+		int pid = fork();
+		if (!pid) exit(0);
+		if (pid < 0 || wait(pid) < 0) {
+			print("  fork failed\n");
+			return;
+		}
+	}
+	print("  fork, exit and wait, ");
+	print(what);
+	print(": ");
+	print_ulong((now_ns() - t0) / FORKS);
+	print(" ns\n");
+}
+
+int main(void) {
+	bench("small");
+
+	char *mem = mmap(0, TOUCHED, PROT_READ | PROT_WRITE, -1, 0);
+	if (mmap_failed(mem)) return (long)mem;
+	for (size_t off = 0; off < TOUCHED; off += 4096) mem[off] = 1;
+	bench("4 MiB written");
+	munmap(mem, TOUCHED);
+	return 0;
+}
@@ -0,0 +1,49 @@
+/* Faults and random reads over a large heap, where 4 KiB pages run out of
+   TLB reach long before megapages do. A second region is read before it is
+   written, so that it fills up page by page for the collapser, and the
+   heap is then cut into to make the kernel split megapages. */
+
+#include "user.h"
+
+#define HEAP (64ul << 20)
+#define FILLED (8ul << 20)
+#define READS 2000000
+
+static volatile unsigned long sink;
+
+static void report(const char *what, uint64_t ns, unsigned long n) {
+	print("  ");
+	print(what);
+	print(": ");
+	print_ulong(ns / n);
+	print(" ns\n");
+}
+
+int main(void) {
+	char *heap = mmap(0, HEAP, PROT_READ | PROT_WRITE, -1, 0);
+	char *filled = mmap(0, FILLED, PROT_READ | PROT_WRITE, -1, 0);
+	if (mmap_failed(heap)) return (long)heap;
+	if (mmap_failed(filled)) return (long)filled;
+
+	uint64_t t0 = now_ns();
+	for (size_t off = 0; off < HEAP; off += 4096) heap[off] = 1;
+	report("first write, per 4 KiB", now_ns() - t0, HEAP / 4096);
+
+	unsigned long sum = 0;
+	for (size_t off = 0; off < FILLED; off += 4096) sum += filled[off];
+	for (size_t off = 0; off < FILLED; off += 4096) filled[off] = 1;
+
+	uint64_t x = 1;
+	t0 = now_ns();
+	for (unsigned long i = 0; i < READS; i++) {
+		x = x * 6364136223846793005ul + 1442695040888963407ul;
+		sum += heap[(x >> 16) & (HEAP - 1)];
+	}
+	report("random read", now_ns() - t0, READS);
+	sink = sum;
+
+	// A page out of the first megapage and the second made read-only.
+	munmap(heap + 4096, 4096);
+	mprotect(heap + (2ul << 20), 4096, PROT_READ);
+	return 0;
+}
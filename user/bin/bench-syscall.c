@@ -0,0 +1,30 @@
+/* Round trips through the kernel with SYS_NULL, the cheapest system call:
+   the best of a few rounds, in nanoseconds per call. */
+
+#include "user.h"
+
+#define CALLS 100000
+#define ROUNDS 5
+#define WARMUP 1000
+
+int main(void) {
+	for (int i = 0; i < WARMUP; i++) sys_null();
+
+	uint64_t best = UINT64_MAX;
+	for (int r = 0; r < ROUNDS; r++) {
+		uint64_t t0 = now_ns();
+		for (int i = 0; i < CALLS; i++) sys_null();
+		uint64_t ns = now_ns() - t0;
+		if (ns < best) best = ns;
+	}
+
+	// Hundredths of a nanosecond, printed as a decimal.
+	uint64_t per_call = best * 100 / CALLS;
+	print("  null syscall: ");
+	print_ulong(per_call / 100);
+	print(".");
+	if (per_call % 100 < 10) print("0");
+	print_ulong(per_call % 100);
+	print(" ns\n");
+	return 0;
+}
@@ -0,0 +1,200 @@
+/* Requests through the rings against one system call each: no-ops, reads
+   of this program's file, 4 KiB reads of block device 0 and UDP datagrams
+   to the QEMU host, in nanoseconds per request. A forked child repeats the
+   first two with a kernel thread polling its submission queue. */
+
+#include "user.h"
+
+#define ENTRIES 64
+#define DEPTH 32
+#define BUF (DEPTH * 4096ul)
+#define NOPS 100000
+#define READS 20000
+#define BLK_READS 2000
+#define BLK_SPAN 2048
+#define DATAGRAMS 5000
+#define SELF "/bin/bench-uring"
+#define CHUNK 1024
+// 10.0.2.2, QEMU's user network host, on a port nobody listens on.
+#define HOST 0x0a000202
+#define PORT 7777
+
+typedef void (*prep_t)(struct uring_sqe *sqe, unsigned long i);
+
+static char *buf;
+static int fd;
+static unsigned long chunks;
+
+static void report(const char *what, uint64_t ns, unsigned long n) {
+	print("  ");
+	print(what);
+	print(": ");
+	print_ulong(ns / n);
+	print(" ns\n");
+}
+
+static void report_error(const char *what, long err) {
+	print("  ");
+	print(what);
+	print(": error ");
+	print_ulong(-err);
+	print("\n");
+}
+
+/* Runs n requests, at most depth in flight. Returns the nanoseconds taken, or
+   the first error. */
+static long run(struct ring *r, prep_t prep, unsigned long n,
+				unsigned int depth) {
+	unsigned long queued = 0, done = 0;
+	long err = 0;
+	uint64_t t0 = now_ns();
+	while (done < n) {
+		struct uring_sqe *sqe;
+		while (queued < n && queued - done < depth && (sqe = ring_get_sqe(r)))
+			prep(sqe, queued++);
+		// With a polling thread, entering the kernel to wait costs more
+		// than watching the completion queue.
+		long got = ring_submit(r, r->sqpoll ? 0 : 1);
+		if (got < 0) return got;
+		struct uring_cqe *cqe;
+		while ((cqe = ring_peek_cqe(r))) {
+			if (cqe->res < 0 && !err) err = cqe->res;
+			ring_cqe_seen(r);
+			done++;
+		}
+	}
+	return err ? err : (long)(now_ns() - t0);
+}
+
+static void run_report(struct ring *r, const char *what, prep_t prep,
+					   unsigned long n, unsigned int depth) {
+	long ns = run(r, prep, n, depth);
+	if (ns < 0)
+		report_error(what, ns);
+	else
+		report(what, ns, n);
+}
+
+static void prep_nop(struct uring_sqe *sqe, unsigned long i) {
+	*sqe = (struct uring_sqe){.op = URING_OP_NOP, .user_data = i};
+}
+
+static void prep_read(struct uring_sqe *sqe, unsigned long i) {
+	*sqe = (struct uring_sqe){
+		.op = URING_OP_READ,
+		.fd = fd,
+		.off = i % chunks * CHUNK,
+		.addr = (uintptr_t)buf + i % DEPTH * 4096,
+		.len = CHUNK,
+		.user_data = i,
+	};
+}
+
+static void prep_blk(struct uring_sqe *sqe, unsigned long i) {
+	*sqe = (struct uring_sqe){
+		.op = URING_OP_BLK_READ,
+		.fd = 0,
+		.off = i * 8 % BLK_SPAN,
+		.addr = (uintptr_t)buf + i % DEPTH * 4096,
+		.len = 4096,
+		.user_data = i,
+	};
+}
+
+static void prep_send(struct uring_sqe *sqe, unsigned long i) {
+	*sqe = (struct uring_sqe){
+		.op = URING_OP_WRITE,
+		.fd = fd,
+		.addr = (uintptr_t)buf + i % DEPTH * 4096,
+		.len = 64,
+		.user_data = i,
+	};
+}
+
+static void bench_nop(struct ring *r) {
+	if (!r->sqpoll) {
+		uint64_t t0 = now_ns();
+		for (int i = 0; i < NOPS; i++) sys_null();
+		report("null syscall", now_ns() - t0, NOPS);
+	}
+	run_report(r, "nop", prep_nop, NOPS, DEPTH);
+}
+
+static void bench_read(struct ring *r) {
+	fd = open(SELF);
+	if (fd < 0) {
+		report_error("open " SELF, fd);
+		return;
+	}
+	unsigned long size = 0;
+	long got;
+	while ((got = read(fd, buf, 4096)) > 0) size += got;
+	chunks = size / CHUNK;
+	if (!chunks) {
+		close(fd);
+		return;
+	}
+	if (!r->sqpoll) {
+		uint64_t t0 = now_ns();
+		for (unsigned long i = 0; i < READS; i++) {
+			if (i % chunks == 0) {
+				close(fd);
+				fd = open(SELF);
+			}
+			read(fd, buf, CHUNK);
+		}
+		report("1 KiB file read()", now_ns() - t0, READS);
+	}
+	run_report(r, "1 KiB file read", prep_read, READS, DEPTH);
+	close(fd);
+}
+
+static void bench_blk(struct ring *r) {
+	run_report(r, "4 KiB block read, one at a time", prep_blk, BLK_READS, 1);
+	run_report(r, "4 KiB block read, 32 deep", prep_blk, BLK_READS, DEPTH);
+}
+
+static void bench_send(struct ring *r) {
+	fd = socket(SOCKET_UDP, HOST, PORT);
+	if (fd < 0) {
+		report_error("socket", fd);
+		return;
+	}
+	uint64_t t0 = now_ns();
+	for (int i = 0; i < DATAGRAMS; i++) write(fd, buf, 64);
+	report("64 B datagram write()", now_ns() - t0, DATAGRAMS);
+	run_report(r, "64 B datagram", prep_send, DATAGRAMS, DEPTH);
+	close(fd);
+}
+
+static int setup(struct ring *r, unsigned int flags) {
+	int err = ring_init(r, ENTRIES, flags);
+	if (!err) err = ring_register(buf, BUF);
+	if (err) report_error("ring setup", err);
+	return err;
+}
+
+int main(void) {
+	buf = mmap(0, BUF, PROT_READ | PROT_WRITE, -1, 0);
+	if (mmap_failed(buf)) return (long)buf;
+
+	struct ring r;
+	int err = setup(&r, 0);
+	if (err) return err;
+	bench_nop(&r);
+	bench_read(&r);
+	bench_blk(&r);
+	bench_send(&r);
+
+	// One ring per process, so the polling variant runs in a child.
+	int pid = fork();
+	if (pid == 0) {
+		print("  with a polling thread:\n");
+		err = setup(&r, URING_SETUP_SQPOLL);
+		if (err) return err;
+		bench_nop(&r);
+		bench_read(&r);
+		return 0;
+	}
+	return pid < 0 ? pid : wait(pid);
+}
@@ -0,0 +1,17 @@
+/* The first user program: greets and prints /etc/motd. */
+
+#include "user.h"
+
+int main(void) {
+	print("init: running as pid ");
+	print_ulong(getpid());
+	print("\n");
+
+	int fd = open("/etc/motd");
+	if (fd < 0) return fd;
+	char buf[256];
+	long n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) write(1, buf, n);
+	close(fd);
+	return n < 0 ? n : 0;
+}
@@ -0,0 +1,3 @@
+/* Does nothing, as cheaply as a process can. */
+
+int main(void) { return 0; }
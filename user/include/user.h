@@ -0,0 +1,139 @@
+/* System call wrappers and helpers for user programs. There is no libc;
+   programs are linked with crt0.S and lib.c. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdnoreturn.h>
+
+#include "syscall.h"
+#include "uring.h"
+#include "vdso.h"
+
+/* ecall with up to five arguments. The kernel zeroes a1-a7 and t0-t6 on
+   return, see syscall.h. */
+static inline long syscall5(long nr, long arg0, long arg1, long arg2,
+							long arg3, long arg4) {
+	register long a0 asm("a0") = arg0;
+	register long a1 asm("a1") = arg1;
+	register long a2 asm("a2") = arg2;
+	register long a3 asm("a3") = arg3;
+	register long a4 asm("a4") = arg4;
+	register long a7 asm("a7") = nr;
+	asm volatile("ecall"
+				 : "+r"(a0), "+r"(a1), "+r"(a2), "+r"(a3), "+r"(a4), "+r"(a7)
+				 :
+				 : "a5", "a6", "t0", "t1", "t2", "t3", "t4", "t5", "t6",
+				   "memory");
+	return a0;
+}
+
+static inline long syscall3(long nr, long arg0, long arg1, long arg2) {
+	return syscall5(nr, arg0, arg1, arg2, 0, 0);
+}
+
+static inline long sys_null(void) { return syscall3(SYS_NULL, 0, 0, 0); }
+
+static inline noreturn void exit(int code) {
+	syscall3(SYS_EXIT, code, 0, 0);
+	__builtin_unreachable();
+}
+
+static inline int getpid(void) { return syscall3(SYS_GETPID, 0, 0, 0); }
+
+static inline void yield(void) { syscall3(SYS_YIELD, 0, 0, 0); }
+
+static inline int open(const char *path) {
+	return syscall3(SYS_OPEN, (long)path, 0, 0);
+}
+
+static inline int close(int fd) { return syscall3(SYS_CLOSE, fd, 0, 0); }
+
+static inline long read(int fd, void *buf, size_t len) {
+	return syscall3(SYS_READ, fd, (long)buf, len);
+}
+
+static inline long write(int fd, const void *buf, size_t len) {
+	return syscall3(SYS_WRITE, fd, (long)buf, len);
+}
+
+static inline void *mmap(void *addr, size_t len, int prot, int fd,
+						 uint64_t offset) {
+	return (void *)syscall5(SYS_MMAP, (long)addr, len, prot, fd, offset);
+}
+
+static inline int munmap(void *addr, size_t len) {
+	return syscall3(SYS_MUNMAP, (long)addr, len, 0);
+}
+
+static inline int mprotect(void *addr, size_t len, int prot) {
+	return syscall3(SYS_MPROTECT, (long)addr, len, prot);
+}
+
+static inline int fork(void) { return syscall3(SYS_FORK, 0, 0, 0); }
+
+static inline int wait(int pid) { return syscall3(SYS_WAIT, pid, 0, 0); }
+
+/* A TCP or UDP socket connected to addr:port. */
+static inline int socket(int type, uint32_t addr, uint16_t port) {
+	return syscall3(SYS_SOCKET, type, addr, port);
+}
+
+/* Submission and completion rings, see uring.h. */
+struct ring {
+	struct uring_shared *sh;
+	struct uring_sqe *sqes;
+	struct uring_cqe *cqes;
+	/* Entries filled but not published yet end here. */
+	uint32_t sq_tail;
+	bool sqpoll;
+};
+
+/* Sets up the process's rings. Returns 0 or an error. */
+int ring_init(struct ring *r, unsigned int entries, unsigned int flags);
+
+/* Makes [buf, buf + len), page aligned, the buffer area requests use. */
+static inline int ring_register(void *buf, size_t len) {
+	return syscall3(SYS_URING_REGISTER, (long)buf, len, 0);
+}
+
+/* The next free submission entry, or NULL if the queue is full. */
+struct uring_sqe *ring_get_sqe(struct ring *r);
+
+/* Publishes the entries filled since the last call and, unless the kernel
+   polls for them, submits them. Waits until wait completions are ready.
+   Returns the number published or an error. */
+long ring_submit(struct ring *r, unsigned int wait);
+
+/* The oldest completion not yet seen, or NULL. */
+struct uring_cqe *ring_peek_cqe(struct ring *r);
+
+/* Hands the completion from ring_peek_cqe() back to the kernel. */
+static inline void ring_cqe_seen(struct ring *r) {
+	__atomic_store_n(&r->sh->cq_head, r->sh->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Errors come back from mmap() as addresses in the last page. */
+static inline bool mmap_failed(void *p) { return (uintptr_t)p >= -4096ul; }
+
+/* Through the vDSO, without a system call. */
+static inline int clock_gettime(int clock, struct timespec *ts) {
+	int (*fn)(int, struct timespec *) = (void *)VDSO_CLOCK_GETTIME;
+	return fn(clock, ts);
+}
+
+/* Nanoseconds since boot. User mode may not read the cycle counter, so
+   benchmarks time themselves with this. */
+static inline uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+size_t strlen(const char *s);
+
+/* Write to fd 1. */
+void print(const char *s);
+void print_ulong(unsigned long v);
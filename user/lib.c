@@ -0,0 +1,62 @@
+#include "user.h"
+
+size_t strlen(const char *s) {
+	size_t n = 0;
+	while (s[n]) n++;
+	return n;
+}
+
+void print(const char *s) { write(1, s, strlen(s)); }
+
+void print_ulong(unsigned long v) {
+	char buf[20];
+	size_t i = sizeof(buf);
+	do {
+		buf[--i] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	write(1, buf + i, sizeof(buf) - i);
+}
+
+int ring_init(struct ring *r, unsigned int entries, unsigned int flags) {
+	long base = syscall3(SYS_URING_SETUP, entries, flags, 0);
+	if (base < 0) return base;
+	r->sh = (struct uring_shared *)base;
+	r->sqes = (struct uring_sqe *)(base + r->sh->sqes_off);
+	r->cqes = (struct uring_cqe *)(base + r->sh->cqes_off);
+	r->sq_tail = r->sh->sq_tail;
+	r->sqpoll = flags & URING_SETUP_SQPOLL;
+	return 0;
+}
+
+struct uring_sqe *ring_get_sqe(struct ring *r) {
+	uint32_t head = __atomic_load_n(&r->sh->sq_head, __ATOMIC_ACQUIRE);
+	if (r->sq_tail - head > r->sh->sq_mask) return NULL;
+	return &r->sqes[r->sq_tail++ & r->sh->sq_mask];
+}
+
+long ring_submit(struct ring *r, unsigned int wait) {
+	uint32_t n = r->sq_tail - r->sh->sq_tail;
+	__atomic_store_n(&r->sh->sq_tail, r->sq_tail, __ATOMIC_SEQ_CST);
+	// Including any the kernel left queued for lack of completion room.
+	uint32_t pending =
+		r->sq_tail - __atomic_load_n(&r->sh->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int flags = 0;
+	if (r->sqpoll) {
+		// Pairs with the polling thread setting the flag and then looking
+		// at the tail.
+		if (__atomic_load_n(&r->sh->sq_flags, __ATOMIC_SEQ_CST) &
+			URING_SQ_NEED_WAKEUP)
+			flags = URING_ENTER_SQ_WAKEUP;
+		else if (!wait)
+			return n;
+	}
+	long err = syscall3(SYS_URING_ENTER, pending, wait, flags);
+	return err < 0 ? err : n;
+}
+
+struct uring_cqe *ring_peek_cqe(struct ring *r) {
+	uint32_t head = r->sh->cq_head;
+	if (head == __atomic_load_n(&r->sh->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &r->cqes[head & r->sh->cq_mask];
+}